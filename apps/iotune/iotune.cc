@@ -0,0 +1,285 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+// iotune: measures the disk backing a directory, and records the I/O queue
+// depth it can usefully absorb in the I/O properties file read by the
+// reactor at startup (see --io-properties-file).
+
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "core/file.hh"
+#include "core/future-util.hh"
+#include "core/print.hh"
+#include "core/shared_ptr.hh"
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <sys/stat.h>
+
+using namespace std::chrono_literals;
+namespace bpo = boost::program_options;
+
+using iotune_clock = std::chrono::steady_clock;
+
+struct run_result {
+    uint64_t ops = 0;
+    uint64_t bytes = 0;
+    iotune_clock::duration elapsed{};
+    iotune_clock::duration total_latency{};
+    iotune_clock::duration max_latency{};
+
+    double seconds() const {
+        return std::chrono::duration<double>(elapsed).count();
+    }
+    double iops() const {
+        return ops / seconds();
+    }
+    double bandwidth() const {
+        return bytes / seconds();
+    }
+    double mean_latency_us() const {
+        return ops ? std::chrono::duration<double, std::micro>(total_latency).count() / ops : 0;
+    }
+    double max_latency_us() const {
+        return std::chrono::duration<double, std::micro>(max_latency).count();
+    }
+};
+
+struct disk_properties {
+    double sequential_write_bandwidth = 0;
+    double sequential_read_bandwidth = 0;
+    unsigned queue_depth = 1;
+    double random_read_iops = 0;
+
+    sstring format() const {
+        return sprint("max-io-requests=%d random-read-iops=%.0f sequential-read-bandwidth=%.0f sequential-write-bandwidth=%.0f",
+                queue_depth, random_read_iops, sequential_read_bandwidth, sequential_write_bandwidth);
+    }
+};
+
+class disk_tester {
+    file _file;
+    uint64_t _file_size;
+    iotune_clock::duration _duration;
+    std::default_random_engine _random{std::random_device()()};
+public:
+    disk_tester(file f, uint64_t file_size, iotune_clock::duration duration)
+        : _file(std::move(f)), _file_size(file_size), _duration(duration) {}
+
+    // Writes the whole file sequentially, with `depth` requests in flight.
+    future<run_result> sequential_write(size_t block_size, unsigned depth) {
+        return sequential(block_size, depth, true);
+    }
+
+    // Reads the whole file sequentially (or for the test duration, whichever
+    // is shorter), with `depth` requests in flight.
+    future<run_result> sequential_read(size_t block_size, unsigned depth) {
+        return sequential(block_size, depth, false);
+    }
+
+    // Reads random blocks for the test duration, with `depth` requests in flight.
+    future<run_result> random_read(size_t block_size, unsigned depth) {
+        auto nr_blocks = _file_size / block_size;
+        return run(depth, block_size, [this, nr_blocks, block_size] (char* buf) {
+            auto pos = std::uniform_int_distribution<uint64_t>(0, nr_blocks - 1)(_random) * block_size;
+            return _file.dma_read(pos, buf, block_size);
+        }, [] { return false; });
+    }
+
+    future<> flush() {
+        return _file.flush();
+    }
+
+    future<> close() {
+        return _file.close();
+    }
+private:
+    future<run_result> sequential(size_t block_size, unsigned depth, bool write) {
+        auto next = make_lw_shared<uint64_t>(0);
+        auto end = _file_size;
+        return run(depth, block_size, [this, next, block_size, write] (char* buf) {
+            auto pos = *next;
+            *next += block_size;
+            return write ? _file.dma_write(pos, buf, block_size) : _file.dma_read(pos, buf, block_size);
+        }, [next, end] { return *next >= end; }, !write);
+    }
+
+    // Runs `depth` workers, each issuing `io` back to back until the duration
+    // expires (if `timed`) or `done()` returns true.
+    template <typename IO, typename Done>
+    future<run_result> run(unsigned depth, size_t block_size, IO io, Done done, bool timed = true) {
+        auto result = make_lw_shared<run_result>();
+        auto start = iotune_clock::now();
+        auto deadline = timed ? start + _duration : iotune_clock::time_point::max();
+        auto workers = boost::irange(0u, depth);
+        return parallel_for_each(workers.begin(), workers.end(), [=] (unsigned) mutable {
+            auto buf = make_lw_shared(temporary_buffer<char>::aligned(4096, block_size));
+            std::fill(buf->get_write(), buf->get_write() + block_size, 0);
+            return do_until([=] { return done() || iotune_clock::now() >= deadline; }, [=] () mutable {
+                auto issued = iotune_clock::now();
+                return io(buf->get_write()).then([result, issued] (size_t n) {
+                    auto latency = iotune_clock::now() - issued;
+                    result->ops++;
+                    result->bytes += n;
+                    result->total_latency += latency;
+                    result->max_latency = std::max(result->max_latency, latency);
+                });
+            });
+        }).then([result, start] {
+            result->elapsed = iotune_clock::now() - start;
+            return *result;
+        });
+    }
+};
+
+// Finds the mountpoint of a directory, by walking up until the device changes.
+static std::string mountpoint_of(const std::string& dir) {
+    char* real = ::realpath(dir.c_str(), nullptr);
+    throw_system_error_on(!real);
+    std::string path = real;
+    ::free(real);
+    struct stat st;
+    throw_system_error_on(::stat(path.c_str(), &st) == -1);
+    auto dev = st.st_dev;
+    while (path != "/") {
+        auto slash = path.rfind('/');
+        auto parent = slash == 0 ? std::string("/") : path.substr(0, slash);
+        throw_system_error_on(::stat(parent.c_str(), &st) == -1);
+        if (st.st_dev != dev) {
+            break;
+        }
+        path = parent;
+    }
+    return path;
+}
+
+// Replaces the line for `mountpoint` in the I/O properties file, keeping the
+// lines describing other mountpoints.
+static void write_io_properties(const std::string& path, const std::string& mountpoint, const std::string& properties) {
+    std::vector<std::string> lines;
+    {
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::vector<std::string> fields;
+            boost::split(fields, line, boost::is_any_of(" \t"), boost::token_compress_on);
+            if (fields.empty() || fields[0] != mountpoint) {
+                lines.push_back(line);
+            }
+        }
+    }
+    lines.push_back(mountpoint + " " + properties);
+    auto tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp);
+        for (auto&& line : lines) {
+            out << line << "\n";
+        }
+        if (!out) {
+            throw std::runtime_error(sprint("failed writing %s", tmp));
+        }
+    }
+    throw_system_error_on(::rename(tmp.c_str(), path.c_str()) == -1);
+}
+
+int main(int ac, char** av) {
+    app_template app;
+    app.add_options()
+        ("directory", bpo::value<std::string>()->default_value("."), "directory on the disk to characterize")
+        ("output", bpo::value<std::string>()->default_value("/etc/seastar/io.conf"), "I/O properties file to update")
+        ("file-size", bpo::value<unsigned>()->default_value(256), "size (MB) of the test file")
+        ("duration", bpo::value<unsigned>()->default_value(2), "duration (s) of each measurement")
+        ("max-queue-depth", bpo::value<unsigned>()->default_value(256), "largest queue depth to try")
+        ("block-size", bpo::value<unsigned>()->default_value(4096), "size of random reads")
+        ("sequential-block-size", bpo::value<unsigned>()->default_value(128 << 10), "size of sequential reads and writes")
+        ;
+
+    return app.run(ac, av, [&app] () -> future<int> {
+        auto& config = app.configuration();
+        auto directory = config["directory"].as<std::string>();
+        auto output = config["output"].as<std::string>();
+        auto seq_block = config["sequential-block-size"].as<unsigned>();
+        auto block = config["block-size"].as<unsigned>();
+        auto file_size = align_up<uint64_t>(uint64_t(config["file-size"].as<unsigned>()) << 20, seq_block);
+        auto duration = std::chrono::seconds(config["duration"].as<unsigned>());
+        // The test runs on this shard only.  Its queue depth must not come
+        // from a previous run's result, divided among the shards, or each
+        // run would recommend less.
+        auto max_depth = config["max-queue-depth"].as<unsigned>();
+        engine().resize_io_queue(max_depth);
+        auto mountpoint = mountpoint_of(directory);
+        auto name = sstring(directory + "/iotune-test.tmp");
+
+        print("Characterizing %s (mounted at %s)\n", directory, mountpoint);
+        return check_direct_io_support(sstring(directory)).then([name] {
+            return open_file_dma(name, open_flags::rw | open_flags::create | open_flags::truncate);
+        }).then([=] (file f) {
+            auto t = make_lw_shared<disk_tester>(std::move(f), file_size, duration);
+            auto props = make_lw_shared<disk_properties>();
+            auto depths = make_lw_shared<std::vector<std::pair<unsigned, run_result>>>();
+            return t->sequential_write(seq_block, 8).then([t, props] (run_result r) {
+                print("Sequential write: %10.1f MB/s\n", r.bandwidth() / (1 << 20));
+                props->sequential_write_bandwidth = r.bandwidth();
+                return t->flush();
+            }).then([t, seq_block] {
+                return t->sequential_read(seq_block, 8);
+            }).then([t, props, depths, block, max_depth] (run_result r) {
+                print("Sequential read:  %10.1f MB/s\n", r.bandwidth() / (1 << 20));
+                props->sequential_read_bandwidth = r.bandwidth();
+                print("%11s %12s %16s %16s\n", "queue depth", "IOPS", "mean lat (us)", "max lat (us)");
+                auto depth = make_lw_shared<unsigned>(1);
+                return do_until([depth, max_depth] { return *depth > max_depth; }, [t, depths, depth, block] {
+                    return t->random_read(block, *depth).then([depths, depth] (run_result r) {
+                        print("%11d %12.0f %16.1f %16.1f\n", *depth, r.iops(), r.mean_latency_us(), r.max_latency_us());
+                        depths->emplace_back(*depth, r);
+                        *depth *= 2;
+                    });
+                });
+            }).then([props, depths] {
+                // Beyond the smallest depth reaching (nearly) peak IOPS, more
+                // concurrency only adds queueing latency.
+                double best = 0;
+                for (auto&& d : *depths) {
+                    best = std::max(best, d.second.iops());
+                }
+                for (auto&& d : *depths) {
+                    if (d.second.iops() >= best * 0.95) {
+                        props->queue_depth = d.first;
+                        props->random_read_iops = d.second.iops();
+                        break;
+                    }
+                }
+                return *props;
+            }).finally([t] {
+                return t->close();
+            });
+        }).then([=] (disk_properties props) {
+            print("Recommended I/O queue depth: %d (%.0f IOPS)\n", props.queue_depth, props.random_read_iops);
+            write_io_properties(output, mountpoint, std::string(props.format()));
+            print("Wrote %s\n", output);
+            return remove_file(name);
+        }).then([] {
+            return make_ready_future<int>(0);
+        });
+    });
+}
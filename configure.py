@@ -196,11 +196,21 @@ tests = [
     'tests/rpc',
     'tests/semaphore_test',
     'tests/packet_test',
+    'tests/flow_table_test',
+    'tests/checksum_test',
+    'tests/checksum_perf',
+    'tests/rx_burst_perf',
+    'tests/toeplitz_test',
+    'tests/capture_test',
+    'tests/loopback_test',
+    'tests/xdp_test',
+    'tests/posix_stack_test',
     ]
 
 apps = [
     'apps/httpd/httpd',
     'apps/seawreck/seawreck',
+    'apps/iotune/iotune',
     'apps/seastar/seastar',
     'apps/memcached/memcached',
     ]
@@ -233,13 +243,16 @@ arg_parser.add_argument('--debuginfo', action = 'store', dest = 'debuginfo', typ
                         help = 'Enable(1)/disable(0)compiler debug information generation')
 add_tristate(arg_parser, name = 'hwloc', dest = 'hwloc', help = 'hwloc support')
 add_tristate(arg_parser, name = 'xen', dest = 'xen', help = 'Xen support')
+add_tristate(arg_parser, name = 'xdp', dest = 'xdp', help = 'AF_XDP device support')
 args = arg_parser.parse_args()
 
 libnet = [
     'net/proxy.cc',
+    'net/loopback.cc',
     'net/virtio.cc',
     'net/dpdk.cc',
     'net/ip.cc',
+    'net/ipv6.cc',
     'net/ethernet.cc',
     'net/arp.cc',
     'net/native-stack.cc',
@@ -263,6 +276,7 @@ core = [
     'net/packet.cc',
     'net/posix-stack.cc',
     'net/net.cc',
+    'net/capture.cc',
     'rpc/rpc.cc',
     ]
 
@@ -312,6 +326,16 @@ if apply_tristate(args.xen, test = have_xen,
             ]
     xen_used=True
 
+def have_xdp():
+    return try_compile(compiler = args.cxx, source = '#include <xdp/xsk.h>\n')
+
+if apply_tristate(args.xdp, test = have_xdp,
+                  note = 'Note: libxdp-devel not installed.  No AF_XDP support.',
+                  missing = 'Error: required package libxdp-devel not installed.'):
+    libs += ' -lxdp -lbpf'
+    defines.append("HAVE_XDP")
+    libnet += [ 'net/xdp.cc' ]
+
 if xen_used and args.dpdk_target:
     print("Error: only xen or dpdk can be used, not both.")
     sys.exit(1)
@@ -347,6 +371,7 @@ deps = {
     'tests/tcp_server': ['tests/tcp_server.cc'] + core + libnet,
     'tests/tcp_client': ['tests/tcp_client.cc'] + core + libnet,
     'apps/seawreck/seawreck': ['apps/seawreck/seawreck.cc', 'http/http_response_parser.rl'] + core + libnet,
+    'apps/iotune/iotune': ['apps/iotune/iotune.cc'] + core,
     'tests/blkdiscard_test': ['tests/blkdiscard_test.cc'] + core,
     'tests/sstring_test': ['tests/sstring_test.cc'] + core,
     'tests/httpd': ['tests/httpd.cc'] + http + core + boost_test_lib,
@@ -359,6 +384,15 @@ deps = {
     'tests/distributed_test': ['tests/distributed_test.cc'] + core,
     'tests/rpc': ['tests/rpc.cc'] + core + libnet,
     'tests/packet_test': ['tests/packet_test.cc'] + core + libnet,
+    'tests/flow_table_test': ['tests/flow_table_test.cc'] + core,
+    'tests/checksum_test': ['tests/checksum_test.cc'] + core + libnet,
+    'tests/checksum_perf': ['tests/checksum_perf.cc'] + core + libnet,
+    'tests/rx_burst_perf': ['tests/rx_burst_perf.cc'] + core + libnet,
+    'tests/toeplitz_test': ['tests/toeplitz_test.cc'] + core,
+    'tests/capture_test': ['tests/capture_test.cc'] + core + boost_test_lib,
+    'tests/loopback_test': ['tests/loopback_test.cc'] + core + libnet + boost_test_lib,
+    'tests/xdp_test': ['tests/xdp_test.cc'] + core + libnet + boost_test_lib,
+    'tests/posix_stack_test': ['tests/posix_stack_test.cc'] + core + libnet + boost_test_lib,
 }
 
 warnings = [
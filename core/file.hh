@@ -78,6 +78,19 @@ struct directory_entry {
 /// \ref file
 struct file_open_options {
     uint64_t extent_allocation_size_hint = 1 << 20; ///< Allocate this much disk space when extending the file
+    sstring io_tag; ///< If not empty, I/O statistics of the file are also accounted under this tag (see \ref io_stats)
+};
+
+/// File copy options
+///
+/// Options used when file data cannot be shared (reflinked) or copied
+/// by the kernel, and has to be copied through memory using DMA reads
+/// and writes instead.
+///
+/// \ref copy_file()
+struct file_copy_options {
+    size_t chunk_size = 128 << 10; ///< Size of each DMA read/write when copying through memory
+    uint64_t bandwidth = 0; ///< Maximum rate, in bytes per second, of copying through memory (0 for unlimited)
 };
 
 /// \cond internal
@@ -108,6 +121,7 @@ class file_impl {
 class posix_file_impl : public file_impl {
 public:
     int _fd;
+    sstring _io_tag;
     posix_file_impl(int fd, file_open_options options);
     virtual ~posix_file_impl() override;
     future<size_t> write_dma(uint64_t pos, const void* buffer, size_t len);
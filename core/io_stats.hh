@@ -0,0 +1,130 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#pragma once
+
+#include "bitops.hh"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <ostream>
+
+/// \addtogroup fileio-module
+/// @{
+
+/// Latency histogram with power-of-two buckets.
+///
+/// Bucket 0 counts samples shorter than 1us, and bucket \c i > 0 counts
+/// samples of at least 2^(i-1)us and shorter than 2^i us.  The last bucket
+/// also counts all longer samples.
+class latency_histogram {
+public:
+    static constexpr unsigned nr_buckets = 24;
+private:
+    std::array<uint64_t, nr_buckets> _buckets = {};
+    uint64_t _count = 0;
+    uint64_t _total_us = 0;
+public:
+    template <typename Rep, typename Period>
+    void add(std::chrono::duration<Rep, Period> d) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        unsigned b = 0;
+        if (us > 0) {
+            b = std::min<unsigned>(std::numeric_limits<unsigned long>::digits
+                    - count_leading_zeros((unsigned long)us), nr_buckets - 1);
+            _total_us += us;
+        }
+        ++_buckets[b];
+        ++_count;
+    }
+    void merge(const latency_histogram& other) {
+        for (unsigned i = 0; i < nr_buckets; ++i) {
+            _buckets[i] += other._buckets[i];
+        }
+        _count += other._count;
+        _total_us += other._total_us;
+    }
+    /// Number of samples
+    uint64_t count() const { return _count; }
+    /// Sum of all samples, in microseconds
+    uint64_t total_us() const { return _total_us; }
+    /// Number of samples in bucket \c i
+    uint64_t bucket(unsigned i) const { return _buckets[i]; }
+    /// Upper bound of bucket \c i, in microseconds
+    static uint64_t bucket_limit_us(unsigned i) { return uint64_t(1) << i; }
+    /// Upper bound, in microseconds, of the given quantile (between 0 and 1)
+    /// of the samples; 0 if there are none.
+    uint64_t quantile_us(double q) const {
+        if (!_count) {
+            return 0;
+        }
+        auto want = uint64_t(q * _count);
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < nr_buckets; ++i) {
+            seen += _buckets[i];
+            if (seen > want) {
+                return bucket_limit_us(i);
+            }
+        }
+        return bucket_limit_us(nr_buckets - 1);
+    }
+};
+
+inline
+std::ostream& operator<<(std::ostream& os, const latency_histogram& h) {
+    os << "count=" << h.count() << " total_us=" << h.total_us()
+       << " p50<" << h.quantile_us(0.5) << "us p99<" << h.quantile_us(0.99)
+       << "us p999<" << h.quantile_us(0.999) << "us buckets:";
+    for (unsigned i = 0; i < latency_histogram::nr_buckets; ++i) {
+        if (h.bucket(i)) {
+            os << " <" << latency_histogram::bucket_limit_us(i) << "us:" << h.bucket(i);
+        }
+    }
+    return os;
+}
+
+/// Disk I/O statistics, of a shard or of the files opened with an I/O tag
+/// (see \ref file_open_options::io_tag).
+///
+/// Latencies of reads and writes are measured from the time they are issued
+/// until their completion, while the queue delays measure the part of that
+/// time spent waiting in the reactor before being submitted to the kernel.
+struct io_stats {
+    latency_histogram read_latency;
+    latency_histogram write_latency;
+    latency_histogram fsync_latency;
+    latency_histogram read_queue_delay;
+    latency_histogram write_queue_delay;
+};
+
+inline
+std::ostream& operator<<(std::ostream& os, const io_stats& s) {
+    os << "  read:              " << s.read_latency << "\n";
+    os << "  read queue delay:  " << s.read_queue_delay << "\n";
+    os << "  write:             " << s.write_latency << "\n";
+    os << "  write queue delay: " << s.write_queue_delay << "\n";
+    os << "  fsync:             " << s.fsync_latency << "\n";
+    return os;
+}
+
+/// @}
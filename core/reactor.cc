@@ -34,10 +34,12 @@
 #include "util/conversions.hh"
 #include "core/future-util.hh"
 #include "thread.hh"
+#include "sleep.hh"
 #include <cassert>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/eventfd.h>
+#include <netinet/tcp.h>
 #include <boost/thread/barrier.hpp>
 #include <boost/algorithm/string/classification.hpp>
 #include <boost/algorithm/string/split.hpp>
@@ -45,6 +47,7 @@
 #include <boost/range/numeric.hpp>
 #include <boost/range/adaptor/transformed.hpp>
 #include <atomic>
+#include <fstream>
 #include <dirent.h>
 #include <linux/types.h> // for xfs, below
 #include <sys/ioctl.h>
@@ -214,11 +217,11 @@ reactor::reactor()
 #endif
     , _cpu_started(0)
     , _io_context(0)
-    , _io_context_available(max_aio)
+    , _io_context_available(_max_aio)
     , _reuseport(posix_reuseport_detect()) {
 
     seastar::thread_impl::init();
-    auto r = ::io_setup(max_aio, &_io_context);
+    auto r = ::io_setup(_max_aio, &_io_context);
     assert(r >= 0);
 #ifdef HAVE_OSV
     _timer_thread.start();
@@ -340,6 +343,62 @@ void reactor::configure(boost::program_options::variables_map vm) {
 
     _handle_sigint = !vm.count("no-handle-interrupt");
     _task_quota = vm["task-quota-ms"].as<double>() * 1ms;
+
+    // The I/O queue depth is a property of the disks, so it is given (or
+    // measured by apps/iotune) for all shards together, and divided here.
+    std::experimental::optional<size_t> max_io_requests;
+    if (vm.count("max-io-requests")) {
+        max_io_requests = vm["max-io-requests"].as<unsigned>();
+    } else {
+        max_io_requests = read_io_properties(vm["io-properties-file"].as<std::string>());
+    }
+    if (max_io_requests) {
+        resize_io_queue(std::max<size_t>(*max_io_requests / smp::count, min_aio));
+    }
+}
+
+// Called while no I/O is in flight, so the context can simply be recreated.
+void reactor::resize_io_queue(size_t max_aio) {
+    if (max_aio == _max_aio) {
+        return;
+    }
+    auto ok = _io_context_available.try_wait(_max_aio);
+    assert(ok);
+    ::io_destroy(_io_context);
+    _io_context = {};
+    auto r = ::io_setup(max_aio, &_io_context);
+    throw_kernel_error(r);
+    _max_aio = max_aio;
+    _io_context_available.signal(_max_aio);
+}
+
+// Reads the total I/O queue depth recommended for all mountpoints listed in
+// an I/O properties file, as written by apps/iotune.  Each non-comment line
+// describes one mountpoint:
+//
+//    <mountpoint> max-io-requests=<n> [<key>=<value> ...]
+std::experimental::optional<size_t>
+reactor::read_io_properties(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        return {};
+    }
+    std::experimental::optional<size_t> total;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::vector<std::string> fields;
+        boost::split(fields, line, boost::is_any_of(" \t"), boost::token_compress_on);
+        if (fields.empty() || fields[0].empty() || fields[0][0] == '#') {
+            continue;
+        }
+        for (auto&& f : fields) {
+            static const std::string key = "max-io-requests=";
+            if (f.compare(0, key.size(), key) == 0) {
+                total = total.value_or(0) + boost::lexical_cast<size_t>(f.substr(key.size()));
+            }
+        }
+    }
+    return total;
 }
 
 future<> reactor_backend_epoll::get_epoll_future(pollable_fd_state& pfd,
@@ -397,6 +456,14 @@ void reactor_backend_epoll::abort_writer(pollable_fd_state& fd, std::exception_p
     abort_fd(fd, std::move(ex), &pollable_fd_state::pollout, EPOLLOUT);
 }
 
+future<> reactor_backend_epoll::errored(pollable_fd_state& fd) {
+    return get_epoll_future(fd, &pollable_fd_state::pollerr, EPOLLERR);
+}
+
+void reactor_backend_epoll::abort_error_waiter(pollable_fd_state& fd, std::exception_ptr ex) {
+    abort_fd(fd, std::move(ex), &pollable_fd_state::pollerr, EPOLLERR);
+}
+
 void reactor_backend_epoll::forget(pollable_fd_state& fd) {
     if (fd.events_epoll) {
         ::epoll_ctl(_epollfd.get(), EPOLL_CTL_DEL, fd.fd.get(), nullptr);
@@ -418,6 +485,10 @@ reactor::posix_listen(socket_address sa, listen_options opts) {
     if (opts.reuse_address) {
         fd.setsockopt(SOL_SOCKET, SO_REUSEADDR, 1);
     }
+    // Inherited by the accepted sockets
+    if (auto cc = tcp_congestion_control_name(opts.congestion_control)) {
+        fd.setsockopt(IPPROTO_TCP, TCP_CONGESTION, cc);
+    }
     if (_reuseport)
         fd.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
 
@@ -475,33 +546,148 @@ void reactor_backend_epoll::complete_epoll_event(pollable_fd_state& pfd, promise
     }
 }
 
+// An aio request issued with submit_io(); the iocb's data points here.
+struct reactor::io_request {
+    promise<io_event> pr;
+    bool write;
+    io_stats* tag_stats;
+    clock_type::time_point issued = clock_type::now();
+};
+
+struct reactor::io_tag_stats {
+    io_stats stats;
+    std::vector<scollectd::registration> regs;
+};
+
 template <typename Func>
 future<io_event>
-reactor::submit_io(Func prepare_io) {
-    return _io_context_available.wait(1).then([this, prepare_io = std::move(prepare_io)] () mutable {
-        auto pr = std::make_unique<promise<io_event>>();
+reactor::submit_io(bool write, io_stats* tag_stats, Func prepare_io) {
+    auto req = std::make_unique<io_request>();
+    req->write = write;
+    req->tag_stats = tag_stats;
+    ++_io_queued;
+    return _io_context_available.wait(1).then([this, req = std::move(req), prepare_io = std::move(prepare_io)] () mutable {
         iocb io;
         prepare_io(io);
-        io.data = pr.get();
+        io.data = req.get();
         _pending_aio.push_back(io);
-        if (_pending_aio.size() >= max_aio / 4) {
+        if (_pending_aio.size() >= _max_aio / 4) {
             flush_pending_aio();
         }
-        return pr.release()->get_future();
+        return req.release()->pr.get_future();
     });
 }
 
+// A run of adjacent requests, submitted as a single vectored request.
+// The iocb's data points here, tagged with merged_aio::tag so process_io()
+// can tell it from a plain request.
+struct reactor::merged_aio {
+    static constexpr uintptr_t tag = 1;
+    std::vector<iovec> iov;
+    std::vector<io_request*> completions;
+};
+
+template <typename Func>
+void
+reactor::for_each_io_request(const iocb& io, Func&& func) {
+    auto data = reinterpret_cast<uintptr_t>(io.data);
+    if (!(data & merged_aio::tag)) {
+        func(reinterpret_cast<io_request*>(io.data));
+        return;
+    }
+    for (auto req : reinterpret_cast<merged_aio*>(data & ~merged_aio::tag)->completions) {
+        func(req);
+    }
+}
+
+static bool aio_mergeable(const iocb& io) {
+    return io.aio_lio_opcode == IO_CMD_PREAD || io.aio_lio_opcode == IO_CMD_PWRITE;
+}
+
+// Merges runs of contiguous reads (or writes) to the same file into
+// vectored requests, so that small sequential requests coming from
+// different streams reach the device as a single request.
+void
+reactor::merge_pending_aio() {
+    if (_pending_aio.size() < 2) {
+        return;
+    }
+    std::stable_sort(_pending_aio.begin(), _pending_aio.end(), [] (const iocb& a, const iocb& b) {
+        return std::tie(a.aio_fildes, a.aio_lio_opcode, a.u.c.offset)
+                < std::tie(b.aio_fildes, b.aio_lio_opcode, b.u.c.offset);
+    });
+    auto& out = _merged_aio_scratch;
+    out.clear();
+    auto n = _pending_aio.size();
+    size_t i = 0;
+    while (i < n) {
+        auto& first = _pending_aio[i];
+        auto bytes = first.u.c.nbytes;
+        auto j = i + 1;
+        if (aio_mergeable(first)) {
+            while (j < n && j - i < max_merged_aio_requests) {
+                auto& prev = _pending_aio[j - 1];
+                auto& next = _pending_aio[j];
+                if (next.aio_fildes != first.aio_fildes
+                        || next.aio_lio_opcode != first.aio_lio_opcode
+                        || uint64_t(next.u.c.offset) != prev.u.c.offset + prev.u.c.nbytes
+                        || bytes + next.u.c.nbytes > max_merged_aio_bytes) {
+                    break;
+                }
+                bytes += next.u.c.nbytes;
+                ++j;
+            }
+        }
+        if (j - i == 1) {
+            out.push_back(first);
+        } else {
+            auto m = new merged_aio;
+            m->iov.reserve(j - i);
+            m->completions.reserve(j - i);
+            for (auto k = i; k < j; ++k) {
+                auto& io = _pending_aio[k];
+                m->iov.push_back(iovec{io.u.c.buf, io.u.c.nbytes});
+                m->completions.push_back(reinterpret_cast<io_request*>(io.data));
+            }
+            iocb io;
+            if (first.aio_lio_opcode == IO_CMD_PREAD) {
+                io_prep_preadv(&io, first.aio_fildes, m->iov.data(), m->iov.size(), first.u.c.offset);
+            } else {
+                io_prep_pwritev(&io, first.aio_fildes, m->iov.data(), m->iov.size(), first.u.c.offset);
+            }
+            io.data = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(m) | merged_aio::tag);
+            out.push_back(io);
+            _aio_merged += j - i;
+        }
+        i = j;
+    }
+    std::swap(_pending_aio, out);
+}
+
 bool
 reactor::flush_pending_aio() {
+    merge_pending_aio();
     while (!_pending_aio.empty()) {
-        auto nr = _pending_aio.size();
-        struct iocb* iocbs[max_aio];
+        auto nr = std::min(_pending_aio.size(), max_aio_batch);
+        struct iocb* iocbs[max_aio_batch];
         for (size_t i = 0; i < nr; ++i) {
             iocbs[i] = &_pending_aio[i];
         }
         auto r = ::io_submit(_io_context, nr, iocbs);
         throw_kernel_error(r);
-        if (size_t(r) == nr) {
+        auto now = clock_type::now();
+        for (size_t i = 0; i < size_t(r); ++i) {
+            for_each_io_request(_pending_aio[i], [&] (io_request* req) {
+                auto delay = req->write ? &io_stats::write_queue_delay : &io_stats::read_queue_delay;
+                (_io_stats.*delay).add(now - req->issued);
+                if (req->tag_stats) {
+                    (req->tag_stats->*delay).add(now - req->issued);
+                }
+                --_io_queued;
+                ++_io_inflight;
+            });
+        }
+        if (size_t(r) == _pending_aio.size()) {
             _pending_aio.clear();
         } else {
             _pending_aio.erase(_pending_aio.begin(), _pending_aio.begin() + r);
@@ -512,37 +698,137 @@ reactor::flush_pending_aio() {
 
 template <typename Func>
 future<io_event>
-reactor::submit_io_read(size_t len, Func prepare_io) {
+reactor::submit_io_read(size_t len, io_stats* tag_stats, Func prepare_io) {
     ++_aio_reads;
     _aio_read_bytes += len;
-    return submit_io(std::move(prepare_io));
+    return submit_io(false, tag_stats, std::move(prepare_io));
 }
 
 template <typename Func>
 future<io_event>
-reactor::submit_io_write(size_t len, Func prepare_io) {
+reactor::submit_io_write(size_t len, io_stats* tag_stats, Func prepare_io) {
     ++_aio_writes;
     _aio_write_bytes += len;
-    return submit_io(std::move(prepare_io));
+    return submit_io(true, tag_stats, std::move(prepare_io));
+}
+
+// Header of the completion ring that io_setup() maps into our address
+// space; io_context_t points at it.  See fs/aio.c.
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+};
+
+static constexpr unsigned aio_ring_magic = 0xa10a10a1;
+
+// Checks, without a system call, whether the kernel has posted completions.
+// If the context doesn't look like a ring we know, assume it has.
+static bool aio_completions_available(io_context_t ctx) {
+    auto ring = reinterpret_cast<aio_ring*>(ctx);
+    if (ring->magic != aio_ring_magic) {
+        return true;
+    }
+    return ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
 }
 
 bool reactor::process_io()
 {
-    io_event ev[max_aio];
+    ++_io_depth_samples;
+    _io_queued_sum += _io_queued;
+    _io_inflight_sum += _io_inflight;
+    if (!aio_completions_available(_io_context)) {
+        return false;
+    }
+    ++_io_getevents_calls;
+    io_event ev[max_aio_batch];
     struct timespec timeout = {0, 0};
-    auto n = ::io_getevents(_io_context, 1, max_aio, ev, &timeout);
+    auto n = ::io_getevents(_io_context, 1, max_aio_batch, ev, &timeout);
     assert(n >= 0);
+    size_t completed = 0;
     for (size_t i = 0; i < size_t(n); ++i) {
-        auto pr = reinterpret_cast<promise<io_event>*>(ev[i].data);
-        pr->set_value(ev[i]);
-        delete pr;
+        completed += complete_aio(ev[i]);
     }
-    _io_context_available.signal(n);
+    _io_context_available.signal(completed);
     return n;
 }
 
+// Completes the request(s) behind a kernel completion event, and returns
+// how many of them there were.  A merged request's result is split back
+// among the original requests in offset order, so a short transfer ends
+// up as short (or empty) transfers of the last ones.
+size_t
+reactor::complete_aio(const io_event& ev) {
+    auto data = reinterpret_cast<uintptr_t>(ev.data);
+    if (!(data & merged_aio::tag)) {
+        complete_io_request(reinterpret_cast<io_request*>(ev.data), ev);
+        return 1;
+    }
+    std::unique_ptr<merged_aio> m(reinterpret_cast<merged_aio*>(data & ~merged_aio::tag));
+    auto res = long(ev.res);
+    auto left = res;
+    for (size_t i = 0; i < m->completions.size(); ++i) {
+        io_event part = ev;
+        if (res >= 0) {
+            auto done = std::min<long>(left, m->iov[i].iov_len);
+            part.res = done;
+            left -= done;
+        }
+        complete_io_request(m->completions[i], part);
+    }
+    return m->completions.size();
+}
+
+void
+reactor::complete_io_request(io_request* r, const io_event& ev) {
+    std::unique_ptr<io_request> req(r);
+    auto latency = clock_type::now() - req->issued;
+    auto hist = req->write ? &io_stats::write_latency : &io_stats::read_latency;
+    (_io_stats.*hist).add(latency);
+    if (req->tag_stats) {
+        (req->tag_stats->*hist).add(latency);
+    }
+    --_io_inflight;
+    io_event e = ev;
+    e.data = r;
+    req->pr.set_value(e);
+}
+
+io_stats*
+reactor::get_io_stats(const sstring& tag) {
+    if (tag.empty()) {
+        return nullptr;
+    }
+    auto i = _io_tag_stats.find(tag);
+    if (i == _io_tag_stats.end()) {
+        auto ts = std::make_unique<io_tag_stats>();
+        ts->regs = register_io_stats_metrics(tag + "-", ts->stats);
+        i = _io_tag_stats.emplace(tag, std::move(ts)).first;
+    }
+    return &i->second->stats;
+}
+
+void
+reactor::dump_io_stats(std::ostream& os) const {
+    auto avg = [this] (uint64_t sum) {
+        return _io_depth_samples ? double(sum) / _io_depth_samples : 0.0;
+    };
+    os << "shard " << _id << ": queued " << _io_queued << " (avg " << avg(_io_queued_sum) << ")"
+       << ", in flight " << _io_inflight << " (avg " << avg(_io_inflight_sum) << ")"
+       << ", max " << _max_aio << "\n";
+    os << _io_stats;
+    for (auto&& ts : _io_tag_stats) {
+        os << " tag " << ts.first << ":\n" << ts.second->stats;
+    }
+}
+
 posix_file_impl::posix_file_impl(int fd, file_open_options options)
-        : _fd(fd) {
+        : _fd(fd), _io_tag(options.io_tag) {
     query_dma_alignment();
 }
 
@@ -568,7 +854,7 @@ posix_file_impl::query_dma_alignment() {
 
 future<size_t>
 posix_file_impl::write_dma(uint64_t pos, const void* buffer, size_t len) {
-    return engine().submit_io_write(len, [this, pos, buffer, len] (iocb& io) {
+    return engine().submit_io_write(len, engine().get_io_stats(_io_tag), [this, pos, buffer, len] (iocb& io) {
         io_prep_pwrite(&io, _fd, const_cast<void*>(buffer), len, pos);
     }).then([] (io_event ev) {
         throw_kernel_error(long(ev.res));
@@ -579,7 +865,7 @@ posix_file_impl::write_dma(uint64_t pos, const void* buffer, size_t len) {
 future<size_t>
 posix_file_impl::write_dma(uint64_t pos, std::vector<iovec> iov) {
     auto len = boost::accumulate(iov | boost::adaptors::transformed(std::mem_fn(&iovec::iov_len)), size_t(0));
-    return engine().submit_io_write(len, [this, pos, iov = std::move(iov)] (iocb& io) {
+    return engine().submit_io_write(len, engine().get_io_stats(_io_tag), [this, pos, iov = std::move(iov)] (iocb& io) {
         io_prep_pwritev(&io, _fd, iov.data(), iov.size(), pos);
     }).then([] (io_event ev) {
         throw_kernel_error(long(ev.res));
@@ -589,7 +875,7 @@ posix_file_impl::write_dma(uint64_t pos, std::vector<iovec> iov) {
 
 future<size_t>
 posix_file_impl::read_dma(uint64_t pos, void* buffer, size_t len) {
-    return engine().submit_io_read(len, [this, pos, buffer, len] (iocb& io) {
+    return engine().submit_io_read(len, engine().get_io_stats(_io_tag), [this, pos, buffer, len] (iocb& io) {
         io_prep_pread(&io, _fd, buffer, len, pos);
     }).then([] (io_event ev) {
         throw_kernel_error(long(ev.res));
@@ -600,7 +886,7 @@ posix_file_impl::read_dma(uint64_t pos, void* buffer, size_t len) {
 future<size_t>
 posix_file_impl::read_dma(uint64_t pos, std::vector<iovec> iov) {
     auto len = boost::accumulate(iov | boost::adaptors::transformed(std::mem_fn(&iovec::iov_len)), size_t(0));
-    return engine().submit_io_read(len, [this, pos, iov = std::move(iov)] (iocb& io) {
+    return engine().submit_io_read(len, engine().get_io_stats(_io_tag), [this, pos, iov = std::move(iov)] (iocb& io) {
         io_prep_preadv(&io, _fd, iov.data(), iov.size(), pos);
     }).then([] (io_event ev) {
         throw_kernel_error(long(ev.res));
@@ -766,6 +1052,210 @@ reactor::file_system_at(sstring pathname) {
 }
 
 
+static bool fs_supports_reflink(fs_type type) {
+    return type == fs_type::xfs || type == fs_type::btrfs;
+}
+
+// Errors from copy_file_range() meaning the kernel can't copy this range
+// for us (too old, across filesystems, unsuitable files), so we should copy
+// through memory instead.
+static bool copy_file_range_unsupported(int error) {
+    return error == ENOSYS || error == EXDEV || error == EINVAL
+            || error == EOPNOTSUPP || error == EBADF;
+}
+
+// Copies a range through memory, a chunk at a time.  Offsets must be aligned
+// for DMA.  The range may end at the end of the source file even if that is
+// not aligned, as long as the destination ends there too (or is extended by
+// the copy); the destination is then truncated back to the copied size.
+static
+future<>
+copy_file_range_dma(file src, uint64_t src_pos, file dst, uint64_t dst_pos, uint64_t len,
+        file_copy_options options) {
+    if ((src_pos & (src.disk_read_dma_alignment() - 1))
+            || (dst_pos & (dst.disk_write_dma_alignment() - 1))) {
+        return make_exception_future<>(std::system_error(EINVAL, std::system_category()));
+    }
+    struct copy_state {
+        file src;
+        file dst;
+        uint64_t dst_size = 0;
+        uint64_t copied = 0;
+        bool eof = false;
+        bool padded = false;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        copy_state(file src, file dst) : src(std::move(src)), dst(std::move(dst)) {}
+    };
+    auto st = make_lw_shared<copy_state>(std::move(src), std::move(dst));
+    auto align = std::max(st->src.disk_read_dma_alignment(), st->dst.disk_write_dma_alignment());
+    auto chunk = align_up<uint64_t>(std::max<size_t>(options.chunk_size, 1), align);
+    auto mem_align = std::max(st->src.memory_dma_alignment(), st->dst.memory_dma_alignment());
+    return st->dst.size().then([=] (uint64_t dst_size) {
+        st->dst_size = dst_size;
+        return do_until([st, len] { return st->eof || st->copied == len; }, [=] {
+            auto to_read = std::min<uint64_t>(chunk, align_up<uint64_t>(len - st->copied, align));
+            auto buf = temporary_buffer<char>::aligned(mem_align, to_read);
+            auto p = buf.get_write();
+            return st->src.dma_read(src_pos + st->copied, p, to_read).then(
+                    [=, buf = std::move(buf)] (size_t n) mutable {
+                if (n < to_read) {
+                    st->eof = true;
+                }
+                n = std::min<uint64_t>(n, len - st->copied);
+                if (!n) {
+                    return make_ready_future<>();
+                }
+                auto to_write = align_up<uint64_t>(n, st->dst.disk_write_dma_alignment());
+                auto end = dst_pos + st->copied + n;
+                if (to_write != n) {
+                    // Padding the tail would clobber destination data past the range.
+                    if (st->dst_size > end) {
+                        throw std::system_error(EINVAL, std::system_category());
+                    }
+                    std::fill(buf.get_write() + n, buf.get_write() + to_write, 0);
+                    st->padded = true;
+                }
+                auto p = buf.get();
+                return st->dst.dma_write(dst_pos + st->copied, p, to_write).then(
+                        [=, buf = std::move(buf)] (size_t written) {
+                    if (written < n) {
+                        throw std::system_error(EIO, std::system_category());
+                    }
+                    st->copied += n;
+                    if (!options.bandwidth) {
+                        return make_ready_future<>();
+                    }
+                    auto due = st->start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                            std::chrono::duration<double>(double(st->copied) / options.bandwidth));
+                    auto now = std::chrono::steady_clock::now();
+                    if (now >= due) {
+                        return make_ready_future<>();
+                    }
+                    return sleep(due - now);
+                });
+            });
+        });
+    }).then([st, dst_pos] {
+        if (!st->padded) {
+            return make_ready_future<>();
+        }
+        return st->dst.truncate(dst_pos + st->copied);
+    });
+}
+
+// Copies as much of the range as the kernel is willing to, with
+// copy_file_range(); returns the number of bytes copied, which is less than
+// len if the kernel can't copy this range, or if the source ends early.
+future<uint64_t>
+reactor::kernel_copy_file_range(int src_fd, uint64_t src_pos, int dst_fd, uint64_t dst_pos, uint64_t len) {
+#ifdef __NR_copy_file_range
+    static constexpr uint64_t max_chunk = 16 << 20;
+    struct copy_state {
+        uint64_t copied = 0;
+        bool done = false;
+    };
+    auto st = make_lw_shared<copy_state>();
+    return do_until([st, len] { return st->done || st->copied == len; }, [=] {
+        loff_t in = src_pos + st->copied;
+        loff_t out = dst_pos + st->copied;
+        auto chunk = std::min(len - st->copied, max_chunk);
+        return _thread_pool.submit<syscall_result<long>>([src_fd, dst_fd, in, out, chunk] () mutable {
+            return wrap_syscall<long>(::syscall(__NR_copy_file_range, src_fd, &in, dst_fd, &out, chunk, 0));
+        }).then([st] (syscall_result<long> sr) {
+            if (sr.result == -1 && !copy_file_range_unsupported(sr.error)) {
+                sr.throw_if_error();
+            }
+            if (sr.result <= 0) {
+                st->done = true;
+            } else {
+                st->copied += sr.result;
+            }
+        });
+    }).then([st] {
+        return st->copied;
+    });
+#else
+    return make_ready_future<uint64_t>(0);
+#endif
+}
+
+future<>
+reactor::do_clone_file_range(file src, uint64_t src_pos, file dst, uint64_t dst_pos, uint64_t len,
+        bool try_reflink, file_copy_options options) {
+    auto src_impl = dynamic_cast<posix_file_impl*>(src._file_impl.get());
+    auto dst_impl = dynamic_cast<posix_file_impl*>(dst._file_impl.get());
+    if (!len) {
+        return make_ready_future<>();
+    }
+    if (!src_impl || !dst_impl) {
+        return copy_file_range_dma(std::move(src), src_pos, std::move(dst), dst_pos, len, options);
+    }
+    auto src_fd = src_impl->_fd;
+    auto dst_fd = dst_impl->_fd;
+    auto reflinked = make_ready_future<bool>(false);
+#ifdef FICLONERANGE
+    if (try_reflink) {
+        reflinked = _thread_pool.submit<syscall_result<int>>([src_fd, src_pos, dst_fd, dst_pos, len] {
+            file_clone_range fcr;
+            fcr.src_fd = src_fd;
+            fcr.src_offset = src_pos;
+            fcr.src_length = len;
+            fcr.dest_offset = dst_pos;
+            return wrap_syscall<int>(::ioctl(dst_fd, FICLONERANGE, &fcr));
+        }).then([] (syscall_result<int> sr) {
+            // Any failure (unsupported, misaligned range, ...) just means
+            // we have to copy the data instead.
+            return sr.result != -1;
+        });
+    }
+#endif
+    return reflinked.then([=] (bool done) mutable {
+        if (done) {
+            return make_ready_future<>();
+        }
+        return kernel_copy_file_range(src_fd, src_pos, dst_fd, dst_pos, len).then(
+                [=] (uint64_t copied) mutable {
+            if (copied == len) {
+                return make_ready_future<>();
+            }
+            return copy_file_range_dma(std::move(src), src_pos + copied, std::move(dst), dst_pos + copied,
+                    len - copied, options);
+        });
+    });
+}
+
+future<>
+reactor::clone_file_range(file src, uint64_t src_pos, file dst, uint64_t dst_pos, uint64_t len,
+        file_copy_options options) {
+    return do_clone_file_range(std::move(src), src_pos, std::move(dst), dst_pos, len, true, options);
+}
+
+future<>
+reactor::copy_file(sstring from, sstring to, file_copy_options options) {
+    return file_system_at(from).then([this, from, to, options] (fs_type fs) {
+        return open_file_dma(from, open_flags::ro).then([this, to, fs, options] (file src) {
+            return open_file_dma(to, open_flags::wo | open_flags::create | open_flags::exclusive).then_wrapped(
+                    [this, src, fs, options] (future<file> f) mutable {
+                if (f.failed()) {
+                    // Don't leak the source; report the open error
+                    return src.close().then_wrapped([f = std::move(f)] (future<> closed) mutable {
+                        closed.ignore_ready_future();
+                        return f.then([] (file) {});
+                    });
+                }
+                auto dst = f.get0();
+                return src.size().then([this, src, dst, fs, options] (uint64_t size) {
+                    return do_clone_file_range(src, 0, dst, 0, size, fs_supports_reflink(fs), options);
+                }).finally([src, dst] () mutable {
+                    return src.close().finally([dst] () mutable {
+                        return dst.close();
+                    });
+                });
+            });
+        });
+    });
+}
+
 future<file>
 reactor::open_directory(sstring name) {
     return _thread_pool.submit<syscall_result<int>>([name] {
@@ -799,9 +1289,15 @@ reactor::touch_directory(sstring name) {
 future<>
 posix_file_impl::flush(void) {
     ++engine()._fsyncs;
+    auto issued = clock_type::now();
     return engine()._thread_pool.submit<syscall_result<int>>([this] {
         return wrap_syscall<int>(::fdatasync(_fd));
-    }).then([] (syscall_result<int> sr) {
+    }).then([this, issued] (syscall_result<int> sr) {
+        auto latency = clock_type::now() - issued;
+        engine()._io_stats.fsync_latency.add(latency);
+        if (auto tag_stats = engine().get_io_stats(_io_tag)) {
+            tag_stats->fsync_latency.add(latency);
+        }
         sr.throw_if_error();
         return make_ready_future<>();
     });
@@ -1103,9 +1599,42 @@ struct reactor::collectd_registrations {
     scollectd::registrations regs;
 };
 
+std::vector<scollectd::registration>
+reactor::register_io_stats_metrics(sstring prefix, io_stats& stats) {
+    std::vector<scollectd::registration> regs;
+    auto add = [&] (sstring name, latency_histogram& h) {
+        // total_operations value:DERIVE:0:U
+        regs.emplace_back(scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                , scollectd::per_cpu_plugin_instance
+                , "total_operations", prefix + name)
+                , scollectd::make_typed(scollectd::data_type::DERIVE, [&h] { return h.count(); })
+        ));
+        // total_time_in_ms value:DERIVE:0:U
+        // Divided by total_operations, gives the mean latency.
+        regs.emplace_back(scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                , scollectd::per_cpu_plugin_instance
+                , "total_time_in_ms", prefix + name)
+                , scollectd::make_typed(scollectd::data_type::DERIVE, [&h] { return h.total_us() / 1000; })
+        ));
+        // latency value:GAUGE:0:U
+        // Upper bound of the 99th percentile, in microseconds.
+        regs.emplace_back(scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                , scollectd::per_cpu_plugin_instance
+                , "latency", prefix + name + "-p99")
+                , scollectd::make_typed(scollectd::data_type::GAUGE, [&h] { return h.quantile_us(0.99); })
+        ));
+    };
+    add("io-read", stats.read_latency);
+    add("io-read-queue", stats.read_queue_delay);
+    add("io-write", stats.write_latency);
+    add("io-write-queue", stats.write_queue_delay);
+    add("io-fsync", stats.fsync_latency);
+    return regs;
+}
+
 reactor::collectd_registrations
 reactor::register_collectd_metrics() {
-    return collectd_registrations{ {
+    collectd_registrations r{ {
             // queue_length     value:GAUGE:0:U
             // Absolute value of num tasks in queue.
             scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
@@ -1157,6 +1686,20 @@ reactor::register_collectd_metrics() {
                     , scollectd::make_typed(scollectd::data_type::DERIVE, _aio_write_bytes)
             ),
             // total_operations value:DERIVE:0:U
+            // io_getevents() calls, made only when completions are pending.
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "aio-getevents-syscalls")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _io_getevents_calls)
+            ),
+            // total_operations value:DERIVE:0:U
+            // Requests submitted as part of a larger, merged, request.
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "aio-merged")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _aio_merged)
+            ),
+            // total_operations value:DERIVE:0:U
             scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
                     , scollectd::per_cpu_plugin_instance
                     , "total_operations", "fsyncs")
@@ -1225,7 +1768,42 @@ reactor::register_collectd_metrics() {
                 scollectd::make_typed(scollectd::data_type::DERIVE,
                         [] { return memory::stats().reclaims(); })
             ),
+            // queue_length     value:GAUGE:0:U
+            // Disk I/O requests waiting to be submitted to the kernel.
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "queue_length", "io-queued")
+                    , scollectd::make_typed(scollectd::data_type::GAUGE, _io_queued)
+            ),
+            // queue_length     value:GAUGE:0:U
+            // Disk I/O requests submitted to the kernel and not yet completed.
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "queue_length", "io-inflight")
+                    , scollectd::make_typed(scollectd::data_type::GAUGE, _io_inflight)
+            ),
+            // The sums of the above sampled on every poll; divided by
+            // io-depth-samples, they give the average depths.
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "derive", "io-depth-samples")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _io_depth_samples)
+            ),
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "derive", "io-queued-sum")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _io_queued_sum)
+            ),
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "derive", "io-inflight-sum")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _io_inflight_sum)
+            ),
     } };
+    for (auto&& reg : register_io_stats_metrics("", _io_stats)) {
+        r.regs.push_back(std::move(reg));
+    }
+    return r;
 }
 
 void reactor::run_tasks(circular_buffer<std::unique_ptr<task>>& tasks) {
@@ -1507,10 +2085,13 @@ reactor_backend_epoll::wait_and_process() {
     for (int i = 0; i < nr; ++i) {
         auto& evt = eevt[i];
         auto pfd = reinterpret_cast<pollable_fd_state*>(evt.data.ptr);
-        auto events = evt.events & (EPOLLIN | EPOLLOUT);
+        // epoll reports errors whether asked to or not; only those
+        // waited for count
+        auto events = evt.events & (EPOLLIN | EPOLLOUT | (pfd->events_epoll & EPOLLERR));
         auto events_to_remove = events & ~pfd->events_requested;
         complete_epoll_event(*pfd, &pollable_fd_state::pollin, events, EPOLLIN);
         complete_epoll_event(*pfd, &pollable_fd_state::pollout, events, EPOLLOUT);
+        complete_epoll_event(*pfd, &pollable_fd_state::pollerr, events, EPOLLERR);
         if (events_to_remove) {
             pfd->events_epoll &= ~events_to_remove;
             evt.events = pfd->events_epoll;
@@ -1799,6 +2380,8 @@ reactor::get_options_description() {
                         format_separated(net_stack_names.begin(), net_stack_names.end(), ", ")).c_str())
         ("no-handle-interrupt", "ignore SIGINT (for gdb)")
         ("task-quota-ms", bpo::value<double>()->default_value(2.0), "Max time (ms) between polls")
+        ("max-io-requests", bpo::value<unsigned>(), "Maximum amount of concurrent requests to be sent to the disk, for all shards together (overrides --io-properties-file)")
+        ("io-properties-file", bpo::value<std::string>()->default_value("/etc/seastar/io.conf"), "I/O properties file, as generated by iotune, used to size the I/O queue depth")
         ;
     opts.add(network_stack_registry::options_description());
     return opts;
@@ -2335,6 +2918,14 @@ future<> link_file(sstring oldpath, sstring newpath) {
     return engine().link_file(std::move(oldpath), std::move(newpath));
 }
 
+future<> copy_file(sstring from, sstring to) {
+    return engine().copy_file(std::move(from), std::move(to));
+}
+
+future<> copy_file(sstring from, sstring to, file_copy_options options) {
+    return engine().copy_file(std::move(from), std::move(to), options);
+}
+
 server_socket listen(socket_address sa) {
     return engine().listen(sa);
 }
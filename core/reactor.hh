@@ -60,6 +60,7 @@
 #include "temporary_buffer.hh"
 #include "circular_buffer.hh"
 #include "file.hh"
+#include "io_stats.hh"
 #include "semaphore.hh"
 #include "core/scattered_message.hh"
 #include "core/enum.hh"
@@ -131,11 +132,12 @@ class pollable_fd_state {
     void operator=(const pollable_fd_state&) = delete;
     void speculate_epoll(int events) { events_known |= events; }
     file_desc fd;
-    int events_requested = 0; // wanted by pollin/pollout promises
+    int events_requested = 0; // wanted by pollin/pollout/pollerr promises
     int events_epoll = 0;     // installed in epoll
     int events_known = 0;     // returned from epoll
     promise<> pollin;
     promise<> pollout;
+    promise<> pollerr;
     friend class reactor;
     friend class pollable_fd;
 };
@@ -167,11 +169,20 @@ class pollable_fd {
     future<> write_all(net::packet& p);
     future<> readable();
     future<> writeable();
+    // For callers doing their own non-blocking reads after readable(): a
+    // read that filled its buffer suggests more data is queued
+    void speculate_readable() { _s->speculate_epoll(EPOLLIN); }
     void abort_reader(std::exception_ptr ex);
     void abort_writer(std::exception_ptr ex);
+    // Resolves once the socket reports an error condition, such as
+    // messages on its error queue
+    future<> errored();
+    void abort_error_waiter(std::exception_ptr ex);
     future<pollable_fd, socket_address> accept();
     future<size_t> sendmsg(struct msghdr *msg);
     future<size_t> recvmsg(struct msghdr *msg);
+    // Receives at least one and at most vlen messages
+    future<size_t> recvmmsg(struct mmsghdr *msgs, unsigned vlen);
     future<size_t> sendto(socket_address addr, const void* buf, size_t len);
     file_desc& get_file_desc() const { return _s->fd; }
     void shutdown(int how) { _s->fd.shutdown(how); }
@@ -194,6 +205,8 @@ class connected_socket_impl {
     virtual void shutdown_output() = 0;
     virtual void set_nodelay(bool nodelay) = 0;
     virtual bool get_nodelay() const = 0;
+    virtual void set_congestion_control(tcp_congestion_control cc) = 0;
+    virtual tcp_connection_info get_tcp_info() const = 0;
 };
 
 /// \addtogroup networking-module
@@ -230,6 +243,16 @@ class connected_socket {
     ///
     /// \return whether the nodelay option is enabled or not
     bool get_nodelay() const;
+    /// Selects the congestion control algorithm of the connection.
+    ///
+    /// Connections accepted by a \ref server_socket start with the
+    /// algorithm of its \ref listen_options.
+    void set_congestion_control(tcp_congestion_control cc);
+    /// Takes a snapshot of the state of the connection.
+    ///
+    /// Useful to diagnose a connection that stalls or is slow:
+    /// round-trip time, windows, queued data and retransmissions.
+    tcp_connection_info get_tcp_info() const;
     /// Disables output to the socket.
     ///
     /// Current or future writes that have not been successfully flushed
@@ -317,6 +340,13 @@ class network_stack {
     // FIXME: local parameter assumes ipv4 for now, fix when adding other AF
     virtual future<connected_socket> connect(socket_address sa, socket_address local = socket_address(::sockaddr_in{AF_INET, INADDR_ANY, 0})) = 0;
     virtual net::udp_channel make_udp_channel(ipv4_addr addr = {}) = 0;
+    // A channel bound to an address of any family the stack supports
+    virtual net::udp_channel make_udp_channel(const socket_address& sa) {
+        if (sa.as_posix_sockaddr().sa_family != AF_INET) {
+            throw std::runtime_error("address family not supported by the network stack");
+        }
+        return make_udp_channel(ipv4_addr(sa));
+    }
     virtual future<> initialize() {
         return make_ready_future();
     }
@@ -626,6 +656,8 @@ class reactor_backend_epoll : public reactor_backend {
     virtual std::unique_ptr<reactor_notifier> make_reactor_notifier() override;
     void abort_reader(pollable_fd_state& fd, std::exception_ptr ex);
     void abort_writer(pollable_fd_state& fd, std::exception_ptr ex);
+    future<> errored(pollable_fd_state& fd);
+    void abort_error_waiter(pollable_fd_state& fd, std::exception_ptr ex);
 };
 
 #ifdef HAVE_OSV
@@ -705,7 +737,11 @@ class reactor {
     reactor_backend_epoll _backend;
 #endif
     std::vector<pollfn*> _pollers;
-    static constexpr size_t max_aio = 128;
+    static constexpr size_t default_max_aio = 128;
+    // Bounds the number of iocbs handled by a single io_submit()/io_getevents()
+    static constexpr size_t max_aio_batch = 128;
+    static constexpr size_t min_aio = 4;
+    size_t _max_aio = default_max_aio;
     std::vector<std::function<future<> ()>> _exit_funcs;
     unsigned _id = 0;
     bool _stopped = false;
@@ -723,11 +759,31 @@ class reactor {
     seastar::timer_set<timer<lowres_clock>, &timer<lowres_clock>::_link>::timer_list_t _expired_lowres_timers;
     io_context_t _io_context;
     std::vector<struct ::iocb> _pending_aio;
+    std::vector<struct ::iocb> _merged_aio_scratch;
+    // Adjacent requests merged into a single vectored request are limited
+    // to this many bytes and requests.
+    static constexpr size_t max_merged_aio_bytes = 128 << 10;
+    static constexpr size_t max_merged_aio_requests = 32;
+    struct merged_aio;
+    struct io_request;
+    struct io_tag_stats;
     semaphore _io_context_available;
     uint64_t _aio_reads = 0;
     uint64_t _aio_read_bytes = 0;
     uint64_t _aio_writes = 0;
     uint64_t _aio_write_bytes = 0;
+    uint64_t _aio_merged = 0;
+    uint64_t _io_getevents_calls = 0;
+    io_stats _io_stats;
+    std::unordered_map<sstring, std::unique_ptr<io_tag_stats>> _io_tag_stats;
+    // Requests issued but not yet submitted to the kernel, and submitted
+    // but not yet completed.
+    uint64_t _io_queued = 0;
+    uint64_t _io_inflight = 0;
+    // Sums of the above, sampled on every poll, to compute average depths.
+    uint64_t _io_depth_samples = 0;
+    uint64_t _io_queued_sum = 0;
+    uint64_t _io_inflight_sum = 0;
     uint64_t _fsyncs = 0;
     circular_buffer<std::unique_ptr<task>> _pending_tasks;
     circular_buffer<std::unique_ptr<task>> _at_destroy_tasks;
@@ -745,6 +801,14 @@ class reactor {
 private:
     static void clear_task_quota(int);
     bool flush_pending_aio();
+    void merge_pending_aio();
+    size_t complete_aio(const io_event& ev);
+    void complete_io_request(io_request* req, const io_event& ev);
+    // Calls func on each io_request submitted with the iocb.
+    template <typename Func>
+    static void for_each_io_request(const iocb& io, Func&& func);
+    std::vector<scollectd::registration> register_io_stats_metrics(sstring prefix, io_stats& stats);
+    static std::experimental::optional<size_t> read_io_properties(const std::string& path);
     void abort_on_error(int ret);
     template <typename T, typename E, typename EnableFunc>
     void complete_timers(T&, E&, EnableFunc&& enable_fn);
@@ -823,13 +887,26 @@ class reactor {
     future<> remove_file(sstring pathname);
     future<> rename_file(sstring old_pathname, sstring new_pathname);
     future<> link_file(sstring oldpath, sstring newpath);
+    future<> copy_file(sstring from, sstring to, file_copy_options options = {});
+    future<> clone_file_range(file src, uint64_t src_pos, file dst, uint64_t dst_pos, uint64_t len,
+            file_copy_options options = {});
 
     template <typename Func>
-    future<io_event> submit_io(Func prepare_io);
+    future<io_event> submit_io(bool write, io_stats* tag_stats, Func prepare_io);
     template <typename Func>
-    future<io_event> submit_io_read(size_t len, Func prepare_io);
+    future<io_event> submit_io_read(size_t len, io_stats* tag_stats, Func prepare_io);
     template <typename Func>
-    future<io_event> submit_io_write(size_t len, Func prepare_io);
+    future<io_event> submit_io_write(size_t len, io_stats* tag_stats, Func prepare_io);
+
+    /// Disk I/O statistics of this shard.
+    const io_stats& get_io_stats() const { return _io_stats; }
+    /// Disk I/O statistics of the files opened with the given tag on this
+    /// shard (see \ref file_open_options::io_tag), created on first use;
+    /// nullptr if the tag is empty.
+    io_stats* get_io_stats(const sstring& tag);
+    /// Writes this shard's disk I/O statistics, including those of each
+    /// tag and the current queue depths, in human readable form.
+    void dump_io_stats(std::ostream& os) const;
 
     int run();
     void exit(int ret);
@@ -848,6 +925,9 @@ class reactor {
     void add_high_priority_task(std::unique_ptr<task>&&);
 
     network_stack& net() { return *_network_stack; }
+    size_t max_io_requests() const { return _max_aio; }
+    // Sets this shard's I/O queue depth; only while no I/O is in flight
+    void resize_io_queue(size_t max_aio);
     unsigned cpu_id() const { return _id; }
 
     void start_epoll() {
@@ -877,6 +957,9 @@ class reactor {
     struct collectd_registrations;
     collectd_registrations register_collectd_metrics();
     future<> write_all_part(pollable_fd_state& fd, const void* buffer, size_t size, size_t completed);
+    future<> do_clone_file_range(file src, uint64_t src_pos, file dst, uint64_t dst_pos, uint64_t len,
+            bool try_reflink, file_copy_options options);
+    future<uint64_t> kernel_copy_file_range(int src_fd, uint64_t src_pos, int dst_fd, uint64_t dst_pos, uint64_t len);
 
     bool process_io();
 
@@ -923,6 +1006,12 @@ class reactor {
     void abort_writer(pollable_fd_state& fd, std::exception_ptr ex) {
         return _backend.abort_writer(fd, std::move(ex));
     }
+    future<> errored(pollable_fd_state& fd) {
+        return _backend.errored(fd);
+    }
+    void abort_error_waiter(pollable_fd_state& fd, std::exception_ptr ex) {
+        return _backend.abort_error_waiter(fd, std::move(ex));
+    }
     void enable_timer(clock_type::time_point when);
     std::unique_ptr<reactor_notifier> make_reactor_notifier() {
         return _backend.make_reactor_notifier();
@@ -1210,6 +1299,17 @@ pollable_fd::abort_writer(std::exception_ptr ex) {
     engine().abort_writer(*_s, std::move(ex));
 }
 
+inline
+future<> pollable_fd::errored() {
+    return engine().errored(*_s);
+}
+
+inline
+void
+pollable_fd::abort_error_waiter(std::exception_ptr ex) {
+    engine().abort_error_waiter(*_s, std::move(ex));
+}
+
 inline
 future<pollable_fd, socket_address> pollable_fd::accept() {
     return engine().accept(*_s);
@@ -1234,6 +1334,21 @@ future<size_t> pollable_fd::recvmsg(struct msghdr *msg) {
     });
 };
 
+inline
+future<size_t> pollable_fd::recvmmsg(struct mmsghdr *msgs, unsigned vlen) {
+    return engine().readable(*_s).then([this, msgs, vlen] {
+        auto r = get_file_desc().recvmmsg(msgs, vlen, MSG_DONTWAIT);
+        if (!r) {
+            return recvmmsg(msgs, vlen);
+        }
+        // A full batch suggests more are queued
+        if (*r == vlen) {
+            _s->speculate_epoll(EPOLLIN);
+        }
+        return make_ready_future<size_t>(*r);
+    });
+}
+
 inline
 future<size_t> pollable_fd::sendmsg(struct msghdr* msg) {
     return engine().writeable(*_s).then([this, msg] () mutable {
@@ -1387,4 +1502,16 @@ connected_socket::get_nodelay() const {
     return _csi->get_nodelay();
 }
 
+inline
+void
+connected_socket::set_congestion_control(tcp_congestion_control cc) {
+    _csi->set_congestion_control(cc);
+}
+
+inline
+tcp_connection_info
+connected_socket::get_tcp_info() const {
+    return _csi->get_tcp_info();
+}
+
 #endif /* REACTOR_HH_ */
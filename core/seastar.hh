@@ -57,6 +57,7 @@ class listen_options;
 // file.hh
 class file;
 class file_open_options;
+class file_copy_options;
 enum class open_flags;
 enum class fs_type;
 
@@ -261,6 +262,32 @@ future<bool> file_exists(sstring name);
 ///
 future<> link_file(sstring oldpath, sstring newpath);
 
+/// Copies a file
+///
+/// Creates \c to with the contents of \c from.  On filesystems that support
+/// it (xfs, btrfs), the data is shared with the source (reflinked) rather than
+/// copied, making the copy nearly free.  Otherwise the kernel is asked to copy
+/// the data with \c copy_file_range(), and if that is not possible either, the
+/// data is copied through memory using DMA.
+///
+/// \param from existing file name
+/// \param to name of the copy; must not exist
+///
+/// \note
+/// The copy is not guaranteed to be stable on disk, unless it is flushed
+/// and its containing directory is sync'ed.
+future<> copy_file(sstring from, sstring to);
+
+/// Copies a file
+///
+/// \param from existing file name
+/// \param to name of the copy; must not exist
+/// \param options options controlling copying through memory, when
+///                the data cannot be shared or copied by the kernel
+///
+/// \see copy_file(sstring from, sstring to)
+future<> copy_file(sstring from, sstring to, file_copy_options options);
+
 /// Return information about the filesystem where a file is located.
 ///
 /// \param name name of the file to inspect
@@ -25,6 +25,8 @@
 #include <memory>
 #include <vector>
 #include <cstring>
+#include <chrono>
+#include <stdexcept>
 #include "core/future.hh"
 #include "net/byteorder.hh"
 #include "net/packet.hh"
@@ -40,19 +42,79 @@ class socket_address {
         ::sockaddr_storage sas;
         ::sockaddr sa;
         ::sockaddr_in in;
+        ::sockaddr_in6 in6;
     } u;
     socket_address(sockaddr_in sa) {
         u.in = sa;
     }
+    socket_address(sockaddr_in6 sa) {
+        u.in6 = sa;
+    }
     socket_address() = default;
     ::sockaddr& as_posix_sockaddr() { return u.sa; }
     ::sockaddr_in& as_posix_sockaddr_in() { return u.in; }
     const ::sockaddr& as_posix_sockaddr() const { return u.sa; }
     const ::sockaddr_in& as_posix_sockaddr_in() const { return u.in; }
+    ::sockaddr_in6& as_posix_sockaddr_in6() { return u.in6; }
+    const ::sockaddr_in6& as_posix_sockaddr_in6() const { return u.in6; }
+};
+
+/// TCP congestion control algorithms
+enum class tcp_congestion_control {
+    stack_default, ///< the network stack's default (Reno for the native stack)
+    reno,
+    cubic,
+    bbr,
+};
+
+/// Name of a congestion control algorithm, as known to Linux's
+/// TCP_CONGESTION socket option; nullptr for
+/// \ref tcp_congestion_control::stack_default.
+static inline
+const char* tcp_congestion_control_name(tcp_congestion_control cc) {
+    switch (cc) {
+    case tcp_congestion_control::reno: return "reno";
+    case tcp_congestion_control::cubic: return "cubic";
+    case tcp_congestion_control::bbr: return "bbr";
+    default: return nullptr;
+    }
+}
+
+/// Snapshot of the state of a TCP connection, like Linux's TCP_INFO.
+///
+/// Windows and queue lengths are in bytes.  Counters cover the lifetime
+/// of the connection.  Fields a stack cannot report are zero.
+struct tcp_connection_info {
+    /// Smoothed round-trip time
+    std::chrono::microseconds srtt{0};
+    /// Round-trip time variation
+    std::chrono::microseconds rttvar{0};
+    /// Current retransmission timeout
+    std::chrono::microseconds rto{0};
+    /// Maximum segment sizes for sending and receiving
+    uint32_t snd_mss = 0;
+    uint32_t rcv_mss = 0;
+    /// Congestion window and slow start threshold
+    uint32_t snd_cwnd = 0;
+    uint32_t snd_ssthresh = 0;
+    /// Window advertised by the remote endpoint
+    uint32_t snd_wnd = 0;
+    /// Window advertised to the remote endpoint
+    uint32_t rcv_wnd = 0;
+    /// Data sent and not yet acknowledged
+    uint32_t bytes_in_flight = 0;
+    /// Data queued and not yet sent
+    uint32_t bytes_unsent = 0;
+    /// Segments retransmitted
+    uint64_t retransmits = 0;
+    /// Retransmission timer expirations
+    uint64_t timeouts = 0;
 };
 
 struct listen_options {
     bool reuse_address = false;
+    /// Congestion control algorithm of the accepted connections
+    tcp_congestion_control congestion_control = tcp_congestion_control::stack_default;
 };
 
 struct ipv4_addr {
@@ -111,6 +173,9 @@ class udp_datagram_impl {
     virtual ipv4_addr get_dst() = 0;
     virtual uint16_t get_dst_port() = 0;
     virtual packet& get_data() = 0;
+    // The source of datagrams of any address family; get_src() only
+    // carries the port of IPv6 sources
+    virtual socket_address get_src_address() { return make_ipv4_address(get_src()); }
 };
 
 class udp_datagram final {
@@ -122,6 +187,7 @@ class udp_datagram final {
     ipv4_addr get_dst() { return _impl->get_dst(); }
     uint16_t get_dst_port() { return _impl->get_dst_port(); }
     packet& get_data() { return _impl->get_data(); }
+    socket_address get_src_address() { return _impl->get_src_address(); }
 };
 
 class udp_channel_impl {
@@ -130,6 +196,13 @@ class udp_channel_impl {
     virtual future<udp_datagram> receive() = 0;
     virtual future<> send(ipv4_addr dst, const char* msg) = 0;
     virtual future<> send(ipv4_addr dst, packet p) = 0;
+    // Sends to a destination of any address family the channel supports
+    virtual future<> send(const socket_address& dst, packet p) {
+        if (dst.as_posix_sockaddr().sa_family != AF_INET) {
+            return make_exception_future<>(std::runtime_error("address family not supported by the channel"));
+        }
+        return send(ipv4_addr(dst), std::move(p));
+    }
     virtual bool is_closed() const = 0;
     virtual void close() = 0;
 };
@@ -143,6 +216,7 @@ class udp_channel {
     future<udp_datagram> receive() { return _impl->receive(); }
     future<> send(ipv4_addr dst, const char* msg) { return _impl->send(std::move(dst), msg); }
     future<> send(ipv4_addr dst, packet p) { return _impl->send(std::move(dst), std::move(p)); }
+    future<> send(const socket_address& dst, packet p) { return _impl->send(dst, std::move(p)); }
     bool is_closed() const { return _impl->is_closed(); }
     void close() { return _impl->close(); }
 };
@@ -23,6 +23,8 @@
 
 namespace net {
 
+thread_local std::vector<arp*> arp::_instances;
+
 arp_for_protocol::arp_for_protocol(arp& a, uint16_t proto_num)
     : _arp(a), _proto_num(proto_num) {
     _arp.add(proto_num, this);
@@ -39,6 +41,11 @@ arp::arp(interface* netif) : _netif(netif), _proto(netif, eth_protocol_num::arp,
     [this](forward_hash& out_hash_data, packet& p, size_t off) {
         return forward(out_hash_data, p, off);
     })) {
+    _instances.push_back(this);
+}
+
+arp::~arp() {
+    _instances.erase(std::find(_instances.begin(), _instances.end(), this));
 }
 
 std::experimental::optional<l3_protocol::l3packet> arp::get_packet() {
@@ -59,6 +66,16 @@ bool arp::forward(forward_hash& out_hash_data, packet& p, size_t off) {
     return false;
 }
 
+arp_for_protocol* arp::local_instance(ethernet_address hw, uint16_t proto_num) {
+    for (auto a : _instances) {
+        if (a->l2self().mac == hw.mac) {
+            auto i = a->_arp_for_protocol.find(proto_num);
+            return i != a->_arp_for_protocol.end() ? i->second : nullptr;
+        }
+    }
+    return nullptr;
+}
+
 void arp::add(uint16_t proto_num, arp_for_protocol* afp) {
     _arp_for_protocol[proto_num] = afp;
 }
@@ -29,6 +29,7 @@
 #include "ethernet.hh"
 #include "core/print.hh"
 #include <unordered_map>
+#include <functional>
 
 namespace net {
 
@@ -37,6 +38,19 @@ class arp_for_protocol;
 template <typename L3>
 class arp_for;
 
+// Timers of a neighbor cache, ARP's or IPv6 neighbor discovery's
+struct neighbor_timing {
+    // How long a reply keeps a neighbor reachable (RFC 4861's REACHABLE_TIME)
+    lowres_clock::duration reachable_time = std::chrono::seconds(30);
+    // A neighbor in use is probed this long before it would turn stale
+    lowres_clock::duration refresh_margin = std::chrono::seconds(5);
+    // Stale neighbors are dropped once unconfirmed or unused for this long
+    lowres_clock::duration stale_time = std::chrono::seconds(60);
+    // Between queries, and how long lookups wait for a reply; also the
+    // period of the aging timer
+    lowres_clock::duration retransmit_time = std::chrono::seconds(1);
+};
+
 class arp_for_protocol {
 protected:
     arp& _arp;
@@ -54,6 +68,9 @@ class arp {
     subscription<packet, ethernet_address> _rx_packets;
     std::unordered_map<uint16_t, arp_for_protocol*> _arp_for_protocol;
     circular_buffer<l3_protocol::l3packet> _packetq;
+    // Each shard's arp instances, by interface address, so that the shards
+    // of one interface can share what they resolve
+    static thread_local std::vector<arp*> _instances;
 private:
     struct arp_hdr {
         packed<uint16_t> htype;
@@ -64,10 +81,18 @@ class arp {
     };
 public:
     explicit arp(interface* netif);
+    ~arp();
     void add(uint16_t proto_num, arp_for_protocol* afp);
     void del(uint16_t proto_num);
 private:
     ethernet_address l2self() { return _netif->hw_address(); }
+    // This shard's handler of proto_num on the interface whose address is
+    // hw, if this shard has a stack on it
+    static arp_for_protocol* local_instance(ethernet_address hw, uint16_t proto_num);
+    // Runs func(arp_for_protocol&) on cpu, for this protocol of the same
+    // interface; resolves to false if that shard has none
+    template <typename Func>
+    future<bool> on_shard(unsigned cpu, uint16_t proto_num, Func func);
     future<> process_packet(packet p, ethernet_address from);
     bool forward(forward_hash& out_hash_data, packet& p, size_t off);
     std::experimental::optional<l3_protocol::l3packet> get_packet();
@@ -102,32 +127,75 @@ class arp_for : public arp_for_protocol {
             a(htype, ptype, oper, sender_hwaddr, sender_paddr, target_hwaddr, target_paddr);
         }
     };
-    struct resolution {
-        std::vector<promise<l2addr>> _waiters;
-        timer<> _timeout_timer;
+    // Reachability states, after RFC 4861's neighbor cache
+    enum class state {
+        incomplete, // queried, no reply yet
+        reachable,  // confirmed within reachable_time
+        stale,      // not confirmed lately; still used while being probed
+        permanent,  // never ages
+    };
+    struct neighbor {
+        state st = state::incomplete;
+        l2addr l2;
+        lowres_clock::time_point confirmed;
+        lowres_clock::time_point used;
+        lowres_clock::time_point probed;
+        // Queries sent since the last confirmation
+        unsigned probes = 0;
+        std::vector<promise<l2addr>> waiters;
     };
+    // Unanswered queries before an unresolved address is forgotten
+    static constexpr unsigned max_probes = 3;
 private:
     l3addr _l3self = L3::broadcast_address();
-    std::unordered_map<l3addr, l2addr> _table;
-    std::unordered_map<l3addr, resolution> _in_progress;
+    std::unordered_map<l3addr, neighbor> _neighbors;
+    neighbor_timing _timing;
+    timer<lowres_clock> _aging_timer;
 private:
     packet make_query_packet(l3addr paddr);
     virtual future<> received(packet p) override;
     future<> handle_request(arp_hdr* ah);
     l2addr l2self() { return _arp.l2self(); }
     void send(l2addr to, packet p);
+    void solicit(const l3addr& paddr, neighbor& n);
+    void probe(const l3addr& paddr, neighbor& n);
+    void resolve_for_peer(const l3addr& paddr, unsigned requester);
+    void learn_everywhere(l2addr l2, l3addr l3);
+    void age();
 public:
     future<> send_query(const l3addr& paddr);
     explicit arp_for(arp& a) : arp_for_protocol(a, L3::arp_protocol_type()) {
-        _table[L3::broadcast_address()] = ethernet::broadcast_address();
+        auto& n = _neighbors[L3::broadcast_address()];
+        n.st = state::permanent;
+        n.l2 = ethernet::broadcast_address();
+        _aging_timer.set_callback([this] { age(); });
+        _aging_timer.arm_periodic(_timing.retransmit_time);
     }
+    // Ready at once, without allocating, for a resolved neighbor
     future<ethernet_address> lookup(const l3addr& addr);
+    // Confirms that l3 is reachable at l2, on this shard only
     void learn(l2addr l2, l3addr l3);
     void run();
     void set_self_addr(l3addr addr) { _l3self = addr; }
+    void set_timing(neighbor_timing timing) {
+        _timing = timing;
+        _aging_timer.cancel();
+        _aging_timer.arm_periodic(_timing.retransmit_time);
+    }
     friend class arp;
 };
 
+template <typename Func>
+future<bool> arp::on_shard(unsigned cpu, uint16_t proto_num, Func func) {
+    return smp::submit_to(cpu, [hw = l2self(), proto_num, func = std::move(func)] () mutable {
+        auto afp = local_instance(hw, proto_num);
+        if (afp) {
+            func(*afp);
+        }
+        return afp != nullptr;
+    });
+}
+
 template <typename L3>
 packet
 arp_for<L3>::make_query_packet(l3addr paddr) {
@@ -175,46 +243,153 @@ class arp_queue_full_error : public arp_error {
 template <typename L3>
 future<ethernet_address>
 arp_for<L3>::lookup(const l3addr& paddr) {
-    auto i = _table.find(paddr);
-    if (i != _table.end()) {
-        return make_ready_future<ethernet_address>(i->second);
+    auto i = _neighbors.find(paddr);
+    if (i != _neighbors.end() && i->second.st != state::incomplete) {
+        i->second.used = lowres_clock::now();
+        return make_ready_future<ethernet_address>(i->second.l2);
+    }
+    auto& n = i != _neighbors.end() ? i->second : _neighbors[paddr];
+    if (n.waiters.size() >= max_waiters) {
+        return make_exception_future<ethernet_address>(arp_queue_full_error());
     }
-    auto j = _in_progress.find(paddr);
-    auto first_request = j == _in_progress.end();
-    auto& res = first_request ? _in_progress[paddr] : j->second;
+    n.waiters.emplace_back();
+    auto f = n.waiters.back().get_future();
+    if (!n.probes) {
+        solicit(paddr, n);
+    }
+    return f;
+}
 
-    if (first_request) {
-        res._timeout_timer.set_callback([paddr, this, &res] {
-            send_query(paddr);
-            for (auto& w : res._waiters) {
-                w.set_exception(arp_timeout_error());
-            }
-            res._waiters.clear();
-        });
-        res._timeout_timer.arm_periodic(std::chrono::seconds(1));
+template <typename L3>
+void
+arp_for<L3>::learn(l2addr hwaddr, l3addr paddr) {
+    auto& n = _neighbors[paddr];
+    if (n.st == state::permanent) {
+        return;
+    }
+    n.st = state::reachable;
+    n.l2 = hwaddr;
+    n.confirmed = lowres_clock::now();
+    n.probes = 0;
+    for (auto&& pr : n.waiters) {
+        pr.set_value(hwaddr);
+    }
+    n.waiters.clear();
+}
+
+// Learns on every shard, so that one shard's resolution serves them all
+template <typename L3>
+void
+arp_for<L3>::learn_everywhere(l2addr hwaddr, l3addr paddr) {
+    learn(hwaddr, paddr);
+    for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+        if (cpu != engine().cpu_id()) {
+            _arp.on_shard(cpu, _proto_num, [hwaddr, paddr] (arp_for_protocol& afp) {
+                static_cast<arp_for&>(afp).learn(hwaddr, paddr);
+            });
+        }
+    }
+}
+
+// Queries for an unresolved address.  Only the address's owner shard
+// broadcasts the query, so shards missing on the same neighbor at once
+// cause one query, not one each; the reply is learned everywhere.  When
+// the owner has no stack on this interface (the device has fewer queues
+// than there are shards, or the stack was built on one shard), the
+// requesting shard queries itself.
+template <typename L3>
+void
+arp_for<L3>::solicit(const l3addr& paddr, neighbor& n) {
+    n.probed = lowres_clock::now();
+    ++n.probes;
+    auto owner = std::hash<l3addr>()(paddr) % smp::count;
+    if (owner == engine().cpu_id()) {
         send_query(paddr);
+        return;
     }
+    _arp.on_shard(owner, _proto_num, [paddr, requester = engine().cpu_id()] (arp_for_protocol& afp) {
+        static_cast<arp_for&>(afp).resolve_for_peer(paddr, requester);
+    }).then([hw = l2self(), proto_num = _proto_num, paddr] (bool found) {
+        if (found) {
+            return;
+        }
+        // Looked up again, as this instance may be gone by now
+        auto afp = arp::local_instance(hw, proto_num);
+        if (afp) {
+            static_cast<arp_for&>(*afp).send_query(paddr);
+        }
+    });
+}
 
-    if (res._waiters.size() >= max_waiters) {
-        return make_exception_future<ethernet_address>(arp_queue_full_error());
+template <typename L3>
+void
+arp_for<L3>::resolve_for_peer(const l3addr& paddr, unsigned requester) {
+    auto& n = _neighbors[paddr];
+    if (n.st == state::reachable || n.st == state::permanent) {
+        _arp.on_shard(requester, _proto_num, [hwaddr = n.l2, paddr] (arp_for_protocol& afp) {
+            static_cast<arp_for&>(afp).learn(hwaddr, paddr);
+        });
+    } else if (!n.probes || lowres_clock::now() - n.probed >= _timing.retransmit_time) {
+        n.probed = lowres_clock::now();
+        ++n.probes;
+        send_query(paddr);
     }
+}
 
-    res._waiters.emplace_back();
-    return res._waiters.back().get_future();
+// Asks a known neighbor directly whether it is still there
+template <typename L3>
+void
+arp_for<L3>::probe(const l3addr& paddr, neighbor& n) {
+    n.probed = lowres_clock::now();
+    ++n.probes;
+    send(n.l2, make_query_packet(paddr));
 }
 
 template <typename L3>
 void
-arp_for<L3>::learn(l2addr hwaddr, l3addr paddr) {
-    _table[paddr] = hwaddr;
-    auto i = _in_progress.find(paddr);
-    if (i != _in_progress.end()) {
-        auto& res = i->second;
-        res._timeout_timer.cancel();
-        for (auto &&pr : res._waiters) {
-            pr.set_value(hwaddr);
+arp_for<L3>::age() {
+    auto now = lowres_clock::now();
+    for (auto i = _neighbors.begin(); i != _neighbors.end();) {
+        auto& paddr = i->first;
+        auto& n = i->second;
+        auto in_use = now - n.used < _timing.reachable_time;
+        auto may_probe = now - n.probed >= _timing.retransmit_time;
+        switch (n.st) {
+        case state::permanent:
+            break;
+        case state::incomplete:
+            if (!may_probe) {
+                break;
+            }
+            for (auto& w : n.waiters) {
+                w.set_exception(arp_timeout_error());
+            }
+            n.waiters.clear();
+            if (n.probes >= max_probes) {
+                i = _neighbors.erase(i);
+                continue;
+            }
+            solicit(paddr, n);
+            break;
+        case state::reachable:
+            if (now - n.confirmed >= _timing.reachable_time) {
+                n.st = state::stale;
+            } else if (now - n.confirmed >= _timing.reachable_time - _timing.refresh_margin && in_use && may_probe) {
+                // Refresh before expiry, so busy neighbors never go stale
+                probe(paddr, n);
+            }
+            break;
+        case state::stale:
+            if (now - n.confirmed >= _timing.stale_time || !in_use) {
+                i = _neighbors.erase(i);
+                continue;
+            }
+            if (may_probe) {
+                probe(paddr, n);
+            }
+            break;
         }
-        _in_progress.erase(i);
+        ++i;
     }
 }
 
@@ -233,7 +408,7 @@ arp_for<L3>::received(packet p) {
     case op_request:
         return handle_request(&h);
     case op_reply:
-        arp_learn(h.sender_hwaddr, h.sender_paddr);
+        learn_everywhere(h.sender_hwaddr, h.sender_paddr);
         return make_ready_future<>();
     default:
         return make_ready_future<>();
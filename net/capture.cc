@@ -0,0 +1,246 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "capture.hh"
+#include "const.hh"
+#include "core/reactor.hh"
+#include "core/fstream.hh"
+#include "core/align.hh"
+#include <boost/algorithm/string.hpp>
+#include <chrono>
+#include <stdexcept>
+
+namespace net {
+
+constexpr size_t capture_filter::header_len;
+constexpr size_t packet_capture::default_snaplen;
+constexpr size_t packet_capture::default_ring_size;
+
+capture_filter capture_filter::parse(const sstring& expr) {
+    std::vector<std::string> words;
+    boost::split(words, expr, boost::is_any_of(" \t"), boost::token_compress_on);
+    capture_filter f;
+    for (auto i = words.begin(); i != words.end(); ++i) {
+        auto& w = *i;
+        if (w.empty()) {
+            continue;
+        } else if (w == "inbound") {
+            f.outbound = false;
+        } else if (w == "outbound") {
+            f.inbound = false;
+        } else if (w == "arp") {
+            f.eth_proto = uint16_t(eth_protocol_num::arp);
+        } else if (w == "ip") {
+            f.eth_proto = uint16_t(eth_protocol_num::ipv4);
+        } else if (w == "ip6") {
+            f.eth_proto = uint16_t(eth_protocol_num::ipv6);
+        } else if (w == "tcp") {
+            f.ip_proto = uint8_t(ip_protocol_num::tcp);
+        } else if (w == "udp") {
+            f.ip_proto = uint8_t(ip_protocol_num::udp);
+        } else if (w == "icmp") {
+            f.eth_proto = uint16_t(eth_protocol_num::ipv4);
+            f.ip_proto = uint8_t(ip_protocol_num::icmp);
+        } else if (w == "icmp6") {
+            f.eth_proto = uint16_t(eth_protocol_num::ipv6);
+            f.ip_proto = uint8_t(ip_protocol_num::icmpv6);
+        } else if (w == "port" && std::next(i) != words.end()) {
+            auto& n = *++i;
+            char* end;
+            auto port = std::strtoul(n.c_str(), &end, 10);
+            if (n.empty() || *end || port > 65535) {
+                throw std::invalid_argument("invalid port in capture filter: " + n);
+            }
+            f.port = port;
+        } else {
+            throw std::invalid_argument("invalid capture filter: " + std::string(expr));
+        }
+    }
+    return f;
+}
+
+static uint16_t read_be16(const char* p) {
+    return uint8_t(p[0]) << 8 | uint8_t(p[1]);
+}
+
+bool capture_filter::match(const char* frame, size_t len) const {
+    if (!eth_proto && !ip_proto && !port) {
+        return true;
+    }
+    if (len < eth_hdr_len) {
+        return false;
+    }
+    auto proto = read_be16(frame + 12);
+    if (eth_proto && proto != *eth_proto) {
+        return false;
+    }
+    if (!ip_proto && !port) {
+        return true;
+    }
+    auto ip = frame + eth_hdr_len;
+    auto end = frame + len;
+    uint8_t l4_proto;
+    const char* l4;
+    if (proto == uint16_t(eth_protocol_num::ipv4) && end - ip >= ipv4_hdr_len_min) {
+        l4_proto = ip[9];
+        l4 = ip + (ip[0] & 0xf) * 4;
+        // Later fragments carry no transport header
+        if (read_be16(ip + 6) & 0x1fff) {
+            l4 = end;
+        }
+    } else if (proto == uint16_t(eth_protocol_num::ipv6) && end - ip >= ipv6_hdr_len_min) {
+        l4_proto = ip[6];
+        l4 = ip + ipv6_hdr_len_min;
+    } else {
+        return false;
+    }
+    if (ip_proto && l4_proto != *ip_proto) {
+        return false;
+    }
+    if (port) {
+        if ((l4_proto != uint8_t(ip_protocol_num::tcp) && l4_proto != uint8_t(ip_protocol_num::udp))
+                || end - l4 < 4) {
+            return false;
+        }
+        return read_be16(l4) == *port || read_be16(l4 + 2) == *port;
+    }
+    return true;
+}
+
+// Copies the first len bytes of a packet
+static void copy_front(const packet& p, char* to, size_t len) {
+    for (auto&& f : p.fragments()) {
+        if (!len) {
+            break;
+        }
+        auto n = std::min(len, size_t(f.size));
+        std::copy_n(f.base, n, to);
+        to += n;
+        len -= n;
+    }
+}
+
+packet_capture::packet_capture(capture_filter filter, size_t snaplen, size_t ring_size)
+    : _filter(std::move(filter))
+    , _snaplen(snaplen ? snaplen : size_t(ip_packet_len_max) + eth_hdr_len)
+    // Keep the record headers aligned
+    , _slot_size(align_up(sizeof(record_header) + _snaplen, alignof(record_header)))
+    , _nr_slots(std::max<size_t>(ring_size / _slot_size, 16))
+    , _ring(new char[_nr_slots * _slot_size])
+    , _collectd_regs({
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "capture"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "captured")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _captured)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "capture"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "dropped")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _dropped)
+        ),
+    }) {
+}
+
+future<> packet_capture::start(sstring file_name) {
+    return engine().open_file_dma(file_name, open_flags::wo | open_flags::create | open_flags::truncate).then([this] (file f) {
+        file_output_stream_options opts;
+        opts.buffer_size = 65536;
+        _out = make_file_output_stream(std::move(f), opts);
+        struct {
+            uint32_t magic;
+            uint16_t version_major;
+            uint16_t version_minor;
+            int32_t thiszone;
+            uint32_t sigfigs;
+            uint32_t snaplen;
+            uint32_t network;
+        } __attribute__((packed)) hdr = { 0xa1b2c3d4, 2, 4, 0, 0, uint32_t(_snaplen), 1 /* LINKTYPE_ETHERNET */ };
+        return _out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+    }).then([this] {
+        _writer = do_until([this] { return _stopping && _tail == _head; }, [this] {
+            if (_tail == _head) {
+                _ring_filled = promise<>();
+                return _ring_filled->get_future();
+            }
+            return write_record();
+        });
+    });
+}
+
+future<> packet_capture::write_record() {
+    auto s = slot(_tail);
+    auto rh = reinterpret_cast<record_header*>(s);
+    return _out.write(s, sizeof(*rh) + rh->caplen).then([this] {
+        ++_tail;
+    });
+}
+
+void packet_capture::wake_writer() {
+    if (_ring_filled) {
+        _ring_filled->set_value();
+        _ring_filled = {};
+    }
+}
+
+future<> packet_capture::stop() {
+    _stopping = true;
+    wake_writer();
+    return std::move(_writer).then([this] {
+        return _out.close();
+    });
+}
+
+void packet_capture::capture(direction dir, const packet& p) {
+    if (!(dir == direction::inbound ? _filter.inbound : _filter.outbound)) {
+        return;
+    }
+    auto len = p.len();
+    auto frame = p.frag(0).base;
+    char hdr[capture_filter::header_len];
+    auto hdr_len = std::min(size_t(len), sizeof(hdr));
+    if (p.frag(0).size < hdr_len) {
+        copy_front(p, hdr, hdr_len);
+        frame = hdr;
+    }
+    if (!_filter.match(frame, hdr_len)) {
+        return;
+    }
+    if (_head - _tail == _nr_slots) {
+        ++_dropped;
+        return;
+    }
+    auto s = slot(_head);
+    auto rh = reinterpret_cast<record_header*>(s);
+    auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    rh->ts_sec = now / 1000000;
+    rh->ts_usec = now % 1000000;
+    rh->len = len;
+    rh->caplen = std::min(size_t(len), _snaplen);
+    copy_front(p, s + sizeof(*rh), rh->caplen);
+    ++_head;
+    ++_captured;
+    wake_writer();
+}
+
+}
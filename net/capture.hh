@@ -0,0 +1,123 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#ifndef NET_CAPTURE_HH_
+#define NET_CAPTURE_HH_
+
+#include <memory>
+#include <experimental/optional>
+#include "core/future.hh"
+#include "core/iostream.hh"
+#include "core/sstring.hh"
+#include "core/scollectd.hh"
+#include "packet.hh"
+
+namespace net {
+
+// Which packets a capture records: all the criteria that are set must
+// match.  Parsed from a small subset of the pcap-filter language, words
+// separated by spaces:
+//
+//   inbound | outbound          direction, relative to the interface
+//   arp | ip | ip6              ethernet protocol
+//   tcp | udp | icmp | icmp6    IP protocol (IPv6 extension headers are
+//                               not followed)
+//   port <n>                    TCP or UDP source or destination port
+//
+// For example "ip tcp port 80" or "outbound udp".
+struct capture_filter {
+    bool inbound = true;
+    bool outbound = true;
+    std::experimental::optional<uint16_t> eth_proto;
+    std::experimental::optional<uint8_t> ip_proto;
+    std::experimental::optional<uint16_t> port;
+    // Bytes of the packet match() may look at
+    static constexpr size_t header_len = 96;
+
+    // Throws std::invalid_argument on an unknown expression
+    static capture_filter parse(const sstring& expr);
+    // Matches the first header_len bytes of an ethernet frame, or all of
+    // it if shorter
+    bool match(const char* frame, size_t len) const;
+};
+
+// Copies the packets an interface sends and receives on this shard into
+// a ring, and writes them to a pcap file in the background, so the
+// traffic of devices tcpdump cannot see can be inspected.
+//
+// capture() runs in the data path: it only filters, and copies up to
+// snaplen bytes and a timestamp into a preallocated slot.  The ring has a
+// single producer and a single consumer, both on this shard, so it needs
+// no locks; when the writer falls behind, packets are dropped and
+// counted.  Transmitted packets are recorded as handed to the device, so
+// offloaded checksums and TSO segments appear as such.
+class packet_capture {
+public:
+    enum class direction { inbound, outbound };
+private:
+    struct record_header {
+        uint32_t ts_sec;
+        uint32_t ts_usec;
+        uint32_t caplen;
+        uint32_t len;
+    };
+    capture_filter _filter;
+    size_t _snaplen;
+    size_t _slot_size;
+    size_t _nr_slots;
+    std::unique_ptr<char[]> _ring;
+    // Slots filled by capture() and consumed by the writer; they only
+    // grow, the slot is the index modulo _nr_slots
+    uint64_t _head = 0;
+    uint64_t _tail = 0;
+    uint64_t _captured = 0;
+    uint64_t _dropped = 0;
+    bool _stopping = false;
+    // Set while the writer waits for capture() to fill a slot
+    std::experimental::optional<promise<>> _ring_filled;
+    output_stream<char> _out;
+    future<> _writer = make_ready_future<>();
+    scollectd::registrations _collectd_regs;
+private:
+    char* slot(uint64_t idx) { return _ring.get() + (idx % _nr_slots) * _slot_size; }
+    future<> write_record();
+    void wake_writer();
+public:
+    static constexpr size_t default_snaplen = 128;
+    static constexpr size_t default_ring_size = 8 << 20;
+    // Records the first snaplen bytes of each packet, or all of it if
+    // snaplen is 0, in a ring of about ring_size bytes
+    packet_capture(capture_filter filter, size_t snaplen = default_snaplen,
+            size_t ring_size = default_ring_size);
+    packet_capture(packet_capture&&) = delete;
+    // Creates the file and starts writing the ring to it
+    future<> start(sstring file_name);
+    // Writes the records left in the ring and closes the file; only after
+    // start() succeeded
+    future<> stop();
+    void capture(direction dir, const packet& p);
+    uint64_t captured() const { return _captured; }
+    uint64_t dropped() const { return _dropped; }
+};
+
+}
+
+#endif /* NET_CAPTURE_HH_ */
@@ -0,0 +1,139 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#ifndef FLOW_TABLE_HH_
+#define FLOW_TABLE_HH_
+
+#include <vector>
+#include <cstdint>
+#include <cassert>
+
+namespace net {
+
+// Open addressing hash table of flows.  The caller supplies each key's
+// hash, so that a lookup for a received packet can reuse the RSS hash the
+// NIC (or the software RSS path) already computed over the flow's tuple.
+//
+// Entries live in one array, with their hash next to the key, so a lookup
+// usually touches a single cache line: linear probing compares the hashes
+// first and only then the keys.  Deletion shifts the following entries
+// back instead of leaving tombstones, keeping probe sequences short under
+// heavy connection churn.
+template <typename Key, typename Value>
+class flow_table {
+    struct slot {
+        uint32_t hash;
+        bool used = false;
+        Key key;
+        Value value;
+    };
+    std::vector<slot> _slots;
+    size_t _mask;
+    size_t _size = 0;
+private:
+    size_t home(uint32_t hash) const { return hash & _mask; }
+    size_t lookup(const Key& key, uint32_t hash) const {
+        for (auto i = home(hash); ; i = (i + 1) & _mask) {
+            auto& s = _slots[i];
+            if (!s.used || (s.hash == hash && s.key == key)) {
+                return i;
+            }
+        }
+    }
+    void grow() {
+        auto old = std::move(_slots);
+        _slots = std::vector<slot>(old.size() * 2);
+        _mask = _slots.size() - 1;
+        for (auto&& s : old) {
+            if (s.used) {
+                auto& n = _slots[lookup(s.key, s.hash)];
+                n.used = true;
+                n.hash = s.hash;
+                n.key = std::move(s.key);
+                n.value = std::move(s.value);
+            }
+        }
+    }
+public:
+    // capacity must be a power of two
+    explicit flow_table(size_t capacity = 256) : _slots(capacity), _mask(capacity - 1) {
+        assert(capacity && !(capacity & _mask));
+    }
+    size_t size() const { return _size; }
+    bool empty() const { return !_size; }
+    // Starts loading the slot a lookup for this hash begins at
+    void prefetch(uint32_t hash) const {
+        __builtin_prefetch(&_slots[home(hash)]);
+    }
+    Value* find(const Key& key, uint32_t hash) {
+        auto& s = _slots[lookup(key, hash)];
+        return s.used ? &s.value : nullptr;
+    }
+    // Inserts a key which is not in the table
+    void insert(const Key& key, uint32_t hash, Value value) {
+        // Keep the load factor under 1/2
+        if ((_size + 1) * 2 > _slots.size()) {
+            grow();
+        }
+        auto& s = _slots[lookup(key, hash)];
+        assert(!s.used);
+        s.used = true;
+        s.hash = hash;
+        s.key = key;
+        s.value = std::move(value);
+        ++_size;
+    }
+    bool erase(const Key& key, uint32_t hash) {
+        auto i = lookup(key, hash);
+        if (!_slots[i].used) {
+            return false;
+        }
+        // Move back each following entry of the cluster whose home slot is
+        // not cyclically within (i, j]
+        for (auto j = (i + 1) & _mask; _slots[j].used; j = (j + 1) & _mask) {
+            auto k = home(_slots[j].hash);
+            bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+            if (!stays) {
+                _slots[i].hash = _slots[j].hash;
+                _slots[i].key = std::move(_slots[j].key);
+                _slots[i].value = std::move(_slots[j].value);
+                i = j;
+            }
+        }
+        _slots[i].used = false;
+        _slots[i].value = Value();
+        --_size;
+        return true;
+    }
+    // Calls func on each value; func must not insert or erase
+    template <typename Func>
+    void for_each(Func&& func) {
+        for (auto&& s : _slots) {
+            if (s.used) {
+                func(s.value);
+            }
+        }
+    }
+};
+
+}
+
+#endif /* FLOW_TABLE_HH_ */
@@ -21,6 +21,7 @@
  */
 
 #include "ip.hh"
+#include "tcp.hh"
 #include "core/print.hh"
 #include "core/future-util.hh"
 #include "core/shared_ptr.hh"
@@ -40,9 +41,11 @@ std::ostream& operator<<(std::ostream& os, ipv4_address a) {
 constexpr std::chrono::seconds ipv4::_frag_timeout;
 constexpr uint32_t ipv4::_frag_low_thresh;
 constexpr uint32_t ipv4::_frag_high_thresh;
+constexpr unsigned ipv4::_gro_max_flows;
 
 ipv4::ipv4(interface* netif)
     : _netif(netif)
+    , _hw_features(netif->hw_features())
     , _global_arp(netif)
     , _arp(_global_arp)
     , _host_address(0)
@@ -69,7 +72,25 @@ ipv4::ipv4(interface* netif)
             , [] { return ipv4_packet_merger::linearizations(); })
         ),
     }) {
+    _l3.receive_burst([this] (l3_protocol::rx_burst& burst) { handle_received_burst(burst); });
     _frag_timer.set_callback([this] { frag_timeout(); });
+    set_gso(true);
+    set_gro(true);
+}
+
+void ipv4::set_gso(bool enable) {
+    auto& dev = _netif->hw_features();
+    _hw_features.tx_tso = dev.tx_tso || enable;
+    _hw_features.tx_csum_l4_offload = dev.tx_csum_l4_offload || enable;
+}
+
+void ipv4::set_gro(bool enable) {
+    if (!enable) {
+        gro_flush();
+        _gro_poller = {};
+    } else if (!_gro_poller) {
+        _gro_poller.emplace([this] { return gro_flush(); });
+    }
 }
 
 bool ipv4::forward(forward_hash& out_hash_data, packet& p, size_t off)
@@ -188,11 +209,13 @@ ipv4::handle_received_packet(packet p, ethernet_address from) {
                 hash_data.push_back(hton(h.src_ip.ip));
                 hash_data.push_back(hton(h.dst_ip.ip));
                 l4->forward(hash_data, ip_data, l4_offset);
-                cpu_id = _netif->hash2cpu(toeplitz_hash(_netif->rss_key(), hash_data));
+                cpu_id = _netif->hash2cpu(_netif->rss_table().hash(hash_data));
             }
 
             // No need to forward if the dst cpu is the current cpu
             if (cpu_id == engine().cpu_id()) {
+                // Its RSS hash, if any, only covered the addresses
+                ip_data.offload_info_ref().reassembled = true;
                 l4->received(std::move(ip_data), h.src_ip, h.dst_ip);
             } else {
                 auto to = _netif->hw_address();
@@ -216,11 +239,118 @@ ipv4::handle_received_packet(packet p, ethernet_address from) {
     if (l4) {
         // Trim IP header and pass to upper layer
         p.trim_front(ip_hdr_len);
-        l4->received(std::move(p), h.src_ip, h.dst_ip);
+        if (_gro_poller && h.ip_proto == uint8_t(ip_protocol_num::tcp)) {
+            gro_receive(std::move(p), h.src_ip, h.dst_ip);
+        } else {
+            l4->received(std::move(p), h.src_ip, h.dst_ip);
+        }
     }
     return make_ready_future<>();
 }
 
+void ipv4::handle_received_burst(l3_protocol::rx_burst& burst) {
+    // Start loading the connections of the whole burst before the first
+    // lookup, so that their cache misses overlap
+    for (auto&& rp : burst) {
+        auto hash = rp.p.rss_hash();
+        if (hash) {
+            _tcp.prefetch(*hash);
+        }
+    }
+    for (auto&& rp : burst) {
+        // As on the stream path, drop packets while the packet filter
+        // handles one, instead of queueing them without limit
+        if (!_burst_ready.available()) {
+            continue;
+        }
+        if (_burst_ready.failed()) {
+            _burst_ready.ignore_ready_future();
+        }
+        _burst_ready = handle_received_packet(std::move(rp.p), rp.from);
+    }
+    // A burst is as far as segments of a flow can be coalesced without
+    // delaying them
+    gro_flush();
+}
+
+void ipv4::gro_receive(packet p, ipv4_address from, ipv4_address to) {
+    auto th = p.get_header<tcp_hdr>(0);
+    if (!th || unsigned(th->data_offset * 4) < sizeof(*th) || p.len() < unsigned(th->data_offset * 4)) {
+        // Let TCP drop it
+        return _l4[uint8_t(ip_protocol_num::tcp)]->received(std::move(p), from, to);
+    }
+    unsigned hdr_len = th->data_offset * 4;
+    auto hdr = reinterpret_cast<uint8_t*>(p.get_header(0, hdr_len));
+    th = reinterpret_cast<tcp_hdr*>(hdr);
+    auto flow = std::find_if(_gro_flows.begin(), _gro_flows.end(), [&] (gro_flow& f) {
+        return f.from == from && f.to == to && f.src_port == th->src_port.raw && f.dst_port == th->dst_port.raw;
+    });
+    // Only plain data segments are coalesced
+    bool data = p.len() > hdr_len && th->f_ack && !th->f_syn && !th->f_fin && !th->f_rst && !th->f_urg;
+    if (data && !_hw_features.rx_csum_offload) {
+        // The merged packet's checksum will be meaningless, so verify the
+        // segment's now
+        checksummer csum;
+        ipv4_traits::tcp_pseudo_header_checksum(csum, from, to, p.len());
+        csum.sum(p);
+        if (csum.get() != 0) {
+            return;
+        }
+        p.offload_info_ref().l4_csum_verified = true;
+    }
+    if (flow != _gro_flows.end()) {
+        // The segment must follow the held data, with the same header
+        // except for the sequence number, checksum and PSH flag
+        auto held = reinterpret_cast<uint8_t*>(flow->p.get_header(0, hdr_len));
+        auto len = p.len() - hdr_len;
+        if (data && th->seq.raw.raw == flow->next_seq && held[12] == hdr[12]
+                && std::equal(hdr + 8, hdr + 12, held + 8)
+                && std::equal(hdr + 14, hdr + 16, held + 14)
+                && std::equal(hdr + sizeof(tcp_hdr), hdr + hdr_len, held + sizeof(tcp_hdr))
+                && flow->p.len() + len <= net::ip_packet_len_max - net::ipv4_hdr_len_min) {
+            bool psh = th->f_psh;
+            flow->next_seq = hton(ntoh(flow->next_seq) + len);
+            p.trim_front(hdr_len);
+            flow->p.append(std::move(p));
+            if (psh) {
+                // The sender wants the data delivered now
+                reinterpret_cast<tcp_hdr*>(held)->f_psh = true;
+                gro_deliver(*flow);
+                _gro_flows.erase(flow);
+            }
+            return;
+        }
+        // Keep the flow's segments in order
+        gro_deliver(*flow);
+        _gro_flows.erase(flow);
+    }
+    if (!data || th->f_psh) {
+        return _l4[uint8_t(ip_protocol_num::tcp)]->received(std::move(p), from, to);
+    }
+    if (_gro_flows.size() == _gro_max_flows) {
+        gro_deliver(_gro_flows.front());
+        _gro_flows.erase(_gro_flows.begin());
+    }
+    auto next_seq = hton(ntoh(th->seq.raw.raw) + uint32_t(p.len() - hdr_len));
+    _gro_flows.push_back(gro_flow{from, to, th->src_port.raw, th->dst_port.raw, next_seq, std::move(p)});
+}
+
+void ipv4::gro_deliver(gro_flow& flow) {
+    _l4[uint8_t(ip_protocol_num::tcp)]->received(std::move(flow.p), flow.from, flow.to);
+}
+
+bool ipv4::gro_flush() {
+    if (_gro_flows.empty()) {
+        return false;
+    }
+    auto flows = std::move(_gro_flows);
+    _gro_flows.clear();
+    for (auto&& f : flows) {
+        gro_deliver(f);
+    }
+    return true;
+}
+
 future<ethernet_address> ipv4::get_l2_dst_address(ipv4_address to) {
     // Figure out where to send the packet to. If it is a directly connected
     // host, send to it directly, otherwise send to the default gateway.
@@ -235,6 +365,13 @@ future<ethernet_address> ipv4::get_l2_dst_address(ipv4_address to) {
 }
 
 void ipv4::send(ipv4_address to, ip_protocol_num proto_num, packet p, ethernet_address e_dst) {
+    auto& dev = _netif->hw_features();
+    if (p.offload_info_ref().tso_seg_size && !dev.tx_tso) {
+        return gso_segment(to, std::move(p), e_dst);
+    }
+    if (p.offload_info_ref().needs_csum && !dev.tx_csum_l4_offload) {
+        complete_l4_checksum(p, proto_num);
+    }
     auto needs_frag = this->needs_frag(p, proto_num, hw_features());
 
     auto send_pkt = [this, to, proto_num, needs_frag, e_dst] (packet& pkt, uint16_t remaining, uint16_t offset) mutable  {
@@ -291,6 +428,55 @@ void ipv4::send(ipv4_address to, ip_protocol_num proto_num, packet p, ethernet_a
     }
 }
 
+void ipv4::gso_segment(ipv4_address to, packet p, ethernet_address e_dst) {
+    // Split the payload of a TCP packet into segments of tso_seg_size bytes,
+    // each with a copy of the header fixed up as the NIC would
+    auto oi = p.offload_info();
+    unsigned hdr_len = oi.tcp_hdr_len;
+    unsigned seg_size = oi.tso_seg_size;
+    auto hdr = p.get_header(0, hdr_len);
+    auto h = ntoh(*reinterpret_cast<tcp_hdr*>(hdr));
+    unsigned payload_len = p.len() - hdr_len;
+    oi.tso_seg_size = 0;
+    oi.needs_csum = true;
+    for (unsigned off = 0; off < payload_len; off += seg_size) {
+        auto len = std::min(seg_size, payload_len - off);
+        bool last = off + len == payload_len;
+        packet seg(fragment{hdr, hdr_len}, p.share(hdr_len + off, len));
+        auto sh = h;
+        sh.seq = tcp_seq(h.seq) + off;
+        sh.f_fin = h.f_fin && last;
+        sh.f_psh = h.f_psh && last;
+        auto th = seg.get_header<tcp_hdr>(0);
+        *th = hton(sh);
+        checksummer csum;
+        ipv4_traits::tcp_pseudo_header_checksum(csum, _host_address, to, hdr_len + len);
+        th->checksum = ~csum.get();
+        seg.set_offload_info(oi);
+        send(to, ip_protocol_num::tcp, std::move(seg), e_dst);
+    }
+}
+
+void ipv4::complete_l4_checksum(packet& p, ip_protocol_num proto_num) {
+    // The checksum field holds the pseudo header's sum; add the segment's
+    size_t off;
+    if (proto_num == ip_protocol_num::tcp) {
+        off = offsetof(tcp_hdr, checksum);
+    } else if (proto_num == ip_protocol_num::udp) {
+        off = offsetof(udp_hdr, cksum);
+    } else {
+        return;
+    }
+    checksummer csum;
+    csum.sum(p);
+    auto sum = csum.get();
+    if (proto_num == ip_protocol_num::udp && sum == 0) {
+        sum = 0xffff;
+    }
+    *reinterpret_cast<packed<uint16_t>*>(p.get_header(off, sizeof(uint16_t))) = sum;
+    p.offload_info_ref().needs_csum = false;
+}
+
 std::experimental::optional<l3_protocol::l3packet> ipv4::get_packet() {
     // _packetq will be mostly empty here unless it hold remnants of previously
     // fragmented packet
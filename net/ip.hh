@@ -107,7 +107,18 @@ struct ipv4_traits {
     static void udp_pseudo_header_checksum(checksummer& csum, ipv4_address src, ipv4_address dst, uint16_t len) {
         csum.sum_many(src.ip.raw, dst.ip.raw, uint8_t(0), uint8_t(ip_protocol_num::udp), len);
     }
+    static void hash_address(forward_hash& out_hash_data, ipv4_address a) {
+        out_hash_data.push_back(hton(a.ip));
+    }
+    static ipv4_address socket_address_ip(const socket_address& sa) {
+        return ipv4_address(ipv4_addr(sa));
+    }
+    static uint16_t socket_address_port(const socket_address& sa) {
+        return net::ntoh(sa.u.in.sin_port);
+    }
     static constexpr uint8_t ip_hdr_len_min = net::ipv4_hdr_len_min;
+    // collectd plugin of the TCP metrics
+    static const char* tcp_plugin() { return "tcp"; }
 };
 
 template <ip_protocol_num ProtoNum>
@@ -145,13 +156,13 @@ struct l4connid {
                 && foreign_port == x.foreign_port;
     }
 
-    uint32_t hash(const rss_key_type& rss_key) {
+    uint32_t hash(const toeplitz_table& rss_table) {
         forward_hash hash_data;
-        hash_data.push_back(hton(foreign_ip.ip));
-        hash_data.push_back(hton(local_ip.ip));
+        InetTraits::hash_address(hash_data, foreign_ip);
+        InetTraits::hash_address(hash_data, local_ip);
         hash_data.push_back(hton(foreign_port));
         hash_data.push_back(hton(local_port));
-        return toeplitz_hash(rss_key, hash_data);
+        return rss_table.hash(hash_data);
     }
 };
 
@@ -163,6 +174,7 @@ class ipv4_tcp final : public ip_protocol {
     ~ipv4_tcp();
     virtual void received(packet p, ipv4_address from, ipv4_address to);
     virtual bool forward(forward_hash& out_hash_data, packet& p, size_t off) override;
+    void prefetch(uint32_t rss_hash);
     friend class ipv4;
 };
 
@@ -301,6 +313,9 @@ class ipv4 {
     static proto_type arp_protocol_type() { return proto_type(eth_protocol_num::ipv4); }
 private:
     interface* _netif;
+    // Features offered to the L4 protocols: the interface's, plus TCP
+    // segmentation and L4 checksums done in software by send() (GSO)
+    net::hw_features _hw_features;
     std::vector<ipv4_traits::packet_provider_type> _pkt_providers;
     arp _global_arp;
     arp_for<ipv4> _arp;
@@ -314,6 +329,9 @@ class ipv4 {
     ipv4_udp _udp;
     array_map<ip_protocol*, 256> _l4;
     ip_packet_filter * _packet_filter = nullptr;
+    // Handling of the last packet received in a burst, which the packet
+    // filter may defer
+    future<> _burst_ready = make_ready_future<>();
     struct frag {
         packet header;
         ipv4_packet_merger data;
@@ -335,9 +353,30 @@ class ipv4 {
     timer<lowres_clock> _frag_timer;
     circular_buffer<l3_protocol::l3packet> _packetq;
     unsigned _pkt_provider_idx = 0;
+    // GRO: TCP segments received in a poll, coalesced with the following
+    // in-order segments of their flow until the poller hands them to TCP
+    struct gro_flow {
+        ipv4_address from;
+        ipv4_address to;
+        uint16_t src_port;
+        uint16_t dst_port;
+        // Sequence number (network order) following the held data
+        uint32_t next_seq;
+        // TCP header and payload
+        packet p;
+    };
+    static constexpr unsigned _gro_max_flows = 8;
+    std::vector<gro_flow> _gro_flows;
+    std::experimental::optional<reactor::poller> _gro_poller;
     scollectd::registrations _collectd_regs;
 private:
     future<> handle_received_packet(packet p, ethernet_address from);
+    void handle_received_burst(l3_protocol::rx_burst& burst);
+    void gso_segment(ipv4_address to, packet p, ethernet_address e_dst);
+    void complete_l4_checksum(packet& p, ip_protocol_num proto_num);
+    void gro_receive(packet p, ipv4_address from, ipv4_address to);
+    void gro_deliver(gro_flow& flow);
+    bool gro_flush();
     bool forward(forward_hash& out_hash_data, packet& p, size_t off);
     std::experimental::optional<l3_protocol::l3packet> get_packet();
     bool in_my_netmask(ipv4_address a) const;
@@ -356,6 +395,8 @@ class ipv4 {
     explicit ipv4(interface* netif);
     void set_host_address(ipv4_address ip);
     ipv4_address host_address();
+    // Source address of packets sent to an address
+    ipv4_address source_address(ipv4_address to) const { return _host_address; }
     void set_gw_address(ipv4_address ip);
     ipv4_address gw_address() const;
     void set_netmask_address(ipv4_address ip);
@@ -372,11 +413,19 @@ class ipv4 {
     tcp<ipv4_traits>& get_tcp() { return *_tcp._tcp; }
     ipv4_udp& get_udp() { return _udp; }
     void register_l4(proto_type id, ip_protocol* handler);
-    const net::hw_features& hw_features() const { return _netif->hw_features(); }
+    const net::hw_features& hw_features() const { return _hw_features; }
+    // Segment TCP packets larger than the MTU in software, when the
+    // interface cannot (generic segmentation offload)
+    void set_gso(bool enable);
+    // Coalesce the TCP segments received in a poll (generic receive offload)
+    void set_gro(bool enable);
     static bool needs_frag(packet& p, ip_protocol_num proto_num, net::hw_features hw_features);
     void learn(ethernet_address l2, ipv4_address l3) {
         _arp.learn(l2, l3);
     }
+    void set_arp_timing(neighbor_timing timing) {
+        _arp.set_timing(timing);
+    }
     void register_packet_provider(ipv4_traits::packet_provider_type&& func) {
         _pkt_providers.push_back(std::move(func));
     }
@@ -437,8 +486,6 @@ struct l4connid<InetTraits>::connid_hash : private std::hash<ipaddr>, private st
     }
 };
 
-void arp_learn(ethernet_address l2, ipv4_address l3);
-
 }
 
 #endif /* IP_HH_ */
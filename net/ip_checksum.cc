@@ -22,29 +22,168 @@
 #include "ip_checksum.hh"
 #include "net.hh"
 #include <arpa/inet.h>
+#include <cstring>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 namespace net {
 
+// The block sums below add the data as native order words into wide
+// accumulators, and only fold the total to 16 bits and convert it to
+// network order at the end; RFC 1071 shows the ones' complement sum is
+// independent of byte order up to that swap.  Each returns a value
+// congruent to the sum modulo 0xffff that is zero only for all-zero data.
+
+static inline uint64_t fold32(uint64_t sum) {
+    sum = (sum & 0xffff'ffff) + (sum >> 32);
+    return (sum & 0xffff'ffff) + (sum >> 32);
+}
+
+static inline uint16_t finish(uint64_t sum) {
+    sum = fold32(sum);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return ntohs(sum);
+}
+
+// len must be even
+static uint64_t native_sum_scalar(const char* data, size_t len) {
+    uint64_t sum = 0, carry = 0;
+    while (len >= 8) {
+        uint64_t w;
+        std::memcpy(&w, data, 8);
+        sum += w;
+        carry += sum < w;
+        data += 8;
+        len -= 8;
+    }
+    // 2^64 is 1 modulo 0xffff, so each carry counts as one
+    sum = fold32(sum) + carry;
+    if (len >= 4) {
+        uint32_t w;
+        std::memcpy(&w, data, 4);
+        sum += w;
+        data += 4;
+        len -= 4;
+    }
+    if (len) {
+        uint16_t w;
+        std::memcpy(&w, data, 2);
+        sum += w;
+    }
+    return sum;
+}
+
+static uint16_t block_sum_scalar(const char* data, size_t len) {
+    return finish(native_sum_scalar(data, len));
+}
+
+#ifdef __x86_64__
+
+// Vectors are summed as 32-bit words, each widened into a 64-bit lane,
+// so that no lane can overflow for any packet size.
+
+static uint16_t block_sum_sse2(const char* data, size_t len) {
+    auto mask = _mm_set1_epi64x(0xffff'ffff);
+    auto acc0 = _mm_setzero_si128();
+    auto acc1 = _mm_setzero_si128();
+    for (; len >= 32; data += 32, len -= 32) {
+        auto v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+        auto v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+        acc0 = _mm_add_epi64(acc0, _mm_and_si128(v0, mask));
+        acc1 = _mm_add_epi64(acc1, _mm_srli_epi64(v0, 32));
+        acc0 = _mm_add_epi64(acc0, _mm_and_si128(v1, mask));
+        acc1 = _mm_add_epi64(acc1, _mm_srli_epi64(v1, 32));
+    }
+    alignas(16) uint64_t lanes[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), _mm_add_epi64(acc0, acc1));
+    return finish(fold32(lanes[0]) + fold32(lanes[1]) + native_sum_scalar(data, len));
+}
+
+__attribute__((target("avx2")))
+static uint16_t block_sum_avx2(const char* data, size_t len) {
+    auto mask = _mm256_set1_epi64x(0xffff'ffff);
+    auto acc0 = _mm256_setzero_si256();
+    auto acc1 = _mm256_setzero_si256();
+    for (; len >= 64; data += 64, len -= 64) {
+        auto v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+        auto v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_and_si256(v0, mask));
+        acc1 = _mm256_add_epi64(acc1, _mm256_srli_epi64(v0, 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_and_si256(v1, mask));
+        acc1 = _mm256_add_epi64(acc1, _mm256_srli_epi64(v1, 32));
+    }
+    alignas(32) uint64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), _mm256_add_epi64(acc0, acc1));
+    uint64_t sum = native_sum_scalar(data, len);
+    for (auto l : lanes) {
+        sum += fold32(l);
+    }
+    return finish(sum);
+}
+
+__attribute__((target("avx512f")))
+static uint16_t block_sum_avx512(const char* data, size_t len) {
+    auto mask = _mm512_set1_epi64(0xffff'ffff);
+    auto acc0 = _mm512_setzero_si512();
+    auto acc1 = _mm512_setzero_si512();
+    for (; len >= 128; data += 128, len -= 128) {
+        auto v0 = _mm512_loadu_si512(data);
+        auto v1 = _mm512_loadu_si512(data + 64);
+        acc0 = _mm512_add_epi64(acc0, _mm512_and_si512(v0, mask));
+        acc1 = _mm512_add_epi64(acc1, _mm512_srli_epi64(v0, 32));
+        acc0 = _mm512_add_epi64(acc0, _mm512_and_si512(v1, mask));
+        acc1 = _mm512_add_epi64(acc1, _mm512_srli_epi64(v1, 32));
+    }
+    alignas(64) uint64_t lanes[8];
+    _mm512_store_si512(lanes, _mm512_add_epi64(acc0, acc1));
+    uint64_t sum = native_sum_scalar(data, len);
+    for (auto l : lanes) {
+        sum += fold32(l);
+    }
+    return finish(sum);
+}
+
+#endif
+
+std::vector<checksum_kernel> checksum_kernels() {
+    std::vector<checksum_kernel> kernels;
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.push_back({"avx512", block_sum_avx512});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back({"avx2", block_sum_avx2});
+    }
+    kernels.push_back({"sse2", block_sum_sse2});
+#endif
+    kernels.push_back({"scalar", block_sum_scalar});
+    return kernels;
+}
+
+// Starts out as the portable kernel, so that checksums computed by other
+// static initializers work, and is switched to the best one at startup
+static uint16_t (*block_sum)(const char* data, size_t len) = block_sum_scalar;
+
+static struct checksum_kernel_selector {
+    checksum_kernel_selector() {
+        block_sum = checksum_kernels().front().sum;
+    }
+} checksum_kernel_selector;
+
 void checksummer::sum(const char* data, size_t len) {
     auto orig_len = len;
     if (odd) {
         csum += uint8_t(*data++);
         --len;
     }
-    auto p64 = reinterpret_cast<const packed<uint64_t>*>(data);
-    while (len >= 8) {
-        csum += ntohq(*p64++);
-        len -= 8;
-    }
-    auto p16 = reinterpret_cast<const packed<uint16_t>*>(p64);
-    while (len >= 2) {
-        csum += ntohs(*p16++);
-        len -= 2;
-    }
-    auto p8 = reinterpret_cast<const uint8_t*>(p16);
-    if (len) {
-        csum += *p8++ << 8;
-        len -= 1;
+    auto even_len = len & ~size_t(1);
+    csum += block_sum(data, even_len);
+    if (len & 1) {
+        csum += uint8_t(data[even_len]) << 8;
     }
     odd ^= orig_len & 1;
 }
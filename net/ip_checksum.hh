@@ -25,12 +25,23 @@
 #include "packet.hh"
 #include <cstdint>
 #include <cstddef>
+#include <vector>
 #include <arpa/inet.h>
 
 namespace net {
 
 uint16_t ip_checksum(const void* data, size_t len);
 
+// A ones' complement sum of an even length block of network order 16-bit
+// words, not inverted, for one instruction set
+struct checksum_kernel {
+    const char* name;
+    uint16_t (*sum)(const char* data, size_t len);
+};
+
+// The kernels this cpu can run, fastest first; checksummer uses the first
+std::vector<checksum_kernel> checksum_kernels();
+
 struct checksummer {
     __int128 csum = 0;
     bool odd = false;
@@ -0,0 +1,608 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "ipv6.hh"
+#include "tcp.hh"
+#include "core/print.hh"
+#include "core/future-util.hh"
+
+namespace net {
+
+std::ostream& operator<<(std::ostream& os, const ipv6_address& a) {
+    boost::asio::ip::address_v6::bytes_type b;
+    std::copy(a.bytes.begin(), a.bytes.end(), b.begin());
+    return os << boost::asio::ip::address_v6(b).to_string();
+}
+
+ipv6_address ipv6_link_local_address(ethernet_address ea) {
+    auto& m = ea.mac;
+    return ipv6_address(std::array<uint8_t, 16>{{0xfe, 0x80, 0, 0, 0, 0, 0, 0,
+            uint8_t(m[0] ^ 0x02), m[1], m[2], 0xff, 0xfe, m[3], m[4], m[5]}});
+}
+
+ipv6_address ipv6_solicited_node_address(const ipv6_address& a) {
+    auto& b = a.bytes;
+    return ipv6_address(std::array<uint8_t, 16>{{0xff, 0x02, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0x01, 0xff, b[13], b[14], b[15]}});
+}
+
+ethernet_address ipv6_multicast_ethernet_address(const ipv6_address& a) {
+    auto& b = a.bytes;
+    return {0x33, 0x33, b[12], b[13], b[14], b[15]};
+}
+
+static const ipv6_address all_nodes_address(std::array<uint8_t, 16>{{0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01}});
+
+ipv6::ipv6(interface* netif)
+    : _netif(netif)
+    , _hw_features(netif->hw_features())
+    , _link_local_address(ipv6_link_local_address(netif->hw_address()))
+    , _l3(netif, eth_protocol_num::ipv6, [this] { return get_packet(); })
+    , _rx_packets(_l3.receive([this] (packet p, ethernet_address ea) {
+        handle_received_packet(std::move(p), ea);
+        return make_ready_future<>(); },
+      [this] (forward_hash& out_hash_data, packet& p, size_t off) {
+        return forward(out_hash_data, p, off);}))
+    , _tcp(*this)
+    , _icmp(*this)
+    , _udp(*this)
+    , _l4({ { uint8_t(ip_protocol_num::tcp), &_tcp }, { uint8_t(ip_protocol_num::icmpv6), &_icmp },
+            { uint8_t(ip_protocol_num::udp), &_udp } }) {
+    _hw_features.tx_csum_ip_offload = false;
+    _hw_features.tx_csum_l4_offload = false;
+    _hw_features.tx_tso = false;
+    _hw_features.tx_ufo = false;
+    _l3.receive_burst([this] (l3_protocol::rx_burst& burst) { handle_received_burst(burst); });
+}
+
+size_t ipv6::skip_extension_headers(packet& p, size_t off, uint8_t& next_header) {
+    for (;;) {
+        switch (ipv6_ext_header(next_header)) {
+        case ipv6_ext_header::hop_by_hop:
+        case ipv6_ext_header::routing:
+        case ipv6_ext_header::destination_options: {
+            auto eh = p.get_header<ipv6_ext_hdr>(off);
+            if (!eh) {
+                return 0;
+            }
+            size_t len = (eh->hdr_ext_len + 1) * 8;
+            auto hdr = reinterpret_cast<uint8_t*>(p.get_header(off, len));
+            if (!hdr) {
+                return 0;
+            }
+            eh = reinterpret_cast<ipv6_ext_hdr*>(hdr);
+            if (ipv6_ext_header(next_header) == ipv6_ext_header::routing) {
+                // Routing through us to another hop is a router's job
+                if (eh->segments_left != 0) {
+                    return 0;
+                }
+            } else {
+                // Options whose type we don't know and whose two high bits
+                // aren't zero ask for the packet to be dropped (RFC 8200, 4.2)
+                for (size_t i = 2; i < len; ) {
+                    auto type = hdr[i];
+                    if (type == 0) {
+                        // Pad1
+                        ++i;
+                        continue;
+                    }
+                    if (type != 1 && (type >> 6) != 0) {
+                        return 0;
+                    }
+                    if (i + 1 == len) {
+                        return 0;
+                    }
+                    i += 2 + hdr[i + 1];
+                    if (i > len) {
+                        return 0;
+                    }
+                }
+            }
+            next_header = eh->next_header;
+            off += len;
+            break;
+        }
+        case ipv6_ext_header::fragment: {
+            auto fh = p.get_header<ipv6_frag_hdr>(off);
+            if (!fh) {
+                return 0;
+            }
+            auto h = ntoh(*fh);
+            // Only atomic fragments (RFC 6946) are whole packets; others
+            // would need reassembly
+            if ((h.offset_flags & 0xfff9) != 0) {
+                return 0;
+            }
+            next_header = h.next_header;
+            off += sizeof(h);
+            break;
+        }
+        case ipv6_ext_header::no_next_header:
+            return 0;
+        default:
+            return off;
+        }
+    }
+}
+
+bool ipv6::forward(forward_hash& out_hash_data, packet& p, size_t off) {
+    auto iph = p.get_header<ipv6_hdr>(off);
+    if (!iph) {
+        return false;
+    }
+
+    ipv6_traits::hash_address(out_hash_data, iph->src_ip);
+    ipv6_traits::hash_address(out_hash_data, iph->dst_ip);
+
+    auto next_header = iph->next_header;
+    auto l4_off = skip_extension_headers(p, off + sizeof(ipv6_hdr), next_header);
+    auto l4 = _l4[next_header];
+    if (l4_off && l4) {
+        l4->forward(out_hash_data, p, l4_off);
+    }
+    return true;
+}
+
+bool ipv6::is_host_address(const ipv6_address& a) const {
+    return a == _link_local_address || (!is_unspecified(_host_address) && a == _host_address);
+}
+
+bool ipv6::accepts(const ipv6_address& dst) const {
+    return is_host_address(dst)
+            || dst == all_nodes_address
+            || dst == ipv6_solicited_node_address(_link_local_address)
+            || (!is_unspecified(_host_address) && dst == ipv6_solicited_node_address(_host_address));
+}
+
+bool ipv6::is_on_link(const ipv6_address& a) const {
+    if (a.is_link_local()) {
+        return true;
+    }
+    if (is_unspecified(_host_address)) {
+        return false;
+    }
+    for (unsigned i = 0; i < _prefix_len; i += 8) {
+        uint8_t mask = _prefix_len - i >= 8 ? 0xff : uint8_t(0xff00 >> (_prefix_len - i));
+        if ((a.bytes[i / 8] ^ _host_address.bytes[i / 8]) & mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ipv6::handle_received_packet(packet p, ethernet_address from) {
+    auto iph = p.get_header<ipv6_hdr>(0);
+    if (!iph) {
+        return;
+    }
+
+    auto h = ntoh(*iph);
+    if (h.version() != 6) {
+        return;
+    }
+    unsigned ip_len = sizeof(ipv6_hdr) + h.payload_len;
+    unsigned pkt_len = p.len();
+    if (pkt_len > ip_len) {
+        // Trim extra data in the packet beyond the payload length
+        p.trim_back(pkt_len - ip_len);
+    } else if (pkt_len < ip_len) {
+        return;
+    }
+
+    if (!accepts(h.dst_ip)) {
+        // We are a host, not a router
+        return;
+    }
+
+    if (is_on_link(h.src_ip) && !h.src_ip.is_multicast() && !is_unspecified(h.src_ip)
+            && !is_host_address(h.src_ip)) {
+        learn(from, h.src_ip);
+    }
+
+    auto next_header = h.next_header;
+    auto l4_off = skip_extension_headers(p, sizeof(ipv6_hdr), next_header);
+    if (!l4_off) {
+        return;
+    }
+    auto l4 = _l4[next_header];
+    if (l4) {
+        // Trim IP and extension headers and pass to upper layer
+        p.trim_front(l4_off);
+        l4->received(std::move(p), h.src_ip, h.dst_ip, h.hop_limit);
+    }
+}
+
+void ipv6::handle_received_burst(l3_protocol::rx_burst& burst) {
+    // Start loading the connections of the whole burst before the first
+    // lookup, so that their cache misses overlap
+    for (auto&& rp : burst) {
+        auto hash = rp.p.rss_hash();
+        if (hash) {
+            get_tcp().prefetch(*hash);
+        }
+    }
+    for (auto&& rp : burst) {
+        handle_received_packet(std::move(rp.p), rp.from);
+    }
+}
+
+future<ethernet_address> ipv6::get_l2_dst_address(ipv6_address to) {
+    if (to.is_multicast()) {
+        return make_ready_future<ethernet_address>(ipv6_multicast_ethernet_address(to));
+    }
+    // Figure out where to send the packet to. If it is a directly connected
+    // host, send to it directly, otherwise send to the default gateway.
+    ipv6_address dst;
+    if (is_on_link(to) || is_unspecified(_gw_address)) {
+        dst = to;
+    } else {
+        dst = _gw_address;
+    }
+
+    return _icmp._icmp.lookup(dst);
+}
+
+void ipv6::send(ipv6_address to, ip_protocol_num proto_num, packet p, ethernet_address e_dst) {
+    auto iph = p.prepend_header<ipv6_hdr>();
+    iph->ver_class_flow = uint32_t(6) << 28;
+    iph->payload_len = p.len() - sizeof(ipv6_hdr);
+    iph->next_header = uint8_t(proto_num);
+    // Neighbor discovery messages must not have crossed a router
+    // (RFC 4861, 7.1)
+    iph->hop_limit = proto_num == ip_protocol_num::icmpv6 ? 255 : 64;
+    iph->src_ip = source_address(to);
+    iph->dst_ip = to;
+    *iph = hton(*iph);
+
+    // L4 checksums are complete; the drivers' offloads assume IPv4
+    auto oi = p.offload_info();
+    oi.protocol = ip_protocol_num::unused;
+    oi.needs_csum = false;
+    oi.ip_hdr_len = sizeof(ipv6_hdr);
+    p.set_offload_info(oi);
+
+    _packetq.push_back(l3_protocol::l3packet{eth_protocol_num::ipv6, e_dst, std::move(p)});
+}
+
+std::experimental::optional<l3_protocol::l3packet> ipv6::get_packet() {
+    if (_packetq.empty()) {
+        for (size_t i = 0; i < _pkt_providers.size(); i++) {
+            auto l4p = _pkt_providers[_pkt_provider_idx++]();
+            if (_pkt_provider_idx == _pkt_providers.size()) {
+                _pkt_provider_idx = 0;
+            }
+            if (l4p) {
+                auto l4pv = std::move(l4p.value());
+                send(l4pv.to, l4pv.proto_num, std::move(l4pv.p), l4pv.e_dst);
+                break;
+            }
+        }
+    }
+
+    std::experimental::optional<l3_protocol::l3packet> p;
+    if (!_packetq.empty()) {
+        p = std::move(_packetq.front());
+        _packetq.pop_front();
+    }
+    return p;
+}
+
+void ipv6::set_host_address(ipv6_address ip, unsigned prefix_len) {
+    _host_address = ip;
+    _prefix_len = std::min(prefix_len, 128u);
+}
+
+ipv6_address ipv6::host_address() const {
+    return is_unspecified(_host_address) ? _link_local_address : _host_address;
+}
+
+ipv6_address ipv6::source_address(const ipv6_address& to) const {
+    if (to.is_link_local() || to.is_multicast() || is_unspecified(_host_address)) {
+        return _link_local_address;
+    }
+    return _host_address;
+}
+
+void ipv6::set_gw_address(ipv6_address ip) {
+    _gw_address = ip;
+}
+
+ipv6_address ipv6::gw_address() const {
+    return _gw_address;
+}
+
+thread_local std::vector<icmpv6*> icmpv6::_instances;
+
+icmpv6::icmpv6(inet_type& inet) : _inet(inet) {
+    _instances.push_back(this);
+    _aging_timer.set_callback([this] { age(); });
+    _aging_timer.arm_periodic(_timing.retransmit_time);
+    _inet.register_packet_provider([this] {
+        std::experimental::optional<ipv6_traits::l4packet> l4p;
+        if (!_packetq.empty()) {
+            l4p = std::move(_packetq.front());
+            _packetq.pop_front();
+            _queue_space.signal(l4p.value().p.len());
+        }
+        return l4p;
+    });
+}
+
+icmpv6::~icmpv6() {
+    _instances.erase(std::find(_instances.begin(), _instances.end(), this));
+}
+
+ethernet_address icmpv6::l2self() const {
+    return _inet._inet.netif()->hw_address();
+}
+
+void icmpv6::received(packet p, ipaddr from, ipaddr to, uint8_t hop_limit) {
+    auto hdr = p.get_header<icmpv6_hdr>(0);
+    if (!hdr) {
+        return;
+    }
+    checksummer csum;
+    ipv6_traits::pseudo_header_checksum(csum, from, to, ip_protocol_num::icmpv6, p.len());
+    csum.sum(p);
+    if (csum.get() != 0) {
+        return;
+    }
+    // Neighbor discovery messages that crossed a router (RFC 4861,
+    // 7.1.1 and 7.1.2) could come from any off-link host
+    auto ndp_valid = hop_limit == 255 && hdr->code == 0;
+    switch (hdr->type) {
+    case icmpv6_hdr::msg_type::echo_request:
+        return handle_echo_request(std::move(p), from, to);
+    case icmpv6_hdr::msg_type::neighbor_solicitation:
+        if (!ndp_valid) {
+            return;
+        }
+        return handle_neighbor_solicitation(std::move(p), from, to);
+    case icmpv6_hdr::msg_type::neighbor_advertisement:
+        if (!ndp_valid) {
+            return;
+        }
+        return handle_neighbor_advertisement(std::move(p));
+    default:
+        return;
+    }
+}
+
+void icmpv6::handle_echo_request(packet p, ipaddr from, ipaddr to) {
+    if (is_unspecified(from) || from.is_multicast()) {
+        return;
+    }
+    auto hdr = p.get_header<icmpv6_hdr>(0);
+    hdr->type = icmpv6_hdr::msg_type::echo_reply;
+    hdr->code = 0;
+    _inet.get_l2_dst_address(from).then([this, from, p = std::move(p)] (ethernet_address e_dst) mutable {
+        send(from, e_dst, std::move(p));
+    });
+}
+
+// Finds a link-layer address option of the given type
+static std::experimental::optional<ethernet_address>
+find_lladdr_option(packet& p, ndp_lladdr_option::option_type type) {
+    size_t off = sizeof(icmpv6_hdr) + sizeof(ndp_hdr);
+    while (off + 2 <= p.len()) {
+        auto opt = reinterpret_cast<uint8_t*>(p.get_header(off, 2));
+        unsigned len = opt[1] * 8;
+        if (!len || off + len > p.len()) {
+            break;
+        }
+        if (opt[0] == uint8_t(type) && len >= sizeof(ndp_lladdr_option)) {
+            return p.get_header<ndp_lladdr_option>(off)->addr;
+        }
+        off += len;
+    }
+    return {};
+}
+
+void icmpv6::handle_neighbor_solicitation(packet p, ipaddr from, ipaddr to) {
+    auto nh = p.get_header<ndp_hdr>(sizeof(icmpv6_hdr));
+    if (!nh || nh->target.is_multicast() || !_inet._inet.is_host_address(nh->target)) {
+        return;
+    }
+    auto target = nh->target;
+    auto lladdr = find_lladdr_option(p, ndp_lladdr_option::option_type::source);
+    if (is_unspecified(from)) {
+        // Duplicate address detection: tell everyone the address is taken
+        send_advertisement(all_nodes_address, ipv6_multicast_ethernet_address(all_nodes_address), target, false);
+        return;
+    }
+    if (lladdr) {
+        learn(*lladdr, from);
+        send_advertisement(from, *lladdr, target, true);
+    } else {
+        _inet.get_l2_dst_address(from).then([this, from, target] (ethernet_address e_dst) {
+            send_advertisement(from, e_dst, target, true);
+        });
+    }
+}
+
+void icmpv6::handle_neighbor_advertisement(packet p) {
+    auto nh = p.get_header<ndp_hdr>(sizeof(icmpv6_hdr));
+    if (!nh || nh->target.is_multicast()) {
+        return;
+    }
+    auto lladdr = find_lladdr_option(p, ndp_lladdr_option::option_type::target);
+    if (lladdr) {
+        learn_everywhere(*lladdr, nh->target);
+    }
+}
+
+packet icmpv6::make_ndp_packet(icmpv6_hdr::msg_type type, uint32_t flags, const ipaddr& target,
+        ndp_lladdr_option::option_type opt_type) {
+    struct {
+        icmpv6_hdr icmp;
+        ndp_hdr nd;
+        ndp_lladdr_option opt;
+    } __attribute__((packed)) msg;
+    msg.icmp.type = type;
+    msg.icmp.code = 0;
+    msg.icmp.csum = 0;
+    msg.nd.flags = flags;
+    msg.nd.target = target;
+    msg.nd = hton(msg.nd);
+    msg.opt.type = opt_type;
+    msg.opt.len = sizeof(msg.opt) / 8;
+    msg.opt.addr = l2self();
+    return packet(reinterpret_cast<char*>(&msg), sizeof(msg));
+}
+
+void icmpv6::send_solicitation(const ipaddr& target) {
+    auto to = ipv6_solicited_node_address(target);
+    auto p = make_ndp_packet(icmpv6_hdr::msg_type::neighbor_solicitation, 0, target,
+            ndp_lladdr_option::option_type::source);
+    send(to, ipv6_multicast_ethernet_address(to), std::move(p));
+}
+
+void icmpv6::send_advertisement(ipaddr to, ethernet_address e_dst, const ipaddr& target, bool solicited) {
+    uint32_t flags = 1u << uint8_t(ndp_hdr::flag_bits::override_);
+    if (solicited) {
+        flags |= 1u << uint8_t(ndp_hdr::flag_bits::solicited);
+    }
+    auto p = make_ndp_packet(icmpv6_hdr::msg_type::neighbor_advertisement, flags, target,
+            ndp_lladdr_option::option_type::target);
+    send(to, e_dst, std::move(p));
+}
+
+void icmpv6::send(ipaddr to, ethernet_address e_dst, packet p) {
+    if (!_queue_space.try_wait(p.len())) { // drop packets that do not fit the queue
+        return;
+    }
+    auto hdr = p.get_header<icmpv6_hdr>(0);
+    hdr->csum = 0;
+    checksummer csum;
+    ipv6_traits::pseudo_header_checksum(csum, _inet._inet.source_address(to), to, ip_protocol_num::icmpv6, p.len());
+    csum.sum(p);
+    hdr->csum = csum.get();
+    _packetq.emplace_back(ipv6_traits::l4packet{to, std::move(p), e_dst, ip_protocol_num::icmpv6});
+}
+
+future<ethernet_address>
+icmpv6::lookup(const ipaddr& addr) {
+    auto i = _neighbors.find(addr);
+    if (i != _neighbors.end()) {
+        i->second.used = lowres_clock::now();
+        return make_ready_future<ethernet_address>(i->second.l2);
+    }
+    auto& res = _in_progress[addr];
+    if (res._waiters.size() >= max_waiters) {
+        return make_exception_future<ethernet_address>(arp_queue_full_error());
+    }
+    res._waiters.emplace_back();
+    auto f = res._waiters.back().get_future();
+    if (!res._solicitations) {
+        solicit(addr, res);
+    }
+    return f;
+}
+
+void icmpv6::solicit(const ipaddr& target, resolution& res) {
+    res._solicited = lowres_clock::now();
+    ++res._solicitations;
+    send_solicitation(target);
+}
+
+// Asks a known neighbor directly whether it is still there
+void icmpv6::probe(const ipaddr& target, neighbor& n) {
+    n.probed = lowres_clock::now();
+    auto p = make_ndp_packet(icmpv6_hdr::msg_type::neighbor_solicitation, 0, target,
+            ndp_lladdr_option::option_type::source);
+    send(target, n.l2, std::move(p));
+}
+
+void icmpv6::learn(ethernet_address l2, ipaddr l3) {
+    auto& n = _neighbors[l3];
+    n.l2 = l2;
+    n.confirmed = lowres_clock::now();
+    auto i = _in_progress.find(l3);
+    if (i != _in_progress.end()) {
+        for (auto&& pr : i->second._waiters) {
+            pr.set_value(l2);
+        }
+        _in_progress.erase(i);
+    }
+}
+
+void icmpv6::set_timing(neighbor_timing timing) {
+    _timing = timing;
+    _aging_timer.cancel();
+    _aging_timer.arm_periodic(_timing.retransmit_time);
+}
+
+void icmpv6::learn_everywhere(ethernet_address l2, ipaddr l3) {
+    learn(l2, l3);
+    for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+        if (cpu == engine().cpu_id()) {
+            continue;
+        }
+        smp::submit_to(cpu, [hw = l2self(), l2, l3] {
+            for (auto icmp : _instances) {
+                if (icmp->l2self().mac == hw.mac) {
+                    icmp->learn(l2, l3);
+                    return;
+                }
+            }
+        });
+    }
+}
+
+// Retransmits solicitations, failing the lookups waiting on them, and
+// forgets neighbors that went unconfirmed: those in use are probed before
+// they would expire, the others dropped.
+void icmpv6::age() {
+    auto now = lowres_clock::now();
+    for (auto i = _in_progress.begin(); i != _in_progress.end();) {
+        auto& res = i->second;
+        if (now - res._solicited < _timing.retransmit_time) {
+            ++i;
+            continue;
+        }
+        for (auto& w : res._waiters) {
+            w.set_exception(arp_timeout_error());
+        }
+        res._waiters.clear();
+        if (res._solicitations >= max_probes) {
+            i = _in_progress.erase(i);
+            continue;
+        }
+        solicit(i->first, res);
+        ++i;
+    }
+    for (auto i = _neighbors.begin(); i != _neighbors.end();) {
+        auto& n = i->second;
+        auto unconfirmed = now - n.confirmed;
+        auto in_use = now - n.used < _timing.reachable_time;
+        if (unconfirmed >= _timing.stale_time || (unconfirmed >= _timing.reachable_time && !in_use)) {
+            i = _neighbors.erase(i);
+            continue;
+        }
+        if (unconfirmed >= _timing.reachable_time - _timing.refresh_margin && in_use
+                && now - n.probed >= _timing.retransmit_time) {
+            probe(i->first, n);
+        }
+        ++i;
+    }
+}
+
+}
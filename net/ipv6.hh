@@ -0,0 +1,416 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#ifndef IPV6_HH_
+#define IPV6_HH_
+
+#include <boost/asio/ip/address_v6.hpp>
+#include <netinet/in.h>
+#include <cstring>
+#include "ip.hh"
+
+namespace net {
+
+class ipv6;
+template <ip_protocol_num ProtoNum>
+class ipv6_l4;
+
+struct ipv6_address {
+    ipv6_address() : bytes{} {}
+    explicit ipv6_address(const std::array<uint8_t, 16>& b) : bytes(b) {}
+    explicit ipv6_address(const std::string& addr) {
+        auto b = boost::asio::ip::address_v6::from_string(addr).to_bytes();
+        std::copy(b.begin(), b.end(), bytes.begin());
+    }
+    explicit ipv6_address(const ::in6_addr& a) {
+        std::copy(a.s6_addr, a.s6_addr + 16, bytes.begin());
+    }
+
+    // In network order
+    std::array<uint8_t, 16> bytes;
+
+    template <typename Adjuster>
+    void adjust_endianness(Adjuster a) {}
+
+    bool is_multicast() const { return bytes[0] == 0xff; }
+    bool is_link_local() const { return bytes[0] == 0xfe && (bytes[1] & 0xc0) == 0x80; }
+
+    friend bool operator==(const ipv6_address& x, const ipv6_address& y) {
+        return x.bytes == y.bytes;
+    }
+    friend bool operator!=(const ipv6_address& x, const ipv6_address& y) {
+        return x.bytes != y.bytes;
+    }
+} __attribute__((packed));
+
+static inline bool is_unspecified(const ipv6_address& addr) { return addr == ipv6_address(); }
+
+// fe80::/64 address with an interface identifier derived from the MAC
+// address (RFC 4291, appendix A)
+ipv6_address ipv6_link_local_address(ethernet_address ea);
+// Solicited-node multicast address of an address (RFC 4291, 2.7.1)
+ipv6_address ipv6_solicited_node_address(const ipv6_address& a);
+// Ethernet address an IPv6 multicast address maps to (RFC 2464, 7)
+ethernet_address ipv6_multicast_ethernet_address(const ipv6_address& a);
+
+std::ostream& operator<<(std::ostream& os, const ipv6_address& a);
+
+}
+
+namespace std {
+
+template <>
+struct hash<net::ipv6_address> {
+    size_t operator()(const net::ipv6_address& a) const {
+        uint32_t w[4];
+        std::memcpy(w, a.bytes.data(), sizeof(w));
+        return w[0] ^ w[1] ^ w[2] ^ w[3];
+    }
+};
+
+}
+
+namespace net {
+
+struct ipv6_traits {
+    using address_type = ipv6_address;
+    using inet_type = ipv6_l4<ip_protocol_num::tcp>;
+    struct l4packet {
+        ipv6_address to;
+        packet p;
+        ethernet_address e_dst;
+        ip_protocol_num proto_num;
+    };
+    using packet_provider_type = std::function<std::experimental::optional<l4packet> ()>;
+    static void pseudo_header_checksum(checksummer& csum, const ipv6_address& src, const ipv6_address& dst,
+            ip_protocol_num proto_num, uint32_t len) {
+        csum.sum(reinterpret_cast<const char*>(src.bytes.data()), src.bytes.size());
+        csum.sum(reinterpret_cast<const char*>(dst.bytes.data()), dst.bytes.size());
+        csum.sum_many(len, uint32_t(proto_num));
+    }
+    static void tcp_pseudo_header_checksum(checksummer& csum, ipv6_address src, ipv6_address dst, uint16_t len) {
+        pseudo_header_checksum(csum, src, dst, ip_protocol_num::tcp, len);
+    }
+    static void udp_pseudo_header_checksum(checksummer& csum, ipv6_address src, ipv6_address dst, uint16_t len) {
+        pseudo_header_checksum(csum, src, dst, ip_protocol_num::udp, len);
+    }
+    static void hash_address(forward_hash& out_hash_data, const ipv6_address& a) {
+        for (auto b : a.bytes) {
+            out_hash_data.push_back(b);
+        }
+    }
+    static ipv6_address socket_address_ip(const socket_address& sa) {
+        return ipv6_address(sa.u.in6.sin6_addr);
+    }
+    static uint16_t socket_address_port(const socket_address& sa) {
+        return net::ntoh(sa.u.in6.sin6_port);
+    }
+    static constexpr uint8_t ip_hdr_len_min = net::ipv6_hdr_len_min;
+    // collectd plugin of the TCP metrics
+    static const char* tcp_plugin() { return "tcp6"; }
+};
+
+template <ip_protocol_num ProtoNum>
+class ipv6_l4 {
+public:
+    ipv6& _inet;
+public:
+    ipv6_l4(ipv6& inet) : _inet(inet) {}
+    void register_packet_provider(ipv6_traits::packet_provider_type func);
+    future<ethernet_address> get_l2_dst_address(ipv6_address to);
+};
+
+class ipv6_protocol {
+public:
+    virtual ~ipv6_protocol() {}
+    virtual void received(packet p, ipv6_address from, ipv6_address to, uint8_t hop_limit) = 0;
+    virtual bool forward(forward_hash& out_hash_data, packet& p, size_t off) { return true; }
+};
+
+class ipv6_tcp final : public ipv6_protocol {
+    ipv6_l4<ip_protocol_num::tcp> _inet_l4;
+    std::unique_ptr<tcp<ipv6_traits>> _tcp;
+public:
+    ipv6_tcp(ipv6& inet);
+    ~ipv6_tcp();
+    virtual void received(packet p, ipv6_address from, ipv6_address to, uint8_t hop_limit) override;
+    virtual bool forward(forward_hash& out_hash_data, packet& p, size_t off) override;
+    friend class ipv6;
+};
+
+// UDP over IPv6.  Ports are separate from IPv4's, and channels are
+// bound to all of the interface's addresses.
+class ipv6_udp final : public ipv6_protocol {
+    static const uint16_t min_anonymous_port = 32768;
+    ipv6_l4<ip_protocol_num::udp> _inet_l4;
+    std::unordered_map<uint16_t, lw_shared_ptr<udp_channel_state>> _channels;
+    int _queue_size = ipv4_udp::default_queue_size;
+    uint16_t _next_anonymous_port = min_anonymous_port;
+    circular_buffer<ipv6_traits::l4packet> _packetq;
+private:
+    uint16_t next_port(uint16_t port);
+public:
+    explicit ipv6_udp(ipv6& inet);
+    udp_channel make_channel(uint16_t port);
+    virtual void received(packet p, ipv6_address from, ipv6_address to, uint8_t hop_limit) override;
+    void send(uint16_t src_port, ipv6_address dst, uint16_t dst_port, packet p);
+    void unregister(uint16_t port) { _channels.erase(port); }
+    void set_queue_size(int size) { _queue_size = size; }
+};
+
+struct icmpv6_hdr {
+    enum class msg_type : uint8_t {
+        echo_request = 128,
+        echo_reply = 129,
+        neighbor_solicitation = 135,
+        neighbor_advertisement = 136,
+    };
+    msg_type type;
+    uint8_t code;
+    packed<uint16_t> csum;
+    template <typename Adjuster>
+    auto adjust_endianness(Adjuster a) {
+        return a(csum);
+    }
+} __attribute__((packed));
+
+// Body of neighbor solicitations and advertisements (RFC 4861, 4.3 and 4.4)
+struct ndp_hdr {
+    enum class flag_bits : uint8_t { override_ = 29, solicited = 30, router = 31 };
+    packed<uint32_t> flags;
+    ipv6_address target;
+    template <typename Adjuster>
+    auto adjust_endianness(Adjuster a) {
+        return a(flags, target);
+    }
+} __attribute__((packed));
+
+// Source and target link-layer address options
+struct ndp_lladdr_option {
+    enum class option_type : uint8_t { source = 1, target = 2 };
+    option_type type;
+    // In units of 8 bytes
+    uint8_t len;
+    ethernet_address addr;
+} __attribute__((packed));
+
+// ICMPv6 echo and neighbor discovery.  The neighbor cache plays the part
+// of ARP for IPv6: lookups multicast neighbor solicitations to the target's
+// solicited-node address until an advertisement arrives.  Neighbors age as
+// ARP's do, with timers of their own, and the shards of an interface share
+// the advertisements they receive.
+class icmpv6 {
+public:
+    using ipaddr = ipv6_address;
+    using inet_type = ipv6_l4<ip_protocol_num::icmpv6>;
+private:
+    static constexpr auto max_waiters = 512;
+    // Unanswered solicitations before an unresolved address is forgotten
+    static constexpr unsigned max_probes = 3;
+    struct neighbor {
+        ethernet_address l2;
+        lowres_clock::time_point confirmed;
+        lowres_clock::time_point used;
+        lowres_clock::time_point probed;
+    };
+    struct resolution {
+        std::vector<promise<ethernet_address>> _waiters;
+        lowres_clock::time_point _solicited;
+        unsigned _solicitations = 0;
+    };
+    inet_type& _inet;
+    circular_buffer<ipv6_traits::l4packet> _packetq;
+    semaphore _queue_space = {212992};
+    std::unordered_map<ipv6_address, neighbor> _neighbors;
+    std::unordered_map<ipv6_address, resolution> _in_progress;
+    neighbor_timing _timing;
+    timer<lowres_clock> _aging_timer;
+    // Each shard's instances, found by interface address
+    static thread_local std::vector<icmpv6*> _instances;
+private:
+    ethernet_address l2self() const;
+    void solicit(const ipaddr& target, resolution& res);
+    void probe(const ipaddr& target, neighbor& n);
+    // Learns on every shard with a stack on this interface, since the
+    // advertisement may have been steered away from the shard that
+    // solicited it
+    void learn_everywhere(ethernet_address l2, ipaddr l3);
+    void age();
+    void handle_echo_request(packet p, ipaddr from, ipaddr to);
+    void handle_neighbor_solicitation(packet p, ipaddr from, ipaddr to);
+    void handle_neighbor_advertisement(packet p);
+    void send(ipaddr to, ethernet_address e_dst, packet p);
+    void send_solicitation(const ipaddr& target);
+    void send_advertisement(ipaddr to, ethernet_address e_dst, const ipaddr& target, bool solicited);
+    packet make_ndp_packet(icmpv6_hdr::msg_type type, uint32_t flags, const ipaddr& target,
+            ndp_lladdr_option::option_type opt);
+public:
+    explicit icmpv6(inet_type& inet);
+    ~icmpv6();
+    void received(packet p, ipaddr from, ipaddr to, uint8_t hop_limit);
+    future<ethernet_address> lookup(const ipaddr& addr);
+    void learn(ethernet_address l2, ipaddr l3);
+    void set_timing(neighbor_timing timing);
+};
+
+class ipv6_icmp final : public ipv6_protocol {
+    ipv6_l4<ip_protocol_num::icmpv6> _inet_l4;
+    icmpv6 _icmp;
+public:
+    ipv6_icmp(ipv6& inet) : _inet_l4(inet), _icmp(_inet_l4) {}
+    virtual void received(packet p, ipv6_address from, ipv6_address to, uint8_t hop_limit) override {
+        _icmp.received(std::move(p), from, to, hop_limit);
+    }
+    friend class ipv6;
+};
+
+struct ipv6_hdr {
+    // Version (4 bits), traffic class (8 bits) and flow label (20 bits)
+    packed<uint32_t> ver_class_flow;
+    packed<uint16_t> payload_len;
+    uint8_t next_header;
+    uint8_t hop_limit;
+    ipv6_address src_ip;
+    ipv6_address dst_ip;
+    template <typename Adjuster>
+    auto adjust_endianness(Adjuster a) {
+        return a(ver_class_flow, payload_len, src_ip, dst_ip);
+    }
+    uint8_t version() const { return uint32_t(ver_class_flow) >> 28; }
+} __attribute__((packed));
+
+enum class ipv6_ext_header : uint8_t {
+    hop_by_hop = 0, routing = 43, fragment = 44, no_next_header = 59, destination_options = 60,
+};
+
+// Start of the hop-by-hop, routing and destination options headers
+// (RFC 8200, 4.3 to 4.6)
+struct ipv6_ext_hdr {
+    uint8_t next_header;
+    // In units of 8 bytes, not counting the first 8
+    uint8_t hdr_ext_len;
+    // Routing header only
+    uint8_t routing_type;
+    uint8_t segments_left;
+} __attribute__((packed));
+
+// Fragment header (RFC 8200, 4.5)
+struct ipv6_frag_hdr {
+    uint8_t next_header;
+    uint8_t reserved;
+    // Fragment offset (13 bits), two reserved bits and the M flag
+    packed<uint16_t> offset_flags;
+    packed<uint32_t> id;
+    template <typename Adjuster>
+    auto adjust_endianness(Adjuster a) {
+        return a(offset_flags, id);
+    }
+} __attribute__((packed));
+
+// IPv6 layer of the native stack, for a host rather than a router: packets
+// for other addresses are dropped.  Hop-by-hop, routing and destination
+// options headers are skipped, but fragments are not reassembled, and
+// packets are never fragmented (TCP sizes its segments to the MTU).
+class ipv6 {
+public:
+    using address_type = ipv6_address;
+    using proto_type = uint16_t;
+private:
+    interface* _netif;
+    // Features offered to the L4 protocols: the interface's, minus the
+    // transmit offloads, which the drivers only implement for IPv4
+    net::hw_features _hw_features;
+    std::vector<ipv6_traits::packet_provider_type> _pkt_providers;
+    ipv6_address _link_local_address;
+    ipv6_address _host_address;
+    ipv6_address _gw_address;
+    unsigned _prefix_len = 64;
+    l3_protocol _l3;
+    subscription<packet, ethernet_address> _rx_packets;
+    ipv6_tcp _tcp;
+    ipv6_icmp _icmp;
+    ipv6_udp _udp;
+    array_map<ipv6_protocol*, 256> _l4;
+    circular_buffer<l3_protocol::l3packet> _packetq;
+    unsigned _pkt_provider_idx = 0;
+private:
+    void handle_received_packet(packet p, ethernet_address from);
+    void handle_received_burst(l3_protocol::rx_burst& burst);
+    // Offset of the upper-layer header past the extension headers at off,
+    // whose type is next_header, or 0 if the packet must be dropped;
+    // next_header becomes the upper-layer protocol
+    size_t skip_extension_headers(packet& p, size_t off, uint8_t& next_header);
+    bool forward(forward_hash& out_hash_data, packet& p, size_t off);
+    std::experimental::optional<l3_protocol::l3packet> get_packet();
+    bool is_on_link(const ipv6_address& a) const;
+    bool accepts(const ipv6_address& dst) const;
+public:
+    explicit ipv6(interface* netif);
+    void set_host_address(ipv6_address ip, unsigned prefix_len);
+    // The global address if one is set, otherwise the link-local one
+    ipv6_address host_address() const;
+    ipv6_address link_local_address() const { return _link_local_address; }
+    // Whether an address is one of ours (link-local or global)
+    bool is_host_address(const ipv6_address& a) const;
+    // Source address of packets sent to an address
+    ipv6_address source_address(const ipv6_address& to) const;
+    void set_gw_address(ipv6_address ip);
+    ipv6_address gw_address() const;
+    interface * netif() const {
+        return _netif;
+    }
+    void send(ipv6_address to, ip_protocol_num proto_num, packet p, ethernet_address e_dst);
+    tcp<ipv6_traits>& get_tcp() { return *_tcp._tcp; }
+    ipv6_udp& get_udp() { return _udp; }
+    const net::hw_features& hw_features() const { return _hw_features; }
+    void learn(ethernet_address l2, ipv6_address l3) {
+        _icmp._icmp.learn(l2, l3);
+    }
+    void set_neighbor_timing(neighbor_timing timing) {
+        _icmp._icmp.set_timing(timing);
+    }
+    void register_packet_provider(ipv6_traits::packet_provider_type&& func) {
+        _pkt_providers.push_back(std::move(func));
+    }
+    future<ethernet_address> get_l2_dst_address(ipv6_address to);
+};
+
+template <ip_protocol_num ProtoNum>
+inline
+void ipv6_l4<ProtoNum>::register_packet_provider(ipv6_traits::packet_provider_type func) {
+    _inet.register_packet_provider([func = std::move(func)] {
+        auto l4p = func();
+        if (l4p) {
+            l4p.value().proto_num = ProtoNum;
+        }
+        return l4p;
+    });
+}
+
+template <ip_protocol_num ProtoNum>
+inline
+future<ethernet_address> ipv6_l4<ProtoNum>::get_l2_dst_address(ipv6_address to) {
+    return _inet.get_l2_dst_address(to);
+}
+
+}
+
+#endif /* IPV6_HH_ */
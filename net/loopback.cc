@@ -0,0 +1,270 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "loopback.hh"
+#include "ip.hh"
+#include "ipv6.hh"
+#include "tcp.hh"
+#include "toeplitz.hh"
+#include "core/reactor.hh"
+#include <random>
+
+namespace net {
+
+class loopback_device;
+
+class loopback_qp : public qp {
+    struct in_flight {
+        clock_type::time_point deliver_at;
+        packet p;
+    };
+    loopback_device* _dev;
+    std::default_random_engine _random;
+    std::uniform_real_distribution<double> _uniform{0, 1};
+    clock_type::time_point _link_free;
+    // Packets waiting for the latency, and those overtaking them; each
+    // is in delivery order
+    circular_buffer<in_flight> _delayed;
+    circular_buffer<in_flight> _overtaking;
+    // Bursts being built for each of the peer's queues
+    std::vector<packet_burst> _out;
+    reactor::poller _delivery_poller;
+public:
+    explicit loopback_qp(loopback_device* dev, uint16_t qid);
+    virtual future<> send(packet p) override {
+        abort();
+    }
+    virtual uint32_t send(circular_buffer<packet>& pkts) override;
+    void receive(packet_burst& burst);
+private:
+    bool deliver_due();
+    void transmit(packet p);
+    void flush();
+};
+
+class loopback_device : public device {
+    loopback_link_config _config;
+    unsigned _queues_count;
+    ethernet_address _hw_address;
+    std::string _name;
+    loopback_device* _peer = nullptr;
+    // Built from the key device::rss_key() returns, which is not overridden
+    toeplitz_table _rss_table{default_rsskey_40bytes};
+public:
+    loopback_device(loopback_link_config config, unsigned queues_count, ethernet_address hw_address, std::string name)
+        : _config(config), _queues_count(queues_count), _hw_address(hw_address), _name(std::move(name)) {}
+    void connect(loopback_device& peer) {
+        _peer = &peer;
+    }
+    loopback_device& peer() { return *_peer; }
+    const toeplitz_table& rss_table() const { return _rss_table; }
+    const loopback_link_config& config() const { return _config; }
+    const std::string& name() const { return _name; }
+    virtual ethernet_address hw_address() override { return _hw_address; }
+    virtual net::hw_features hw_features() override {
+        net::hw_features hw;
+        // Packets never leave memory, so there is nothing to checksum
+        hw.tx_csum_ip_offload = true;
+        hw.tx_csum_l4_offload = true;
+        hw.rx_csum_offload = true;
+        return hw;
+    }
+    virtual uint16_t hw_queues_count() override { return _queues_count; }
+    virtual std::unique_ptr<qp> init_local_queue(boost::program_options::variables_map opts, uint16_t qid) override {
+        assert(qid < _queues_count);
+        return std::make_unique<loopback_qp>(this, qid);
+    }
+};
+
+// The hash a NIC would compute over the same fields as ipv4::forward(),
+// ipv6::forward() and tcp::forward(), so that the receiving stack agrees
+// on which shard owns a connection
+static uint32_t loopback_rss_hash(packet& p, const toeplitz_table& rss_table) {
+    forward_hash data;
+    auto eh = p.get_header<eth_hdr>();
+    if (!eh) {
+        return 0;
+    }
+    size_t l4_off;
+    uint8_t l4_proto;
+    auto proto = ntoh(eh->eth_proto);
+    if (proto == uint16_t(eth_protocol_num::ipv4)) {
+        auto iph = p.get_header<ip_hdr>(sizeof(eth_hdr));
+        if (!iph) {
+            return 0;
+        }
+        data.push_back(iph->src_ip.ip);
+        data.push_back(iph->dst_ip.ip);
+        auto h = ntoh(*iph);
+        if (h.mf() || h.offset()) {
+            return rss_table.hash(data);
+        }
+        l4_off = sizeof(eth_hdr) + sizeof(ip_hdr);
+        l4_proto = h.ip_proto;
+    } else if (proto == uint16_t(eth_protocol_num::ipv6)) {
+        auto iph = p.get_header<ipv6_hdr>(sizeof(eth_hdr));
+        if (!iph) {
+            return 0;
+        }
+        ipv6_traits::hash_address(data, iph->src_ip);
+        ipv6_traits::hash_address(data, iph->dst_ip);
+        l4_off = sizeof(eth_hdr) + sizeof(ipv6_hdr);
+        l4_proto = iph->next_header;
+    } else {
+        return 0;
+    }
+    if (l4_proto == uint8_t(ip_protocol_num::tcp)) {
+        auto th = p.get_header<tcp_hdr>(l4_off);
+        if (th) {
+            data.push_back(th->src_port);
+            data.push_back(th->dst_port);
+        }
+    }
+    return rss_table.hash(data);
+}
+
+loopback_qp::loopback_qp(loopback_device* dev, uint16_t qid)
+    : qp(false, dev->name(), qid)
+    , _dev(dev)
+    , _random(dev->config().seed + qid)
+    , _out(dev->hw_queues_count())
+    , _delivery_poller([this] { return deliver_due(); }) {
+}
+
+uint32_t loopback_qp::send(circular_buffer<packet>& pkts) {
+    auto& config = _dev->config();
+    auto now = clock_type::now();
+    uint32_t sent = 0;
+    while (!pkts.empty()) {
+        auto p = std::move(pkts.front());
+        pkts.pop_front();
+        ++sent;
+        _stats.tx.good.update_frags_stats(p.nr_frags(), p.len());
+        if (config.loss && _uniform(_random) < config.loss) {
+            continue;
+        }
+        auto at = now;
+        if (config.bandwidth) {
+            _link_free = std::max(_link_free, now)
+                    + std::chrono::nanoseconds(p.len() * uint64_t(1000000000) / config.bandwidth);
+            at = _link_free;
+        }
+        if (config.reorder && _uniform(_random) < config.reorder) {
+            _overtaking.push_back(in_flight{at, std::move(p)});
+        } else if (at + config.latency > now) {
+            _delayed.push_back(in_flight{at + config.latency, std::move(p)});
+        } else {
+            transmit(std::move(p));
+        }
+    }
+    deliver_due();
+    return sent;
+}
+
+bool loopback_qp::deliver_due() {
+    if (_delayed.empty() && _overtaking.empty()) {
+        return false;
+    }
+    auto now = clock_type::now();
+    for (auto q : { &_overtaking, &_delayed }) {
+        while (!q->empty() && q->front().deliver_at <= now) {
+            transmit(std::move(q->front().p));
+            q->pop_front();
+        }
+    }
+    flush();
+    return true;
+}
+
+void loopback_qp::transmit(packet p) {
+    // Copy, as a wire would: the receiver must not see the sender's
+    // buffers, which it may still retransmit from
+    auto len = p.len();
+    auto buf = static_cast<char*>(::malloc(len));
+    if (!buf) {
+        // Lost, as on a full ring
+        return;
+    }
+    auto pos = buf;
+    for (auto&& f : p.fragments()) {
+        pos = std::copy(f.base, f.base + f.size, pos);
+    }
+    packet copy(fragment{buf, len}, make_free_deleter(buf));
+    auto& peer = _dev->peer();
+    auto hash = loopback_rss_hash(copy, peer.rss_table());
+    copy.set_rss_hash(hash);
+    _out[peer.hash2qid(hash)].push_back(std::move(copy));
+}
+
+void loopback_qp::flush() {
+    // Each burst goes to the shard of its queue, like a NIC's DMA; the
+    // stack there hands the packets of flows owned by proxy shards on,
+    // through the queue's sw_reta.  Both devices have the same number of
+    // queues, so queue cpu of the peer is a loopback_qp.
+    auto& peer = _dev->peer();
+    auto src_cpu = engine().cpu_id();
+    for (unsigned cpu = 0; cpu < _out.size(); ++cpu) {
+        auto& burst = _out[cpu];
+        if (burst.empty()) {
+            continue;
+        }
+        if (cpu == src_cpu) {
+            static_cast<loopback_qp&>(peer.queue_for_cpu(cpu)).receive(burst);
+            continue;
+        }
+        packet_burst moving;
+        moving.reserve(burst.size());
+        for (auto&& p : burst) {
+            moving.push_back(p.free_on_cpu_batched(src_cpu));
+        }
+        burst.clear();
+        smp::submit_to(cpu, [&peer, cpu, moving = std::move(moving)] () mutable {
+            static_cast<loopback_qp&>(peer.queue_for_cpu(cpu)).receive(moving);
+        });
+    }
+}
+
+void loopback_qp::receive(packet_burst& burst) {
+    for (auto&& p : burst) {
+        _stats.rx.good.update_frags_stats(p.nr_frags(), p.len());
+    }
+    _stats.rx.good.update_pkts_bunch(burst.size());
+    if (_dev->config().bursts) {
+        _dev->l2receive(burst);
+        return;
+    }
+    for (auto&& p : burst) {
+        _dev->l2receive(std::move(p));
+    }
+    burst.clear();
+}
+
+std::pair<std::shared_ptr<device>, std::shared_ptr<device>>
+create_loopback_net_device_pair(loopback_link_config config, unsigned queues_count) {
+    assert(queues_count && queues_count <= smp::count);
+    auto a = std::make_shared<loopback_device>(config, queues_count, ethernet_address{0x02, 0, 0, 0, 0, 0x01}, "loopback0");
+    auto b = std::make_shared<loopback_device>(config, queues_count, ethernet_address{0x02, 0, 0, 0, 0, 0x02}, "loopback1");
+    a->connect(*b);
+    b->connect(*a);
+    return { a, b };
+}
+
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#ifndef LOOPBACK_HH_
+#define LOOPBACK_HH_
+
+#include <memory>
+#include <chrono>
+#include "net.hh"
+
+namespace net {
+
+// Impairments of a loopback link, applied separately to each sending queue
+struct loopback_link_config {
+    // One way delay of every packet
+    std::chrono::microseconds latency{0};
+    // Bytes per second a queue sends, 0 for no limit
+    uint64_t bandwidth = 0;
+    // Probability of dropping a packet
+    double loss = 0;
+    // Probability of sending a packet without the latency, so that it
+    // overtakes those in flight (as netem's reorder)
+    double reorder = 0;
+    // Seed of the loss and reorder decisions
+    unsigned seed = 0;
+    // Whether the packets of a poll go up as a burst, or one by one as
+    // from a device without burst support
+    bool bursts = true;
+};
+
+// Creates two devices connected back to back in memory: what one sends,
+// the other receives on the queue its RSS hash maps to.  As with a NIC,
+// queue i belongs to shard i, for i < queues_count, and the other shards
+// use proxies of them (create_proxy_net_device()).  Both devices must
+// outlive the stacks using them.
+std::pair<std::shared_ptr<device>, std::shared_ptr<device>>
+create_loopback_net_device_pair(loopback_link_config config = loopback_link_config(), unsigned queues_count = smp::count);
+
+}
+
+#endif /* LOOPBACK_HH_ */
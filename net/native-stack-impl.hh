@@ -46,7 +46,7 @@ class native_server_socket_impl : public server_socket_impl {
 
 template <typename Protocol>
 native_server_socket_impl<Protocol>::native_server_socket_impl(Protocol& proto, uint16_t port, listen_options opt)
-    : _listener(proto.listen(port)) {
+    : _listener(proto.listen(port, 100, opt.congestion_control)) {
 }
 
 template <typename Protocol>
@@ -80,6 +80,8 @@ class native_connected_socket_impl : public connected_socket_impl {
     virtual void shutdown_output() override;
     virtual void set_nodelay(bool nodelay) override;
     virtual bool get_nodelay() const override;
+    virtual void set_congestion_control(tcp_congestion_control cc) override;
+    virtual tcp_connection_info get_tcp_info() const override;
 };
 
 template <typename Protocol>
@@ -166,6 +168,18 @@ native_connected_socket_impl<Protocol>::get_nodelay() const {
     return true;
 }
 
+template <typename Protocol>
+void
+native_connected_socket_impl<Protocol>::set_congestion_control(tcp_congestion_control cc) {
+    _conn.set_congestion_control(cc);
+}
+
+template <typename Protocol>
+tcp_connection_info
+native_connected_socket_impl<Protocol>::get_tcp_info() const {
+    return _conn.get_tcp_info();
+}
+
 }
 
 
@@ -23,11 +23,13 @@
 #include "native-stack-impl.hh"
 #include "net.hh"
 #include "ip.hh"
+#include "ipv6.hh"
 #include "tcp-stack.hh"
 #include "udp.hh"
 #include "virtio.hh"
 #include "dpdk.hh"
 #include "xenfront.hh"
+#include "xdp.hh"
 #include "proxy.hh"
 #include "dhcp.hh"
 #include <memory>
@@ -81,6 +83,12 @@ void create_native_net_device(boost::program_options::variables_map opts) {
     } else
 #endif
 
+#ifdef HAVE_XDP
+    if (opts.count("xdp-device")) {
+        dev = create_xdp_net_device(opts, smp::count);
+    } else
+#endif
+
 #ifdef HAVE_DPDK
     if (opts.count("dpdk-pmd")) {
         // Hardcoded port index 0.
@@ -132,6 +140,7 @@ class native_network_stack : public network_stack {
 private:
     interface _netif;
     ipv4 _inet;
+    ipv6 _inet6;
     bool _dhcp = false;
     promise<> _config;
     timer<> _timer;
@@ -147,6 +156,7 @@ class native_network_stack : public network_stack {
     virtual server_socket listen(socket_address sa, listen_options opt) override;
     virtual future<connected_socket> connect(socket_address sa, socket_address local) override;
     virtual udp_channel make_udp_channel(ipv4_addr addr) override;
+    virtual udp_channel make_udp_channel(const socket_address& sa) override;
     virtual future<> initialize() override;
     static future<std::unique_ptr<network_stack>> create(boost::program_options::variables_map opts) {
         if (engine().cpu_id() == 0) {
@@ -155,9 +165,6 @@ class native_network_stack : public network_stack {
         return ready_promise.get_future();
     }
     virtual bool has_per_core_namespace() override { return true; };
-    void arp_learn(ethernet_address l2, ipv4_address l3) {
-        _inet.learn(l2, l3);
-    }
     friend class native_server_socket_impl<tcp4>;
 };
 
@@ -168,6 +175,18 @@ native_network_stack::make_udp_channel(ipv4_addr addr) {
     return _inet.get_udp().make_channel(addr);
 }
 
+udp_channel
+native_network_stack::make_udp_channel(const socket_address& sa) {
+    if (sa.as_posix_sockaddr().sa_family != AF_INET6) {
+        return network_stack::make_udp_channel(sa);
+    }
+    auto& in6 = sa.as_posix_sockaddr_in6();
+    if (!IN6_IS_ADDR_UNSPECIFIED(&in6.sin6_addr)) {
+        throw std::runtime_error("Binding to specific IP not supported yet");
+    }
+    return _inet6.get_udp().make_channel(ntohs(in6.sin6_port));
+}
+
 void
 add_native_net_options_description(boost::program_options::options_description &opts) {
 
@@ -179,6 +198,9 @@ add_native_net_options_description(boost::program_options::options_description &
     }
 #endif
     opts.add(get_virtio_net_options_description());
+#ifdef HAVE_XDP
+    opts.add(get_xdp_net_options_description());
+#endif
 #ifdef HAVE_DPDK
     opts.add(get_dpdk_net_options_description());
 #endif
@@ -186,8 +208,14 @@ add_native_net_options_description(boost::program_options::options_description &
 
 native_network_stack::native_network_stack(boost::program_options::variables_map opts, std::shared_ptr<device> dev)
     : _netif(std::move(dev))
-    , _inet(&_netif) {
+    , _inet(&_netif)
+    , _inet6(&_netif) {
     _inet.get_udp().set_queue_size(opts["udpv4-queue-size"].as<int>());
+    _inet6.get_udp().set_queue_size(opts["udpv4-queue-size"].as<int>());
+    tcpv4_set_rto_min(_inet.get_tcp(), std::chrono::milliseconds(opts["tcp-rto-min"].as<unsigned>()));
+    tcpv6_set_rto_min(_inet6.get_tcp(), std::chrono::milliseconds(opts["tcp-rto-min"].as<unsigned>()));
+    _inet.set_gso(opts["gso"].as<std::string>() != "off");
+    _inet.set_gro(opts["gro"].as<std::string>() != "off");
     _dhcp = opts["host-ipv4-addr"].defaulted()
             && opts["gw-ipv4-addr"].defaulted()
             && opts["netmask-ipv4-addr"].defaulted() && opts["dhcp"].as<bool>();
@@ -196,10 +224,32 @@ native_network_stack::native_network_stack(boost::program_options::variables_map
         _inet.set_gw_address(ipv4_address(opts["gw-ipv4-addr"].as<std::string>()));
         _inet.set_netmask_address(ipv4_address(opts["netmask-ipv4-addr"].as<std::string>()));
     }
+    if (!opts["host-ipv6-addr"].as<std::string>().empty()) {
+        _inet6.set_host_address(ipv6_address(opts["host-ipv6-addr"].as<std::string>()),
+                opts["ipv6-prefix-len"].as<unsigned>());
+    }
+    if (!opts["gw-ipv6-addr"].as<std::string>().empty()) {
+        _inet6.set_gw_address(ipv6_address(opts["gw-ipv6-addr"].as<std::string>()));
+    }
+    if (opts.count("capture-file")) {
+        auto name = sprint("%s.%d", opts["capture-file"].as<std::string>(), engine().cpu_id());
+        auto filter = capture_filter::parse(opts["capture-filter"].as<std::string>());
+        _netif.start_capture(name, filter, opts["capture-snaplen"].as<unsigned>()).then_wrapped([name] (auto&& f) {
+            try {
+                f.get();
+            } catch (std::exception& ex) {
+                std::cerr << "cannot capture to " << name << ": " << ex.what() << std::endl;
+            }
+        });
+        engine().at_exit([this] { return _netif.stop_capture(); });
+    }
 }
 
 server_socket
 native_network_stack::listen(socket_address sa, listen_options opts) {
+    if (sa.as_posix_sockaddr().sa_family == AF_INET6) {
+        return tcpv6_listen(_inet6.get_tcp(), ntohs(sa.as_posix_sockaddr_in6().sin6_port), opts);
+    }
     assert(sa.as_posix_sockaddr().sa_family == AF_INET);
     return tcpv4_listen(_inet.get_tcp(), ntohs(sa.as_posix_sockaddr_in().sin_port), opts);
 }
@@ -207,6 +257,9 @@ native_network_stack::listen(socket_address sa, listen_options opts) {
 future<connected_socket>
 native_network_stack::connect(socket_address sa, socket_address local) {
     // FIXME: local is ignored since native stack does not support multiple IPs yet
+    if (sa.as_posix_sockaddr().sa_family == AF_INET6) {
+        return tcpv6_connect(_inet6.get_tcp(), sa);
+    }
     assert(sa.as_posix_sockaddr().sa_family == AF_INET);
     return tcpv4_connect(_inet.get_tcp(), sa);
 }
@@ -286,16 +339,6 @@ future<> native_network_stack::initialize() {
     });
 }
 
-void arp_learn(ethernet_address l2, ipv4_address l3)
-{
-    for (unsigned i = 0; i < smp::count; i++) {
-        smp::submit_to(i, [l2, l3] {
-            auto & ns = static_cast<native_network_stack&>(engine().net());
-            ns.arp_learn(l2, l3);
-        });
-    }
-}
-
 void create_native_stack(boost::program_options::variables_map opts, std::shared_ptr<device> dev) {
     native_network_stack::ready_promise.set_value(std::unique_ptr<network_stack>(std::make_unique<native_network_stack>(opts, std::move(dev))));
 }
@@ -316,9 +359,21 @@ boost::program_options::options_description nns_options() {
         ("netmask-ipv4-addr",
                 boost::program_options::value<std::string>()->default_value("255.255.255.0"),
                 "static IPv4 netmask to use")
+        ("host-ipv6-addr",
+                boost::program_options::value<std::string>()->default_value(""),
+                "static global IPv6 address to use, in addition to the link-local one")
+        ("ipv6-prefix-len",
+                boost::program_options::value<unsigned>()->default_value(64),
+                "length of the on-link prefix of the IPv6 address")
+        ("gw-ipv6-addr",
+                boost::program_options::value<std::string>()->default_value(""),
+                "static IPv6 gateway to use")
         ("udpv4-queue-size",
                 boost::program_options::value<int>()->default_value(ipv4_udp::default_queue_size),
-                "Default size of the UDPv4 per-channel packet queue")
+                "Default size of the UDP per-channel packet queue, over IPv4 and IPv6")
+        ("tcp-rto-min",
+                boost::program_options::value<unsigned>()->default_value(200),
+                "Minimum TCP retransmission timeout (ms)")
         ("dhcp",
                 boost::program_options::value<bool>()->default_value(true),
                         "Use DHCP discovery")
@@ -331,6 +386,21 @@ boost::program_options::options_description nns_options() {
         ("lro",
                 boost::program_options::value<std::string>()->default_value("on"),
                 "Enable LRO")
+        ("gso",
+                boost::program_options::value<std::string>()->default_value("on"),
+                "Segment TCP packets in software when the device has no TSO")
+        ("gro",
+                boost::program_options::value<std::string>()->default_value("on"),
+                "Coalesce received TCP segments in software")
+        ("capture-file",
+                boost::program_options::value<std::string>(),
+                "Write the packets each shard sends and receives to <capture-file>.<shard>, in pcap format")
+        ("capture-filter",
+                boost::program_options::value<std::string>()->default_value(""),
+                "Packets to capture, e.g. \"ip tcp port 80\" (inbound, outbound, arp, ip, ip6, tcp, udp, icmp, icmp6, port <n>)")
+        ("capture-snaplen",
+                boost::program_options::value<unsigned>()->default_value(packet_capture::default_snaplen),
+                "Bytes of each packet to capture, 0 for whole packets")
         ;
 
     add_native_net_options_description(opts);
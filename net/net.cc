@@ -25,6 +25,7 @@
 #include "net.hh"
 #include <utility>
 #include "toeplitz.hh"
+#include "core/prefetch.hh"
 
 using std::move;
 
@@ -224,7 +225,10 @@ void qp::configure_proxies(const std::map<unsigned, float>& cpu_weights) {
         }
         return p;
     });
-    build_sw_reta(cpu_weights);
+    // Keep the table of a device that steers over all the shards itself
+    if (!_sw_reta) {
+        build_sw_reta(cpu_weights);
+    }
 }
 
 void qp::build_sw_reta(const std::map<unsigned, float>& cpu_weights) {
@@ -253,6 +257,22 @@ device::receive(std::function<future<> (packet)> next_packet) {
     return std::move(sub);
 }
 
+void device::receive_burst(std::function<void (packet_burst&)> burst_fn) {
+    _queues[engine().cpu_id()]->_rx_burst_fn = std::move(burst_fn);
+}
+
+void device::l2receive(packet_burst& burst) {
+    auto& q = *_queues[engine().cpu_id()];
+    if (q._rx_burst_fn) {
+        q._rx_burst_fn(burst);
+    } else {
+        for (auto&& p : burst) {
+            q._rx_stream.produce(std::move(p));
+        }
+    }
+    burst.clear();
+}
+
 void device::set_local_queue(std::unique_ptr<qp> dev) {
     assert(!_queues[engine().cpu_id()]);
     _queues[engine().cpu_id()] = dev.get();
@@ -271,11 +291,18 @@ subscription<packet, ethernet_address> l3_protocol::receive(
     return _netif->register_l3(_proto_num, std::move(rx_fn), std::move(forward));
 };
 
+void l3_protocol::receive_burst(std::function<void (rx_burst&)> burst_fn) {
+    _netif->register_l3_burst(_proto_num, std::move(burst_fn));
+}
+
 interface::interface(std::shared_ptr<device> dev)
     : _dev(dev)
     , _rx(_dev->receive([this] (packet p) { return dispatch_packet(std::move(p)); }))
     , _hw_address(_dev->hw_address())
-    , _hw_features(_dev->hw_features()) {
+    , _hw_features(_dev->hw_features())
+    , _rss_table(_dev->rss_key())
+    , _forward_out(smp::count) {
+    _dev->receive_burst([this] (packet_burst& burst) { dispatch_burst(burst); });
     dev->local_queue().register_packet_provider([this, idx = 0u] () mutable {
             std::experimental::optional<packet> p;
             for (size_t i = 0; i < _pkt_providers.size(); i++) {
@@ -289,6 +316,9 @@ interface::interface(std::shared_ptr<device> dev)
                     eh->src_mac = _hw_address;
                     eh->eth_proto = uint16_t(l3pv.proto_num);
                     *eh = hton(*eh);
+                    if (_capture) {
+                        _capture->capture(packet_capture::direction::outbound, l3pv.p);
+                    }
                     p = std::move(l3pv.p);
                     return p;
                 }
@@ -307,6 +337,12 @@ interface::register_l3(eth_protocol_num proto_num,
     return l3_rx.packet_stream.listen(std::move(next));
 }
 
+void interface::register_l3_burst(eth_protocol_num proto_num, std::function<void (l3_protocol::rx_burst&)> burst_fn) {
+    auto i = _proto_map.find(uint16_t(proto_num));
+    assert(i != _proto_map.end());
+    i->second.burst_fn = std::move(burst_fn);
+}
+
 unsigned interface::hash2cpu(uint32_t hash) {
     return _dev->hash2cpu(hash);
 }
@@ -315,53 +351,163 @@ const rss_key_type& interface::rss_key() const {
     return _dev->rss_key();
 }
 
-void interface::forward(unsigned cpuid, packet p) {
-    static __thread unsigned queue_depth;
+future<> interface::start_capture(sstring file_name, capture_filter filter, size_t snaplen) {
+    assert(!_capture);
+    auto c = std::make_unique<packet_capture>(std::move(filter), snaplen);
+    auto f = c->start(std::move(file_name));
+    return f.then([this, c = std::move(c)] () mutable {
+        _capture = std::move(c);
+    });
+}
+
+future<> interface::stop_capture() {
+    if (!_capture) {
+        return make_ready_future<>();
+    }
+    auto c = std::move(_capture);
+    auto f = c->stop();
+    return f.finally([c = std::move(c)] {});
+}
 
-    if (queue_depth < 1000) {
-        queue_depth++;
+// Messages carrying forwarded packets not yet processed by their shard
+static __thread unsigned forward_queue_depth;
+
+void interface::forward(unsigned cpuid, packet p) {
+    if (forward_queue_depth < 1000) {
+        forward_queue_depth++;
         auto src_cpu = engine().cpu_id();
         smp::submit_to(cpuid, [this, p = std::move(p), src_cpu]() mutable {
-            _dev->l2receive(p.free_on_cpu(src_cpu));
+            _dev->l2receive(p.free_on_cpu_batched(src_cpu));
         }).then([] {
-            queue_depth--;
+            forward_queue_depth--;
         });
     }
 }
 
+void interface::forward_burst(unsigned cpuid, packet_burst& burst) {
+    if (forward_queue_depth < 1000) {
+        forward_queue_depth++;
+        auto src_cpu = engine().cpu_id();
+        smp::submit_to(cpuid, [this, burst = std::move(burst), src_cpu]() mutable {
+            for (auto&& p : burst) {
+                p = p.free_on_cpu_batched(src_cpu);
+            }
+            _dev->l2receive(burst);
+        }).then([] {
+            forward_queue_depth--;
+        });
+    }
+    burst.clear();
+}
+
+unsigned interface::dispatch_cpu(l3_rx_stream& l3, packet& p) {
+    return _dev->forward_dst(engine().cpu_id(), [&p, &l3, this] () {
+        auto hwrss = p.rss_hash();
+        if (hwrss) {
+            return hwrss.value();
+        } else {
+            forward_hash data;
+            if (l3.forward(data, p, sizeof(eth_hdr))) {
+                // Keep it for the upper layers' flow lookups
+                auto hash = _rss_table.hash(data);
+                p.set_rss_hash(hash);
+                return hash;
+            }
+            return 0u;
+        }
+    });
+}
+
 future<> interface::dispatch_packet(packet p) {
     auto eh = p.get_header<eth_hdr>();
     if (eh) {
         auto i = _proto_map.find(ntoh(eh->eth_proto));
         if (i != _proto_map.end()) {
-            l3_rx_stream& l3 = i->second;
-            auto fw = _dev->forward_dst(engine().cpu_id(), [&p, &l3, this] () {
-                auto hwrss = p.rss_hash();
-                if (hwrss) {
-                    return hwrss.value();
-                } else {
-                    forward_hash data;
-                    if (l3.forward(data, p, sizeof(eth_hdr))) {
-                        return toeplitz_hash(rss_key(), data);
-                    }
-                    return 0u;
-                }
-            });
-            if (fw != engine().cpu_id()) {
-                forward(fw, std::move(p));
-            } else {
-                auto h = ntoh(*eh);
-                auto from = h.src_mac;
-                p.trim_front(sizeof(*eh));
-                // avoid chaining, since queue lenth is unlimited
-                // drop instead.
-                if (l3.ready.available()) {
-                    l3.ready = l3.packet_stream.produce(std::move(p), from);
-                }
-            }
+            dispatch_packet(i->second, std::move(p));
         }
     }
     return make_ready_future<>();
 }
 
+void interface::dispatch_packet(l3_rx_stream& l3, packet p) {
+    auto fw = dispatch_cpu(l3, p);
+    if (fw != engine().cpu_id()) {
+        forward(fw, std::move(p));
+    } else {
+        if (_capture) {
+            _capture->capture(packet_capture::direction::inbound, p);
+        }
+        auto h = ntoh(*p.get_header<eth_hdr>());
+        auto from = h.src_mac;
+        p.trim_front(sizeof(h));
+        // avoid chaining, since queue lenth is unlimited
+        // drop instead.
+        if (l3.ready.available()) {
+            l3.ready = l3.packet_stream.produce(std::move(p), from);
+        }
+    }
+}
+
+void interface::flush_burst(l3_rx_stream*& l3) {
+    if (l3) {
+        l3->burst_fn(l3->burst);
+        l3->burst.clear();
+        l3 = nullptr;
+    }
+}
+
+void interface::dispatch_burst(packet_burst& burst) {
+    // How many packets ahead to prefetch the headers of
+    static constexpr size_t prefetch_distance = 4;
+    for (size_t i = 0; i < std::min(prefetch_distance, burst.size()); ++i) {
+        prefetch<2>(burst[i].frag(0).base);
+    }
+    // Protocols get runs of consecutive packets in one call each, so that
+    // the shard's packets go up in the order they arrived; this is the
+    // protocol of the run being gathered
+    l3_rx_stream* run = nullptr;
+    for (size_t i = 0; i < burst.size(); ++i) {
+        if (i + prefetch_distance < burst.size()) {
+            prefetch<2>(burst[i + prefetch_distance].frag(0).base);
+        }
+        auto& p = burst[i];
+        auto eh = p.get_header<eth_hdr>();
+        if (!eh) {
+            continue;
+        }
+        auto l3i = _proto_map.find(ntoh(eh->eth_proto));
+        if (l3i == _proto_map.end()) {
+            continue;
+        }
+        l3_rx_stream& l3 = l3i->second;
+        if (!l3.burst_fn) {
+            flush_burst(run);
+            dispatch_packet(l3, std::move(p));
+            continue;
+        }
+        auto fw = dispatch_cpu(l3, p);
+        if (fw != engine().cpu_id()) {
+            _forward_out[fw].push_back(std::move(p));
+            continue;
+        }
+        if (run != &l3) {
+            flush_burst(run);
+            run = &l3;
+        }
+        if (_capture) {
+            _capture->capture(packet_capture::direction::inbound, p);
+        }
+        auto from = ntoh(*eh).src_mac;
+        p.trim_front(sizeof(*eh));
+        l3.burst.push_back(l3_protocol::rx_packet{std::move(p), from});
+    }
+    flush_burst(run);
+    // Each other shard gets its share in one message
+    for (unsigned cpu = 0; cpu < _forward_out.size(); ++cpu) {
+        if (!_forward_out[cpu].empty()) {
+            forward_burst(cpu, _forward_out[cpu]);
+        }
+    }
+}
+
 }
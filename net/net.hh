@@ -28,6 +28,7 @@
 #include "core/stream.hh"
 #include "core/scollectd.hh"
 #include "net/toeplitz.hh"
+#include "net/capture.hh"
 #include "ethernet.hh"
 #include "packet.hh"
 #include "const.hh"
@@ -41,6 +42,9 @@ class device;
 class qp;
 class l3_protocol;
 
+// Packets a queue received in one poll, handed up the stack together
+using packet_burst = std::vector<packet>;
+
 class forward_hash {
     uint8_t data[64];
     size_t end_idx = 0;
@@ -92,6 +96,11 @@ class l3_protocol {
         packet p;
     };
     using packet_provider_type = std::function<std::experimental::optional<l3packet> ()>;
+    struct rx_packet {
+        packet p;
+        ethernet_address from;
+    };
+    using rx_burst = std::vector<rx_packet>;
 private:
     interface* _netif;
     eth_protocol_num _proto_num;
@@ -100,6 +109,9 @@ class l3_protocol {
     subscription<packet, ethernet_address> receive(
             std::function<future<> (packet, ethernet_address)> rx_fn,
             std::function<bool (forward_hash&, packet&, size_t)> forward);
+    // Deliver packets received in a burst by a single call instead of
+    // one rx_fn call each.  Must follow receive().
+    void receive_burst(std::function<void (rx_burst&)> burst_fn);
 private:
     friend class interface;
 };
@@ -109,6 +121,8 @@ class interface {
         stream<packet, ethernet_address> packet_stream;
         future<> ready;
         std::function<bool (forward_hash&, packet&, size_t)> forward;
+        std::function<void (l3_protocol::rx_burst&)> burst_fn;
+        l3_protocol::rx_burst burst;
         l3_rx_stream(std::function<bool (forward_hash&, packet&, size_t)>&& fw) : ready(packet_stream.started()), forward(fw) {}
     };
     std::unordered_map<uint16_t, l3_rx_stream> _proto_map;
@@ -116,9 +130,20 @@ class interface {
     subscription<packet> _rx;
     ethernet_address _hw_address;
     net::hw_features _hw_features;
+    toeplitz_table _rss_table;
     std::vector<l3_protocol::packet_provider_type> _pkt_providers;
+    // Packets of the burst being dispatched that belong to other shards
+    std::vector<packet_burst> _forward_out;
+    // Recording of this shard's traffic, if enabled
+    std::unique_ptr<packet_capture> _capture;
 private:
     future<> dispatch_packet(packet p);
+    void dispatch_packet(l3_rx_stream& l3, packet p);
+    void dispatch_burst(packet_burst& burst);
+    // Hands the packets gathered for l3, if any, to it
+    void flush_burst(l3_rx_stream*& l3);
+    void forward_burst(unsigned cpuid, packet_burst& burst);
+    unsigned dispatch_cpu(l3_rx_stream& l3, packet& p);
 public:
     explicit interface(std::shared_ptr<device> dev);
     ethernet_address hw_address() { return _hw_address; }
@@ -126,12 +151,21 @@ class interface {
     subscription<packet, ethernet_address> register_l3(eth_protocol_num proto_num,
             std::function<future<> (packet p, ethernet_address from)> next,
             std::function<bool (forward_hash&, packet&, size_t)> forward);
+    void register_l3_burst(eth_protocol_num proto_num, std::function<void (l3_protocol::rx_burst&)> burst_fn);
     void forward(unsigned cpuid, packet p);
     unsigned hash2cpu(uint32_t hash);
     void register_packet_provider(l3_protocol::packet_provider_type func) {
         _pkt_providers.push_back(std::move(func));
     }
     const rss_key_type& rss_key() const;
+    // Software RSS hashing with the device's key
+    const toeplitz_table& rss_table() const { return _rss_table; }
+    // Writes the packets this shard sends and receives to a pcap file.
+    // Received packets are recorded on the shard that processes them,
+    // after forwarding, and only for protocols registered here.
+    future<> start_capture(sstring file_name, capture_filter filter,
+            size_t snaplen = packet_capture::default_snaplen);
+    future<> stop_capture();
     friend class l3_protocol;
 };
 
@@ -214,6 +248,7 @@ class qp {
     std::experimental::optional<std::array<uint8_t, 128>> _sw_reta;
     circular_buffer<packet> _proxy_packetq;
     stream<packet> _rx_stream;
+    std::function<void (packet_burst&)> _rx_burst_fn;
     reactor::poller _tx_poller;
     circular_buffer<packet> _tx_packetq;
 
@@ -264,7 +299,12 @@ class device {
     qp& queue_for_cpu(unsigned cpu) { return *_queues[cpu]; }
     qp& local_queue() { return queue_for_cpu(engine().cpu_id()); }
     void l2receive(packet p) { _queues[engine().cpu_id()]->_rx_stream.produce(std::move(p)); }
+    // Hands the packets of one poll to the stack and empties the burst
+    void l2receive(packet_burst& burst);
     subscription<packet> receive(std::function<future<> (packet)> next_packet);
+    // Receives bursts passed to l2receive(packet_burst&) in a single call;
+    // without it they are fed one by one to the receive() subscription
+    void receive_burst(std::function<void (packet_burst&)> burst_fn);
     virtual ethernet_address hw_address() = 0;
     virtual net::hw_features hw_features() = 0;
     virtual const rss_key_type& rss_key() const { return default_rsskey_40bytes; }
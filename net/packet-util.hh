@@ -42,6 +42,23 @@ class packet_merger {
         return linearizations_ref();
     }
 
+    // Bytes of the segments overlapping or adjoining [beg, end]: those a
+    // merge of that range combines into one
+    size_t bytes_around(Offset beg, Offset end) const {
+        size_t bytes = 0;
+        auto it = map.upper_bound(beg);
+        if (it != map.begin()) {
+            auto prev = std::prev(it);
+            if (beg <= prev->first + prev->second.len()) {
+                bytes += prev->second.len();
+            }
+        }
+        for (; it != map.end() && it->first <= end; ++it) {
+            bytes += it->second.len();
+        }
+        return bytes;
+    }
+
     void merge(Offset offset, packet p) {
         bool insert;
         auto beg = offset;
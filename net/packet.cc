@@ -29,6 +29,39 @@ namespace net {
 
 constexpr size_t packet::internal_data_size;
 constexpr size_t packet::default_nr_frags;
+constexpr size_t packet::max_pooled_blocks;
+
+// Free blocks for impls of default_nr_frags fragments, linked through
+// their first word.  Blocks freed on a shard go to its own list, even if
+// another shard allocated them; the bound keeps a shard that mostly frees
+// other shards' packets from hoarding memory.
+static __thread void* impl_free_list;
+static __thread size_t impl_free_count;
+
+void* packet::impl::allocate_block(size_t nr_frags) {
+    assert(nr_frags == uint16_t(nr_frags));
+    if (nr_frags == default_nr_frags && impl_free_list) {
+        auto block = impl_free_list;
+        impl_free_list = *static_cast<void**>(block);
+        --impl_free_count;
+        return block;
+    }
+    return ::operator new(sizeof(impl) + nr_frags * sizeof(fragment));
+}
+
+void packet::impl::free_block(void* block, size_t nr_frags) {
+    if (nr_frags == default_nr_frags && impl_free_count < max_pooled_blocks) {
+        *static_cast<void**>(block) = impl_free_list;
+        impl_free_list = block;
+        ++impl_free_count;
+        return;
+    }
+    ::operator delete(block);
+}
+
+size_t packet::pooled_blocks() {
+    return impl_free_count;
+}
 
 void packet::linearize(size_t at_frag, size_t desired_size) {
     _impl->unuse_internal_data();
@@ -75,6 +108,43 @@ packet packet::free_on_cpu(unsigned cpu, std::function<void()> cb)
     return packet(impl::copy(_impl.get()));
 }
 
+// Deleters to run on each other shard, and whether a task to send them
+// there is already scheduled
+static thread_local std::vector<std::vector<deleter>> remote_deleters;
+static thread_local bool remote_deleters_flush_scheduled;
+
+static void flush_remote_deleters() {
+    remote_deleters_flush_scheduled = false;
+    for (unsigned cpu = 0; cpu < remote_deleters.size(); ++cpu) {
+        auto& ds = remote_deleters[cpu];
+        if (ds.empty()) {
+            continue;
+        }
+        smp::submit_to(cpu, [ds = std::move(ds)] () mutable {
+            // Destroy them here, not where the work item is destroyed
+            auto xxx = std::move(ds);
+        });
+        ds.clear();
+    }
+}
+
+packet packet::free_on_cpu_batched(unsigned cpu, std::function<void()> cb)
+{
+    auto d = make_deleter(std::move(_impl->_deleter), std::move(cb));
+    _impl->_deleter = make_deleter(deleter(), [d = std::move(d), cpu] () mutable {
+        if (remote_deleters.empty()) {
+            remote_deleters.resize(smp::count);
+        }
+        remote_deleters[cpu].push_back(std::move(d));
+        if (!remote_deleters_flush_scheduled) {
+            remote_deleters_flush_scheduled = true;
+            schedule(make_task([] { flush_remote_deleters(); }));
+        }
+    });
+
+    return packet(impl::copy(_impl.get()));
+}
+
 std::ostream& operator<<(std::ostream& os, const packet& p) {
     os << "packet{";
     bool first = true;
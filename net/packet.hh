@@ -28,6 +28,8 @@
 #include <vector>
 #include <cassert>
 #include <algorithm>
+#include <memory>
+#include <new>
 #include <iosfwd>
 #include <experimental/optional>
 
@@ -46,6 +48,8 @@ struct offload_info {
     uint8_t udp_hdr_len = 8;
     bool needs_ip_csum = false;
     bool reassembled = false;
+    // Received packet whose L4 checksum was already verified in software
+    bool l4_csum_verified = false;
     uint16_t tso_seg_size = 0;
     // HW stripped VLAN header (CPU order)
     std::experimental::optional<uint16_t> vlan_tci;
@@ -74,9 +78,15 @@ struct offload_info {
 // extra space, so prepending to the packet does not require extra
 // allocations.  This is useful when adding headers.
 //
+// The packet's own state lives in a block that, for the common number of
+// fragments, comes from a per-shard pool: together with the space above,
+// building a pure ACK or a small reply needs no general-purpose heap
+// allocation at all.
+//
 class packet final {
-    // enough for lots of headers, not quite two cache lines:
-    static constexpr size_t internal_data_size = 128 - 16;
+    // enough for Ethernet, IPv4 or IPv6 and TCP headers, each with the
+    // most options they can carry (14 + 60 + 60), rounded up:
+    static constexpr size_t internal_data_size = 136;
     static constexpr size_t default_nr_frags = 4;
 
     struct pseudo_vector {
@@ -89,6 +99,13 @@ class packet final {
         fragment& operator[](size_t idx) { return _start[idx]; }
     };
 
+    struct impl;
+    // Destroys an impl and returns its block to where it came from
+    struct impl_deleter {
+        void operator()(impl* p) const;
+    };
+    using impl_ptr = std::unique_ptr<impl, impl_deleter>;
+
     struct impl {
         // when destroyed, virtual destructor will reclaim resources
         deleter _deleter;
@@ -109,12 +126,27 @@ class packet final {
 
         pseudo_vector fragments() { return { _frags, _nr_frags }; }
 
-        static std::unique_ptr<impl> allocate(size_t nr_frags) {
-            nr_frags = std::max(nr_frags, default_nr_frags);
-            return std::unique_ptr<impl>(new (nr_frags) impl(nr_frags));
+        // Blocks of default_nr_frags fragments are pooled, others come
+        // from the heap
+        static void* allocate_block(size_t nr_frags);
+        static void free_block(void* block, size_t nr_frags);
+
+        template <typename... Args>
+        static impl_ptr make(size_t nr_frags, Args&&... args) {
+            auto block = allocate_block(nr_frags);
+            try {
+                return impl_ptr(new (block) impl(std::forward<Args>(args)..., nr_frags));
+            } catch (...) {
+                free_block(block, nr_frags);
+                throw;
+            }
         }
 
-        static std::unique_ptr<impl> copy(impl* old, size_t nr) {
+        static impl_ptr allocate(size_t nr_frags) {
+            return make(std::max(nr_frags, default_nr_frags));
+        }
+
+        static impl_ptr copy(impl* old, size_t nr) {
             auto n = allocate(nr);
             n->_deleter = std::move(old->_deleter);
             n->_len = old->_len;
@@ -127,29 +159,16 @@ class packet final {
             return std::move(n);
         }
 
-        static std::unique_ptr<impl> copy(impl* old) {
+        static impl_ptr copy(impl* old) {
             return copy(old, old->_nr_frags);
         }
 
-        static std::unique_ptr<impl> allocate_if_needed(std::unique_ptr<impl> old, size_t extra_frags) {
+        static impl_ptr allocate_if_needed(impl_ptr old, size_t extra_frags) {
             if (old->_allocated_frags >= old->_nr_frags + extra_frags) {
                 return std::move(old);
             }
             return copy(old.get(), std::max<size_t>(old->_nr_frags + extra_frags, 2 * old->_nr_frags));
         }
-        void* operator new(size_t size, size_t nr_frags = default_nr_frags) {
-            assert(nr_frags == uint16_t(nr_frags));
-            return ::operator new(size + nr_frags * sizeof(fragment));
-        }
-        // Matching the operator new above
-        void operator delete(void* ptr, size_t nr_frags) {
-            return ::operator delete(ptr);
-        }
-        // Since the above "placement delete" hides the global one, expose it
-        void operator delete(void* ptr) {
-            return ::operator delete(ptr);
-        }
-
         bool using_internal_data() const {
             return _nr_frags
                     && _frags[0].base >= _data
@@ -179,8 +198,8 @@ class packet final {
                     to->_frags[0].base);
         }
     };
-    packet(std::unique_ptr<impl>&& impl) : _impl(std::move(impl)) {}
-    std::unique_ptr<impl> _impl;
+    packet(impl_ptr&& impl) : _impl(std::move(impl)) {}
+    impl_ptr _impl;
 public:
     static packet from_static_data(const char* data, size_t len) {
         return {fragment{const_cast<char*>(data), len}, deleter()};
@@ -258,6 +277,10 @@ class packet final {
     char* prepend_uninitialized_header(size_t size);
 
     packet free_on_cpu(unsigned cpu, std::function<void()> cb = []{});
+    // Like free_on_cpu(), but the original deleter is queued on the shard
+    // that frees the packet, and all those queued for cpu during a task
+    // queue pass go back to it in a single message
+    packet free_on_cpu_batched(unsigned cpu, std::function<void()> cb = []{});
 
     void linearize() { return linearize(0, len()); }
 
@@ -282,6 +305,9 @@ class packet final {
     class offload_info offload_info() const { return _impl->_offload_info; }
     class offload_info& offload_info_ref() { return _impl->_offload_info; }
     void set_offload_info(class offload_info oi) { _impl->_offload_info = oi; }
+    // Most free blocks a shard's pool keeps, and how many it has now
+    static constexpr size_t max_pooled_blocks = 4096;
+    static size_t pooled_blocks();
 };
 
 std::ostream& operator<<(std::ostream& os, const packet& p);
@@ -291,6 +317,13 @@ packet::packet(packet&& x) noexcept
     : _impl(std::move(x._impl)) {
 }
 
+inline
+void packet::impl_deleter::operator()(impl* p) const {
+    auto nr_frags = p->_allocated_frags;
+    p->~impl();
+    impl::free_block(p, nr_frags);
+}
+
 inline
 packet::impl::impl(size_t nr_frags)
     : _len(0), _allocated_frags(nr_frags) {
@@ -327,7 +360,7 @@ packet::packet(size_t nr_frags)
 }
 
 inline
-packet::packet(fragment frag) : _impl(new impl(frag)) {
+packet::packet(fragment frag) : _impl(impl::make(default_nr_frags, frag)) {
 }
 
 inline
@@ -23,7 +23,31 @@
 #include "net.hh"
 #include "packet.hh"
 #include "api.hh"
+#include "core/sharded.hh"
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+// MSG_ZEROCOPY arrived in 4.14
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
 
 namespace net {
 
@@ -46,6 +70,38 @@ class posix_connected_socket_impl final : public connected_socket_impl {
     virtual bool get_nodelay() const override {
         return _fd.get_file_desc().getsockopt<int>(IPPROTO_TCP, TCP_NODELAY);
     }
+    virtual void set_congestion_control(tcp_congestion_control cc) override {
+        if (auto name = tcp_congestion_control_name(cc)) {
+            _fd.get_file_desc().setsockopt(IPPROTO_TCP, TCP_CONGESTION, name);
+        }
+    }
+    virtual tcp_connection_info get_tcp_info() const override {
+        auto& fd = _fd.get_file_desc();
+        auto ti = fd.getsockopt<struct tcp_info>(IPPROTO_TCP, TCP_INFO);
+        // The kernel counts the congestion window and the data in flight
+        // in segments; its ssthresh starts out "infinite"
+        auto bytes = [mss = ti.tcpi_snd_mss] (uint32_t segs) {
+            return uint32_t(std::min<uint64_t>(uint64_t(segs) * mss, std::numeric_limits<uint32_t>::max()));
+        };
+        tcp_connection_info info;
+        info.srtt = std::chrono::microseconds(ti.tcpi_rtt);
+        info.rttvar = std::chrono::microseconds(ti.tcpi_rttvar);
+        info.rto = std::chrono::microseconds(ti.tcpi_rto);
+        info.snd_mss = ti.tcpi_snd_mss;
+        info.rcv_mss = ti.tcpi_rcv_mss;
+        info.snd_cwnd = bytes(ti.tcpi_snd_cwnd);
+        info.snd_ssthresh = bytes(ti.tcpi_snd_ssthresh);
+        info.bytes_in_flight = bytes(ti.tcpi_unacked);
+        int unsent = 0;
+        fd.ioctl(SIOCOUTQNSD, unsent);
+        info.bytes_unsent = unsent;
+        info.retransmits = ti.tcpi_total_retrans;
+        // The advertised windows and the timeout count are not in the
+        // tcp_info the C library knows about, and are left at zero
+        // (tcpi_rcv_space is the receive buffer auto-tuning's estimate,
+        // not the window)
+        return info;
+    }
     friend class posix_server_socket_impl;
     friend class posix_ap_server_socket_impl;
     friend class posix_reuseport_server_socket_impl;
@@ -130,13 +186,38 @@ data_source posix_data_source(pollable_fd& fd) {
     return data_source(std::make_unique<posix_data_source_impl>(fd));
 }
 
+// The unused tail of the shard's current receive chunk.  Reads go there
+// and take just what they filled; a chunk is freed once every buffer
+// carved from it is.
+static thread_local temporary_buffer<char> receive_chunk;
+static constexpr size_t receive_chunk_size = 64 * 1024;
+// Start a new chunk rather than read less than this
+static constexpr size_t min_receive_space = 4096;
+
+// Sends of at least this many bytes use MSG_ZEROCOPY; 0 disables it
+static __thread size_t zerocopy_threshold;
+
 future<temporary_buffer<char>>
 posix_data_source_impl::get() {
-    return _fd.read_some(_buf.get_write(), _buf_size).then([this] (size_t size) {
-        _buf.trim(size);
-        auto ret = std::move(_buf);
-        _buf = temporary_buffer<char>(_buf_size);
-        return make_ready_future<temporary_buffer<char>>(std::move(ret));
+    return _fd.readable().then([this] {
+        if (receive_chunk.size() < min_receive_space) {
+            receive_chunk = temporary_buffer<char>(receive_chunk_size);
+        }
+        auto space = receive_chunk.size();
+        auto r = _fd.get_file_desc().read(receive_chunk.get_write(), space);
+        if (!r) {
+            return get();
+        }
+        if (*r == 0) {
+            // End of stream
+            return make_ready_future<temporary_buffer<char>>();
+        }
+        if (*r == space) {
+            _fd.speculate_readable();
+        }
+        auto buf = receive_chunk.share(0, *r);
+        receive_chunk.trim_front(*r);
+        return make_ready_future<temporary_buffer<char>>(std::move(buf));
     });
 }
 
@@ -162,17 +243,187 @@ std::vector<iovec> to_iovec(std::vector<temporary_buffer<char>>& buf_vec) {
     return v;
 }
 
+posix_data_sink_impl::posix_data_sink_impl(pollable_fd& fd) : _fd(fd) {
+}
+
 future<>
 posix_data_sink_impl::put(temporary_buffer<char> buf) {
+    if (use_zerocopy(buf.size())) {
+        return put(packet(fragment{buf.get_write(), buf.size()}, buf.release()));
+    }
     return _fd.write_all(buf.get(), buf.size()).then([d = buf.release()] {});
 }
 
 future<>
 posix_data_sink_impl::put(packet p) {
+    if (use_zerocopy(p.len())) {
+        reap_zerocopy();
+        auto iov = to_iovec(p);
+        // Pending already, so that completions reaped while it is being
+        // sent are not lost
+        _zerocopy_pending.push_back({_zerocopy_seq, 0, 0, std::move(p), true});
+        return send_zerocopy(std::move(iov)).finally([this] {
+            _zerocopy_pending.back().sending = false;
+            reap_zerocopy();
+            if (!_zerocopy_pending.empty() && _zerocopy_reaper.available()) {
+                _zerocopy_reaper = reap_zerocopy_on_error();
+            }
+        });
+    }
     _p = std::move(p);
     return _fd.write_all(_p).then([this] { _p.reset(); });
 }
 
+// The kernel reads zero-copy buffers until the peer acknowledges their
+// data, so close() waits for that, but only this long
+static constexpr auto zerocopy_close_timeout = std::chrono::seconds(10);
+
+future<>
+posix_data_sink_impl::close() {
+    reap_zerocopy();
+    auto expiry = make_lw_shared<timer<>>();
+    if (_zerocopy_pending.empty()) {
+        // The reaper may still be waiting, for nothing
+        _fd.abort_error_waiter(std::make_exception_ptr(std::system_error(ECANCELED, std::system_category())));
+    } else {
+        expiry->set_callback([this] {
+            _fd.abort_error_waiter(std::make_exception_ptr(std::system_error(ETIMEDOUT, std::system_category())));
+        });
+        expiry->arm(zerocopy_close_timeout);
+    }
+    return std::move(_zerocopy_reaper).then_wrapped([this, expiry] (future<> f) {
+        f.ignore_ready_future();
+        expiry->cancel();
+        if (!_zerocopy_pending.empty()) {
+            // Resetting the connection drops the data the kernel still
+            // holds, and with it the kernel's references to our buffers
+            ::linger l = { 1, 0 };
+            _fd.get_file_desc().setsockopt(SOL_SOCKET, SO_LINGER, l);
+        }
+        _fd.close();
+        while (!_zerocopy_pending.empty()) {
+            _zerocopy_pending.pop_front();
+        }
+    });
+}
+
+bool posix_data_sink_impl::use_zerocopy(size_t len) {
+    if (!zerocopy_threshold || len < zerocopy_threshold) {
+        return false;
+    }
+    if (!_zerocopy) {
+        try {
+            _fd.get_file_desc().setsockopt(SOL_SOCKET, SO_ZEROCOPY, 1);
+            _zerocopy = true;
+        } catch (std::system_error&) {
+            // Kernel too old, or not a TCP socket
+            _zerocopy = false;
+        }
+    }
+    return *_zerocopy;
+}
+
+// Waits for the socket to report completions, until none are pending
+future<> posix_data_sink_impl::reap_zerocopy_on_error() {
+    return _fd.errored().then([this] {
+        reap_zerocopy();
+        if (_zerocopy_pending.empty()) {
+            return make_ready_future<>();
+        }
+        return reap_zerocopy_on_error();
+    });
+}
+
+// Sends all of iov for the last pending send.  Every successful
+// MSG_ZEROCOPY call, even a partial one, takes a sequence number.
+future<> posix_data_sink_impl::send_zerocopy(std::vector<iovec> iov) {
+    return _fd.writeable().then([this, iov = std::move(iov)] () mutable {
+        ::msghdr mh = {};
+        mh.msg_iov = iov.data();
+        mh.msg_iovlen = iov.size();
+        boost::optional<size_t> r;
+        try {
+            r = _fd.get_file_desc().sendmsg(&mh, MSG_ZEROCOPY | MSG_NOSIGNAL);
+            if (r) {
+                ++_zerocopy_seq;
+                ++_zerocopy_pending.back().nr_calls;
+            }
+        } catch (std::system_error& e) {
+            if (e.code().value() != ENOBUFS) {
+                throw;
+            }
+            // Out of socket option memory for pinning pages: copy instead
+            r = _fd.get_file_desc().sendmsg(&mh, MSG_NOSIGNAL);
+        }
+        if (!r) {
+            return send_zerocopy(std::move(iov));
+        }
+        auto sent = *r;
+        auto i = iov.begin();
+        for (; i != iov.end() && sent >= i->iov_len; ++i) {
+            sent -= i->iov_len;
+        }
+        iov.erase(iov.begin(), i);
+        if (iov.empty()) {
+            return make_ready_future<>();
+        }
+        iov.front().iov_base = static_cast<char*>(iov.front().iov_base) + sent;
+        iov.front().iov_len -= sent;
+        return send_zerocopy(std::move(iov));
+    });
+}
+
+void posix_data_sink_impl::reap_zerocopy() {
+    if (_zerocopy_pending.empty()) {
+        return;
+    }
+    char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+    while (true) {
+        ::msghdr mh = {};
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        if (!_fd.get_file_desc().recvmsg(&mh, MSG_ERRQUEUE)) {
+            break;
+        }
+        for (auto cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                    && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            auto ee = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+            if (ee->ee_errno || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            complete_zerocopy(ee->ee_info, ee->ee_data);
+            // The device could not send from our pages, so the kernel
+            // copied anyway, later and at a higher cost than send() would
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                _zerocopy = false;
+            }
+        }
+    }
+    while (!_zerocopy_pending.empty() && !_zerocopy_pending.front().sending
+            && _zerocopy_pending.front().completed == _zerocopy_pending.front().nr_calls) {
+        _zerocopy_pending.pop_front();
+    }
+}
+
+// Completion reports cover disjoint ranges of sequence numbers, not
+// necessarily in order; sequence numbers are compared relative to the
+// oldest pending one so that they may wrap
+void posix_data_sink_impl::complete_zerocopy(uint32_t lo, uint32_t hi) {
+    auto base = _zerocopy_pending.front().first_seq;
+    auto from = lo - base;
+    auto to = hi - base + 1;
+    for (auto&& s : _zerocopy_pending) {
+        auto begin = std::max(from, s.first_seq - base);
+        auto end = std::min(to, s.first_seq - base + s.nr_calls);
+        if (begin < end) {
+            s.completed += end - begin;
+        }
+    }
+}
+
 server_socket
 posix_network_stack::listen(socket_address sa, listen_options opt) {
     if (_reuseport)
@@ -208,72 +459,122 @@ posix_ap_network_stack::connect(socket_address sa, socket_address local) {
     });
 }
 
-struct cmsg_with_pktinfo {
-    struct cmsghdrcmh;
-    struct in_pktinfo pktinfo;
-};
-
 class posix_udp_channel : public udp_channel_impl {
 private:
     static constexpr int MAX_DATAGRAM_SIZE = 65507;
-    struct recv_ctx {
-        struct msghdr _hdr;
-        struct iovec _iov;
-        socket_address _src_addr;
-        char* _buffer;
-        cmsg_with_pktinfo _cmsg;
-
-        recv_ctx() {
-            memset(&_hdr, 0, sizeof(_hdr));
-            _hdr.msg_iov = &_iov;
-            _hdr.msg_iovlen = 1;
-            _hdr.msg_name = &_src_addr.u.sa;
-            _hdr.msg_namelen = sizeof(_src_addr.u.sas);
-            memset(&_cmsg, 0, sizeof(_cmsg));
-            _hdr.msg_control = &_cmsg;
-            _hdr.msg_controllen = sizeof(_cmsg);
-        }
-
-        void prepare() {
-            _buffer = new char[MAX_DATAGRAM_SIZE];
-            _iov.iov_base = _buffer;
-            _iov.iov_len = MAX_DATAGRAM_SIZE;
+    // Messages received, or sent, per system call
+    static constexpr unsigned batch_size = 16;
+    // Most datagrams sent as one UDP_SEGMENT message
+    static constexpr unsigned max_segments = 64;
+    // IPv4 and UDP headers; a segment with them must fit the path MTU
+    static constexpr size_t udp_ip_hdr_len = 28;
+    static constexpr size_t recv_cmsg_space = CMSG_SPACE(sizeof(in_pktinfo)) + CMSG_SPACE(sizeof(int));
+    static constexpr size_t send_cmsg_space = CMSG_SPACE(sizeof(uint16_t));
+    // Receive buffers, reused once the datagrams made from them are freed
+    struct buffer_pool {
+        std::vector<char*> _free;
+        ~buffer_pool() {
+            for (auto b : _free) {
+                delete[] b;
+            }
+        }
+        char* get() {
+            if (_free.empty()) {
+                return new char[MAX_DATAGRAM_SIZE];
+            }
+            auto b = _free.back();
+            _free.pop_back();
+            return b;
+        }
+        void put(char* b) {
+            if (_free.size() < batch_size) {
+                _free.push_back(b);
+            } else {
+                delete[] b;
+            }
         }
     };
-    struct send_ctx {
-        struct msghdr _hdr;
-        std::vector<struct iovec> _iovecs;
-        socket_address _dst;
-        packet _p;
-
-        send_ctx() {
-            memset(&_hdr, 0, sizeof(_hdr));
-            _hdr.msg_name = &_dst.u.sa;
-            _hdr.msg_namelen = sizeof(_dst.u.sas);
+    struct recv_ctx {
+        std::array<mmsghdr, batch_size> _msgs;
+        std::array<iovec, batch_size> _iovs;
+        std::array<socket_address, batch_size> _src_addrs;
+        std::array<char*, batch_size> _buffers{};
+        alignas(cmsghdr) char _cmsgs[batch_size][recv_cmsg_space];
+
+        ~recv_ctx() {
+            for (auto b : _buffers) {
+                delete[] b;
+            }
         }
-
-        void prepare(ipv4_addr dst, packet p) {
-            _dst = make_ipv4_address(dst);
-            _p = std::move(p);
-            _iovecs = std::move(to_iovec(_p));
-            _hdr.msg_iov = _iovecs.data();
-            _hdr.msg_iovlen = _iovecs.size();
+        void prepare(buffer_pool& pool) {
+            for (unsigned i = 0; i < batch_size; ++i) {
+                if (!_buffers[i]) {
+                    _buffers[i] = pool.get();
+                }
+                _iovs[i].iov_base = _buffers[i];
+                _iovs[i].iov_len = MAX_DATAGRAM_SIZE;
+                auto& hdr = _msgs[i].msg_hdr;
+                memset(&hdr, 0, sizeof(hdr));
+                hdr.msg_iov = &_iovs[i];
+                hdr.msg_iovlen = 1;
+                hdr.msg_name = &_src_addrs[i].u.sa;
+                hdr.msg_namelen = sizeof(_src_addrs[i].u.sas);
+                hdr.msg_control = _cmsgs[i];
+                hdr.msg_controllen = recv_cmsg_space;
+            }
         }
     };
+    struct pending_send {
+        ipv4_addr dst;
+        packet p;
+        promise<> pr;
+    };
+    struct send_ctx {
+        std::array<mmsghdr, batch_size> _msgs;
+        std::array<socket_address, batch_size> _dsts;
+        std::array<unsigned, batch_size> _nr_datagrams;
+        std::array<size_t, batch_size + 1> _iov_start;
+        std::vector<iovec> _iovecs;
+        alignas(cmsghdr) char _cmsgs[batch_size][send_cmsg_space];
+    };
     std::unique_ptr<pollable_fd> _fd;
     ipv4_addr _address;
+    lw_shared_ptr<buffer_pool> _buffers = make_lw_shared<buffer_pool>();
     recv_ctx _recv;
+    circular_buffer<udp_datagram> _received;
     send_ctx _send;
+    circular_buffer<pending_send> _send_queue;
+    // Sends queued while tasks run leave together, after them
+    reactor::poller _send_poller;
+    // Set while the socket buffer is full, until the socket is writeable
+    lw_shared_ptr<bool> _send_blocked = make_lw_shared<bool>(false);
+    // Clears _send_blocked; close() aborts the wait
+    future<> _send_unblocked = make_ready_future<>();
+    bool _gso = false;
+    // Largest datagram sent as a segment: the kernel refuses segments
+    // that do not fit the path MTU.  Starts at Ethernet's, and is lowered
+    // to the path MTU of destinations that refuse it
+    size_t _gso_max_segment = 1500 - udp_ip_hdr_len;
     bool _closed;
+private:
+    void queue_received(unsigned i);
+    bool flush_sends();
 public:
     posix_udp_channel(ipv4_addr bind_address)
-            : _closed(false) {
+            : _send_poller([this] { return flush_sends(); })
+            , _closed(false) {
         auto sa = make_ipv4_address(bind_address);
         file_desc fd = file_desc::socket(sa.u.sa.sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         fd.setsockopt(SOL_IP, IP_PKTINFO, true);
         if (engine().posix_reuseport_available()) {
             fd.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
         }
+        // Both are optional: kernels before 4.18 and 5.0 lack them
+        int gso_size;
+        socklen_t optlen = sizeof(gso_size);
+        _gso = ::getsockopt(fd.get(), SOL_UDP, UDP_SEGMENT, &gso_size, &optlen) == 0;
+        int on = 1;
+        ::setsockopt(fd.get(), SOL_UDP, UDP_GRO, &on, sizeof(on));
         fd.bind(sa.u.sa, sizeof(sa.u.sas));
         _address = ipv4_addr(fd.get_address());
         _fd = std::make_unique<pollable_fd>(std::move(fd));
@@ -282,24 +583,147 @@ class posix_udp_channel : public udp_channel_impl {
     virtual future<udp_datagram> receive() override;
     virtual future<> send(ipv4_addr dst, const char *msg);
     virtual future<> send(ipv4_addr dst, packet p);
-    virtual void close() override {
-        _closed = true;
-        _fd.reset();
-    }
+    virtual void close() override;
     virtual bool is_closed() const override { return _closed; }
 };
 
+void posix_udp_channel::close() {
+    _closed = true;
+    auto ex = std::make_exception_ptr(std::system_error(EBADF, std::system_category()));
+    if (*_send_blocked) {
+        _fd->abort_writer(ex);
+    }
+    _fd.reset();
+    // Sends still queued fail rather than being lost
+    while (!_send_queue.empty()) {
+        _send_queue.front().pr.set_exception(ex);
+        _send_queue.pop_front();
+    }
+}
+
 future<> posix_udp_channel::send(ipv4_addr dst, const char *message) {
-    auto len = strlen(message);
-    return _fd->sendto(make_ipv4_address(dst), message, len)
-            .then([len] (size_t size) { assert(size == len); });
+    return send(dst, packet(message, strlen(message)));
 }
 
 future<> posix_udp_channel::send(ipv4_addr dst, packet p) {
-    auto len = p.len();
-    _send.prepare(dst, std::move(p));
-    return _fd->sendmsg(&_send._hdr)
-            .then([len] (size_t size) { assert(size == len); });
+    _send_queue.push_back(pending_send{dst, std::move(p), promise<>()});
+    return _send_queue.back().pr.get_future();
+}
+
+// The MTU of the route to dst, or 0 if unknown
+static size_t path_mtu(const socket_address& dst) {
+    try {
+        auto fd = file_desc::socket(dst.u.sa.sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        fd.connect(const_cast<sockaddr&>(dst.u.sa), sizeof(dst.u.sas));
+        return fd.getsockopt<int>(SOL_IP, IP_MTU);
+    } catch (std::system_error&) {
+        return 0;
+    }
+}
+
+bool posix_udp_channel::flush_sends() {
+    if (_send_queue.empty() || !_fd || *_send_blocked) {
+        return false;
+    }
+    auto& s = _send;
+    s._iovecs.clear();
+    unsigned nr_msgs = 0;
+    for (size_t i = 0; i < _send_queue.size() && nr_msgs < batch_size; ++nr_msgs) {
+        auto& first = _send_queue[i];
+        auto seg_size = first.p.len();
+        size_t total = seg_size;
+        unsigned n = 1;
+        // Datagrams to one destination, all of one size except for a
+        // shorter last one, can go as one message the kernel segments
+        while (_gso && seg_size && seg_size <= _gso_max_segment
+                && i + n < _send_queue.size() && n < max_segments) {
+            auto& next = _send_queue[i + n];
+            if (next.dst.ip != first.dst.ip || next.dst.port != first.dst.port
+                    || next.p.len() > seg_size || total + next.p.len() > MAX_DATAGRAM_SIZE) {
+                break;
+            }
+            total += next.p.len();
+            ++n;
+            if (next.p.len() < seg_size) {
+                break;
+            }
+        }
+        s._iov_start[nr_msgs] = s._iovecs.size();
+        for (unsigned k = 0; k < n; ++k) {
+            for (auto&& f : _send_queue[i + k].p.fragments()) {
+                s._iovecs.push_back({f.base, f.size});
+            }
+        }
+        auto& hdr = s._msgs[nr_msgs].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        s._dsts[nr_msgs] = make_ipv4_address(first.dst);
+        hdr.msg_name = &s._dsts[nr_msgs].u.sa;
+        hdr.msg_namelen = sizeof(s._dsts[nr_msgs].u.sas);
+        if (n > 1) {
+            hdr.msg_control = s._cmsgs[nr_msgs];
+            hdr.msg_controllen = send_cmsg_space;
+            auto cm = CMSG_FIRSTHDR(&hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *reinterpret_cast<uint16_t*>(CMSG_DATA(cm)) = seg_size;
+        }
+        s._nr_datagrams[nr_msgs] = n;
+        i += n;
+    }
+    s._iov_start[nr_msgs] = s._iovecs.size();
+    // The iovecs are in place now that the vector stopped growing
+    for (unsigned m = 0; m < nr_msgs; ++m) {
+        auto& hdr = s._msgs[m].msg_hdr;
+        hdr.msg_iov = s._iovecs.data() + s._iov_start[m];
+        hdr.msg_iovlen = s._iov_start[m + 1] - s._iov_start[m];
+    }
+
+    size_t sent;
+    try {
+        auto r = _fd->get_file_desc().sendmmsg(s._msgs.data(), nr_msgs, MSG_DONTWAIT);
+        if (!r) {
+            // Socket buffer full; try again once it drains
+            *_send_blocked = true;
+            _send_unblocked = _fd->writeable().then_wrapped([blocked = _send_blocked] (future<> f) {
+                f.ignore_ready_future();
+                *blocked = false;
+            });
+            return true;
+        }
+        sent = *r;
+    } catch (std::system_error& e) {
+        if (e.code().value() == EIO && s._nr_datagrams[0] > 1) {
+            // The device cannot segment (it lacks checksum offload), so
+            // send datagrams one by one from now on
+            _gso = false;
+            return true;
+        }
+        if (e.code().value() == EINVAL && s._nr_datagrams[0] > 1) {
+            // The segments do not fit the path MTU: send these datagrams
+            // without segmentation, and only smaller ones with it
+            size_t seg_size = _send_queue.front().p.len();
+            auto mtu = path_mtu(s._dsts[0]);
+            _gso_max_segment = std::min(_gso_max_segment, seg_size - 1);
+            if (mtu > udp_ip_hdr_len) {
+                _gso_max_segment = std::min(_gso_max_segment, mtu - udp_ip_hdr_len);
+            }
+            return true;
+        }
+        // Only the first message failed
+        for (unsigned k = 0; k < s._nr_datagrams[0]; ++k) {
+            _send_queue.front().pr.set_exception(std::current_exception());
+            _send_queue.pop_front();
+        }
+        return true;
+    }
+    for (unsigned m = 0; m < sent; ++m) {
+        for (unsigned k = 0; k < s._nr_datagrams[m]; ++k) {
+            _send_queue.front().pr.set_value();
+            _send_queue.pop_front();
+        }
+    }
+    return true;
 }
 
 udp_channel
@@ -320,18 +744,80 @@ class posix_datagram : public udp_datagram_impl {
     virtual packet& get_data() override { return _p; }
 };
 
+void posix_udp_channel::queue_received(unsigned i) {
+    auto& hdr = _recv._msgs[i].msg_hdr;
+    size_t len = _recv._msgs[i].msg_len;
+    auto dst = ipv4_addr(0, _address.port);
+    size_t seg_size = len;
+    for (auto cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+        if (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_PKTINFO) {
+            dst.ip = reinterpret_cast<in_pktinfo*>(CMSG_DATA(cm))->ipi_addr.s_addr;
+        } else if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            seg_size = *reinterpret_cast<int*>(CMSG_DATA(cm));
+        }
+    }
+    auto buf = _recv._buffers[i];
+    _recv._buffers[i] = nullptr;
+    // The datagram may be freed on another shard; the pool, and its
+    // reference count, are only touched on this one
+    packet p(fragment{buf, len}, make_deleter([pool = make_foreign(_buffers), buf, cpu = engine().cpu_id()] () mutable {
+        if (engine().cpu_id() == cpu) {
+            pool->put(buf);
+            return;
+        }
+        smp::submit_to(cpu, [pool = std::move(pool), buf] () mutable {
+            auto local = std::move(pool);
+            local->put(buf);
+        });
+    }));
+    ipv4_addr src = _recv._src_addrs[i];
+    if (!seg_size || seg_size >= len) {
+        _received.push_back(udp_datagram(std::make_unique<posix_datagram>(src, dst, std::move(p))));
+        return;
+    }
+    // The kernel coalesced datagrams of seg_size bytes, the last
+    // possibly shorter
+    for (size_t off = 0; off < len; off += seg_size) {
+        auto sz = std::min(seg_size, len - off);
+        _received.push_back(udp_datagram(std::make_unique<posix_datagram>(src, dst, p.share(off, sz))));
+    }
+}
+
 future<udp_datagram>
 posix_udp_channel::receive() {
-    _recv.prepare();
-    return _fd->recvmsg(&_recv._hdr).then([this] (size_t size) {
-        auto dst = ipv4_addr(_recv._cmsg.pktinfo.ipi_addr.s_addr, _address.port);
-        return make_ready_future<udp_datagram>(udp_datagram(std::make_unique<posix_datagram>(
-            _recv._src_addr, dst, packet(fragment{_recv._buffer, size}, make_deleter([buf = _recv._buffer] { delete[] buf; })))));
+    if (!_received.empty()) {
+        auto d = std::move(_received.front());
+        _received.pop_front();
+        return make_ready_future<udp_datagram>(std::move(d));
+    }
+    _recv.prepare(*_buffers);
+    return _fd->recvmmsg(_recv._msgs.data(), batch_size).then([this] (size_t n) {
+        for (unsigned i = 0; i < n; ++i) {
+            queue_received(i);
+        }
+        return receive();
     });
 }
 
+posix_network_stack::posix_network_stack(boost::program_options::variables_map opts)
+        : _reuseport(engine().posix_reuseport_available()) {
+    if (opts.count("posix-zerocopy-threshold")) {
+        zerocopy_threshold = opts["posix-zerocopy-threshold"].as<size_t>();
+    }
+}
+
+boost::program_options::options_description posix_stack_options() {
+    boost::program_options::options_description opts("Posix stack options");
+    opts.add_options()
+        ("posix-zerocopy-threshold",
+                boost::program_options::value<size_t>()->default_value(0),
+                "send TCP writes of at least this many bytes with MSG_ZEROCOPY (0: never)")
+        ;
+    return opts;
+}
+
 network_stack_registrator nsr_posix{"posix",
-    boost::program_options::options_description(),
+    posix_stack_options(),
     [](boost::program_options::variables_map ops) {
         return smp::main_thread() ? posix_network_stack::create(ops) : posix_ap_network_stack::create(ops);
     },
@@ -30,27 +30,46 @@ namespace net {
 data_source posix_data_source(pollable_fd& fd);
 data_sink posix_data_sink(pollable_fd& fd);
 
+// Reads into buffers carved out of chunks shared by all of the shard's
+// sockets, and only once data has arrived: an idle connection pins no
+// receive memory, a busy one only what its reader still holds.
 class posix_data_source_impl final : public data_source_impl {
     pollable_fd& _fd;
-    temporary_buffer<char> _buf;
-    size_t _buf_size;
 public:
-    explicit posix_data_source_impl(pollable_fd& fd, size_t buf_size = 8192)
-        : _fd(fd), _buf(buf_size), _buf_size(buf_size) {}
+    explicit posix_data_source_impl(pollable_fd& fd) : _fd(fd) {}
     virtual future<temporary_buffer<char>> get() override;
 };
 
 class posix_data_sink_impl : public data_sink_impl {
+    // A send made with MSG_ZEROCOPY, whose buffers must live until the
+    // kernel reports its sequence numbers, [first_seq, first_seq + nr_calls),
+    // completed
+    struct zerocopy_send {
+        uint32_t first_seq;
+        uint32_t nr_calls;
+        uint32_t completed;
+        packet p;
+        bool sending;
+    };
     pollable_fd& _fd;
     packet _p;
+    // Unknown until the first write large enough to want it
+    std::experimental::optional<bool> _zerocopy;
+    uint32_t _zerocopy_seq = 0;
+    circular_buffer<zerocopy_send> _zerocopy_pending;
+    // Reaps completions as the socket reports them, while sends are pending
+    future<> _zerocopy_reaper = make_ready_future<>();
 public:
-    explicit posix_data_sink_impl(pollable_fd& fd) : _fd(fd) {}
+    explicit posix_data_sink_impl(pollable_fd& fd);
     future<> put(packet p) override;
     future<> put(temporary_buffer<char> buf) override;
-    future<> close() override {
-        _fd.close();
-        return make_ready_future<>();
-    }
+    future<> close() override;
+private:
+    bool use_zerocopy(size_t len);
+    future<> send_zerocopy(std::vector<iovec> iov);
+    void reap_zerocopy();
+    future<> reap_zerocopy_on_error();
+    void complete_zerocopy(uint32_t lo, uint32_t hi);
 };
 
 class posix_ap_server_socket_impl : public server_socket_impl {
@@ -91,7 +110,7 @@ class posix_network_stack : public network_stack {
 private:
     const bool _reuseport;
 public:
-    explicit posix_network_stack(boost::program_options::variables_map opts) : _reuseport(engine().posix_reuseport_available()) {}
+    explicit posix_network_stack(boost::program_options::variables_map opts);
     virtual server_socket listen(socket_address sa, listen_options opts) override;
     virtual future<connected_socket> connect(socket_address sa, socket_address local) override;
     virtual net::udp_channel make_udp_channel(ipv4_addr addr) override;
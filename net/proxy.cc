@@ -59,7 +59,7 @@ uint32_t proxy_net_device::send(circular_buffer<packet>& p)
         auto cpu = engine().cpu_id();
         smp::submit_to(_cpu, [this, dev, cpu]() mutable {
             for(size_t i = 0; i < _moving.size(); i++) {
-                dev->proxy_send(_moving[i].free_on_cpu(cpu, [this] { _send_depth--; }));
+                dev->proxy_send(_moving[i].free_on_cpu_batched(cpu, [this] { _send_depth--; }));
             }
         }).then([this] {
             _moving.clear();
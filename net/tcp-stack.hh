@@ -25,6 +25,7 @@
 #define NET_TCP_STACK_HH
 
 #include "core/future.hh"
+#include <chrono>
 
 class listen_options;
 class server_socket;
@@ -33,6 +34,7 @@ class connected_socket;
 namespace net {
 
 class ipv4_traits;
+class ipv6_traits;
 template <typename InetTraits>
 class tcp;
 
@@ -42,6 +44,18 @@ tcpv4_listen(tcp<ipv4_traits>& tcpv4, uint16_t port, listen_options opts);
 future<connected_socket>
 tcpv4_connect(tcp<ipv4_traits>& tcpv4, socket_address sa);
 
+void
+tcpv4_set_rto_min(tcp<ipv4_traits>& tcpv4, std::chrono::milliseconds rto_min);
+
+server_socket
+tcpv6_listen(tcp<ipv6_traits>& tcpv6, uint16_t port, listen_options opts);
+
+future<connected_socket>
+tcpv6_connect(tcp<ipv6_traits>& tcpv6, socket_address sa);
+
+void
+tcpv6_set_rto_min(tcp<ipv6_traits>& tcpv6, std::chrono::milliseconds rto_min);
+
 }
 
 #endif
@@ -22,13 +22,17 @@
 #include "tcp.hh"
 #include "tcp-stack.hh"
 #include "ip.hh"
+#include "ipv6.hh"
 #include "core/align.hh"
 #include "core/future.hh"
 #include "native-stack-impl.hh"
+#include <cmath>
 
 namespace net {
 
-void tcp_option::parse(uint8_t* beg, uint8_t* end) {
+constexpr unsigned tcp_option::max_sack_blocks;
+
+void tcp_option::parse(uint8_t* beg, uint8_t* end, bool syn) {
     while (beg < end) {
         auto kind = option_kind(*beg);
         if (kind != option_kind::nop && kind != option_kind::eol) {
@@ -55,6 +59,33 @@ void tcp_option::parse(uint8_t* beg, uint8_t* end) {
             _sack_received = true;
             beg += option_len::sack;
             break;
+        case option_kind::sack_blocks: {
+            auto len = *(beg + 1);
+            if (len < uint8_t(option_len::sack_blocks)) {
+                return;
+            }
+            auto edges = reinterpret_cast<sack_edges*>(beg + uint8_t(option_len::sack_blocks));
+            auto nr = std::min<unsigned>((len - uint8_t(option_len::sack_blocks)) / sizeof(sack_edges), max_sack_blocks);
+            for (_nr_remote_sack = 0; _nr_remote_sack < nr; ++_nr_remote_sack) {
+                auto e = ntoh(edges[_nr_remote_sack]);
+                _remote_sack[_nr_remote_sack] = {e.left, e.right};
+            }
+            beg += len;
+            break;
+        }
+        case option_kind::timestamps: {
+            auto len = *(beg + 1);
+            if (len != uint8_t(option_len::timestamps)) {
+                return;
+            }
+            auto ts = ntoh(*reinterpret_cast<timestamps*>(beg));
+            _timestamps_received |= syn;
+            _remote_ts_present = true;
+            _remote_ts_val = ts.t1;
+            _remote_ts_ecr = ts.t2;
+            beg += option_len::timestamps;
+            break;
+        }
         case option_kind::nop:
             beg += option_len::nop;
             break;
@@ -94,6 +125,33 @@ uint8_t tcp_option::fill(tcp_hdr* th, uint8_t options_size) {
             off += win_scale->len;
             size += win_scale->len;
         }
+        if (_sack_received || !ack_on) {
+            auto sack = new (off) tcp_option::sack;
+            off += sack->len;
+            size += sack->len;
+        }
+    }
+    if (timestamps_on(syn_on, ack_on)) {
+        auto ts = new (off) tcp_option::timestamps;
+        ts->t1 = _local_ts_val;
+        ts->t2 = _local_ts_ecr;
+        *ts = hton(*ts);
+        off += option_len::timestamps;
+        size += option_len::timestamps;
+    }
+    if (_nr_local_sack) {
+        auto blocks = new (off) tcp_option::sack_blocks;
+        blocks->len = option_len(uint8_t(option_len::sack_blocks) + _nr_local_sack * sizeof(sack_edges));
+        off += option_len::sack_blocks;
+        size += option_len::sack_blocks;
+        for (unsigned i = 0; i < _nr_local_sack; ++i) {
+            auto edges = new (off) tcp_option::sack_edges;
+            edges->left = _local_sack[i].start;
+            edges->right = _local_sack[i].end;
+            *edges = hton(*edges);
+            off += sizeof(sack_edges);
+            size += sizeof(sack_edges);
+        }
     }
     if (size > 0) {
         // Insert NOP option
@@ -120,6 +178,15 @@ uint8_t tcp_option::get_size(bool syn_on, bool ack_on) {
         if (_win_scale_received || !ack_on) {
             size += option_len::win_scale;
         }
+        if (_sack_received || !ack_on) {
+            size += option_len::sack;
+        }
+    }
+    if (timestamps_on(syn_on, ack_on)) {
+        size += option_len::timestamps;
+    }
+    if (_nr_local_sack) {
+        size += uint8_t(option_len::sack_blocks) + _nr_local_sack * sizeof(sack_edges);
     }
     if (size > 0) {
         size += option_len::eol;
@@ -129,6 +196,209 @@ uint8_t tcp_option::get_size(bool syn_on, bool ack_on) {
     return size;
 }
 
+std::unique_ptr<tcp_congestion_controller>
+tcp_congestion_controller::make(tcp_congestion_control cc, uint32_t& cwnd, uint32_t& ssthresh, const uint16_t& mss) {
+    switch (cc) {
+    case tcp_congestion_control::cubic:
+        return std::make_unique<tcp_cubic>(cwnd, ssthresh, mss);
+    case tcp_congestion_control::bbr:
+        return std::make_unique<tcp_bbr>(cwnd, ssthresh, mss);
+    default:
+        return std::make_unique<tcp_reno>(cwnd, ssthresh, mss);
+    }
+}
+
+void tcp_reno::on_ack(uint32_t acked_bytes, uint32_t in_flight) {
+    uint32_t smss = _mss;
+    if (_cwnd < _ssthresh) {
+        // In slow start phase
+        _cwnd += std::min(acked_bytes, smss);
+    } else {
+        // In congestion avoidance phase
+        uint32_t round_up = 1;
+        _cwnd += std::max(round_up, smss * smss / _cwnd);
+    }
+}
+
+void tcp_reno::on_loss(uint32_t flight_size) {
+    uint32_t smss = _mss;
+    _ssthresh = std::max(flight_size / 2, 2 * smss);
+}
+
+constexpr double tcp_cubic::c;
+constexpr double tcp_cubic::beta;
+
+void tcp_cubic::on_ack(uint32_t acked_bytes, uint32_t in_flight) {
+    if (_cwnd < _ssthresh) {
+        return tcp_reno::on_ack(acked_bytes, in_flight);
+    }
+    auto now = clock_type::now();
+    double mss = _mss;
+    double cwnd = _cwnd / mss;
+    if (!_epoch_started) {
+        _epoch_started = true;
+        _epoch_start = now;
+        if (cwnd < _w_max) {
+            _k = std::cbrt((_w_max - cwnd) / c);
+        } else {
+            // No loss yet, or the window grew past the last one
+            _k = 0;
+            _w_max = cwnd;
+        }
+        _w_est = cwnd;
+    }
+    // RFC8312 4.1: aim at the window W_cubic(t + RTT) ...
+    auto t = std::chrono::duration<double>(now - _epoch_start + _srtt).count();
+    auto target = c * std::pow(t - _k, 3) + _w_max;
+    // ... unless Reno would do better (4.2: TCP friendly region)
+    _w_est += 3 * (1 - beta) / (1 + beta) * (acked_bytes / mss) / cwnd;
+    target = std::max(target, _w_est);
+    // 4.3, 4.4: grow by (target - cwnd) / cwnd per acked segment
+    target = std::min(target, 1.5 * cwnd);
+    if (target > cwnd) {
+        _cwnd += std::max(1u, uint32_t((target - cwnd) / cwnd * acked_bytes));
+    }
+}
+
+void tcp_cubic::on_loss(uint32_t flight_size) {
+    double cwnd = double(std::min(_cwnd, flight_size)) / _mss;
+    // RFC8312 4.6: fast convergence, release bandwidth to new flows
+    if (cwnd < _w_last_max) {
+        _w_last_max = cwnd;
+        _w_max = cwnd * (1 + beta) / 2;
+    } else {
+        _w_last_max = cwnd;
+        _w_max = cwnd;
+    }
+    _epoch_started = false;
+    uint32_t smss = _mss;
+    _ssthresh = std::max(uint32_t(cwnd * beta * smss), 2 * smss);
+}
+
+void tcp_cubic::on_rtt_sample(std::chrono::microseconds rtt) {
+    _srtt = _srtt.count() ? (_srtt * 7 + rtt) / 8 : rtt;
+}
+
+constexpr double tcp_bbr::high_gain;
+constexpr unsigned tcp_bbr::bw_window_rounds;
+constexpr unsigned tcp_bbr::nr_cycle_gains;
+constexpr double tcp_bbr::cycle_gains[];
+constexpr std::chrono::seconds tcp_bbr::min_rtt_window;
+constexpr std::chrono::milliseconds tcp_bbr::probe_rtt_duration;
+
+uint32_t tcp_bbr::bdp(double gain) const {
+    uint64_t min_cwnd = 4 * _mss;
+    if (!_btl_bw || _min_rtt == std::chrono::microseconds::max()) {
+        return min_cwnd;
+    }
+    auto bdp = uint64_t(gain * _btl_bw * _min_rtt.count() / 1000000);
+    return std::min<uint64_t>(std::max(bdp, min_cwnd), std::numeric_limits<uint32_t>::max());
+}
+
+void tcp_bbr::enter_probe_bw() {
+    _mode = mode::probe_bw;
+    _cwnd_gain = 2;
+    // Start cruising; the cycle probes for more bandwidth, then drains the
+    // queue it may have created.
+    _cycle_index = 2;
+    _pacing_gain = cycle_gains[_cycle_index];
+}
+
+void tcp_bbr::end_round(rtt_clock::time_point now, std::chrono::microseconds elapsed) {
+    _bw_samples[_round++ % bw_window_rounds] = _round_delivered * 1000000 / std::max<int64_t>(elapsed.count(), 1);
+    _btl_bw = *std::max_element(_bw_samples.begin(), _bw_samples.end());
+    _round_start = now;
+    _round_delivered = 0;
+    if (!_full_bw_reached) {
+        if (_btl_bw >= _full_bw * 5 / 4) {
+            _full_bw = _btl_bw;
+            _full_bw_rounds = 0;
+        } else if (++_full_bw_rounds >= 3) {
+            _full_bw_reached = true;
+            if (_mode == mode::startup) {
+                // Drain the queue built during startup
+                _mode = mode::drain;
+                _pacing_gain = 1 / high_gain;
+            }
+        }
+    }
+    if (_mode == mode::probe_bw) {
+        _cycle_index = (_cycle_index + 1) % nr_cycle_gains;
+        _pacing_gain = cycle_gains[_cycle_index];
+    }
+}
+
+void tcp_bbr::on_ack(uint32_t acked_bytes, uint32_t in_flight) {
+    auto now = rtt_clock::now();
+    if (!_round_started) {
+        _round_started = true;
+        _round_start = now;
+    }
+    _round_delivered += acked_bytes;
+    // A round lasts the minimum RTT, once there is a sample of it
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - _round_start);
+    if (_min_rtt != std::chrono::microseconds::max() && elapsed >= _min_rtt) {
+        end_round(now, elapsed);
+    }
+    switch (_mode) {
+    case mode::drain:
+        if (in_flight <= bdp(1)) {
+            enter_probe_bw();
+        }
+        break;
+    case mode::probe_rtt:
+        if (now >= _probe_rtt_done) {
+            _min_rtt_stamp = now;
+            if (_full_bw_reached) {
+                enter_probe_bw();
+            } else {
+                _mode = mode::startup;
+                _pacing_gain = _cwnd_gain = high_gain;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    uint32_t min_cwnd = 4 * _mss;
+    if (_mode == mode::probe_rtt) {
+        _cwnd = min_cwnd;
+        return;
+    }
+    auto target = bdp(_cwnd_gain);
+    if (_full_bw_reached) {
+        _cwnd = std::min(_cwnd + acked_bytes, target);
+    } else if (_cwnd < target || !_btl_bw) {
+        _cwnd += acked_bytes;
+    }
+    _cwnd = std::max(_cwnd, min_cwnd);
+}
+
+void tcp_bbr::on_loss(uint32_t flight_size) {
+    // Losses do not change the model; on leaving recovery, the tcb sets
+    // cwnd to what is in flight, after which on_ack() restores it.
+    _ssthresh = std::max(_cwnd, uint32_t(4 * _mss));
+}
+
+void tcp_bbr::on_rtt_sample(std::chrono::microseconds rtt) {
+    auto now = rtt_clock::now();
+    bool expired = _min_rtt != std::chrono::microseconds::max() && now - _min_rtt_stamp > min_rtt_window;
+    if (rtt <= _min_rtt || expired) {
+        _min_rtt = rtt;
+        _min_rtt_stamp = now;
+    }
+    if (expired && _mode != mode::probe_rtt) {
+        // Drain the path to (re)measure the propagation delay
+        _mode = mode::probe_rtt;
+        _pacing_gain = 1;
+        _probe_rtt_done = now + probe_rtt_duration;
+    }
+}
+
+uint64_t tcp_bbr::pacing_rate() const {
+    return _pacing_gain * _btl_bw;
+}
+
 ipv4_tcp::ipv4_tcp(ipv4& inet)
 	: _inet_l4(inet), _tcp(std::make_unique<tcp<ipv4_traits>>(_inet_l4)) {
 }
@@ -140,6 +410,10 @@ void ipv4_tcp::received(packet p, ipv4_address from, ipv4_address to) {
     _tcp->received(std::move(p), from, to);
 }
 
+void ipv4_tcp::prefetch(uint32_t rss_hash) {
+    _tcp->prefetch(rss_hash);
+}
+
 bool ipv4_tcp::forward(forward_hash& out_hash_data, packet& p, size_t off) {
 
     return _tcp->forward(out_hash_data, p, off);
@@ -159,5 +433,44 @@ tcpv4_connect(tcp<ipv4_traits>& tcpv4, socket_address sa) {
     });
 }
 
+void
+tcpv4_set_rto_min(tcp<ipv4_traits>& tcpv4, std::chrono::milliseconds rto_min) {
+    tcpv4.set_rto_min(rto_min);
+}
+
+ipv6_tcp::ipv6_tcp(ipv6& inet)
+    : _inet_l4(inet), _tcp(std::make_unique<tcp<ipv6_traits>>(_inet_l4)) {
+}
+
+ipv6_tcp::~ipv6_tcp() {
+}
+
+void ipv6_tcp::received(packet p, ipv6_address from, ipv6_address to, uint8_t hop_limit) {
+    _tcp->received(std::move(p), from, to);
+}
+
+bool ipv6_tcp::forward(forward_hash& out_hash_data, packet& p, size_t off) {
+    return _tcp->forward(out_hash_data, p, off);
+}
+
+server_socket
+tcpv6_listen(tcp<ipv6_traits>& tcpv6, uint16_t port, listen_options opts) {
+    return server_socket(std::make_unique<native_server_socket_impl<tcp<ipv6_traits>>>(
+            tcpv6, port, opts));
+}
+
+future<connected_socket>
+tcpv6_connect(tcp<ipv6_traits>& tcpv6, socket_address sa) {
+    return tcpv6.connect(sa).then([] (tcp<ipv6_traits>::connection conn) mutable {
+        std::unique_ptr<connected_socket_impl> csi(new native_connected_socket_impl<tcp<ipv6_traits>>(std::move(conn)));
+        return make_ready_future<connected_socket>(connected_socket(std::move(csi)));
+    });
+}
+
+void
+tcpv6_set_rto_min(tcp<ipv6_traits>& tcpv6, std::chrono::milliseconds rto_min) {
+    tcpv6.set_rto_min(rto_min);
+}
+
 }
 
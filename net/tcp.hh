@@ -26,15 +26,19 @@
 #include "core/queue.hh"
 #include "core/semaphore.hh"
 #include "core/print.hh"
+#include "core/memory.hh"
 #include "net.hh"
 #include "ip_checksum.hh"
 #include "ip.hh"
 #include "const.hh"
 #include "packet-util.hh"
+#include "flow_table.hh"
 #include <unordered_map>
 #include <map>
+#include <algorithm>
 #include <functional>
 #include <deque>
+#include <array>
 #include <chrono>
 #include <experimental/optional>
 #include <random>
@@ -91,10 +95,40 @@ void tcp_debug(const char* fmt, Args&&... args) {
 #endif
 }
 
+struct tcp_seq {
+    uint32_t raw;
+};
+
+inline tcp_seq ntoh(tcp_seq s) {
+    return tcp_seq { ntoh(s.raw) };
+}
+
+inline tcp_seq hton(tcp_seq s) {
+    return tcp_seq { hton(s.raw) };
+}
+
+inline
+std::ostream& operator<<(std::ostream& os, tcp_seq s) {
+    return os << s.raw;
+}
+
+inline tcp_seq make_seq(uint32_t raw) { return tcp_seq{raw}; }
+inline tcp_seq& operator+=(tcp_seq& s, int32_t n) { s.raw += n; return s; }
+inline tcp_seq& operator-=(tcp_seq& s, int32_t n) { s.raw -= n; return s; }
+inline tcp_seq operator+(tcp_seq s, int32_t n) { return s += n; }
+inline tcp_seq operator-(tcp_seq s, int32_t n) { return s -= n; }
+inline int32_t operator-(tcp_seq s, tcp_seq q) { return s.raw - q.raw; }
+inline bool operator==(tcp_seq s, tcp_seq q)  { return s.raw == q.raw; }
+inline bool operator!=(tcp_seq s, tcp_seq q) { return !(s == q); }
+inline bool operator<(tcp_seq s, tcp_seq q) { return s - q < 0; }
+inline bool operator>(tcp_seq s, tcp_seq q) { return q < s; }
+inline bool operator<=(tcp_seq s, tcp_seq q) { return !(s > q); }
+inline bool operator>=(tcp_seq s, tcp_seq q) { return !(s < q); }
+
 struct tcp_option {
     // The kind and len field are fixed and defined in TCP protocol
-    enum class option_kind: uint8_t { mss = 2, win_scale = 3, sack = 4, timestamps = 8,  nop = 1, eol = 0 };
-    enum class option_len:  uint8_t { mss = 4, win_scale = 3, sack = 2, timestamps = 10, nop = 1, eol = 1 };
+    enum class option_kind: uint8_t { mss = 2, win_scale = 3, sack = 4, sack_blocks = 5, timestamps = 8,  nop = 1, eol = 0 };
+    enum class option_len:  uint8_t { mss = 4, win_scale = 3, sack = 2, sack_blocks = 2, timestamps = 10, nop = 1, eol = 1 };
     struct mss {
         option_kind kind = option_kind::mss;
         option_len len = option_len::mss;
@@ -111,6 +145,17 @@ struct tcp_option {
         option_kind kind = option_kind::sack;
         option_len len = option_len::sack;
     } __attribute__((packed));
+    // RFC2018: followed by len - 2 bytes of sack_edges
+    struct sack_blocks {
+        option_kind kind = option_kind::sack_blocks;
+        option_len len = option_len::sack_blocks;
+    } __attribute__((packed));
+    struct sack_edges {
+        packed<tcp_seq> left;
+        packed<tcp_seq> right;
+        template <typename Adjuster>
+        void adjust_endianness(Adjuster a) { a(left, right); }
+    } __attribute__((packed));
     struct timestamps {
         option_kind kind = option_kind::timestamps;
         option_len len = option_len::timestamps;
@@ -127,9 +172,14 @@ struct tcp_option {
     } __attribute__((packed));
     static const uint8_t align = 4;
 
-    void parse(uint8_t* beg, uint8_t* end);
+    // Options which are negotiated are only recorded as received from a
+    // SYN segment (syn == true)
+    void parse(uint8_t* beg, uint8_t* end, bool syn = true);
     uint8_t fill(tcp_hdr* th, uint8_t option_size);
     uint8_t get_size(bool syn_on, bool ack_on);
+    bool timestamps_on(bool syn_on, bool ack_on) {
+        return _timestamps_received || (syn_on && !ack_on);
+    }
 
     // For option negotiattion
     bool _mss_received = false;
@@ -142,40 +192,31 @@ struct tcp_option {
     uint16_t _local_mss;
     uint8_t _remote_win_scale = 0;
     uint8_t _local_win_scale = 0;
+
+    // RFC7323 timestamps (TSval, TSecr) of the last parsed segment, if it
+    // had them, and to be sent in the next one
+    bool _remote_ts_present = false;
+    uint32_t _remote_ts_val = 0;
+    uint32_t _remote_ts_ecr = 0;
+    uint32_t _local_ts_val = 0;
+    uint32_t _local_ts_ecr = 0;
+
+    // SACK blocks, [start, end), received in the last parsed segment and to
+    // be sent in the next one.  Four blocks fill the 40 bytes of option space,
+    // three when the timestamps are sent as well.
+    struct sack_block {
+        tcp_seq start;
+        tcp_seq end;
+    };
+    static constexpr unsigned max_sack_blocks = 4;
+    std::array<sack_block, max_sack_blocks> _remote_sack;
+    uint8_t _nr_remote_sack = 0;
+    std::array<sack_block, max_sack_blocks> _local_sack;
+    uint8_t _nr_local_sack = 0;
 };
 inline uint8_t*& operator+=(uint8_t*& x, tcp_option::option_len len) { x += uint8_t(len); return x; }
 inline uint8_t& operator+=(uint8_t& x, tcp_option::option_len len) { x += uint8_t(len); return x; }
 
-struct tcp_seq {
-    uint32_t raw;
-};
-
-inline tcp_seq ntoh(tcp_seq s) {
-    return tcp_seq { ntoh(s.raw) };
-}
-
-inline tcp_seq hton(tcp_seq s) {
-    return tcp_seq { hton(s.raw) };
-}
-
-inline
-std::ostream& operator<<(std::ostream& os, tcp_seq s) {
-    return os << s.raw;
-}
-
-inline tcp_seq make_seq(uint32_t raw) { return tcp_seq{raw}; }
-inline tcp_seq& operator+=(tcp_seq& s, int32_t n) { s.raw += n; return s; }
-inline tcp_seq& operator-=(tcp_seq& s, int32_t n) { s.raw -= n; return s; }
-inline tcp_seq operator+(tcp_seq s, int32_t n) { return s += n; }
-inline tcp_seq operator-(tcp_seq s, int32_t n) { return s -= n; }
-inline int32_t operator-(tcp_seq s, tcp_seq q) { return s.raw - q.raw; }
-inline bool operator==(tcp_seq s, tcp_seq q)  { return s.raw == q.raw; }
-inline bool operator!=(tcp_seq s, tcp_seq q) { return !(s == q); }
-inline bool operator<(tcp_seq s, tcp_seq q) { return s - q < 0; }
-inline bool operator>(tcp_seq s, tcp_seq q) { return q < s; }
-inline bool operator<=(tcp_seq s, tcp_seq q) { return !(s > q); }
-inline bool operator>=(tcp_seq s, tcp_seq q) { return !(s < q); }
-
 struct tcp_hdr {
     packed<uint16_t> src_port;
     packed<uint16_t> dst_port;
@@ -201,13 +242,143 @@ struct tcp_hdr {
 struct tcp_tag {};
 using tcp_packet_merger = packet_merger<tcp_seq, tcp_tag>;
 
+// Congestion control algorithm of a connection.  It owns the connection's
+// congestion window and slow start threshold, adjusting them as the tcb
+// reports acknowledged data, RTT samples and losses; the tcb itself only
+// applies the loss recovery rules of RFC5681/RFC6582/RFC6675.
+class tcp_congestion_controller {
+protected:
+    using clock_type = lowres_clock;
+    uint32_t& _cwnd;
+    uint32_t& _ssthresh;
+    const uint16_t& _mss;
+public:
+    tcp_congestion_controller(uint32_t& cwnd, uint32_t& ssthresh, const uint16_t& mss)
+        : _cwnd(cwnd), _ssthresh(ssthresh), _mss(mss) {}
+    virtual ~tcp_congestion_controller() {}
+    // acked_bytes of new data were acknowledged, and in_flight bytes are
+    // still outstanding.
+    virtual void on_ack(uint32_t acked_bytes, uint32_t in_flight) = 0;
+    // A loss was detected, by fast retransmit or the first retransmission
+    // timeout of a segment, with flight_size bytes outstanding.  Sets the
+    // slow start threshold.
+    virtual void on_loss(uint32_t flight_size) = 0;
+    virtual void on_rtt_sample(std::chrono::microseconds rtt) {}
+    // Rate, in bytes per second, to pace transmissions at; 0 if they are
+    // not paced.
+    virtual uint64_t pacing_rate() const { return 0; }
+    static std::unique_ptr<tcp_congestion_controller> make(tcp_congestion_control cc,
+            uint32_t& cwnd, uint32_t& ssthresh, const uint16_t& mss);
+};
+
+// RFC5681 slow start and congestion avoidance
+class tcp_reno : public tcp_congestion_controller {
+public:
+    using tcp_congestion_controller::tcp_congestion_controller;
+    virtual void on_ack(uint32_t acked_bytes, uint32_t in_flight) override;
+    virtual void on_loss(uint32_t flight_size) override;
+};
+
+// RFC8312 CUBIC: in congestion avoidance, the window grows as a cubic
+// function of the time since the last loss, centered on the window at that
+// loss, and independently of the RTT.
+class tcp_cubic : public tcp_reno {
+    static constexpr double c = 0.4;
+    static constexpr double beta = 0.7;
+    // All windows are in segments
+    double _w_max = 0;
+    double _w_last_max = 0;
+    double _k = 0;
+    // TCP friendly (Reno equivalent) window
+    double _w_est = 0;
+    bool _epoch_started = false;
+    clock_type::time_point _epoch_start;
+    std::chrono::microseconds _srtt{0};
+public:
+    using tcp_reno::tcp_reno;
+    virtual void on_ack(uint32_t acked_bytes, uint32_t in_flight) override;
+    virtual void on_loss(uint32_t flight_size) override;
+    virtual void on_rtt_sample(std::chrono::microseconds rtt) override;
+};
+
+// BBR: instead of reacting to losses, estimate the bottleneck bandwidth
+// (windowed maximum of the delivery rate) and the round-trip propagation
+// time (windowed minimum of the RTT), pace at the former, and cap the
+// data in flight at a small multiple of their product.
+class tcp_bbr : public tcp_congestion_controller {
+    // Rounds and delivery rates are timed as precisely as the RTT samples
+    // the model is built from; the low resolution clock's ticks are
+    // longer than datacenter RTTs
+    using rtt_clock = std::chrono::steady_clock;
+    enum class mode { startup, drain, probe_bw, probe_rtt };
+    static constexpr double high_gain = 2.885;
+    static constexpr unsigned bw_window_rounds = 10;
+    static constexpr unsigned nr_cycle_gains = 8;
+    static constexpr double cycle_gains[nr_cycle_gains] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+    static constexpr std::chrono::seconds min_rtt_window{10};
+    static constexpr std::chrono::milliseconds probe_rtt_duration{200};
+    mode _mode = mode::startup;
+    double _pacing_gain = high_gain;
+    double _cwnd_gain = high_gain;
+    // Delivery rate samples (bytes/s) of the last rounds, and their maximum
+    std::array<uint64_t, bw_window_rounds> _bw_samples = {};
+    unsigned _round = 0;
+    uint64_t _btl_bw = 0;
+    std::chrono::microseconds _min_rtt = std::chrono::microseconds::max();
+    rtt_clock::time_point _min_rtt_stamp;
+    // Bytes delivered since the current round started
+    bool _round_started = false;
+    rtt_clock::time_point _round_start;
+    uint64_t _round_delivered = 0;
+    // Startup ends once the bandwidth stops growing by 25% for 3 rounds
+    uint64_t _full_bw = 0;
+    unsigned _full_bw_rounds = 0;
+    bool _full_bw_reached = false;
+    unsigned _cycle_index = 0;
+    rtt_clock::time_point _probe_rtt_done;
+private:
+    uint32_t bdp(double gain) const;
+    void end_round(rtt_clock::time_point now, std::chrono::microseconds elapsed);
+    void enter_probe_bw();
+public:
+    using tcp_congestion_controller::tcp_congestion_controller;
+    virtual void on_ack(uint32_t acked_bytes, uint32_t in_flight) override;
+    virtual void on_loss(uint32_t flight_size) override;
+    virtual void on_rtt_sample(std::chrono::microseconds rtt) override;
+    virtual uint64_t pacing_rate() const override;
+};
+
+// Receive memory of the TCP connections of a shard, IPv4 and IPv6: the
+// data they queued, in order or out of order, that the application has
+// not read yet.  Connections grow their receive buffers only while the
+// shard uses less than half of its limit and memory is not short, and
+// open no new window once it reaches the limit.
+class tcp_receive_memory {
+    size_t _used = 0;
+    size_t _limit = memory::stats().total_memory() / 8;
+    lowres_clock::time_point _low_memory_until;
+public:
+    static tcp_receive_memory& local() {
+        static thread_local tcp_receive_memory m;
+        return m;
+    }
+    void charge(size_t bytes) { _used += bytes; }
+    void uncharge(size_t bytes) { _used -= bytes; }
+    // The system is reclaiming memory: stop growing buffers for a while
+    void low_memory() { _low_memory_until = lowres_clock::now() + std::chrono::seconds(1); }
+    bool may_grow() const { return _used < _limit / 2 && lowres_clock::now() >= _low_memory_until; }
+    bool exhausted() const { return _used >= _limit; }
+    size_t used() const { return _used; }
+    size_t limit() const { return _limit; }
+    void set_limit(size_t limit) { _limit = limit; }
+};
+
 template <typename InetTraits>
 class tcp {
 public:
     using ipaddr = typename InetTraits::address_type;
     using inet_type = typename InetTraits::inet_type;
     using connid = l4connid<InetTraits>;
-    using connid_hash = typename connid::connid_hash;
     class connection;
     class listener;
 private:
@@ -215,6 +386,9 @@ class tcp {
 
     class tcb : public enable_lw_shared_from_this<tcb> {
         using clock_type = lowres_clock;
+        // For RTT samples, which the low resolution clock cannot measure
+        // inside a datacenter
+        using rtt_clock = std::chrono::steady_clock;
         static constexpr tcp_state CLOSED         = tcp_state::CLOSED;
         static constexpr tcp_state LISTEN         = tcp_state::LISTEN;
         static constexpr tcp_state SYN_SENT       = tcp_state::SYN_SENT;
@@ -234,11 +408,18 @@ class tcp {
         ipaddr _foreign_ip;
         uint16_t _local_port;
         uint16_t _foreign_port;
+        // Key of the connection in tcp::_tcbs
+        uint32_t _flow_hash;
         struct unacked_segment {
             packet p;
             uint16_t data_len;
             unsigned nr_transmits;
-            clock_type::time_point tx_time;
+            rtt_clock::time_point tx_time;
+            tcp_seq seq;
+            // Covered by a SACK block from the remote
+            bool sacked = false;
+            // Retransmitted during the current loss recovery
+            bool retransmitted = false;
         };
         struct send {
             tcp_seq unacknowledged;
@@ -261,11 +442,11 @@ class tcp {
             // Limit number of data queued into send queue
             semaphore user_queue_space = {212992};
             // Round-trip time variation
-            std::chrono::milliseconds rttvar;
+            std::chrono::microseconds rttvar;
             // Smoothed round-trip time
-            std::chrono::milliseconds srtt;
+            std::chrono::microseconds srtt;
             bool first_rto_sample = true;
-            clock_type::time_point syn_tx_time;
+            rtt_clock::time_point syn_tx_time;
             // Congestion window
             uint32_t cwnd;
             // Slow start threshold
@@ -278,6 +459,17 @@ class tcp {
             uint32_t partial_ack = 0;
             tcp_seq recover;
             bool window_probe = false;
+            // RFC6675 scoreboard, kept up to date as SACK blocks arrive and
+            // segments are sent, retransmitted and acknowledged: the ranges
+            // SACKed so far, the data in flight (SetPipe()), the end of the
+            // segments deemed lost (IsLost()), the end of the highest SACKed
+            // segment, and where the search for the next segment to
+            // retransmit resumes (NextSeg())
+            std::map<tcp_seq, tcp_seq> sacked;
+            uint32_t pipe = 0;
+            tcp_seq lost_edge;
+            tcp_seq high_sacked;
+            tcp_seq next_hole;
         } _snd;
         struct receive {
             tcp_seq next;
@@ -288,21 +480,58 @@ class tcp {
             tcp_seq initial;
             std::deque<packet> data;
             tcp_packet_merger out_of_order;
+            // Sequence number of the last out of order segment received,
+            // whose block is reported first in the SACK option
+            tcp_seq last_out_of_order;
+            // RFC7323: the timestamp to echo, when it was received, and the
+            // ACK field of the last segment sent
+            uint32_t ts_recent = 0;
+            clock_type::time_point ts_recent_stamp;
+            tcp_seq last_ack_sent;
             std::experimental::optional<promise<>> _data_received_promise;
+            // Bytes in data and in out_of_order, and bytes queued charged
+            // to tcp_receive_memory
+            uint32_t data_len = 0;
+            uint32_t out_of_order_len = 0;
+            uint32_t charged = 0;
+            // Receive buffer, which bounds the window, auto-tuned to what
+            // the application reads per round trip
+            uint32_t buffer;
+            uint32_t consumed = 0;
+            clock_type::time_point consumed_stamp;
+            // Right edge of the window last advertised, which must not
+            // move back (RFC793 3.7)
+            tcp_seq window_edge;
         } _rcv;
         tcp_option _option;
+        std::unique_ptr<tcp_congestion_controller> _cc;
+        // Pacing, at the controller's rate: the bytes that can be sent now,
+        // replenished as the low resolution clock ticks
+        uint32_t _pacing_budget = 0;
+        clock_type::time_point _pacing_stamp;
+        static constexpr std::chrono::milliseconds _pacing_granularity{10};
+        timer<lowres_clock> _pacing;
         timer<lowres_clock> _delayed_ack;
         // Retransmission timeout
         std::chrono::milliseconds _rto{1000};
         std::chrono::milliseconds _persist_time_out{1000};
-        static constexpr std::chrono::milliseconds _rto_min{1000};
         static constexpr std::chrono::milliseconds _rto_max{60000};
         // Clock granularity
         static constexpr std::chrono::milliseconds _rto_clk_granularity{1};
         static constexpr uint16_t _max_nr_retransmit{5};
+        // Receive buffer bounds, as Linux's default tcp_rmem
+        static constexpr uint32_t _rcv_buffer_initial{128 * 1024};
+        static constexpr uint32_t _rcv_buffer_max{6 * 1024 * 1024};
+        // RFC7323 5.5: TS.Recent is too old for PAWS after 24 days idle
+        static constexpr std::chrono::hours _paws_idle{24 * 24};
+        // Random offset of our timestamp clock (RFC7323 5.4)
+        uint32_t _ts_offset;
         timer<lowres_clock> _retransmit;
         timer<lowres_clock> _persist;
         uint16_t _nr_full_seg_received = 0;
+        // Segments retransmitted and retransmission timer expirations
+        uint64_t _nr_retransmits = 0;
+        uint64_t _nr_timeouts = 0;
         struct isn_secret {
             // 512 bits secretkey for ISN generating
             uint32_t key[16];
@@ -320,11 +549,13 @@ class tcp {
         circular_buffer<typename InetTraits::l4packet> _packetq;
         bool _poll_active = false;
     public:
-        tcb(tcp& t, connid id);
+        tcb(tcp& t, connid id, uint32_t flow_hash);
+        ~tcb();
         void input_handle_listen_state(tcp_hdr* th, packet p);
+        void input_handle_syn_cookie(tcp_hdr* th, uint16_t mss, packet p);
         void input_handle_syn_sent_state(tcp_hdr* th, packet p);
         void input_handle_other_state(tcp_hdr* th, packet p);
-        void output_one(bool data_retransmit = false);
+        void output_one(unacked_segment* retransmit = nullptr);
         future<> wait_for_data();
         void abort_reader();
         future<> wait_for_all_data_acked();
@@ -332,9 +563,35 @@ class tcp {
         void connect();
         packet read();
         void close();
+        void set_congestion_control(tcp_congestion_control cc) {
+            _cc = tcp_congestion_controller::make(cc, _snd.cwnd, _snd.ssthresh, _snd.mss);
+        }
+        // Discards the out-of-order data, which the peer will retransmit;
+        // returns the bytes freed
+        uint32_t prune_out_of_order();
+        tcp_connection_info get_tcp_info() {
+            tcp_connection_info info;
+            // No round trip measured yet
+            if (!_snd.first_rto_sample) {
+                info.srtt = _snd.srtt;
+                info.rttvar = _snd.rttvar;
+            }
+            info.rto = _rto;
+            info.snd_mss = _snd.mss;
+            info.rcv_mss = _rcv.mss;
+            info.snd_cwnd = _snd.cwnd;
+            info.snd_ssthresh = _snd.ssthresh;
+            info.snd_wnd = _snd.window;
+            info.rcv_wnd = _rcv.window;
+            info.bytes_in_flight = flight_size();
+            info.bytes_unsent = _snd.unsent_len;
+            info.retransmits = _nr_retransmits;
+            info.timeouts = _nr_timeouts;
+            return info;
+        }
         void remove_from_tcbs() {
             auto id = connid{_local_ip, _foreign_ip, _local_port, _foreign_port};
-            _tcp._tcbs.erase(id);
+            _tcp._tcbs.erase(id, _flow_hash);
         }
         std::experimental::optional<typename InetTraits::l4packet> get_packet();
         void output() {
@@ -368,12 +625,25 @@ class tcp {
         bool merge_out_of_order();
         void insert_out_of_order(tcp_seq seq, packet p);
         void trim_receive_data_after_window();
+        void init_receive_window();
+        void update_receive_window();
+        void adjust_receive_buffer(uint32_t consumed);
         bool should_send_ack(uint16_t seg_len);
         void clear_delayed_ack();
-        packet get_transmit_packet();
+        packet get_transmit_packet(uint8_t options_size);
         void retransmit_one() {
-            bool data_retransmit = true;
-            output_one(data_retransmit);
+            retransmit_one(_snd.data.front());
+        }
+        void mark_retransmitted(unacked_segment& seg) {
+            if (!seg.retransmitted && !seg.sacked) {
+                _snd.pipe += seg.p.len();
+            }
+            seg.retransmitted = true;
+        }
+        void retransmit_one(unacked_segment& seg) {
+            ++_nr_retransmits;
+            ++_tcp._stats.retransmits;
+            output_one(&seg);
         }
         void start_retransmit_timer() {
             auto now = clock_type::now();
@@ -400,7 +670,7 @@ class tcp {
         void persist();
         void retransmit();
         void fast_retransmit();
-        void update_rto(clock_type::time_point tx_time);
+        void update_rto(rtt_clock::duration rtt);
         void update_cwnd(uint32_t acked_bytes);
         void cleanup();
         uint32_t can_send() {
@@ -411,6 +681,15 @@ class tcp {
             auto x = std::min(uint32_t(_snd.unacknowledged + _snd.window - _snd.next), _snd.unsent_len);
             // Can not send more than congestion window allows
             x = std::min(_snd.cwnd, x);
+            // Nor faster than the pacing rate
+            auto budget = pacing_budget();
+            if (x && budget < std::min(x, uint32_t(_snd.mss))) {
+                if (!_pacing.armed()) {
+                    _pacing.arm(_pacing_granularity);
+                }
+                return 0;
+            }
+            x = std::min(budget, x);
             if (_snd.dupacks == 1 || _snd.dupacks == 2) {
                 // RFC5681 Step 3.1
                 // Send cwnd + 2 * smss per RFC3042
@@ -419,12 +698,35 @@ class tcp {
                 x = flight <= max ? std::min(x, max - flight) : 0;
                 _snd.limited_transfer += x;
             } else if (_snd.dupacks >= 3) {
-                // RFC5681 Step 3.5
-                // Sent 1 full-sized segment at most
-                x = std::min(uint32_t(_snd.mss), x);
+                if (sack_enabled()) {
+                    // RFC6675: send as long as the data in flight is below cwnd
+                    auto pipe = _snd.pipe;
+                    x = pipe < _snd.cwnd ? std::min(x, _snd.cwnd - pipe) : 0;
+                } else {
+                    // RFC5681 Step 3.5
+                    // Sent 1 full-sized segment at most
+                    x = std::min(uint32_t(_snd.mss), x);
+                }
             }
             return x;
         }
+        uint32_t pacing_budget() {
+            auto rate = _cc->pacing_rate();
+            if (!rate) {
+                return std::numeric_limits<uint32_t>::max();
+            }
+            auto now = clock_type::now();
+            auto elapsed = std::min(std::chrono::duration_cast<std::chrono::milliseconds>(now - _pacing_stamp),
+                    std::chrono::milliseconds(1000));
+            _pacing_stamp = now;
+            // Allow bursts of up to two clock ticks' worth
+            auto burst = std::max<uint64_t>(2 * _snd.mss, rate * 2 * _pacing_granularity.count() / 1000);
+            _pacing_budget = std::min<uint64_t>(burst, _pacing_budget + rate * elapsed.count() / 1000);
+            return _pacing_budget;
+        }
+        void consume_pacing_budget(uint32_t len) {
+            _pacing_budget -= std::min(_pacing_budget, len);
+        }
         uint32_t flight_size() {
             uint32_t size = 0;
             std::for_each(_snd.data.begin(), _snd.data.end(), [&] (unacked_segment& seg) { size += seg.p.len(); });
@@ -450,19 +752,19 @@ class tcp {
         }
         void do_syn_sent() {
             _state = SYN_SENT;
-            _snd.syn_tx_time = clock_type::now();
+            _snd.syn_tx_time = rtt_clock::now();
             // Send <SYN> to remote
             output();
         }
         void do_syn_received() {
             _state = SYN_RECEIVED;
-            _snd.syn_tx_time = clock_type::now();
+            _snd.syn_tx_time = rtt_clock::now();
             // Send <SYN,ACK> to remote
             output();
         }
         void do_established() {
             _state = ESTABLISHED;
-            update_rto(_snd.syn_tx_time);
+            update_rto(rtt_clock::now() - _snd.syn_tx_time);
             _connect_done.set_value();
         }
         void do_reset() {
@@ -493,6 +795,7 @@ class tcp {
             _snd.unacknowledged = _snd.initial;
             _snd.next = _snd.initial + 1;
             _snd.recover = _snd.initial;
+            reset_scoreboard();
         }
         void do_local_fin_acked() {
             _snd.unacknowledged += 1;
@@ -519,22 +822,77 @@ class tcp {
             _snd.limited_transfer = 0;
             _snd.partial_ack = 0;
         }
+        bool sack_enabled() {
+            return _option._sack_received;
+        }
+        bool timestamps_enabled() {
+            return _option._timestamps_received;
+        }
+        // Timestamp clock, ticking every millisecond
+        uint32_t ts_now() {
+            using namespace std::chrono;
+            return duration_cast<milliseconds>(rtt_clock::now().time_since_epoch()).count() + _ts_offset;
+        }
+        // Bytes of seg, from its first byte, that count in the pipe
+        uint32_t pipe_share(const unacked_segment& seg, uint32_t len) {
+            if (seg.sacked) {
+                return 0;
+            }
+            return (seg.seq < _snd.lost_edge ? 0 : len) + (seg.retransmitted ? len : 0);
+        }
+        // First segment of the scoreboard ending after seq
+        typename std::deque<unacked_segment>::iterator segment_after(tcp_seq seq) {
+            return std::partition_point(_snd.data.begin(), _snd.data.end(), [seq] (const unacked_segment& seg) {
+                return seg.seq + seg.p.len() <= seq;
+            });
+        }
+        void reset_scoreboard() {
+            _snd.sacked.clear();
+            _snd.pipe = flight_size();
+            _snd.lost_edge = _snd.unacknowledged;
+            _snd.high_sacked = _snd.unacknowledged;
+            _snd.next_hole = _snd.unacknowledged;
+        }
+        void mark_sacked(tcp_seq from, tcp_seq to, tcp_seq start, tcp_seq end);
+        void update_lost_edge();
+        unacked_segment* sack_next_hole();
+        void update_scoreboard();
+        void update_local_sack_blocks(bool syn_on);
         uint32_t data_segment_acked(tcp_seq seg_ack);
         bool segment_acceptable(tcp_seq seg_seq, unsigned seg_len);
         void init_from_options(tcp_hdr* th, uint8_t* opt_start, uint8_t* opt_end);
         friend class connection;
     };
     inet_type& _inet;
-    std::unordered_map<connid, lw_shared_ptr<tcb>, connid_hash> _tcbs;
+    flow_table<connid, lw_shared_ptr<tcb>> _tcbs;
     std::unordered_map<uint16_t, listener*> _listening;
     std::random_device _rd;
     std::default_random_engine _e;
     std::uniform_int_distribution<uint16_t> _port_dist{41952, 65535};
     circular_buffer<std::pair<lw_shared_ptr<tcb>, ethernet_address>> _poll_tcbs;
     // queue for packets that do not belong to any tcb
-    circular_buffer<ipv4_traits::l4packet> _packetq;
+    circular_buffer<typename InetTraits::l4packet> _packetq;
     semaphore _queue_space = {212992};
+    // Lower bound of the retransmission timeout.  RFC6298 asks for one
+    // second, which is hundreds of round trips inside a datacenter.
+    std::chrono::milliseconds _rto_min{200};
+    // SYN cookies (RFC4987): when a listener's backlog is full, SYNs are
+    // answered with an ISN encoding the connection instead of a tcb.  From
+    // the most significant bit: a 64 second counter (5 bits), the index of
+    // the remote MSS in _syn_cookie_mss (3 bits), and a keyed hash of the
+    // connection and counter (24 bits).
+    static constexpr uint16_t _syn_cookie_mss[] = { 536, 1300, 1440, 1460, 4312, 8960 };
+    uint32_t _syn_cookie_secret[16];
+    // Events of all the connections of this shard
+    struct stats {
+        uint64_t retransmits = 0;
+        uint64_t timeouts = 0;
+        uint64_t fast_retransmits = 0;
+        uint64_t out_of_order = 0;
+        uint64_t zero_windows = 0;
+    } _stats;
     scollectd::registrations _collectd_regs;
+    memory::reclaimer _reclaimer{[this] { return reclaim(); }};
 public:
     class connection {
         lw_shared_ptr<tcb> _tcb;
@@ -562,6 +920,12 @@ class tcp {
         packet read() {
             return _tcb->read();
         }
+        void set_congestion_control(tcp_congestion_control cc) {
+            _tcb->set_congestion_control(cc);
+        }
+        tcp_connection_info get_tcp_info() const {
+            return _tcb->get_tcp_info();
+        }
         void close_read();
         void close_write();
     };
@@ -569,14 +933,15 @@ class tcp {
         tcp& _tcp;
         uint16_t _port;
         queue<connection> _q;
+        tcp_congestion_control _congestion_control;
     private:
-        listener(tcp& t, uint16_t port, size_t queue_length)
-            : _tcp(t), _port(port), _q(queue_length) {
+        listener(tcp& t, uint16_t port, size_t queue_length, tcp_congestion_control cc)
+            : _tcp(t), _port(port), _q(queue_length), _congestion_control(cc) {
             _tcp._listening.emplace(_port, this);
         }
     public:
         listener(listener&& x)
-            : _tcp(x._tcp), _port(x._port), _q(std::move(x._q)) {
+            : _tcp(x._tcp), _port(x._port), _q(std::move(x._q)), _congestion_control(x._congestion_control) {
             _tcp._listening[_port] = this;
             x._port = 0;
         }
@@ -598,14 +963,35 @@ class tcp {
 public:
     explicit tcp(inet_type& inet);
     void received(packet p, ipaddr from, ipaddr to);
+    // Warm the connection lookup of a packet with this RSS hash
+    void prefetch(uint32_t rss_hash) const { _tcbs.prefetch(rss_hash); }
     bool forward(forward_hash& out_hash_data, packet& p, size_t off);
-    listener listen(uint16_t port, size_t queue_length = 100);
+    listener listen(uint16_t port, size_t queue_length = 100,
+            tcp_congestion_control cc = tcp_congestion_control::stack_default);
     future<connection> connect(socket_address sa);
     const net::hw_features& hw_features() const { return _inet._inet.hw_features(); }
     future<> poll_tcb(ipaddr to, lw_shared_ptr<tcb> tcb);
+    void set_rto_min(std::chrono::milliseconds rto_min) { _rto_min = rto_min; }
 private:
     void send_packet_without_tcb(ipaddr from, ipaddr to, packet p);
+    void send_segment_without_tcb(ipaddr local_ip, ipaddr foreign_ip, packet p, uint8_t hdr_len);
     void respond_with_reset(tcp_hdr* rth, ipaddr local_ip, ipaddr foreign_ip);
+    // Hash of a connection under the device's RSS key.  Reuses the RSS hash
+    // of the received packet when the NIC or the software RSS path computed
+    // it, over the same tuple unless the packet is a reassembled datagram.
+    uint32_t flow_hash(connid& id, packet& p) {
+        auto rss = p.rss_hash();
+        if (rss && !p.offload_info_ref().reassembled) {
+            return *rss;
+        }
+        return id.hash(_inet._inet.netif()->rss_table());
+    }
+    memory::reclaiming_result reclaim();
+    static uint32_t syn_cookie_count();
+    uint32_t syn_cookie_hash(const connid& id, uint32_t count);
+    void send_syn_cookie(tcp_hdr* rth, const connid& id, packet& p);
+    // The remote MSS encoded in the cookie acknowledged by th, if valid
+    std::experimental::optional<uint16_t> check_syn_cookie(tcp_hdr* th, const connid& id);
     friend class listener;
 };
 
@@ -618,13 +1004,50 @@ tcp<InetTraits>::tcp(inet_type& inet)
         // Linearized events: DERIVE:0:u
         //
         scollectd::add_polled_metric(scollectd::type_instance_id(
-              "tcp"
+              InetTraits::tcp_plugin()
             , scollectd::per_cpu_plugin_instance
             , "total_operations", "linearizations")
             , scollectd::make_typed(scollectd::data_type::DERIVE
             , [] { return tcp_packet_merger::linearizations(); })
         ),
+        //
+        // Loss recovery and flow control events: DERIVE:0:u
+        //
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              InetTraits::tcp_plugin()
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "retransmits")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.retransmits)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              InetTraits::tcp_plugin()
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "timeouts")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.timeouts)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              InetTraits::tcp_plugin()
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "fast-retransmits")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.fast_retransmits)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              InetTraits::tcp_plugin()
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "out-of-order")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.out_of_order)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              InetTraits::tcp_plugin()
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "zero-windows")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _stats.zero_windows)
+        ),
     }) {
+    std::uniform_int_distribution<uint32_t> dist;
+    for (auto& k : _syn_cookie_secret) {
+        k = dist(_e);
+    }
     _inet.register_packet_provider([this, tcb_polled = 0u] () mutable {
         std::experimental::optional<typename InetTraits::l4packet> l4p;
         auto c = _poll_tcbs.size();
@@ -658,26 +1081,28 @@ future<> tcp<InetTraits>::poll_tcb(ipaddr to, lw_shared_ptr<tcb> tcb) {
 }
 
 template <typename InetTraits>
-auto tcp<InetTraits>::listen(uint16_t port, size_t queue_length) -> listener {
-    return listener(*this, port, queue_length);
+auto tcp<InetTraits>::listen(uint16_t port, size_t queue_length, tcp_congestion_control cc) -> listener {
+    return listener(*this, port, queue_length, cc);
 }
 
 template <typename InetTraits>
 future<typename tcp<InetTraits>::connection> tcp<InetTraits>::connect(socket_address sa) {
     uint16_t src_port;
     connid id;
-    auto src_ip = _inet._inet.host_address();
-    auto dst_ip = ipv4_address(sa);
-    auto dst_port = net::ntoh(sa.u.in.sin_port);
+    uint32_t hash;
+    auto dst_ip = InetTraits::socket_address_ip(sa);
+    auto dst_port = InetTraits::socket_address_port(sa);
+    auto src_ip = _inet._inet.source_address(dst_ip);
 
     do {
         src_port = _port_dist(_e);
         id = connid{src_ip, dst_ip, src_port, dst_port};
-    } while (_inet._inet.netif()->hash2cpu(id.hash(_inet._inet.netif()->rss_key())) != engine().cpu_id()
-            || _tcbs.find(id) != _tcbs.end());
+        hash = id.hash(_inet._inet.netif()->rss_table());
+    } while (_inet._inet.netif()->hash2cpu(hash) != engine().cpu_id()
+            || _tcbs.find(id, hash));
 
-    auto tcbp = make_lw_shared<tcb>(*this, id);
-    _tcbs.insert({id, tcbp});
+    auto tcbp = make_lw_shared<tcb>(*this, id, hash);
+    _tcbs.insert(id, hash, tcbp);
     tcbp->connect();
 
     return tcbp->connect_done().then([tcbp] {
@@ -706,7 +1131,7 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
         return;
     }
 
-    if (!hw_features().rx_csum_offload) {
+    if (!hw_features().rx_csum_offload && !p.offload_info_ref().l4_csum_verified) {
         checksummer csum;
         InetTraits::tcp_pseudo_header_checksum(csum, from, to, p.len());
         csum.sum(p);
@@ -716,11 +1141,12 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
     }
     auto h = ntoh(*th);
     auto id = connid{to, from, h.dst_port, h.src_port};
-    auto tcbi = _tcbs.find(id);
+    auto hash = flow_hash(id, p);
+    auto tcbi = _tcbs.find(id, hash);
     lw_shared_ptr<tcb> tcbp;
-    if (tcbi == _tcbs.end()) {
+    if (!tcbi) {
         auto listener = _listening.find(id.local_port);
-        if (listener == _listening.end() || listener->second->_q.full()) {
+        if (listener == _listening.end()) {
             // 1) In CLOSE state
             // 1.1 all data in the incoming segment is discarded.  An incoming
             // segment containing a RST is discarded. An incoming segment not
@@ -738,8 +1164,21 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
             }
             // 2.2 second check for an ACK
             if (h.f_ack) {
-                // Any acknowledgment is bad if it arrives on a connection
-                // still in the LISTEN state.
+                // Unless it completes a handshake answered with a SYN
+                // cookie, any acknowledgment is bad if it arrives on a
+                // connection still in the LISTEN state.
+                auto mss = h.f_syn ? std::experimental::optional<uint16_t>() : check_syn_cookie(&h, id);
+                if (mss) {
+                    if (listener->second->_q.full()) {
+                        // The remote will retransmit
+                        return;
+                    }
+                    tcbp = make_lw_shared<tcb>(*this, id, hash);
+                    tcbp->set_congestion_control(listener->second->_congestion_control);
+                    listener->second->_q.push(connection(tcbp));
+                    _tcbs.insert(id, hash, tcbp);
+                    return tcbp->input_handle_syn_cookie(&h, *mss, std::move(p));
+                }
                 // <SEQ=SEG.ACK><CTL=RST>
                 return respond_with_reset(&h, id.local_ip, id.foreign_ip);
             }
@@ -747,9 +1186,15 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
             if (h.f_syn) {
                 // check the security
                 // NOTE: Ignored for now
-                tcbp = make_lw_shared<tcb>(*this, id);
+                if (listener->second->_q.full()) {
+                    // Backlog overflow, as under a SYN flood: do not
+                    // allocate anything until the handshake completes
+                    return send_syn_cookie(&h, id, p);
+                }
+                tcbp = make_lw_shared<tcb>(*this, id, hash);
+                tcbp->set_congestion_control(listener->second->_congestion_control);
                 listener->second->_q.push(connection(tcbp));
-                _tcbs.insert({id, tcbp});
+                _tcbs.insert(id, hash, tcbp);
                 return tcbp->input_handle_listen_state(&h, std::move(p));
             }
             // 2.4 fourth other text or control
@@ -758,7 +1203,7 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
             return;
         }
     } else {
-        tcbp = tcbi->second;
+        tcbp = *tcbi;
         if (tcbp->state() == tcp_state::SYN_SENT) {
             // 3) In SYN_SENT State
             return tcbp->input_handle_syn_sent_state(&h, std::move(p));
@@ -776,7 +1221,7 @@ template <typename InetTraits>
 void tcp<InetTraits>::send_packet_without_tcb(ipaddr from, ipaddr to, packet p) {
     if (_queue_space.try_wait(p.len())) { // drop packets that do not fit the queue
         _inet.get_l2_dst_address(to).then([this, to, p = std::move(p)] (ethernet_address e_dst) mutable {
-                _packetq.emplace_back(ipv4_traits::l4packet{to, std::move(p), e_dst, ip_protocol_num::tcp});
+                _packetq.emplace_back(typename InetTraits::l4packet{to, std::move(p), e_dst, ip_protocol_num::tcp});
         });
     }
 }
@@ -791,15 +1236,24 @@ tcp<InetTraits>::connection::~connection() {
 }
 
 template <typename InetTraits>
-tcp<InetTraits>::tcb::tcb(tcp& t, connid id)
+tcp<InetTraits>::tcb::tcb(tcp& t, connid id, uint32_t flow_hash)
     : _tcp(t)
     , _local_ip(id.local_ip)
     , _foreign_ip(id.foreign_ip)
     , _local_port(id.local_port)
     , _foreign_port(id.foreign_port)
+    , _flow_hash(flow_hash)
+    , _cc(tcp_congestion_controller::make(tcp_congestion_control::stack_default, _snd.cwnd, _snd.ssthresh, _snd.mss))
+    , _pacing([this] { output(); })
     , _delayed_ack([this] { _nr_full_seg_received = 0; output(); })
     , _retransmit([this] { retransmit(); })
     , _persist([this] { persist(); }) {
+    _ts_offset = std::uniform_int_distribution<uint32_t>()(_tcp._e);
+}
+
+template <typename InetTraits>
+tcp<InetTraits>::tcb::~tcb() {
+    tcp_receive_memory::local().uncharge(_rcv.charged);
 }
 
 template <typename InetTraits>
@@ -829,9 +1283,15 @@ void tcp<InetTraits>::respond_with_reset(tcp_hdr* rth, ipaddr local_ip, ipaddr f
     th->checksum = 0;
     *th = hton(*th);
 
+    send_segment_without_tcb(local_ip, foreign_ip, std::move(p), sizeof(*th));
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::send_segment_without_tcb(ipaddr local_ip, ipaddr foreign_ip, packet p, uint8_t hdr_len) {
+    auto th = p.get_header<tcp_hdr>(0);
     checksummer csum;
     offload_info oi;
-    InetTraits::tcp_pseudo_header_checksum(csum, local_ip, foreign_ip, sizeof(*th));
+    InetTraits::tcp_pseudo_header_checksum(csum, local_ip, foreign_ip, p.len());
     if (hw_features().tx_csum_l4_offload) {
         th->checksum = ~csum.get();
         oi.needs_csum = true;
@@ -842,27 +1302,114 @@ void tcp<InetTraits>::respond_with_reset(tcp_hdr* rth, ipaddr local_ip, ipaddr f
     }
 
     oi.protocol = ip_protocol_num::tcp;
-    oi.tcp_hdr_len = sizeof(tcp_hdr);
+    oi.tcp_hdr_len = hdr_len;
     p.set_offload_info(oi);
 
     send_packet_without_tcb(local_ip, foreign_ip, std::move(p));
 }
 
+// Out-of-order data is the only receive memory that can be taken back
+// without breaking the connections: the peers retransmit it.
+template <typename InetTraits>
+memory::reclaiming_result tcp<InetTraits>::reclaim() {
+    tcp_receive_memory::local().low_memory();
+    size_t freed = 0;
+    _tcbs.for_each([&freed] (lw_shared_ptr<tcb>& tcbp) {
+        freed += tcbp->prune_out_of_order();
+    });
+    return freed ? memory::reclaiming_result::reclaimed_something
+                 : memory::reclaiming_result::reclaimed_nothing;
+}
+
+template <typename InetTraits>
+uint32_t tcp<InetTraits>::syn_cookie_count() {
+    using namespace std::chrono;
+    return duration_cast<seconds>(lowres_clock::now().time_since_epoch()).count() / 64;
+}
+
+template <typename InetTraits>
+uint32_t tcp<InetTraits>::syn_cookie_hash(const connid& id, uint32_t count) {
+    uint32_t hash[4];
+    hash[0] = std::hash<ipaddr>()(id.local_ip);
+    hash[1] = std::hash<ipaddr>()(id.foreign_ip);
+    hash[2] = (id.local_port << 16) + id.foreign_port;
+    hash[3] = count;
+    CryptoPP::Weak::MD5::Transform(hash, _syn_cookie_secret);
+    return hash[0];
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::send_syn_cookie(tcp_hdr* rth, const connid& id, packet& p) {
+    auto opt_len = rth->data_offset * 4 - sizeof(tcp_hdr);
+    auto opt_start = reinterpret_cast<uint8_t*>(p.get_header(0, rth->data_offset * 4)) + sizeof(tcp_hdr);
+    tcp_option syn_option;
+    syn_option.parse(opt_start, opt_start + opt_len);
+    uint32_t mss_index = 0;
+    for (uint32_t i = 0; i < sizeof(_syn_cookie_mss) / sizeof(_syn_cookie_mss[0]); ++i) {
+        if (_syn_cookie_mss[i] <= syn_option._remote_mss) {
+            mss_index = i;
+        }
+    }
+    auto count = syn_cookie_count() & 31;
+    auto cookie = (count << 27) | (mss_index << 24) | (syn_cookie_hash(id, count) & 0xffffff);
+
+    // Nothing else can be remembered, so only offer the MSS option: no
+    // window scaling, SACK or timestamps
+    tcp_option option;
+    option._mss_received = true;
+    option._local_mss = hw_features().mtu - net::tcp_hdr_len_min - InetTraits::ip_hdr_len_min;
+    auto options_size = option.get_size(true, true);
+    packet reply;
+    auto th = reply.prepend_header<tcp_hdr>(options_size);
+    th->src_port = id.local_port;
+    th->dst_port = id.foreign_port;
+    th->seq = make_seq(cookie);
+    th->ack = rth->seq + 1;
+    th->f_syn = true;
+    th->f_ack = true;
+    th->data_offset = (sizeof(*th) + options_size) / 4;
+    th->window = 29200;
+    th->checksum = 0;
+    option.fill(th, options_size);
+    *th = hton(*th);
+
+    send_segment_without_tcb(id.local_ip, id.foreign_ip, std::move(reply), sizeof(*th) + options_size);
+}
+
+template <typename InetTraits>
+std::experimental::optional<uint16_t> tcp<InetTraits>::check_syn_cookie(tcp_hdr* th, const connid& id) {
+    auto cookie = (th->ack - 1).raw;
+    auto count = cookie >> 27;
+    auto mss_index = (cookie >> 24) & 7;
+    // Cookies are valid for 64 to 128 seconds
+    if (((syn_cookie_count() - count) & 31) > 1
+            || mss_index >= sizeof(_syn_cookie_mss) / sizeof(_syn_cookie_mss[0])
+            || ((syn_cookie_hash(id, count) ^ cookie) & 0xffffff)) {
+        return {};
+    }
+    return _syn_cookie_mss[mss_index];
+}
+
 template <typename InetTraits>
 uint32_t tcp<InetTraits>::tcb::data_segment_acked(tcp_seq seg_ack) {
     uint32_t total_acked_bytes = 0;
+    // Take one RTT sample per ACK, from the last segment it acknowledges.
+    // Ignore retransmitted segments (Karn's algorithm), and SACKed ones,
+    // whose cumulative ACK may have been delayed by a hole.
+    auto now = rtt_clock::now();
+    std::experimental::optional<rtt_clock::duration> rtt;
     // Full ACK of segment
     while (!_snd.data.empty()
             && (_snd.unacknowledged + _snd.data.front().p.len() <= seg_ack)) {
         auto acked_bytes = _snd.data.front().p.len();
         _snd.unacknowledged += acked_bytes;
-        // Ignore retransmitted segments when setting the RTO
-        if (_snd.data.front().nr_transmits == 0) {
-            update_rto(_snd.data.front().tx_time);
+        if (_snd.data.front().nr_transmits == 0 && !_snd.data.front().sacked) {
+            rtt = now - _snd.data.front().tx_time;
         }
         update_cwnd(acked_bytes);
         total_acked_bytes += acked_bytes;
         _snd.user_queue_space.signal(_snd.data.front().data_len);
+        _snd.pipe -= pipe_share(_snd.data.front(), acked_bytes);
         _snd.data.pop_front();
     }
     // Partial ACK of segment
@@ -870,12 +1417,29 @@ uint32_t tcp<InetTraits>::tcb::data_segment_acked(tcp_seq seg_ack) {
         auto acked_bytes = seg_ack - _snd.unacknowledged;
         if (!_snd.data.empty()) {
             auto& unacked_seg = _snd.data.front();
+            _snd.pipe -= pipe_share(unacked_seg, acked_bytes);
             unacked_seg.p.trim_front(acked_bytes);
+            unacked_seg.seq = seg_ack;
         }
         _snd.unacknowledged = seg_ack;
         update_cwnd(acked_bytes);
         total_acked_bytes += acked_bytes;
     }
+    auto& sacked = _snd.sacked;
+    while (!sacked.empty() && sacked.begin()->second <= _snd.unacknowledged) {
+        sacked.erase(sacked.begin());
+    }
+    // Otherwise, the echoed timestamp tells how long ago the segment that
+    // triggered this ACK was sent, retransmitted or not (RFC7323 4.2)
+    if (!rtt && timestamps_enabled() && _option._remote_ts_present && _option._remote_ts_ecr) {
+        auto ms = int32_t(ts_now() - _option._remote_ts_ecr);
+        if (ms >= 0) {
+            rtt = std::chrono::milliseconds(ms);
+        }
+    }
+    if (rtt) {
+        update_rto(*rtt);
+    }
     return total_acked_bytes;
 }
 
@@ -904,6 +1468,11 @@ template <typename InetTraits>
 void tcp<InetTraits>::tcb::init_from_options(tcp_hdr* th, uint8_t* opt_start, uint8_t* opt_end) {
     // Handle tcp options
     _option.parse(opt_start, opt_end);
+    _rcv.last_ack_sent = _rcv.next;
+    if (timestamps_enabled()) {
+        _rcv.ts_recent = _option._remote_ts_val;
+        _rcv.ts_recent_stamp = clock_type::now();
+    }
 
     // Remote receive window scale factor
     _snd.window_scale = _option._remote_win_scale;
@@ -915,8 +1484,7 @@ void tcp<InetTraits>::tcb::init_from_options(tcp_hdr* th, uint8_t* opt_start, ui
     // Maximum segment size local can receive
     _rcv.mss = _option._local_mss = local_mss();
 
-    // Linux's default window size
-    _rcv.window = 29200 << _rcv.window_scale;
+    init_receive_window();
     _snd.window = th->window << _snd.window_scale;
 
     // Segment sequence number used for last window update
@@ -966,6 +1534,32 @@ void tcp<InetTraits>::tcb::input_handle_listen_state(tcp_hdr* th, packet p) {
     do_syn_received();
 }
 
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::input_handle_syn_cookie(tcp_hdr* th, uint16_t mss, packet p) {
+    // Rebuild the SYN_RECEIVED state the cookie stands for from the ACK
+    // completing the handshake, then process the ACK as usual
+    _rcv.initial = th->seq - 1;
+    _rcv.next = th->seq;
+    _rcv.urgent = _rcv.next;
+    _snd.initial = th->ack - 1;
+    _snd.unacknowledged = _snd.initial;
+    _snd.next = _snd.initial + 1;
+    _snd.recover = _snd.initial;
+    reset_scoreboard();
+
+    // The SYN,ACK only carried the MSS option
+    _option._mss_received = true;
+    _option._remote_mss = mss;
+    init_from_options(th, nullptr, nullptr);
+
+    tcp_debug("syn cookie: LISTEN -> SYN_RECEIVED\n");
+    _state = SYN_RECEIVED;
+    // When the SYN,ACK was sent is unknown; the first RTT sample will be
+    // an underestimate
+    _snd.syn_tx_time = rtt_clock::now();
+    input_handle_other_state(th, std::move(p));
+}
+
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::input_handle_syn_sent_state(tcp_hdr* th, packet p) {
     auto opt_len = th->data_offset * 4 - sizeof(tcp_hdr);
@@ -1038,6 +1632,13 @@ void tcp<InetTraits>::tcb::input_handle_syn_sent_state(tcp_hdr* th, packet p) {
 
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
+    _option._nr_remote_sack = 0;
+    _option._remote_ts_present = false;
+    if ((sack_enabled() || timestamps_enabled()) && th->data_offset * 4 > sizeof(tcp_hdr)) {
+        auto opt_len = th->data_offset * 4 - sizeof(tcp_hdr);
+        auto opt_start = reinterpret_cast<uint8_t*>(p.get_header(0, th->data_offset * 4)) + sizeof(tcp_hdr);
+        _option.parse(opt_start, opt_start + opt_len, false);
+    }
     p.trim_front(th->data_offset * 4);
     bool do_output = false;
     bool do_output_data = false;
@@ -1045,12 +1646,28 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
     auto seg_ack = th->ack;
     auto seg_len = p.len();
 
+    bool ts = timestamps_enabled() && _option._remote_ts_present;
+    // RFC7323 5.3 R1: PAWS, a segment with an older timestamp than the
+    // last one is an old duplicate, even if its sequence number wrapped
+    // into the window
+    if (ts && !th->f_rst && int32_t(_option._remote_ts_val - _rcv.ts_recent) < 0
+            && clock_type::now() - _rcv.ts_recent_stamp < _paws_idle) {
+        return output();
+    }
+
     // 4.1 first check sequence number
     if (!segment_acceptable(seg_seq, seg_len)) {
         //<SEQ=SND.NXT><ACK=RCV.NXT><CTL=ACK>
         return output();
     }
 
+    // RFC7323 5.3 R3: echo the timestamp of the segment which filled the
+    // last ACK we sent, or of the earliest one when ACKs are delayed
+    if (ts && int32_t(_option._remote_ts_val - _rcv.ts_recent) >= 0 && seg_seq <= _rcv.last_ack_sent) {
+        _rcv.ts_recent = _option._remote_ts_val;
+        _rcv.ts_recent_stamp = clock_type::now();
+    }
+
     // In the following it is assumed that the segment is the idealized
     // segment that begins at RCV.NXT and does not exceed the window.
     if (seg_seq < _rcv.next) {
@@ -1140,10 +1757,14 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
         auto update_window = [this, th, seg_seq, seg_ack] {
             tcp_debug("window update seg_seq=%d, seg_ack=%d, old window=%d new window=%d\n",
                       seg_seq, seg_ack, _snd.window, th->window << _snd.window_scale);
+            auto old_window = _snd.window;
             _snd.window = th->window << _snd.window_scale;
             _snd.wl1 = seg_seq;
             _snd.wl2 = seg_ack;
             if (_snd.window == 0) {
+                if (old_window) {
+                    ++_tcp._stats.zero_windows;
+                }
                 _persist_time_out = _rto;
                 start_persist_timer();
             } else {
@@ -1153,6 +1774,9 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
         // ESTABLISHED STATE or
         // CLOSE_WAIT STATE: Do the same processing as for the ESTABLISHED state.
         if (in_state(ESTABLISHED | CLOSE_WAIT)){
+            if (_option._nr_remote_sack) {
+                update_scoreboard();
+            }
             // If SND.UNA < SEG.ACK =< SND.NXT then, set SND.UNA <- SEG.ACK.
             if (_snd.unacknowledged < seg_ack && seg_ack <= _snd.next) {
                 // Remote ACKed data we sent
@@ -1190,15 +1814,19 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
                         set_retransmit_timer();
                     } else {
                         tcp_debug("ack: partial_ack\n");
-                        // Retransmit the first unacknowledged segment
-                        fast_retransmit();
-                        // Deflate the congestion window by the amount of new data
-                        // acknowledged by the Cumulative Acknowledgment field
-                        _snd.cwnd -= acked_bytes;
-                        // If the partial ACK acknowledges at least one SMSS of new
-                        // data, then add back SMSS bytes to the congestion window
-                        if (acked_bytes >= smss) {
-                            _snd.cwnd += smss;
+                        // With SACK, the holes are retransmitted from the
+                        // scoreboard (see sack_next_hole()) and cwnd is not inflated
+                        if (!sack_enabled()) {
+                            // Retransmit the first unacknowledged segment
+                            fast_retransmit();
+                            // Deflate the congestion window by the amount of new data
+                            // acknowledged by the Cumulative Acknowledgment field
+                            _snd.cwnd -= acked_bytes;
+                            // If the partial ACK acknowledges at least one SMSS of new
+                            // data, then add back SMSS bytes to the congestion window
+                            if (acked_bytes >= smss) {
+                                _snd.cwnd += smss;
+                            }
                         }
                         // Send a new segment if permitted by the new value of
                         // cwnd.  Do not exit the fast recovery procedure For
@@ -1232,6 +1860,14 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
                 // Here, We follow RFC5681.
                 _snd.dupacks++;
                 uint32_t smss = _snd.mss;
+                // RFC6675: the scoreboard may tell the first segment is lost
+                // before the third duplicated ACK
+                if (_snd.dupacks < 3 && sack_enabled() && !_snd.data.empty()) {
+                    auto& front = _snd.data.front();
+                    if (!front.sacked && !front.retransmitted && front.seq < _snd.lost_edge) {
+                        _snd.dupacks = 3;
+                    }
+                }
                 // 3 duplicated ACKs trigger a fast retransmit
                 if (_snd.dupacks == 1 || _snd.dupacks == 2) {
                     // RFC5681 Step 3.1
@@ -1242,16 +1878,25 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
                     if (seg_ack - 1 > _snd.recover) {
                         _snd.recover = _snd.next - 1;
                         // RFC5681 Step 3.2
-                        _snd.ssthresh = std::max((flight_size() - _snd.limited_transfer) / 2, 2 * smss);
+                        _cc->on_loss(flight_size() - _snd.limited_transfer);
                         fast_retransmit();
                     } else {
                         // Do not enter fast retransmit and do not reset ssthresh
                     }
-                    // RFC5681 Step 3.3
-                    _snd.cwnd = _snd.ssthresh + 3 * smss;
+                    if (sack_enabled()) {
+                        // RFC6675 Step 4.2: the data in flight is accounted
+                        // by the scoreboard, no need to inflate cwnd
+                        _snd.cwnd = _snd.ssthresh;
+                        do_output_data = true;
+                    } else {
+                        // RFC5681 Step 3.3
+                        _snd.cwnd = _snd.ssthresh + 3 * smss;
+                    }
                 } else if (_snd.dupacks > 3) {
-                    // RFC5681 Step 3.4
-                    _snd.cwnd += smss;
+                    if (!sack_enabled()) {
+                        // RFC5681 Step 3.4
+                        _snd.cwnd += smss;
+                    }
                     // RFC5681 Step 3.5
                     do_output_data = true;
                 }
@@ -1321,9 +1966,11 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
             // RCV.NXT over the data accepted, and adjusts RCV.WND as
             // apporopriate to the current buffer availability.  The total of
             // RCV.NXT and RCV.WND should not be reduced.
+            _rcv.data_len += seg_len;
             _rcv.data.push_back(std::move(p));
             _rcv.next += seg_len;
             auto merged = merge_out_of_order();
+            update_receive_window();
             signal_data_received();
             // Send an acknowledgment of the form:
             // <SEQ=SND.NXT><ACK=RCV.NXT><CTL=ACK>
@@ -1382,7 +2029,7 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
             }
         }
     }
-    if (do_output || (do_output_data && can_send())) {
+    if (do_output || (do_output_data && (can_send() || sack_next_hole()))) {
         // Since we will do output, we can canncel scheduled delayed ACK.
         clear_delayed_ack();
         output();
@@ -1390,7 +2037,7 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
 }
 
 template <typename InetTraits>
-packet tcp<InetTraits>::tcb::get_transmit_packet() {
+packet tcp<InetTraits>::tcb::get_transmit_packet(uint8_t options_size) {
     // easy case: empty queue
     if (_snd.unsent.empty()) {
         return packet();
@@ -1400,9 +2047,11 @@ packet tcp<InetTraits>::tcb::get_transmit_packet() {
     uint32_t len;
     if (_tcp.hw_features().tx_tso) {
         // FIXME: Info tap device the size of the splitted packet
-        len = _tcp.hw_features().max_packet_len - net::tcp_hdr_len_min - InetTraits::ip_hdr_len_min;
+        len = _tcp.hw_features().max_packet_len - net::tcp_hdr_len_min - InetTraits::ip_hdr_len_min - options_size;
     } else {
-        len = std::min(uint16_t(_tcp.hw_features().mtu - net::tcp_hdr_len_min - InetTraits::ip_hdr_len_min), _snd.mss);
+        // The MSS does not account for the options (RFC6691)
+        len = std::min(uint16_t(_tcp.hw_features().mtu - net::tcp_hdr_len_min - InetTraits::ip_hdr_len_min), _snd.mss)
+                - options_size;
     }
     can_send = std::min(can_send, len);
     // easy case: one small packet
@@ -1439,18 +2088,34 @@ packet tcp<InetTraits>::tcb::get_transmit_packet() {
 }
 
 template <typename InetTraits>
-void tcp<InetTraits>::tcb::output_one(bool data_retransmit) {
+void tcp<InetTraits>::tcb::output_one(unacked_segment* retransmit) {
     if (in_state(CLOSED)) {
         return;
     }
 
-    packet p = data_retransmit ? _snd.data.front().p.share() : get_transmit_packet();
-    packet clone = p.share();  // early clone to prevent share() from calling packet::unuse_internal_data() on header.
-    uint16_t len = p.len();
     bool syn_on = syn_needs_on();
     bool ack_on = ack_needs_on();
 
+    update_local_sack_blocks(syn_on);
+    _option._local_ts_val = ts_now();
+    _option._local_ts_ecr = _rcv.ts_recent;
     auto options_size = _option.get_size(syn_on, ack_on);
+
+    bool data_retransmit = retransmit;
+    if (data_retransmit) {
+        // The segment was sized for the options of its first transmission;
+        // leave out the SACK blocks which no longer fit.
+        while (_option._nr_local_sack && retransmit->p.len() + options_size > _snd.mss) {
+            _option._nr_local_sack--;
+            options_size = _option.get_size(syn_on, ack_on);
+        }
+    }
+    packet p = data_retransmit ? retransmit->p.share() : get_transmit_packet(options_size);
+    packet clone = p.share();  // early clone to prevent share() from calling packet::unuse_internal_data() on header.
+    uint16_t len = p.len();
+    if (!data_retransmit) {
+        consume_pacing_budget(len);
+    }
     auto th = p.prepend_header<tcp_hdr>(options_size);
 
     th->src_port = _local_port;
@@ -1466,15 +2131,25 @@ void tcp<InetTraits>::tcb::output_one(bool data_retransmit) {
 
     tcp_seq seq;
     if (data_retransmit) {
-        seq = _snd.unacknowledged;
+        seq = retransmit->seq;
     } else {
         seq = syn_on ? _snd.initial : _snd.next;
         _snd.next += len;
     }
     th->seq = seq;
     th->ack = _rcv.next;
+    if (ack_on) {
+        _rcv.last_ack_sent = _rcv.next;
+    }
     th->data_offset = (sizeof(*th) + options_size) / 4;
-    th->window = _rcv.window >> _rcv.window_scale;
+    // RFC7323 2.2: the window of a SYN is not scaled
+    if (syn_on) {
+        th->window = std::min(_rcv.window, uint32_t(0xffff));
+        _rcv.window_edge = _rcv.next + th->window;
+    } else {
+        th->window = _rcv.window >> _rcv.window_scale;
+        _rcv.window_edge = _rcv.next + (uint32_t(th->window) << _rcv.window_scale);
+    }
     th->checksum = 0;
 
     // FIXME: does the FIN have to fit in the window?
@@ -1503,8 +2178,9 @@ void tcp<InetTraits>::tcb::output_one(bool data_retransmit) {
         // segment length set to 0. All the rest is the same as for a TCP Tx
         // CSUM offload case.
         //
-        if (_tcp.hw_features().tx_tso && len > _snd.mss) {
-            oi.tso_seg_size = _snd.mss;
+        uint16_t seg_size = _snd.mss - options_size;
+        if (_tcp.hw_features().tx_tso && len > seg_size) {
+            oi.tso_seg_size = seg_size;
         } else {
             pseudo_hdr_seg_len = sizeof(*th) + options_size + len;
         }
@@ -1532,7 +2208,8 @@ void tcp<InetTraits>::tcb::output_one(bool data_retransmit) {
         if (len) {
             unsigned nr_transmits = 0;
             _snd.data.emplace_back(unacked_segment{std::move(clone),
-                                   len, nr_transmits, now});
+                                   len, nr_transmits, rtt_clock::now(), seq});
+            _snd.pipe += len;
         }
         if (!_retransmit.armed()) {
             start_retransmit_timer(now);
@@ -1581,8 +2258,7 @@ void tcp<InetTraits>::tcb::connect() {
     _rcv.window_scale = _option._local_win_scale = 7;
     // Maximum segment size local can receive
     _rcv.mss = _option._local_mss = local_mss();
-    // Linux's default window size
-    _rcv.window = 29200 << _rcv.window_scale;
+    init_receive_window();
 
     do_syn_sent();
 }
@@ -1594,6 +2270,15 @@ packet tcp<InetTraits>::tcb::read() {
         p.append(std::move(q));
     }
     _rcv.data.clear();
+    _rcv.data_len = 0;
+    adjust_receive_buffer(p.len());
+    uint32_t offered = _rcv.next < _rcv.window_edge ? uint32_t(_rcv.window_edge - _rcv.next) : 0;
+    update_receive_window();
+    // Tell the peer about the space the application made, when the window
+    // it knows of became small
+    if (_rcv.window > offered && offered < _rcv.window / 2 && in_state(ESTABLISHED | FIN_WAIT_1 | FIN_WAIT_2)) {
+        output();
+    }
     return p;
 }
 
@@ -1695,18 +2380,21 @@ bool tcp<InetTraits>::tcb::merge_out_of_order() {
         if (seg_beg <= _rcv.next && _rcv.next < seg_end) {
             // This segment has been received out of order and its previous
             // segment has been received now
+            _rcv.out_of_order_len -= seg_len;
             auto trim = _rcv.next - seg_beg;
             if (trim) {
                 p.trim_front(trim);
                 seg_len -= trim;
             }
             _rcv.next += seg_len;
+            _rcv.data_len += seg_len;
             _rcv.data.push_back(std::move(p));
             // Since c++11, erase() always returns the value of the following element
             it = _rcv.out_of_order.map.erase(it);
             merged = true;
         } else if (_rcv.next >= seg_end) {
             // This segment has been receive already, drop it
+            _rcv.out_of_order_len -= seg_len;
             it = _rcv.out_of_order.map.erase(it);
         } else {
             // seg_beg > _rcv.need, can not merge. Note, seg_beg can grow only,
@@ -1720,7 +2408,83 @@ bool tcp<InetTraits>::tcb::merge_out_of_order() {
 
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::insert_out_of_order(tcp_seq seg, packet p) {
+    ++_tcp._stats.out_of_order;
+    // Out of the shard's receive memory: the peer will retransmit it
+    if (tcp_receive_memory::local().exhausted()) {
+        return;
+    }
+    _rcv.last_out_of_order = seg;
+    auto end = seg + p.len();
+    auto before = _rcv.out_of_order.bytes_around(seg, end);
     _rcv.out_of_order.merge(seg, std::move(p));
+    // The merged segment is the only one around it now
+    _rcv.out_of_order_len += _rcv.out_of_order.bytes_around(seg, end) - before;
+    update_receive_window();
+}
+
+template <typename InetTraits>
+uint32_t tcp<InetTraits>::tcb::prune_out_of_order() {
+    auto before = _rcv.charged;
+    _rcv.out_of_order.map.clear();
+    _rcv.out_of_order_len = 0;
+    update_receive_window();
+    return before - _rcv.charged;
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::init_receive_window() {
+    _rcv.buffer = _rcv_buffer_initial;
+    _rcv.consumed = 0;
+    _rcv.consumed_stamp = clock_type::now();
+    _rcv.window_edge = _rcv.next;
+    update_receive_window();
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::update_receive_window() {
+    auto& mem = tcp_receive_memory::local();
+    uint32_t queued = _rcv.data_len + _rcv.out_of_order_len;
+    if (queued > _rcv.charged) {
+        mem.charge(queued - _rcv.charged);
+    } else {
+        mem.uncharge(_rcv.charged - queued);
+    }
+    _rcv.charged = queued;
+
+    // What the peer was offered can't be taken back; beyond it, offer
+    // the free buffer space, unless the shard is out of receive memory
+    uint32_t offered = _rcv.next < _rcv.window_edge ? uint32_t(_rcv.window_edge - _rcv.next) : 0;
+    uint32_t space = 0;
+    if (_rcv.buffer > queued && !mem.exhausted()) {
+        space = _rcv.buffer - queued;
+    }
+    // RFC1122 4.2.3.3: avoid the silly window syndrome by moving the
+    // right edge only by a full segment or half the buffer at least
+    if (space > offered && space - offered >= std::min<uint32_t>(_rcv.buffer / 2, _rcv.mss)) {
+        _rcv.window = space;
+    } else {
+        _rcv.window = offered;
+    }
+    _rcv.window = std::min(_rcv.window, uint32_t(0xffff) << _rcv.window_scale);
+}
+
+// Dynamic right-sizing, as in Linux: once per round trip, make room for
+// twice what the application read during the last one, since the sender
+// may double its rate each round trip.
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::adjust_receive_buffer(uint32_t consumed) {
+    auto now = clock_type::now();
+    _rcv.consumed += consumed;
+    auto rtt = _snd.first_rto_sample ? std::chrono::microseconds(_tcp._rto_min) : _snd.srtt;
+    if (now - _rcv.consumed_stamp < rtt) {
+        return;
+    }
+    auto wanted = uint32_t(std::min<uint64_t>(2 * uint64_t(_rcv.consumed), _rcv_buffer_max));
+    if (wanted > _rcv.buffer && tcp_receive_memory::local().may_grow()) {
+        _rcv.buffer = wanted;
+    }
+    _rcv.consumed = 0;
+    _rcv.consumed_stamp = now;
 }
 
 template <typename InetTraits>
@@ -1744,6 +2508,8 @@ void tcp<InetTraits>::tcb::persist() {
 
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::retransmit() {
+    ++_nr_timeouts;
+    ++_tcp._stats.timeouts;
     auto output_update_rto = [this] {
         output();
         // According to RFC6298, Update RTO <- RTO * 2 to perform binary exponential back-off
@@ -1784,10 +2550,17 @@ void tcp<InetTraits>::tcb::retransmit() {
     // Update ssthresh only for the first retransmit
     uint32_t smss = _snd.mss;
     if (unacked_seg.nr_transmits == 0) {
-        _snd.ssthresh = std::max(flight_size() / 2, 2 * smss);
+        _cc->on_loss(flight_size());
     }
     // RFC6582 Step 4
     _snd.recover = _snd.next - 1;
+    // RFC2018: the receiver may have discarded SACKed data, so forget the
+    // SACK information after a timeout
+    for (auto& seg : _snd.data) {
+        seg.sacked = false;
+        seg.retransmitted = false;
+    }
+    reset_scoreboard();
     // Start the slow start process
     _snd.cwnd = smss;
     // End fast recovery
@@ -1810,15 +2583,17 @@ void tcp<InetTraits>::tcb::fast_retransmit() {
     if (!_snd.data.empty()) {
         auto& unacked_seg = _snd.data.front();
         unacked_seg.nr_transmits++;
+        mark_retransmitted(unacked_seg);
+        ++_tcp._stats.fast_retransmits;
         retransmit_one();
         output();
     }
 }
 
 template <typename InetTraits>
-void tcp<InetTraits>::tcb::update_rto(clock_type::time_point tx_time) {
+void tcp<InetTraits>::tcb::update_rto(rtt_clock::duration rtt) {
     // Update RTO according to RFC6298
-    auto R = std::chrono::duration_cast<std::chrono::milliseconds>(clock_type::now() - tx_time);
+    auto R = std::chrono::duration_cast<std::chrono::microseconds>(rtt);
     if (_snd.first_rto_sample) {
         _snd.first_rto_sample = false;
         // RTTVAR <- R/2
@@ -1833,24 +2608,169 @@ void tcp<InetTraits>::tcb::update_rto(clock_type::time_point tx_time) {
         _snd.rttvar = _snd.rttvar * 3 / 4 + delta / 4;
         _snd.srtt = _snd.srtt * 7 / 8 +  R / 8;
     }
-    // RTO <- SRTT + max(G, K * RTTVAR)
-    _rto =  _snd.srtt + std::max(_rto_clk_granularity, 4 * _snd.rttvar);
+    _cc->on_rtt_sample(R);
+    // RTO <- SRTT + max(G, K * RTTVAR), rounded up to the timer's unit
+    std::chrono::microseconds rto = _snd.srtt + std::max<std::chrono::microseconds>(_rto_clk_granularity, 4 * _snd.rttvar);
+    _rto = std::chrono::duration_cast<std::chrono::milliseconds>(rto + std::chrono::microseconds(999));
 
-    // Make sure 1 sec << _rto << 60 sec
-    _rto = std::max(_rto, _rto_min);
+    // Make sure _rto_min << _rto << 60 sec
+    _rto = std::max(_rto, _tcp._rto_min);
     _rto = std::min(_rto, _rto_max);
 }
 
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::update_cwnd(uint32_t acked_bytes) {
-    uint32_t smss = _snd.mss;
-    if (_snd.cwnd < _snd.ssthresh) {
-        // In slow start phase
-        _snd.cwnd += std::min(acked_bytes, smss);
+    _cc->on_ack(acked_bytes, _snd.next - _snd.unacknowledged);
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::update_scoreboard() {
+    // Merge the SACK blocks of the received ACK into the ranges SACKed so
+    // far.  Only the segments in the gaps a block fills get marked, so a
+    // block the remote repeats on every ACK costs nothing once known.
+    auto& sacked = _snd.sacked;
+    for (unsigned i = 0; i < _option._nr_remote_sack; ++i) {
+        auto& b = _option._remote_sack[i];
+        // Ignore D-SACK blocks and blocks beyond the data sent
+        if (b.end <= b.start || b.end <= _snd.unacknowledged || _snd.next < b.end) {
+            continue;
+        }
+        auto start = std::max(b.start, _snd.unacknowledged);
+        auto end = b.end;
+        auto first = sacked.upper_bound(start);
+        if (first != sacked.begin() && start <= std::prev(first)->second) {
+            --first;
+        }
+        auto last = first;
+        while (last != sacked.end() && last->first <= end) {
+            ++last;
+        }
+        if (first != last) {
+            start = std::min(start, first->first);
+            end = std::max(end, std::prev(last)->second);
+        }
+        auto from = start;
+        for (auto it = first; it != last; ++it) {
+            mark_sacked(from, it->first, start, end);
+            from = it->second;
+        }
+        mark_sacked(from, end, start, end);
+        sacked.erase(first, last);
+        sacked.emplace(start, end);
+    }
+    update_lost_edge();
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::mark_sacked(tcp_seq from, tcp_seq to, tcp_seq start, tcp_seq end) {
+    // Mark the segments overlapping [from, to) which the SACKed range
+    // [start, end) covers, and take them out of the pipe
+    for (auto it = segment_after(from); it != _snd.data.end() && it->seq < to; ++it) {
+        auto seg_end = it->seq + it->p.len();
+        if (it->sacked || it->seq < start || end < seg_end) {
+            continue;
+        }
+        _snd.pipe -= pipe_share(*it, it->p.len());
+        it->sacked = true;
+        if (_snd.high_sacked < seg_end) {
+            _snd.high_sacked = seg_end;
+        }
+    }
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::update_lost_edge() {
+    // RFC6675 IsLost(): a segment is lost once DupThresh segments, or more
+    // than (DupThresh - 1) * SMSS bytes, above it have been SACKed.  SACKs
+    // only add up until a timeout, so the lost segments only grow: walk down
+    // from the highest SACKed segment, but not below those already lost.
+    static constexpr unsigned dupthresh = 3;
+    auto old_edge = _snd.lost_edge;
+    if (_snd.high_sacked <= std::max(old_edge, _snd.unacknowledged)) {
+        return;
+    }
+    auto top = segment_after(_snd.high_sacked - 1);
+    if (top == _snd.data.end()) {
+        return;
+    }
+    unsigned sacked_segs = 0;
+    uint32_t sacked_bytes = 0;
+    using reverse_iterator = typename std::deque<unacked_segment>::reverse_iterator;
+    for (auto it = reverse_iterator(std::next(top)); it != _snd.data.rend(); ++it) {
+        auto seg_end = it->seq + it->p.len();
+        if (seg_end <= old_edge) {
+            break;
+        }
+        if (sacked_segs >= dupthresh || sacked_bytes > (dupthresh - 1) * _snd.mss) {
+            _snd.lost_edge = seg_end;
+            break;
+        }
+        if (it->sacked) {
+            sacked_segs++;
+            sacked_bytes += it->p.len();
+        }
+    }
+    // The segments newly deemed lost leave the pipe, unless retransmitted
+    for (auto it = segment_after(old_edge); it != _snd.data.end() && it->seq < _snd.lost_edge; ++it) {
+        if (!it->sacked) {
+            _snd.pipe -= it->p.len();
+        }
+    }
+}
+
+template <typename InetTraits>
+typename tcp<InetTraits>::tcb::unacked_segment* tcp<InetTraits>::tcb::sack_next_hole() {
+    if (!sack_enabled() || _snd.dupacks < 3) {
+        return nullptr;
+    }
+    // RFC6675 Step 4.3: transmit only while cwnd - pipe >= 1 SMSS
+    if (_snd.pipe + _snd.mss > _snd.cwnd) {
+        return nullptr;
+    }
+    // NextSeg() rule 1: the first lost segment neither SACKed nor
+    // retransmitted.  The holes are retransmitted in order, so the search
+    // resumes where the previous one stopped.
+    auto it = segment_after(_snd.next_hole);
+    while (it != _snd.data.end() && it->seq < _snd.lost_edge && (it->sacked || it->retransmitted)) {
+        ++it;
+    }
+    if (it == _snd.data.end()) {
+        _snd.next_hole = _snd.next;
+        return nullptr;
+    }
+    _snd.next_hole = it->seq;
+    return it->seq < _snd.lost_edge ? &*it : nullptr;
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::update_local_sack_blocks(bool syn_on) {
+    _option._nr_local_sack = 0;
+    auto& ooo = _rcv.out_of_order.map;
+    if (!sack_enabled() || syn_on || ooo.empty()) {
+        return;
+    }
+    // The packet merger keeps each contiguous range as a single entry, so
+    // each entry is a block.  RFC2018 wants the block holding the most
+    // recently received segment first; the others follow in sequence order.
+    auto add = [this] (tcp_seq start, const packet& p) {
+        _option._local_sack[_option._nr_local_sack++] = {start, start + p.len()};
+    };
+    auto last = ooo.upper_bound(_rcv.last_out_of_order);
+    if (last != ooo.begin()) {
+        --last;
+        if (_rcv.last_out_of_order < last->first + last->second.len()) {
+            add(last->first, last->second);
+        } else {
+            last = ooo.end();
+        }
     } else {
-        // In congestion avoidance phase
-        uint32_t round_up = 1;
-        _snd.cwnd += std::max(round_up, smss * smss / _snd.cwnd);
+        last = ooo.end();
+    }
+    auto max_blocks = timestamps_enabled() ? tcp_option::max_sack_blocks - 1 : tcp_option::max_sack_blocks;
+    for (auto it = ooo.begin(); it != ooo.end() && _option._nr_local_sack < max_blocks; ++it) {
+        if (it != last) {
+            add(it->first, it->second);
+        }
     }
 }
 
@@ -1858,10 +2778,15 @@ template <typename InetTraits>
 void tcp<InetTraits>::tcb::cleanup() {
     _snd.unsent.clear();
     _snd.data.clear();
+    reset_scoreboard();
     _rcv.out_of_order.map.clear();
+    _rcv.out_of_order_len = 0;
     _rcv.data.clear();
+    _rcv.data_len = 0;
+    update_receive_window();
     stop_retransmit_timer();
     clear_delayed_ack();
+    _pacing.cancel();
     remove_from_tcbs();
 }
 
@@ -1873,8 +2798,8 @@ tcp_seq tcp<InetTraits>::tcb::get_isn() {
     //   M is the 4 microsecond timer
     using namespace std::chrono;
     uint32_t hash[4];
-    hash[0] = _local_ip.ip;
-    hash[1] = _foreign_ip.ip;
+    hash[0] = std::hash<ipaddr>()(_local_ip);
+    hash[1] = std::hash<ipaddr>()(_foreign_ip);
     hash[2] = (_local_port << 16) + _foreign_port;
     hash[3] = _isn_secret.key[15];
     CryptoPP::Weak::MD5::Transform(hash, _isn_secret.key);
@@ -1888,7 +2813,14 @@ template <typename InetTraits>
 std::experimental::optional<typename InetTraits::l4packet> tcp<InetTraits>::tcb::get_packet() {
     _poll_active = false;
     if (_packetq.empty()) {
-        output_one();
+        auto hole = sack_next_hole();
+        if (hole) {
+            hole->nr_transmits++;
+            mark_retransmitted(*hole);
+            retransmit_one(*hole);
+        } else {
+            output_one();
+        }
     }
 
     if (in_state(CLOSED)) {
@@ -1899,10 +2831,12 @@ std::experimental::optional<typename InetTraits::l4packet> tcp<InetTraits>::tcb:
 
     auto p = std::move(_packetq.front());
     _packetq.pop_front();
-    if (!_packetq.empty() || (_snd.dupacks < 3 && can_send() > 0)) {
+    if (!_packetq.empty() || ((_snd.dupacks < 3 || sack_enabled()) && can_send() > 0)
+            || sack_next_hole()) {
         // If there are packets to send in the queue or tcb is allowed to send
         // more add tcp back to polling set to keep sending. In addition, dupacks >= 3
-        // is an indication that an segment is lost, stop sending more in this case.
+        // is an indication that an segment is lost, stop sending more in this case,
+        // unless the SACK scoreboard tells how much is still in flight.
         output();
     }
     return std::move(p);
@@ -1922,7 +2856,13 @@ template <typename InetTraits>
 constexpr uint16_t tcp<InetTraits>::tcb::_max_nr_retransmit;
 
 template <typename InetTraits>
-constexpr std::chrono::milliseconds tcp<InetTraits>::tcb::_rto_min;
+constexpr uint32_t tcp<InetTraits>::tcb::_rcv_buffer_initial;
+
+template <typename InetTraits>
+constexpr uint32_t tcp<InetTraits>::tcb::_rcv_buffer_max;
+
+template <typename InetTraits>
+constexpr std::chrono::hours tcp<InetTraits>::tcb::_paws_idle;
 
 template <typename InetTraits>
 constexpr std::chrono::milliseconds tcp<InetTraits>::tcb::_rto_max;
@@ -1930,9 +2870,15 @@ constexpr std::chrono::milliseconds tcp<InetTraits>::tcb::_rto_max;
 template <typename InetTraits>
 constexpr std::chrono::milliseconds tcp<InetTraits>::tcb::_rto_clk_granularity;
 
+template <typename InetTraits>
+constexpr std::chrono::milliseconds tcp<InetTraits>::tcb::_pacing_granularity;
+
 template <typename InetTraits>
 typename tcp<InetTraits>::tcb::isn_secret tcp<InetTraits>::tcb::_isn_secret;
 
+template <typename InetTraits>
+constexpr uint16_t tcp<InetTraits>::_syn_cookie_mss[];
+
 }
 
 
@@ -45,6 +45,8 @@
 #define TOEPLITZ_HH_
 
 #include <vector>
+#include <array>
+#include <cstdint>
 
 using rss_key_type = std::vector<uint8_t>;
 
@@ -90,4 +92,54 @@ toeplitz_hash(const rss_key_type& key, const T& data)
 	}
 	return (hash);
 }
+
+// Table driven Toeplitz hash, bit-identical with toeplitz_hash().  Each
+// input byte contributes the XOR of the key windows of its set bits, which
+// only depends on the byte's position and value, so it is precomputed for
+// every position the key covers: 12 bytes of an IPv4 tuple cost 12 lookups
+// instead of 96 shifts.  Longer input falls back to the bitwise hash.
+class toeplitz_table {
+    rss_key_type _key;
+    std::vector<std::array<uint32_t, 256>> _table;
+private:
+    // 32 bits of the key starting at bit, zeros past its end
+    static uint32_t key_bits(const rss_key_type& key, size_t bit) {
+        uint64_t v = 0;
+        for (size_t i = bit / 8; i < bit / 8 + 5; ++i) {
+            v = (v << 8) | (i < key.size() ? key[i] : 0);
+        }
+        return v >> (8 - bit % 8);
+    }
+public:
+    explicit toeplitz_table(const rss_key_type& key)
+        : _key(key)
+        , _table(key.size() > 4 ? key.size() - 4 : 0) {
+        for (size_t i = 0; i < _table.size(); ++i) {
+            auto& t = _table[i];
+            t[0] = 0;
+            // Bit 7 - b of the byte uses the window at bit b; filling in
+            // the low bits first lets each entry reuse a smaller one
+            for (int b = 7; b >= 0; --b) {
+                auto w = key_bits(key, i * 8 + b);
+                auto bit = 0x80u >> b;
+                for (unsigned x = 0; x < bit; ++x) {
+                    t[bit | x] = t[x] ^ w;
+                }
+            }
+        }
+    }
+    const rss_key_type& key() const { return _key; }
+    template <typename T>
+    uint32_t hash(const T& data) const {
+        if (data.size() > _table.size()) {
+            return toeplitz_hash(_key, data);
+        }
+        uint32_t hash = 0;
+        for (size_t i = 0; i < data.size(); ++i) {
+            hash ^= _table[i][uint8_t(data[i])];
+        }
+        return hash;
+    }
+};
+
 #endif
@@ -20,6 +20,7 @@
  */
 
 #include "ip.hh"
+#include "ipv6.hh"
 
 using namespace net;
 
@@ -217,4 +218,205 @@ ipv4_udp::make_channel(ipv4_addr addr) {
     return udp_channel(std::make_unique<native_channel>(*this, registration(*this, bind_port), chan_state));
 }
 
+namespace ipv6_udp_impl {
+
+static inline
+socket_address
+make_ipv6_address(const ipv6_address& a, uint16_t port) {
+    socket_address sa;
+    sa.u.in6 = {};
+    sa.u.in6.sin6_family = AF_INET6;
+    sa.u.in6.sin6_port = htons(port);
+    std::copy(a.bytes.begin(), a.bytes.end(), sa.u.in6.sin6_addr.s6_addr);
+    return sa;
+}
+
+// get_src() and get_dst() only carry the ports; get_src_address() has
+// the whole source
+class native_datagram : public udp_datagram_impl {
+private:
+    ipv6_address _src;
+    uint16_t _src_port;
+    uint16_t _dst_port;
+    packet _p;
+public:
+    native_datagram(ipv6_address src, const udp_hdr& h, packet p)
+            : _src(src), _src_port(h.src_port), _dst_port(h.dst_port), _p(std::move(p)) {
+    }
+
+    virtual ipv4_addr get_src() override {
+        return ipv4_addr(_src_port);
+    };
+
+    virtual ipv4_addr get_dst() override {
+        return ipv4_addr(_dst_port);
+    };
+
+    virtual uint16_t get_dst_port() override {
+        return _dst_port;
+    }
+
+    virtual packet& get_data() override {
+        return _p;
+    }
+
+    virtual socket_address get_src_address() override {
+        return make_ipv6_address(_src, _src_port);
+    }
+};
+
+class native_channel : public udp_channel_impl {
+private:
+    ipv6_udp& _proto;
+    uint16_t _port;
+    bool _closed = false;
+    lw_shared_ptr<udp_channel_state> _state;
+
+public:
+    native_channel(ipv6_udp& proto, uint16_t port, lw_shared_ptr<udp_channel_state> state)
+            : _proto(proto)
+            , _port(port)
+            , _state(state)
+    {
+    }
+
+    ~native_channel()
+    {
+        if (!_closed)
+            close();
+    }
+
+    virtual future<udp_datagram> receive() override {
+        return _state->_queue.pop_eventually();
+    }
+
+    virtual future<> send(ipv4_addr dst, const char* msg) override {
+        return send(dst, packet::from_static_data(msg, strlen(msg)));
+    }
+
+    virtual future<> send(ipv4_addr dst, packet p) override {
+        return make_exception_future<>(std::runtime_error("IPv4 destination on an IPv6 channel"));
+    }
+
+    virtual future<> send(const socket_address& dst, packet p) override {
+        if (dst.as_posix_sockaddr().sa_family != AF_INET6) {
+            return make_exception_future<>(std::runtime_error("address family not supported by the channel"));
+        }
+        auto to = ipv6_traits::socket_address_ip(dst);
+        auto port = ipv6_traits::socket_address_port(dst);
+        auto len = p.len();
+        return _state->wait_for_send_buffer(len).then([this, to, port, p = std::move(p), len] () mutable {
+            p = packet(std::move(p), make_deleter([s = _state, len] { s->complete_send(len); }));
+            _proto.send(_port, to, port, std::move(p));
+        });
+    }
+
+    virtual bool is_closed() const {
+        return _closed;
+    }
+
+    virtual void close() override {
+        _proto.unregister(_port);
+        _closed = true;
+    }
+};
+
+} /* namespace ipv6_udp_impl */
+
+ipv6_udp::ipv6_udp(ipv6& inet)
+    : _inet_l4(inet)
+{
+    _inet_l4.register_packet_provider([this] {
+        std::experimental::optional<ipv6_traits::l4packet> l4p;
+        if (!_packetq.empty()) {
+            l4p = std::move(_packetq.front());
+            _packetq.pop_front();
+        }
+        return l4p;
+    });
+}
+
+void ipv6_udp::received(packet p, ipv6_address from, ipv6_address to, uint8_t hop_limit)
+{
+    auto uh = p.get_header<udp_hdr>(0);
+    if (!uh) {
+        return;
+    }
+    auto h = ntoh(*uh);
+    if (h.len < sizeof(udp_hdr) || h.len > p.len()) {
+        return;
+    }
+    p.trim_back(p.len() - h.len);
+    // The checksum is mandatory over IPv6 (RFC 8200, 8.1)
+    if (h.cksum == 0) {
+        return;
+    }
+    if (!_inet_l4._inet.hw_features().rx_csum_offload) {
+        checksummer csum;
+        ipv6_traits::udp_pseudo_header_checksum(csum, from, to, p.len());
+        csum.sum(p);
+        if (csum.get() != 0) {
+            return;
+        }
+    }
+    auto chan_it = _channels.find(h.dst_port);
+    if (chan_it == _channels.end()) {
+        return;
+    }
+    p.trim_front(sizeof(udp_hdr));
+    chan_it->second->_queue.push(udp_datagram(std::make_unique<ipv6_udp_impl::native_datagram>(from, h, std::move(p))));
+}
+
+void ipv6_udp::send(uint16_t src_port, ipv6_address dst, uint16_t dst_port, packet p)
+{
+    auto src = _inet_l4._inet.source_address(dst);
+    auto hdr = p.prepend_header<udp_hdr>();
+    hdr->src_port = src_port;
+    hdr->dst_port = dst_port;
+    hdr->len = p.len();
+    hdr->cksum = 0;
+    *hdr = hton(*hdr);
+
+    checksummer csum;
+    ipv6_traits::udp_pseudo_header_checksum(csum, src, dst, p.len());
+    csum.sum(p);
+    // A zero checksum would mean none (RFC 768)
+    hdr->cksum = csum.get() ? csum.get() : 0xffff;
+
+    _inet_l4.get_l2_dst_address(dst).then([this, dst, p = std::move(p)] (ethernet_address e_dst) mutable {
+        _packetq.emplace_back(ipv6_traits::l4packet{dst, std::move(p), e_dst, ip_protocol_num::udp});
+    });
+}
+
+uint16_t ipv6_udp::next_port(uint16_t port) {
+    return (port + 1) == 0 ? min_anonymous_port : port + 1;
+}
+
+udp_channel
+ipv6_udp::make_channel(uint16_t port) {
+    uint16_t bind_port;
+
+    if (port) {
+        if (_channels.count(port)) {
+            throw std::runtime_error("Address already in use");
+        }
+        bind_port = port;
+    } else {
+        auto starting_port = _next_anonymous_port;
+        while (_channels.count(_next_anonymous_port)) {
+            _next_anonymous_port = next_port(_next_anonymous_port);
+            if (starting_port == _next_anonymous_port) {
+                throw std::runtime_error("No free port");
+            }
+        }
+
+        bind_port = _next_anonymous_port;
+        _next_anonymous_port = next_port(_next_anonymous_port);
+    }
+
+    auto chan_state = make_lw_shared<udp_channel_state>(_queue_size);
+    _channels[bind_port] = chan_state;
+    return udp_channel(std::make_unique<ipv6_udp_impl::native_channel>(*this, bind_port, chan_state));
+}
+
 } /* namespace net */
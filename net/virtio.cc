@@ -33,6 +33,7 @@
 #include <atomic>
 #include <vector>
 #include <queue>
+#include <algorithm>
 #include <fcntl.h>
 #include <linux/vhost.h>
 #include <linux/if_tun.h>
@@ -69,8 +70,14 @@ class device : public net::device {
     boost::program_options::variables_map _opts;
     net::hw_features _hw_features;
     uint64_t _features;
+    // A queue of the tap device for each vhost queue pair.  They are all
+    // attached here, before the shards set up their queues, so that the
+    // number of queues is known up front.
+    std::vector<file_desc> _tap_fds;
+    static constexpr unsigned max_tap_queues = 256;
 
 private:
+    void attach_tap_queues();
     uint64_t setup_features() {
         int64_t seastar_supported_features = VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_NET_F_MRG_RXBUF;
 
@@ -113,8 +120,14 @@ class device : public net::device {
 
 public:
     device(boost::program_options::variables_map opts)
-       : _opts(opts), _features(setup_features())
-       {}
+       : _opts(opts), _features(setup_features()) {
+#ifdef HAVE_OSV
+        if (osv::assigned_virtio::get && osv::assigned_virtio::get()) {
+            return;
+        }
+#endif
+        attach_tap_queues();
+    }
     ethernet_address hw_address() override {
         return { 0x12, 0x23, 0x34, 0x56, 0x67, 0x78 };
     }
@@ -127,9 +140,55 @@ class device : public net::device {
         return _features;
     }
 
+    virtual uint16_t hw_queues_count() override {
+        return std::max<size_t>(_tap_fds.size(), 1);
+    }
+    file_desc take_tap_queue(uint16_t qid) {
+        return std::move(_tap_fds[qid]);
+    }
+
     virtual std::unique_ptr<net::qp> init_local_queue(boost::program_options::variables_map opts, uint16_t qid) override;
 };
 
+constexpr unsigned device::max_tap_queues;
+
+// One queue pair per shard, unless --virtio-queues asks for fewer.  A tap
+// device created without multi_queue only accepts a single attachment
+// without IFF_MULTI_QUEUE, so fall back to one queue for it.
+void device::attach_tap_queues() {
+    auto tap_device = _opts["tap-device"].as<std::string>();
+    assert(tap_device.size() + 1 <= IFNAMSIZ);
+    unsigned nr_queues = 1;
+    if (_opts.count("virtio-queues")) {
+        nr_queues = _opts["virtio-queues"].as<unsigned>();
+        if (!nr_queues) {
+            nr_queues = smp::count;
+        }
+    }
+    nr_queues = std::min({nr_queues, unsigned(smp::count), max_tap_queues});
+    auto attach = [&tap_device] (short flags) {
+        file_desc tap_fd(file_desc::open("/dev/net/tun", O_RDWR | O_NONBLOCK));
+        ifreq ifr = {};
+        ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_ONE_QUEUE | IFF_VNET_HDR | flags;
+        strcpy(ifr.ifr_ifrn.ifrn_name, tap_device.c_str());
+        tap_fd.ioctl(TUNSETIFF, ifr);
+        return tap_fd;
+    };
+    try {
+        while (_tap_fds.size() < nr_queues) {
+            _tap_fds.push_back(attach(IFF_MULTI_QUEUE));
+        }
+    } catch (std::system_error& e) {
+        if (!_tap_fds.empty() || e.code().value() != EINVAL) {
+            throw;
+        }
+        if (nr_queues > 1) {
+            std::cerr << "tap device " << tap_device << " is not multi_queue, using a single virtio queue\n";
+        }
+        _tap_fds.push_back(attach(0));
+    }
+}
+
 /* The virtio_notifier class determines how to do host-to-guest and guest-to-
  * host notifications. We have two different implementations - one for vhost
  * (where both notifications occur through eventfds) and one for an assigned
@@ -440,7 +499,6 @@ template <typename BufferChain, typename Completion>
 bool vring<BufferChain, Completion>::do_complete() {
     auto used_head = _used._shared->_idx.load(std::memory_order_acquire);
     auto count = _used._tail - used_head;
-    _complete.bunch(count);
     while (used_head != _used._tail) {
         auto ue = _used._shared->_used_elements[masked(_used._tail++)];
         _complete(std::move(_buffer_chains[ue._id]), ue._len);
@@ -459,6 +517,8 @@ bool vring<BufferChain, Completion>::do_complete() {
         }
         _free_last = id;
     }
+    // After the buffers, so that the completion can act on all of them
+    _complete.bunch(count);
     return count;
 }
 
@@ -531,11 +591,13 @@ class qp : public net::qp {
             }
             void bunch(uint64_t c) {
                 q.update_rx_count(c);
+                q.deliver_burst();
             }
         };
         qp& _dev;
         vring<single_buffer, complete> _ring;
         unsigned _remaining_buffers = 0;
+        packet_burst _rx_burst;
         std::vector<fragment> _fragments;
         std::vector<std::unique_ptr<char[], free_deleter>> _buffers;
     public:
@@ -555,6 +617,9 @@ class qp : public net::qp {
         void update_rx_count(uint64_t c) {
             _dev._stats.rx.good.update_pkts_bunch(c);
         }
+        void deliver_burst() {
+            _dev._dev->l2receive(_rx_burst);
+        }
     private:
         future<> prepare_buffers();
         void complete_buffer(single_buffer&& b, size_t len);
@@ -573,7 +638,7 @@ class qp : public net::qp {
     void common_config(ring_config& r);
     size_t vring_storage_size(size_t ring_size);
 public:
-    explicit qp(device* dev, size_t rx_ring_size, size_t tx_ring_size);
+    explicit qp(device* dev, uint16_t qid, size_t rx_ring_size, size_t tx_ring_size);
     virtual future<> send(packet p) override {
         abort();
     }
@@ -732,7 +797,7 @@ qp::rxq::complete_buffer(single_buffer&& bc, size_t len) {
 
         _dev._stats.rx.good.update_frags_stats(p.nr_frags(), p.len());
 
-        _dev._dev->l2receive(std::move(p));
+        _rx_burst.push_back(std::move(p));
 
 
         _ring.available_descriptors().signal(_fragments.size());
@@ -749,8 +814,9 @@ static std::unique_ptr<char[], free_deleter> virtio_buffer(size_t size) {
     return std::unique_ptr<char[], free_deleter>(reinterpret_cast<char*>(ret));
 }
 
-qp::qp(device* dev, size_t rx_ring_size, size_t tx_ring_size)
-    : _dev(dev)
+qp::qp(device* dev, uint16_t qid, size_t rx_ring_size, size_t tx_ring_size)
+    : net::qp(false, "network", qid)
+    , _dev(dev)
     , _txq_storage(virtio_buffer(vring_storage_size(tx_ring_size)))
     , _rxq_storage(virtio_buffer(vring_storage_size(rx_ring_size)))
     , _txq(*this, txq_config(tx_ring_size))
@@ -803,7 +869,7 @@ class qp_vhost : public qp {
     // this driver, as as soon as we close it, vhost stops servicing us.
     file_desc _vhost_fd;
 public:
-    qp_vhost(device* dev, boost::program_options::variables_map opts);
+    qp_vhost(device* dev, uint16_t qid, boost::program_options::variables_map opts);
 };
 
 static size_t config_ring_size(boost::program_options::variables_map &opts) {
@@ -814,11 +880,10 @@ static size_t config_ring_size(boost::program_options::variables_map &opts) {
     }
 }
 
-qp_vhost::qp_vhost(device *dev, boost::program_options::variables_map opts)
-    : qp(dev, config_ring_size(opts), config_ring_size(opts))
+qp_vhost::qp_vhost(device *dev, uint16_t qid, boost::program_options::variables_map opts)
+    : qp(dev, qid, config_ring_size(opts), config_ring_size(opts))
     , _vhost_fd(file_desc::open("/dev/vhost-net", O_RDWR))
 {
-    auto tap_device = opts["tap-device"].as<std::string>();
     int64_t vhost_supported_features;
     _vhost_fd.ioctl(VHOST_GET_FEATURES, vhost_supported_features);
     vhost_supported_features &= _dev->features();
@@ -829,17 +894,12 @@ qp_vhost::qp_vhost(device *dev, boost::program_options::variables_map opts)
         _header_len = sizeof(net_hdr);
     }
 
-    // Open and set up the tap device, which we'll tell vhost to use.
-    // Note that the tap_fd we open here will be closed at the end of
-    // this function. It appears that this is fine - i.e., after we pass
-    // this fd to VHOST_NET_SET_BACKEND, the Linux kernel keeps the reference
-    // to it and it's fine to close the file descriptor.
-    file_desc tap_fd(file_desc::open("/dev/net/tun", O_RDWR | O_NONBLOCK));
-    assert(tap_device.size() + 1 <= IFNAMSIZ);
-    ifreq ifr = {};
-    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_ONE_QUEUE | IFF_VNET_HDR;
-    strcpy(ifr.ifr_ifrn.ifrn_name, tap_device.c_str());
-    tap_fd.ioctl(TUNSETIFF, ifr);
+    // Set up this queue of the tap device, which we'll tell vhost to use.
+    // Note that the tap_fd will be closed at the end of this function.
+    // It appears that this is fine - i.e., after we pass this fd to
+    // VHOST_NET_SET_BACKEND, the Linux kernel keeps the reference to it
+    // and it's fine to close the file descriptor.
+    auto tap_fd = dev->take_tap_queue(qid);
     unsigned int offload = 0;
     auto hw_features = _dev->hw_features();
     if (hw_features.tx_csum_l4_offload && hw_features.rx_csum_offload) {
@@ -906,7 +966,7 @@ class qp_osv : public qp {
 
 qp_osv::qp_osv(device *dev, osv::assigned_virtio &virtio,
         boost::program_options::variables_map opts)
-        : qp(dev, virtio.queue_size(0), virtio.queue_size(1))
+        : qp(dev, 0, virtio.queue_size(0), virtio.queue_size(1))
         , _virtio(virtio)
 {
     // Read the host's virtio supported feature bitmask, AND it with the
@@ -971,18 +1031,35 @@ qp_osv::qp_osv(device *dev, osv::assigned_virtio &virtio,
 #endif
 
 std::unique_ptr<net::qp> device::init_local_queue(boost::program_options::variables_map opts, uint16_t qid) {
-    static bool called = false;
-    assert(!qid);
-    assert(!called);
-    called = true;
-
 #ifdef HAVE_OSV
     if (osv::assigned_virtio::get && osv::assigned_virtio::get()) {
+        static bool called = false;
+        assert(!qid);
+        assert(!called);
+        called = true;
         std::cout << "In OSv and assigned host's virtio device\n";
         return std::make_unique<qp_osv>(this, *osv::assigned_virtio::get(), opts);
     }
 #endif
-    return std::make_unique<qp_vhost>(this, opts);
+    assert(qid < hw_queues_count());
+    auto qp = std::make_unique<qp_vhost>(this, qid, opts);
+    if (hw_queues_count() > 1) {
+        // The tap device spreads new flows over its queues by its own hash,
+        // and then delivers a flow's packets to the queue it last sent on,
+        // as long as it keeps sending.  Steer by our hash in software
+        // instead, with the same table on all the queues, so that whichever
+        // queue a packet arrives on, it reaches the shard hash2cpu() gives.
+        std::map<unsigned, float> cpu_weights;
+        for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+            cpu_weights[cpu] = 1;
+            // Relative to the shards without a queue, if any
+            if (cpu < hw_queues_count() && smp::count > hw_queues_count() && opts.count("hw-queue-weight")) {
+                cpu_weights[cpu] = opts["hw-queue-weight"].as<float>();
+            }
+        }
+        qp->build_sw_reta(cpu_weights);
+    }
+    return std::move(qp);
 }
 
 }
@@ -1008,6 +1085,9 @@ get_virtio_net_options_description()
         ("virtio-ring-size",
                 boost::program_options::value<unsigned>()->default_value(256),
                 "Virtio ring size (must be power-of-two)")
+        ("virtio-queues",
+                boost::program_options::value<unsigned>()->default_value(0),
+                "Number of virtio queue pairs, 0 for one per shard (needs a multi_queue tap device)")
         ;
     return opts;
 }
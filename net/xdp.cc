@@ -0,0 +1,371 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "xdp.hh"
+#include "core/reactor.hh"
+#include "core/posix.hh"
+#include "toeplitz.hh"
+#include <xdp/xsk.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <cmath>
+
+using namespace net;
+
+namespace xdp {
+
+class device;
+
+class qp : public net::qp {
+    device* _dev;
+    uint16_t _qid;
+    size_t _frame_size;
+    mmap_area _umem_area;
+    xsk_umem* _umem = nullptr;
+    xsk_socket* _xsk = nullptr;
+    xsk_ring_prod _fill;
+    xsk_ring_cons _comp;
+    xsk_ring_cons _rx;
+    xsk_ring_prod _tx;
+    // UMEM frames owned by neither the kernel nor a packet
+    std::vector<uint64_t> _free_frames;
+    size_t _nr_frames;
+    bool _zero_copy = false;
+    packet_burst _rx_burst;
+    reactor::poller _rx_poller;
+    static constexpr uint32_t rx_burst_size = 64;
+public:
+    explicit qp(device* dev, uint16_t qid, boost::program_options::variables_map opts);
+    virtual ~qp();
+    virtual future<> send(packet p) override {
+        abort();
+    }
+    virtual uint32_t send(circular_buffer<packet>& pkts) override;
+    // Whether the driver DMAs straight into the UMEM
+    bool zero_copy() const { return _zero_copy; }
+private:
+    bool poll_rx_once();
+    void refill();
+    void reclaim_completions();
+    void kick_tx();
+    void free_frame(uint64_t addr) {
+        _free_frames.push_back(addr);
+    }
+    char* frame_data(uint64_t addr) {
+        return static_cast<char*>(xsk_umem__get_data(_umem_area.get(), addr));
+    }
+};
+
+class device : public net::device {
+    sstring _ifname;
+    unsigned _num_queues;
+    ethernet_address _hw_address;
+    net::hw_features _hw_features;
+    rss_key_type _rss_key = default_rsskey_40bytes;
+    std::vector<uint8_t> _redir_table;
+private:
+    file_desc ethtool_socket();
+    unsigned hw_channels();
+    bool set_rss_table();
+public:
+    static constexpr size_t max_frame_len = XSK_UMEM__DEFAULT_FRAME_SIZE
+            - XSK_UMEM__DEFAULT_FRAME_HEADROOM - XDP_PACKET_HEADROOM;
+    device(sstring ifname, unsigned num_queues);
+    const sstring& ifname() const { return _ifname; }
+    virtual ethernet_address hw_address() override { return _hw_address; }
+    virtual net::hw_features hw_features() override { return _hw_features; }
+    virtual uint16_t hw_queues_count() override { return _num_queues; }
+    virtual const rss_key_type& rss_key() const override { return _rss_key; }
+    virtual unsigned hash2qid(uint32_t hash) override {
+        return _redir_table[hash % _redir_table.size()];
+    }
+    virtual std::unique_ptr<net::qp> init_local_queue(boost::program_options::variables_map opts, uint16_t qid) override {
+        return std::make_unique<qp>(this, qid, opts);
+    }
+};
+
+file_desc device::ethtool_socket() {
+    return file_desc::socket(AF_INET, SOCK_DGRAM);
+}
+
+unsigned device::hw_channels() {
+    ethtool_channels ch = {};
+    ch.cmd = ETHTOOL_GCHANNELS;
+    ifreq ifr = {};
+    strncpy(ifr.ifr_name, _ifname.c_str(), IFNAMSIZ - 1);
+    ifr.ifr_data = reinterpret_cast<char*>(&ch);
+    auto fd = ethtool_socket();
+    if (::ioctl(fd.get(), SIOCETHTOOL, &ifr) == -1) {
+        // Drivers without channels, such as older veth, have one queue
+        return 1;
+    }
+    return std::max(1u, std::max(ch.combined_count, ch.rx_count));
+}
+
+// Points the NIC's indirection table at our queues only, and loads our
+// Toeplitz key, so that hash2qid() agrees with the NIC on where a flow
+// arrives.
+bool device::set_rss_table() {
+    auto fd = ethtool_socket();
+    ifreq ifr = {};
+    strncpy(ifr.ifr_name, _ifname.c_str(), IFNAMSIZ - 1);
+
+    ethtool_rxfh sizes = {};
+    sizes.cmd = ETHTOOL_GRSSH;
+    ifr.ifr_data = reinterpret_cast<char*>(&sizes);
+    if (::ioctl(fd.get(), SIOCETHTOOL, &ifr) == -1 || !sizes.indir_size) {
+        return false;
+    }
+    if (sizes.key_size == default_rsskey_52bytes.size()) {
+        _rss_key = default_rsskey_52bytes;
+    } else if (sizes.key_size != default_rsskey_40bytes.size()) {
+        return false;
+    }
+
+    std::vector<char> buf(sizeof(ethtool_rxfh) + sizes.indir_size * sizeof(uint32_t) + sizes.key_size);
+    auto rxfh = reinterpret_cast<ethtool_rxfh*>(buf.data());
+    rxfh->cmd = ETHTOOL_SRSSH;
+    rxfh->indir_size = sizes.indir_size;
+    rxfh->key_size = sizes.key_size;
+    // ETH_RSS_HASH_TOP, which the uapi headers do not export
+    rxfh->hfunc = 1 << 0;
+    _redir_table.resize(sizes.indir_size);
+    for (unsigned i = 0; i < sizes.indir_size; ++i) {
+        _redir_table[i] = rxfh->rss_config[i] = i % _num_queues;
+    }
+    std::copy(_rss_key.begin(), _rss_key.end(), reinterpret_cast<uint8_t*>(rxfh->rss_config + sizes.indir_size));
+    ifr.ifr_data = buf.data();
+    if (::ioctl(fd.get(), SIOCETHTOOL, &ifr) == -1) {
+        return false;
+    }
+    _rss_table_bits = std::lround(std::log2(sizes.indir_size));
+    return true;
+}
+
+device::device(sstring ifname, unsigned num_queues)
+    : _ifname(std::move(ifname)) {
+    auto fd = ethtool_socket();
+    ifreq ifr = {};
+    strncpy(ifr.ifr_name, _ifname.c_str(), IFNAMSIZ - 1);
+    fd.ioctl(SIOCGIFHWADDR, ifr);
+    std::copy_n(reinterpret_cast<uint8_t*>(ifr.ifr_hwaddr.sa_data), 6, _hw_address.mac.begin());
+    fd.ioctl(SIOCGIFMTU, ifr);
+    // Every frame, received or sent, has to fit in a single UMEM frame,
+    // after the headroom the kernel keeps in front of received data
+    if (size_t(ifr.ifr_mtu) + eth_hdr_len > max_frame_len) {
+        throw std::runtime_error("xdp: the MTU of " + _ifname + " is larger than "
+                + to_sstring(max_frame_len - eth_hdr_len) + "; AF_XDP frames are one UMEM frame");
+    }
+    // AF_XDP has no offloads: checksums, segmentation and reassembly all
+    // happen in the stack
+    _hw_features.mtu = ifr.ifr_mtu;
+
+    auto channels = hw_channels();
+    _num_queues = std::min(num_queues, channels);
+    if (channels > 1 && !set_rss_table()) {
+        throw std::runtime_error("xdp: cannot program the RSS table of " + _ifname
+                + "; reduce it to one channel with ethtool -L");
+    }
+    if (_redir_table.empty()) {
+        _redir_table.push_back(0);
+    }
+}
+
+qp::qp(device* dev, uint16_t qid, boost::program_options::variables_map opts)
+    : net::qp(true, "network", qid)
+    , _dev(dev)
+    , _qid(qid)
+    , _frame_size(XSK_UMEM__DEFAULT_FRAME_SIZE)
+    , _nr_frames(opts["xdp-frames"].as<unsigned>())
+    , _rx_poller([this] { return poll_rx_once(); }) {
+    auto size = _nr_frames * _frame_size;
+    _umem_area = mmap_anonymous(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE);
+    xsk_umem_config ucfg = {};
+    ucfg.fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+    ucfg.comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
+    ucfg.frame_size = _frame_size;
+    ucfg.frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM;
+    auto r = xsk_umem__create(&_umem, _umem_area.get(), size, &_fill, &_comp, &ucfg);
+    if (r) {
+        throw std::system_error(-r, std::system_category(), "xsk_umem__create");
+    }
+
+    auto mode = opts["xdp-mode"].as<std::string>();
+    xsk_socket_config scfg = {};
+    scfg.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
+    scfg.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+    r = -EINVAL;
+    if (mode != "copy") {
+        scfg.bind_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+        r = xsk_socket__create(&_xsk, _dev->ifname().c_str(), qid, _umem, &_rx, &_tx, &scfg);
+        _zero_copy = !r;
+    }
+    if (r && mode != "zero-copy") {
+        // The driver cannot DMA into our memory; the kernel copies instead
+        scfg.bind_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+        r = xsk_socket__create(&_xsk, _dev->ifname().c_str(), qid, _umem, &_rx, &_tx, &scfg);
+    }
+    if (r) {
+        xsk_umem__delete(_umem);
+        throw std::system_error(-r, std::system_category(), "xsk_socket__create");
+    }
+
+    _free_frames.reserve(_nr_frames);
+    for (size_t i = 0; i < _nr_frames; ++i) {
+        _free_frames.push_back(i * _frame_size);
+    }
+    refill();
+}
+
+qp::~qp() {
+    xsk_socket__delete(_xsk);
+    xsk_umem__delete(_umem);
+}
+
+void qp::refill() {
+    // Keep half of the frames for transmission and for packets the stack
+    // still holds
+    auto want = std::min<size_t>(xsk_prod_nb_free(&_fill, XSK_RING_PROD__DEFAULT_NUM_DESCS),
+            _free_frames.size() > _nr_frames / 2 ? _free_frames.size() - _nr_frames / 2 : 0);
+    uint32_t idx;
+    auto n = xsk_ring_prod__reserve(&_fill, want, &idx);
+    for (uint32_t i = 0; i < n; ++i) {
+        *xsk_ring_prod__fill_addr(&_fill, idx + i) = _free_frames.back();
+        _free_frames.pop_back();
+    }
+    xsk_ring_prod__submit(&_fill, n);
+    if (xsk_ring_prod__needs_wakeup(&_fill)) {
+        ::recvfrom(xsk_socket__fd(_xsk), nullptr, 0, MSG_DONTWAIT, nullptr, nullptr);
+    }
+}
+
+bool qp::poll_rx_once() {
+    uint32_t idx;
+    auto n = xsk_ring_cons__peek(&_rx, rx_burst_size, &idx);
+    if (!n) {
+        refill();
+        return false;
+    }
+    uint64_t nr_frags = 0, bytes = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        auto desc = xsk_ring_cons__rx_desc(&_rx, idx + i);
+        auto frame = xsk_umem__extract_addr(desc->addr);
+        auto data = frame_data(xsk_umem__add_offset_to_addr(desc->addr));
+        ++nr_frags;
+        bytes += desc->len;
+        if (_free_frames.size() > _nr_frames / 4) {
+            // Hand the frame itself to the stack; it comes back to us when
+            // the packet is freed
+            _rx_burst.push_back(packet(fragment{data, desc->len},
+                    make_deleter(deleter(), [this, frame] { free_frame(frame); })));
+        } else {
+            // Frames are running out, so copy rather than let the stack
+            // starve the fill ring
+            _rx_burst.push_back(packet(fragment{data, desc->len}));
+            _stats.rx.good.update_copy_stats(1, desc->len);
+            free_frame(frame);
+        }
+    }
+    xsk_ring_cons__release(&_rx, n);
+    _stats.rx.good.update_pkts_bunch(n);
+    _stats.rx.good.update_frags_stats(nr_frags, bytes);
+    _dev->l2receive(_rx_burst);
+    refill();
+    return true;
+}
+
+void qp::reclaim_completions() {
+    uint32_t idx;
+    auto n = xsk_ring_cons__peek(&_comp, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx);
+    for (uint32_t i = 0; i < n; ++i) {
+        free_frame(*xsk_ring_cons__comp_addr(&_comp, idx + i));
+    }
+    xsk_ring_cons__release(&_comp, n);
+}
+
+void qp::kick_tx() {
+    if (xsk_ring_prod__needs_wakeup(&_tx)) {
+        ::sendto(xsk_socket__fd(_xsk), nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+    }
+}
+
+uint32_t qp::send(circular_buffer<packet>& pkts) {
+    reclaim_completions();
+    uint32_t idx;
+    auto n = xsk_ring_prod__reserve(&_tx, std::min<size_t>(pkts.size(), _free_frames.size()), &idx);
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        auto p = std::move(pkts.front());
+        pkts.pop_front();
+        auto frame = _free_frames.back();
+        _free_frames.pop_back();
+        // Transmitted data has to be in the UMEM, so copy it there
+        auto len = p.len();
+        assert(len <= _frame_size);
+        auto pos = frame_data(frame);
+        for (auto&& f : p.fragments()) {
+            pos = std::copy_n(f.base, f.size, pos);
+        }
+        auto desc = xsk_ring_prod__tx_desc(&_tx, idx + i);
+        desc->addr = frame;
+        desc->len = len;
+        bytes += len;
+        _stats.tx.good.update_copy_stats(p.nr_frags(), len);
+    }
+    xsk_ring_prod__submit(&_tx, n);
+    _stats.tx.good.update_frags_stats(n, bytes);
+    kick_tx();
+    return n;
+}
+
+}
+
+boost::program_options::options_description
+get_xdp_net_options_description()
+{
+    boost::program_options::options_description opts(
+            "AF_XDP net options");
+    opts.add_options()
+        ("xdp-device",
+                boost::program_options::value<std::string>(),
+                "Use AF_XDP sockets on this interface instead of a tap device")
+        ("xdp-mode",
+                boost::program_options::value<std::string>()->default_value("auto"),
+                "AF_XDP mode (zero-copy / copy / auto: zero-copy if the driver supports it)")
+        ("xdp-frames",
+                boost::program_options::value<unsigned>()->default_value(8192),
+                "Number of UMEM frames per queue")
+        ;
+    return opts;
+}
+
+std::unique_ptr<net::device> create_xdp_net_device(boost::program_options::variables_map opts, unsigned num_queues) {
+    auto mode = opts["xdp-mode"].as<std::string>();
+    if (mode != "auto" && mode != "copy" && mode != "zero-copy") {
+        throw std::runtime_error("xdp: unknown --xdp-mode " + mode + "; use zero-copy, copy or auto");
+    }
+    return std::make_unique<xdp::device>(opts["xdp-device"].as<std::string>(), num_queues);
+}
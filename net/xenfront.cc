@@ -101,6 +101,8 @@ class xenfront_qp : public net::qp {
     grant_head *_tx_refs;
     grant_head *_rx_refs;
 
+    packet_burst _rx_burst;
+
     std::unordered_map<std::string, int> _features;
     static std::unordered_map<std::string, std::string> _supported_features;
 
@@ -258,7 +260,7 @@ future<> xenfront_qp::queue_rx_packet()
     _rx_ring.process_ring([this, &bunch, &bytes] (gntref &entry, rx &rx) mutable {
         packet p(static_cast<char *>(entry.page) + rx.rsp.offset, rx.rsp.status);
 
-        _dev->l2receive(std::move(p));
+        _rx_burst.push_back(std::move(p));
 
         bytes += rx.rsp.status;
         bunch++;
@@ -266,6 +268,7 @@ future<> xenfront_qp::queue_rx_packet()
         return true;
     }, _rx_refs);
 
+    _dev->l2receive(_rx_burst);
     _stats.rx.good.update_pkts_bunch(bunch);
     //
     // Our XEN implementation only supports packets with a single fragment
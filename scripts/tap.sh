@@ -16,12 +16,12 @@
 # under the License.
 #
 
-### Set up a tap device for seastar
+### Set up a tap device for seastar, with a queue for each shard using it
 tap=tap0
 bridge=virbr0
 user=`whoami`
 sudo tunctl -d $tap
-sudo ip tuntap add mode tap dev $tap user $user one_queue vnet_hdr
+sudo ip tuntap add mode tap dev $tap user $user multi_queue vnet_hdr
 sudo ifconfig $tap up
 sudo brctl addif $bridge $tap
 sudo brctl stp $bridge off
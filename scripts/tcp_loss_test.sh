@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# This file is open source software, licensed to you under the terms
+# of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+# distributed with this work for additional information regarding copyright
+# ownership.  You may not use this file except in compliance with the License.
+#
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+### Run tests/tcp_client over the native stack on a tap device (see tap.sh)
+### against tests/tcp_server on the host, with netem dropping packets in both
+### directions.  rxrx exercises the native sender's loss recovery, txtx the
+### receiver's SACK generation, and ping the tail latency added by
+### retransmission timeouts.  Each test runs with the RFC6298 minimum RTO of
+### one second, then with the given one.
+###
+### usage: tcp_loss_test.sh [build mode] [loss] [minimum RTO (ms)]
+
+mode=${1:-release}
+loss=${2:-1%}
+rto_min=${3:-200}
+tap=tap0
+ifb=ifb0
+host=192.168.122.1
+bin=build/$mode/tests
+
+cleanup() {
+    sudo tc qdisc del dev $tap root 2>/dev/null
+    sudo tc qdisc del dev $tap ingress 2>/dev/null
+    sudo tc qdisc del dev $ifb root 2>/dev/null
+    [ -n "$server" ] && kill $server 2>/dev/null
+}
+trap cleanup EXIT
+
+# Host to seastar: netem on the tap's egress
+sudo tc qdisc add dev $tap root netem loss $loss
+# Seastar to host: redirect the tap's ingress through an ifb device
+sudo modprobe ifb numifbs=1
+sudo ip link set dev $ifb up
+sudo tc qdisc add dev $tap handle ffff: ingress
+sudo tc filter add dev $tap parent ffff: protocol ip u32 match u32 0 0 action mirred egress redirect dev $ifb
+sudo tc qdisc add dev $ifb root netem loss $loss
+
+$bin/tcp_server --network-stack posix --smp 1 &
+server=$!
+sleep 1
+
+status=0
+for rto in 1000 $rto_min; do
+    for test in ping rxrx txtx; do
+        echo "== $test, $loss loss, minimum RTO ${rto}ms"
+        if ! timeout 300 $bin/tcp_client --network-stack native --dhcp 0 --smp 1 --conn 4 \
+                --tcp-rto-min $rto --server $host:10000 --test $test; then
+            echo "$test failed with $loss loss"
+            status=1
+        fi
+    done
+done
+exit $status
@@ -37,6 +37,13 @@ boost_tests = [
     'shared_ptr_test',
     'fileiotest',
     'packet_test',
+    'flow_table_test',
+    'loopback_test',
+    'checksum_test',
+    'toeplitz_test',
+    'capture_test',
+    'xdp_test',
+    'posix_stack_test',
 ]
 
 other_tests = [
@@ -46,6 +53,7 @@ other_tests = [
     'allocator_test',
     'directory_test',
     'thread_context_switch',
+    'checksum_perf',
 ]
 
 last_len = 0
@@ -0,0 +1,195 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+
+#include "core/reactor.hh"
+#include "core/future-util.hh"
+#include "net/capture.hh"
+#include "test-utils.hh"
+#include <boost/range/irange.hpp>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+#include <vector>
+#include <stdexcept>
+
+using namespace net;
+
+// An ethernet frame carrying an IPv4 or IPv6 packet with the given
+// transport protocol and ports
+static std::vector<char> make_frame(uint16_t eth_proto, uint8_t ip_proto, uint16_t sport, uint16_t dport) {
+    std::vector<char> f(14 + 40 + 8);
+    f[12] = eth_proto >> 8;
+    f[13] = eth_proto;
+    size_t l4;
+    if (eth_proto == 0x0800) {
+        f[14] = 0x45;
+        f[14 + 9] = ip_proto;
+        l4 = 14 + 20;
+    } else {
+        f[14] = 0x60;
+        f[14 + 6] = ip_proto;
+        l4 = 14 + 40;
+    }
+    f[l4] = sport >> 8;
+    f[l4 + 1] = sport;
+    f[l4 + 2] = dport >> 8;
+    f[l4 + 3] = dport;
+    return f;
+}
+
+static bool matches(const char* expr, const std::vector<char>& frame) {
+    return capture_filter::parse(expr).match(frame.data(), frame.size());
+}
+
+SEASTAR_TEST_CASE(test_empty_filter_matches_everything) {
+    auto f = capture_filter::parse("");
+    BOOST_REQUIRE(f.inbound && f.outbound);
+    BOOST_REQUIRE(matches("", make_frame(0x0806, 0, 0, 0)));
+    BOOST_REQUIRE(capture_filter().match(nullptr, 0));
+    return make_ready_future<>();
+}
+
+SEASTAR_TEST_CASE(test_protocols_and_ports) {
+    auto v4 = make_frame(0x0800, 6, 34567, 80);
+    auto v6 = make_frame(0x86dd, 6, 80, 34567);
+    auto udp = make_frame(0x0800, 17, 53, 80);
+    BOOST_REQUIRE(matches("ip", v4));
+    BOOST_REQUIRE(!matches("ip6", v4));
+    BOOST_REQUIRE(matches("tcp port 80", v4));
+    BOOST_REQUIRE(matches("tcp port 80", v6));
+    BOOST_REQUIRE(!matches("ip tcp port 80", v6));
+    BOOST_REQUIRE(!matches("tcp port 81", v4));
+    BOOST_REQUIRE(!matches("tcp", udp));
+    BOOST_REQUIRE(matches("port 53", udp));
+    BOOST_REQUIRE(!matches("icmp", v4));
+    return make_ready_future<>();
+}
+
+SEASTAR_TEST_CASE(test_later_fragments_have_no_ports) {
+    auto frag = make_frame(0x0800, 17, 53, 53);
+    frag[14 + 6] = 0x00;
+    frag[14 + 7] = 0x10;
+    BOOST_REQUIRE(matches("udp", frag));
+    BOOST_REQUIRE(!matches("udp port 53", frag));
+    return make_ready_future<>();
+}
+
+SEASTAR_TEST_CASE(test_directions_and_errors) {
+    auto in = capture_filter::parse("inbound tcp");
+    BOOST_REQUIRE(in.inbound && !in.outbound);
+    auto out = capture_filter::parse("outbound");
+    BOOST_REQUIRE(!out.inbound && out.outbound);
+    BOOST_REQUIRE_THROW(capture_filter::parse("sctp"), std::invalid_argument);
+    BOOST_REQUIRE_THROW(capture_filter::parse("port"), std::invalid_argument);
+    BOOST_REQUIRE_THROW(capture_filter::parse("port 70000"), std::invalid_argument);
+    return make_ready_future<>();
+}
+
+// A frame of len bytes, in two fragments, whose byte j is tag + j
+static packet tagged_frame(uint8_t tag, size_t len) {
+    std::vector<char> data(len);
+    for (size_t j = 0; j < len; ++j) {
+        data[j] = tag + j;
+    }
+    packet p(data.data(), len / 2);
+    p.append(packet(data.data() + len / 2, len - len / 2));
+    return p;
+}
+
+static size_t tagged_len(uint8_t tag) {
+    return 40 + tag * 7;
+}
+
+template <typename T>
+static T read_le(const std::vector<char>& file, size_t pos) {
+    T v = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        v |= T(uint8_t(file[pos + i])) << (8 * i);
+    }
+    return v;
+}
+
+static future<> yield_times(unsigned n) {
+    auto r = boost::irange(0u, n);
+    return do_for_each(r.begin(), r.end(), [] (unsigned) {
+        return later();
+    });
+}
+
+// Captures to a file through a ring of 16 slots: a burst larger than the
+// ring loses the excess, a later burst fits again once the writer, woken
+// by the first packet, has emptied the ring
+SEASTAR_TEST_CASE(test_capture_to_file) {
+    static constexpr size_t snaplen = 64;
+    static constexpr char file_name[] = "capture_test.pcap";
+    auto c = make_lw_shared<packet_capture>(capture_filter::parse("inbound"), snaplen, 0);
+    return c->start(file_name).then([c] {
+        // Filtered out: neither captured nor dropped
+        c->capture(packet_capture::direction::outbound, tagged_frame(100, 60));
+        for (uint8_t tag = 0; tag < 20; ++tag) {
+            c->capture(packet_capture::direction::inbound, tagged_frame(tag, tagged_len(tag)));
+        }
+        BOOST_REQUIRE_EQUAL(c->captured(), 16u);
+        BOOST_REQUIRE_EQUAL(c->dropped(), 4u);
+        return yield_times(10);
+    }).then([c] {
+        for (uint8_t tag = 20; tag < 36; ++tag) {
+            c->capture(packet_capture::direction::inbound, tagged_frame(tag, tagged_len(tag)));
+        }
+        BOOST_REQUIRE_EQUAL(c->captured(), 32u);
+        BOOST_REQUIRE_EQUAL(c->dropped(), 4u);
+        return c->stop();
+    }).then([c] {
+        std::ifstream in(file_name, std::ios::binary);
+        std::vector<char> file{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+        ::unlink(file_name);
+        // Global header
+        BOOST_REQUIRE(file.size() >= 24);
+        BOOST_REQUIRE_EQUAL(read_le<uint32_t>(file, 0), 0xa1b2c3d4);
+        BOOST_REQUIRE_EQUAL(read_le<uint16_t>(file, 4), 2u);
+        BOOST_REQUIRE_EQUAL(read_le<uint16_t>(file, 6), 4u);
+        BOOST_REQUIRE_EQUAL(read_le<uint32_t>(file, 16), snaplen);
+        BOOST_REQUIRE_EQUAL(read_le<uint32_t>(file, 20), 1u);
+        // Records of the first 16 packets and of the last 16
+        size_t pos = 24;
+        std::vector<uint8_t> tags;
+        for (uint8_t tag = 0; tag < 16; ++tag) {
+            tags.push_back(tag);
+        }
+        for (uint8_t tag = 20; tag < 36; ++tag) {
+            tags.push_back(tag);
+        }
+        for (auto tag : tags) {
+            auto len = tagged_len(tag);
+            auto caplen = std::min(len, snaplen);
+            BOOST_REQUIRE(file.size() >= pos + 16 + caplen);
+            BOOST_REQUIRE_EQUAL(read_le<uint32_t>(file, pos + 8), caplen);
+            BOOST_REQUIRE_EQUAL(read_le<uint32_t>(file, pos + 12), len);
+            pos += 16;
+            for (size_t j = 0; j < caplen; ++j) {
+                BOOST_REQUIRE_EQUAL(uint8_t(file[pos + j]), uint8_t(tag + j));
+            }
+            pos += caplen;
+        }
+        BOOST_REQUIRE_EQUAL(file.size(), pos);
+    });
+}
@@ -0,0 +1,61 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+
+// Throughput of each checksum kernel this cpu supports, over packet sized
+// buffers that stay in cache.
+
+#include "net/ip_checksum.hh"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+using namespace net;
+
+int main(int ac, char** av) {
+    using clock = std::chrono::steady_clock;
+    std::vector<char> data(65536);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = i * 7;
+    }
+    std::cout << std::setw(8) << "size";
+    auto kernels = checksum_kernels();
+    for (auto&& k : kernels) {
+        std::cout << std::setw(12) << k.name;
+    }
+    std::cout << "  (Gbit/s)\n";
+    for (size_t size : {64, 128, 256, 576, 1500, 4096, 9000, 65536}) {
+        std::cout << std::setw(8) << size;
+        for (auto&& k : kernels) {
+            size_t iterations = (size_t(1) << 28) / size;
+            volatile uint16_t sink = 0;
+            auto start = clock::now();
+            for (size_t i = 0; i < iterations; ++i) {
+                sink = k.sum(data.data(), size) + sink;
+            }
+            std::chrono::duration<double> t = clock::now() - start;
+            std::cout << std::setw(12) << std::fixed << std::setprecision(1)
+                    << size * iterations * 8 / t.count() / 1e9;
+        }
+        std::cout << "\n";
+    }
+    return 0;
+}
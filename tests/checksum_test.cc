@@ -0,0 +1,99 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "net/ip_checksum.hh"
+#include <random>
+
+using namespace net;
+
+// RFC 1071, a byte at a time
+static uint16_t reference_checksum(const char* data, size_t len) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < len; ++i) {
+        sum += uint8_t(data[i]) << (i & 1 ? 0 : 8);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum & 0xffff;
+}
+
+static std::vector<char> random_data(std::default_random_engine& e, size_t len) {
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::vector<char> data(len);
+    for (auto& c : data) {
+        c = byte(e);
+    }
+    return data;
+}
+
+BOOST_AUTO_TEST_CASE(test_kernels_match_reference) {
+    std::default_random_engine e;
+    auto data = random_data(e, 4096 + 64);
+    for (auto&& k : checksum_kernels()) {
+        BOOST_TEST_MESSAGE("kernel " << k.name);
+        for (size_t offset = 0; offset < 64; offset += 7) {
+            for (size_t len = 0; len <= 4096; len += len < 300 ? 2 : 98) {
+                auto p = data.data() + offset;
+                uint16_t expected = ~reference_checksum(p, len);
+                uint16_t sum = k.sum(p, len);
+                // 0 and 0xffff are the same in ones' complement
+                BOOST_REQUIRE_EQUAL(sum % 0xffff, expected % 0xffff);
+            }
+        }
+        // Wide accumulators must not wrap on all-ones data
+        std::vector<char> ones(65536, char(0xff));
+        BOOST_REQUIRE_EQUAL(k.sum(ones.data(), ones.size()), 0xffff);
+        std::vector<char> zeros(1500);
+        BOOST_REQUIRE_EQUAL(k.sum(zeros.data(), zeros.size()), 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_ip_checksum_matches_reference) {
+    std::default_random_engine e;
+    for (size_t len = 0; len < 2000; ++len) {
+        auto data = random_data(e, len);
+        BOOST_REQUIRE_EQUAL(ntohs(ip_checksum(data.data(), len)),
+                reference_checksum(data.data(), len));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_fragmented_packet) {
+    std::default_random_engine e;
+    std::uniform_int_distribution<size_t> frag_len(1, 200);
+    for (int i = 0; i < 1000; ++i) {
+        auto data = random_data(e, 1 + i * 9);
+        packet p;
+        for (size_t off = 0; off < data.size();) {
+            auto n = std::min(frag_len(e), data.size() - off);
+            p.append(packet(data.data() + off, n));
+            off += n;
+        }
+        checksummer csum;
+        csum.sum(p);
+        BOOST_REQUIRE_EQUAL(ntohs(csum.get()), reference_checksum(data.data(), data.size()));
+    }
+}
@@ -69,3 +69,48 @@ SEASTAR_TEST_CASE(test1) {
 }
 
 
+
+SEASTAR_TEST_CASE(test_copy_file) {
+    // Note: the source size is deliberately not a multiple of the DMA
+    // alignment, to exercise copying the tail.
+    static constexpr size_t blocks = 10;
+    static constexpr size_t size = blocks * 4096 - 100;
+    return file_exists("copytest.tmp").then([] (bool exists) {
+        return exists ? remove_file("copytest.tmp") : make_ready_future<>();
+    }).then([] {
+        return open_file_dma("copytest-src.tmp", open_flags::rw | open_flags::create | open_flags::truncate);
+    }).then([] (file f) {
+        auto wbuf = allocate_aligned_buffer<unsigned char>(blocks * 4096, 4096);
+        for (size_t i = 0; i < blocks * 4096; ++i) {
+            wbuf[i] = i * 7;
+        }
+        auto wb = wbuf.get();
+        return f.dma_write(0, wb, blocks * 4096).then([f, wbuf = std::move(wbuf)] (size_t ret) mutable {
+            BOOST_REQUIRE(ret == blocks * 4096);
+            return f.truncate(size);
+        }).then([f] () mutable {
+            return f.close();
+        });
+    }).then([] {
+        file_copy_options options;
+        options.chunk_size = 4096;
+        return copy_file("copytest-src.tmp", "copytest.tmp", options);
+    }).then([] {
+        return file_size("copytest.tmp");
+    }).then([] (uint64_t copied_size) {
+        BOOST_REQUIRE_EQUAL(copied_size, size);
+        return open_file_dma("copytest.tmp", open_flags::ro);
+    }).then([] (file f) {
+        return f.dma_read<unsigned char>(0, size).then([f] (temporary_buffer<unsigned char> rbuf) mutable {
+            BOOST_REQUIRE_EQUAL(rbuf.size(), size);
+            for (size_t i = 0; i < size; ++i) {
+                BOOST_REQUIRE_EQUAL(rbuf[i], (unsigned char)(i * 7));
+            }
+            return f.close();
+        });
+    }).then([] {
+        return remove_file("copytest.tmp").then([] {
+            return remove_file("copytest-src.tmp");
+        });
+    });
+}
@@ -0,0 +1,94 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "net/flow_table.hh"
+#include <unordered_map>
+#include <random>
+
+using namespace net;
+
+BOOST_AUTO_TEST_CASE(test_insert_find_erase) {
+    flow_table<int, int> t;
+    BOOST_REQUIRE(t.empty());
+    t.insert(1, 10, 100);
+    t.insert(2, 20, 200);
+    BOOST_REQUIRE_EQUAL(t.size(), 2);
+    BOOST_REQUIRE_EQUAL(*t.find(1, 10), 100);
+    BOOST_REQUIRE_EQUAL(*t.find(2, 20), 200);
+    BOOST_REQUIRE(!t.find(3, 30));
+    // Same key with another hash is another flow
+    BOOST_REQUIRE(!t.find(1, 20));
+    BOOST_REQUIRE(t.erase(1, 10));
+    BOOST_REQUIRE(!t.erase(1, 10));
+    BOOST_REQUIRE(!t.find(1, 10));
+    BOOST_REQUIRE_EQUAL(*t.find(2, 20), 200);
+    BOOST_REQUIRE_EQUAL(t.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_erase_within_cluster) {
+    flow_table<int, int> t(8);
+    // 1, 2 and 3 share home slot 7 and wrap around; 4 lives in slot 1
+    t.insert(1, 7, 1);
+    t.insert(2, 15, 2);
+    t.insert(3, 7, 3);
+    BOOST_REQUIRE(t.erase(1, 7));
+    BOOST_REQUIRE_EQUAL(*t.find(2, 15), 2);
+    BOOST_REQUIRE_EQUAL(*t.find(3, 7), 3);
+    t.insert(4, 1, 4);
+    BOOST_REQUIRE(t.erase(2, 15));
+    BOOST_REQUIRE_EQUAL(*t.find(3, 7), 3);
+    BOOST_REQUIRE_EQUAL(*t.find(4, 1), 4);
+    BOOST_REQUIRE(t.erase(3, 7));
+    BOOST_REQUIRE_EQUAL(*t.find(4, 1), 4);
+    BOOST_REQUIRE_EQUAL(t.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_against_unordered_map) {
+    flow_table<uint32_t, uint32_t> t(4);
+    std::unordered_map<uint32_t, uint32_t> ref;
+    std::default_random_engine e;
+    // Few hash bits so that long clusters form
+    auto hash = [] (uint32_t k) { return (k * 2654435761u) & 0x3f; };
+    for (int i = 0; i < 100000; ++i) {
+        uint32_t k = e() % 512;
+        if (ref.count(k)) {
+            BOOST_REQUIRE_EQUAL(*t.find(k, hash(k)), ref[k]);
+            if (e() % 2) {
+                BOOST_REQUIRE(t.erase(k, hash(k)));
+                ref.erase(k);
+            }
+        } else {
+            BOOST_REQUIRE(!t.find(k, hash(k)));
+            t.insert(k, hash(k), i);
+            ref[k] = i;
+        }
+        BOOST_REQUIRE_EQUAL(t.size(), ref.size());
+    }
+    for (auto&& x : ref) {
+        BOOST_REQUIRE_EQUAL(*t.find(x.first, hash(x.first)), x.second);
+    }
+}
@@ -0,0 +1,797 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+
+#include "core/reactor.hh"
+#include "core/future-util.hh"
+#include "core/sleep.hh"
+#include "net/loopback.hh"
+#include "net/proxy.hh"
+#include "net/ip.hh"
+#include "net/ipv6.hh"
+#include "net/tcp.hh"
+#include "test-utils.hh"
+#include <boost/range/irange.hpp>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+
+using namespace net;
+using tcp4 = tcp<ipv4_traits>;
+using tcp6 = tcp<ipv6_traits>;
+
+static constexpr size_t chunk_size = 4096;
+
+static uint8_t pattern(size_t pos) {
+    return pos % 251;
+}
+
+struct loopback_host {
+    interface netif;
+    ipv4 inet;
+    ipv6 inet6;
+    loopback_host(std::shared_ptr<device> dev, ipv4_address addr)
+            : netif(std::move(dev)), inet(&netif), inet6(&netif) {
+        inet.set_host_address(addr);
+        inet.set_netmask_address(ipv4_address("255.255.255.0"));
+        inet.get_tcp().set_rto_min(std::chrono::milliseconds(10));
+        inet6.get_tcp().set_rto_min(std::chrono::milliseconds(10));
+    }
+};
+
+// Sets up this shard's queue of dev as the native stack does, for stacks
+// on the first nr_shards shards: those up to hw_queues_count() have a
+// queue of their own, the others a proxy
+static void set_up_local_queue(device& dev, unsigned nr_shards) {
+    auto qid = engine().cpu_id();
+    auto nr_queues = dev.hw_queues_count();
+    if (qid >= nr_queues) {
+        dev.set_local_queue(create_proxy_net_device(qid % nr_queues, &dev));
+        return;
+    }
+    auto qp = dev.init_local_queue(boost::program_options::variables_map(), qid);
+    std::map<unsigned, float> cpu_weights;
+    for (unsigned cpu = nr_queues + qid; cpu < nr_shards; cpu += nr_queues) {
+        cpu_weights[cpu] = 1;
+    }
+    cpu_weights[qid] = 1;
+    qp->configure_proxies(cpu_weights);
+    dev.set_local_queue(std::move(qp));
+}
+
+// Creates a host on this shard, with the shard's queue of dev; the hosts
+// on dev span nr_shards shards.  The queue calls into the host's interface
+// until the reactor stops, so the host lives until then too; it is
+// destroyed first, as at_destroy() tasks run in order.
+static loopback_host* make_host(std::shared_ptr<device> dev, ipv4_address addr, unsigned nr_shards = 1) {
+    auto host = make_lw_shared<std::unique_ptr<loopback_host>>();
+    engine().at_destroy([host] { host->reset(); });
+    set_up_local_queue(*dev, nr_shards);
+    *host = std::make_unique<loopback_host>(std::move(dev), addr);
+    return host->get();
+}
+
+static socket_address make_ipv6_address(const ipv6_address& ip, uint16_t port) {
+    sockaddr_in6 sa = {};
+    sa.sin6_family = AF_INET6;
+    sa.sin6_port = htons(port);
+    std::copy(ip.bytes.begin(), ip.bytes.end(), sa.sin6_addr.s6_addr);
+    return socket_address(sa);
+}
+
+// Reads a connection until the remote closes it, checking that the data
+// follows pattern(), and resolves to its length.  before_read runs before
+// waiting for each read.
+template <typename Connection>
+static future<size_t> receive_all(lw_shared_ptr<Connection> conn,
+        std::function<future<> (Connection&)> before_read = {}) {
+    auto pos = make_lw_shared<size_t>(0);
+    return repeat([conn, pos, before_read] {
+        auto ready = before_read ? before_read(*conn) : make_ready_future<>();
+        return ready.then([conn] {
+            return conn->wait_for_data();
+        }).then([conn, pos] {
+            auto p = conn->read();
+            if (!p.len()) {
+                return stop_iteration::yes;
+            }
+            for (auto&& f : p.fragments()) {
+                for (size_t i = 0; i < f.size; ++i) {
+                    BOOST_REQUIRE_EQUAL(uint8_t(f.base[i]), pattern(*pos + i));
+                }
+                *pos += f.size;
+            }
+            return stop_iteration::no;
+        });
+    }).then([pos] {
+        return *pos;
+    });
+}
+
+// Sends chunks following pattern(), then closes the connection for writing
+template <typename Connection>
+static future<> send_all(lw_shared_ptr<Connection> conn, size_t chunks) {
+    auto i = make_lw_shared<size_t>(0);
+    return do_until([i, chunks] { return *i == chunks; }, [conn, i] {
+        std::vector<char> data(chunk_size);
+        for (size_t j = 0; j < chunk_size; ++j) {
+            data[j] = pattern(*i * chunk_size + j);
+        }
+        ++*i;
+        return conn->send(packet(data.data(), data.size()));
+    }).then([conn] {
+        conn->close_write();
+    });
+}
+
+// Sends chunks from one TCP stack to another, listening on port 10000 of
+// server_addr, and checks that the receiver gets every byte, in order.
+// The receiver runs before_read before waiting for each read.
+template <typename Tcp>
+static future<> transfer(Tcp& client, Tcp& server, socket_address server_addr, size_t chunks,
+        std::function<future<> (typename Tcp::connection&)> before_read = {}) {
+    using connection = typename Tcp::connection;
+    auto listener = make_lw_shared<typename Tcp::listener>(server.listen(10000));
+    auto received = listener->accept().then([before_read = std::move(before_read)] (connection c) {
+        auto conn = make_lw_shared<connection>(std::move(c));
+        return receive_all(conn, before_read).then([conn] (size_t len) {
+            conn->close_write();
+            return len;
+        });
+    });
+    auto sent = client.connect(server_addr).then([chunks] (connection c) {
+        return send_all(make_lw_shared<connection>(std::move(c)), chunks);
+    });
+    return sent.then([received = std::move(received)] () mutable {
+        return std::move(received);
+    }).then([listener, chunks] (size_t total) {
+        BOOST_REQUIRE_EQUAL(total, chunks * chunk_size);
+    });
+}
+
+static future<> check_transfer(loopback_link_config config, size_t chunks) {
+    auto devs = create_loopback_net_device_pair(config, 1);
+    auto client = make_host(devs.first, ipv4_address("10.0.0.1"));
+    auto server = make_host(devs.second, ipv4_address("10.0.0.2"));
+    return transfer(client->inet.get_tcp(), server->inet.get_tcp(),
+            make_ipv4_address({"10.0.0.2", 10000}), chunks);
+}
+
+SEASTAR_TEST_CASE(test_clean_link) {
+    return check_transfer(loopback_link_config(), 256);
+}
+
+SEASTAR_TEST_CASE(test_slow_link) {
+    loopback_link_config config;
+    config.latency = std::chrono::milliseconds(1);
+    config.bandwidth = 100 << 20;
+    return check_transfer(config, 256);
+}
+
+SEASTAR_TEST_CASE(test_lossy_link) {
+    loopback_link_config config;
+    config.latency = std::chrono::microseconds(200);
+    config.loss = 0.01;
+    config.reorder = 0.05;
+    config.seed = 1;
+    return check_transfer(config, 256);
+}
+
+// A TCP segment of a capture; sequence numbers as on the wire
+struct captured_segment {
+    uint32_t src_ip;
+    uint32_t seq;
+    uint32_t ack;
+    bool syn;
+    uint32_t len;
+    std::vector<std::pair<uint32_t, uint32_t>> sack_blocks;
+};
+
+static uint32_t read_be(const std::vector<char>& f, size_t pos, size_t n) {
+    uint32_t v = 0;
+    for (size_t i = 0; i < n; ++i) {
+        v = v << 8 | uint8_t(f[pos + i]);
+    }
+    return v;
+}
+
+// Reads the IPv4 TCP segments of a pcap file written by packet_capture,
+// in capture order, and removes the file
+static std::vector<captured_segment> read_tcp_capture(const char* file_name) {
+    std::ifstream in(file_name, std::ios::binary);
+    std::vector<char> f{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    ::unlink(file_name);
+    std::vector<captured_segment> segs;
+    // Records follow the 24 byte global header; their header is in host
+    // order, the frames as on the wire
+    for (size_t pos = 24; pos + 16 <= f.size();) {
+        uint32_t caplen;
+        std::copy_n(&f[pos + 8], 4, reinterpret_cast<char*>(&caplen));
+        auto frame = pos + 16;
+        pos = frame + caplen;
+        BOOST_REQUIRE_LE(pos, f.size());
+        if (caplen < 34 || read_be(f, frame + 12, 2) != uint16_t(eth_protocol_num::ipv4)) {
+            continue;
+        }
+        auto ip = frame + 14;
+        auto ihl = (f[ip] & 0xf) * 4;
+        auto tcp = ip + ihl;
+        BOOST_REQUIRE_LE(tcp + 20, pos);
+        auto doff = (uint8_t(f[tcp + 12]) >> 4) * 4;
+        captured_segment seg;
+        seg.src_ip = read_be(f, ip + 12, 4);
+        seg.seq = read_be(f, tcp + 4, 4);
+        seg.ack = read_be(f, tcp + 8, 4);
+        seg.syn = f[tcp + 13] & 0x02;
+        seg.len = read_be(f, ip + 2, 2) - ihl - doff;
+        BOOST_REQUIRE_LE(tcp + doff, pos);
+        for (auto opt = tcp + 20; opt < tcp + doff && f[opt] != 0;) {
+            if (f[opt] == 1) {
+                ++opt;
+                continue;
+            }
+            auto len = uint8_t(f[opt + 1]);
+            if (f[opt] == 5) {
+                for (auto e = opt + 2; e + 8 <= opt + len; e += 8) {
+                    seg.sack_blocks.emplace_back(read_be(f, e, 4), read_be(f, e + 4, 4));
+                }
+            }
+            opt += std::max<uint8_t>(len, 2);
+        }
+        segs.push_back(std::move(seg));
+    }
+    return segs;
+}
+
+// Retransmitted data of a capture of the sender, and the data a sender
+// resending everything past the cumulative ACK would have retransmitted:
+// from the first hole of each loss episode to the highest sequence sent
+static std::pair<uint64_t, uint64_t> retransmitted_bytes(const std::vector<captured_segment>& sent) {
+    auto isn = sent.front().seq;
+    uint64_t high = 0, episode_end = 0, holes = 0, go_back_n = 0;
+    for (auto&& seg : sent) {
+        if (seg.syn || !seg.len) {
+            continue;
+        }
+        uint64_t start = uint32_t(seg.seq - isn);
+        if (start < high) {
+            holes += seg.len;
+            if (start >= episode_end) {
+                go_back_n += high - start;
+                episode_end = high;
+            }
+        }
+        high = std::max(high, start + seg.len);
+    }
+    return { holes, go_back_n };
+}
+
+// Over a lossy link, the sender retransmits only the holes left by the
+// receiver's SACK blocks, and the receiver reports, above its cumulative
+// ACK, data that it actually holds out of order
+SEASTAR_TEST_CASE(test_sack_retransmits_holes_only) {
+    static constexpr char client_file[] = "sack_client.pcap";
+    static constexpr char server_file[] = "sack_server.pcap";
+    loopback_link_config config;
+    config.latency = std::chrono::microseconds(200);
+    config.loss = 0.03;
+    config.reorder = 0.05;
+    config.seed = 2;
+    auto devs = create_loopback_net_device_pair(config, 1);
+    auto client = make_host(devs.first, ipv4_address("10.0.0.1"));
+    auto server = make_host(devs.second, ipv4_address("10.0.0.2"));
+    return client->netif.start_capture(client_file, capture_filter::parse("outbound tcp")).then([server] {
+        return server->netif.start_capture(server_file, capture_filter::parse("tcp"));
+    }).then([client, server] {
+        return transfer(client->inet.get_tcp(), server->inet.get_tcp(),
+                make_ipv4_address({"10.0.0.2", 10000}), 256);
+    }).then([client] {
+        return client->netif.stop_capture();
+    }).then([server] {
+        return server->netif.stop_capture();
+    }).then([] {
+        auto sent = read_tcp_capture(client_file);
+        BOOST_REQUIRE(!sent.empty() && sent.front().syn);
+        auto r = retransmitted_bytes(sent);
+        BOOST_REQUIRE_GT(r.first, 0u);
+        BOOST_REQUIRE_LT(r.first, r.second);
+
+        // The server sees the client's segments and sends its ACKs in
+        // order; every SACK block must be data it has received
+        auto client_ip = ipv4_address("10.0.0.1").ip;
+        auto seen = read_tcp_capture(server_file);
+        auto syn = std::find_if(seen.begin(), seen.end(), [client_ip] (const captured_segment& s) {
+            return s.src_ip == client_ip && s.syn;
+        });
+        BOOST_REQUIRE(syn != seen.end());
+        auto isn = syn->seq;
+        std::vector<bool> received;
+        unsigned acks_with_sack = 0;
+        for (auto&& seg : seen) {
+            if (seg.src_ip == client_ip) {
+                uint32_t start = seg.seq - isn;
+                if (seg.len && !seg.syn) {
+                    received.resize(std::max<size_t>(received.size(), start + seg.len));
+                    std::fill_n(received.begin() + start, seg.len, true);
+                }
+                continue;
+            }
+            acks_with_sack += !seg.sack_blocks.empty();
+            uint32_t ack = seg.ack - isn;
+            for (auto&& b : seg.sack_blocks) {
+                uint32_t left = b.first - isn;
+                uint32_t right = b.second - isn;
+                BOOST_REQUIRE_GT(left, ack);
+                BOOST_REQUIRE_GT(right, left);
+                BOOST_REQUIRE_LE(right, received.size());
+                BOOST_REQUIRE(std::all_of(received.begin() + left, received.begin() + right, [] (bool b) { return b; }));
+            }
+        }
+        BOOST_REQUIRE_GT(acks_with_sack, 0u);
+    });
+}
+
+// Resolves a neighbor whose ARP owner shard has no stack on the interface:
+// the stacks here live on this shard only
+SEASTAR_TEST_CASE(test_arp_owner_without_stack) {
+    auto devs = create_loopback_net_device_pair(loopback_link_config(), 1);
+    uint32_t ip = ipv4_address("10.0.0.2").ip;
+    while (smp::count > 1 && std::hash<ipv4_address>()(ipv4_address(ip)) % smp::count == engine().cpu_id()) {
+        ++ip;
+    }
+    auto client = make_host(devs.first, ipv4_address("10.0.0.1"));
+    auto server = make_host(devs.second, ipv4_address(ip));
+    return client->inet.get_l2_dst_address(ipv4_address(ip)).then([server] (ethernet_address l2) {
+        BOOST_REQUIRE(l2.mac == server->netif.hw_address().mac);
+    });
+}
+
+// The far end of a link without a stack, which sees the ARP queries for
+// arp_peer::ip at the device and answers them while answering is set
+struct arp_peer {
+    static ipv4_address ip() { return ipv4_address("10.0.0.2"); }
+    std::shared_ptr<device> dev;
+    // Queries broadcast while resolving, and sent to us while probing
+    unsigned broadcasts = 0;
+    unsigned probes = 0;
+    bool answering = true;
+    subscription<packet> rx;
+    explicit arp_peer(std::shared_ptr<device> d)
+        : dev(std::move(d))
+        , rx(dev->receive([this] (packet p) {
+            handle(std::move(p));
+            return make_ready_future<>();
+        })) {
+    }
+    void handle(packet p) {
+        p.linearize();
+        auto q = p.frag(0).base;
+        auto query_for = [q] (size_t off) { return ipv4_address(ntoh(*reinterpret_cast<const packed<uint32_t>*>(q + off))); };
+        if (p.len() < 42 || uint8_t(q[12]) != 0x08 || uint8_t(q[13]) != 0x06 || q[21] != 1 || query_for(38) != ip()) {
+            return;
+        }
+        auto broadcast = std::all_of(q, q + 6, [] (char c) { return uint8_t(c) == 0xff; });
+        ++(broadcast ? broadcasts : probes);
+        if (!answering) {
+            return;
+        }
+        std::vector<char> r(42);
+        auto self = dev->hw_address();
+        std::copy(q + 6, q + 12, r.begin());
+        std::copy(self.mac.begin(), self.mac.end(), r.begin() + 6);
+        const uint8_t arp_reply_hdr[] = { 0x08, 0x06, 0, 1, 0x08, 0, 6, 4, 0, 2 };
+        std::copy(std::begin(arp_reply_hdr), std::end(arp_reply_hdr), r.begin() + 12);
+        std::copy(self.mac.begin(), self.mac.end(), r.begin() + 22);
+        std::copy(q + 38, q + 42, r.begin() + 28);
+        std::copy(q + 22, q + 32, r.begin() + 32);
+        // Not from within the device's receive path
+        later().then([this, r = std::move(r)] {
+            circular_buffer<packet> out;
+            out.push_back(packet(r.data(), r.size()));
+            dev->local_queue().send(out);
+        });
+    }
+};
+
+// Created as make_host() creates hosts
+static arp_peer* make_arp_peer(std::shared_ptr<device> dev) {
+    auto peer = make_lw_shared<std::unique_ptr<arp_peer>>();
+    engine().at_destroy([peer] { peer->reset(); });
+    set_up_local_queue(*dev, 1);
+    *peer = std::make_unique<arp_peer>(std::move(dev));
+    return peer->get();
+}
+
+// A client on devs.first with timers short enough for tests, and a peer
+// on devs.second
+static std::pair<loopback_host*, arp_peer*> make_arp_hosts() {
+    auto devs = create_loopback_net_device_pair(loopback_link_config(), 1);
+    auto client = make_host(devs.first, ipv4_address("10.0.0.1"));
+    neighbor_timing timing;
+    timing.reachable_time = std::chrono::milliseconds(200);
+    timing.refresh_margin = std::chrono::milliseconds(100);
+    timing.stale_time = std::chrono::milliseconds(600);
+    timing.retransmit_time = std::chrono::milliseconds(20);
+    client->inet.set_arp_timing(timing);
+    return { client, make_arp_peer(devs.second) };
+}
+
+// Whether the peer is resolved from the cache, without waiting for a reply
+static bool resolved(loopback_host* client) {
+    auto f = client->inet.get_l2_dst_address(arp_peer::ip());
+    return f.available() && !f.failed();
+}
+
+// Calls func every 5ms for a while
+static future<> for_a_while(std::chrono::milliseconds t, std::function<void ()> func) {
+    auto end = std::chrono::steady_clock::now() + t;
+    return do_until([end] { return std::chrono::steady_clock::now() >= end; }, [func] {
+        func();
+        return sleep(std::chrono::milliseconds(5));
+    });
+}
+
+// An unanswered lookup fails after a retransmit time; the address is
+// queried max_probes times in all, then forgotten
+SEASTAR_TEST_CASE(test_arp_incomplete_times_out) {
+    auto hosts = make_arp_hosts();
+    auto client = hosts.first;
+    auto peer = hosts.second;
+    peer->answering = false;
+    return client->inet.get_l2_dst_address(arp_peer::ip()).then_wrapped([] (future<ethernet_address> f) {
+        BOOST_REQUIRE_THROW(f.get(), arp_timeout_error);
+        return sleep(std::chrono::milliseconds(300));
+    }).then([client, peer] {
+        BOOST_REQUIRE_EQUAL(peer->broadcasts, 3u);
+        BOOST_REQUIRE_EQUAL(peer->probes, 0u);
+        // Forgotten, so looked up afresh
+        peer->answering = true;
+        return client->inet.get_l2_dst_address(arp_peer::ip());
+    }).then([peer] (ethernet_address l2) {
+        BOOST_REQUIRE(l2.mac == peer->dev->hw_address().mac);
+        BOOST_REQUIRE_EQUAL(peer->broadcasts, 4u);
+    });
+}
+
+// A neighbor in use is probed before it would go stale, and stays
+// reachable as long as it answers
+SEASTAR_TEST_CASE(test_arp_refresh_keeps_neighbor_reachable) {
+    auto hosts = make_arp_hosts();
+    auto client = hosts.first;
+    auto peer = hosts.second;
+    auto misses = make_lw_shared<unsigned>(0);
+    return client->inet.get_l2_dst_address(arp_peer::ip()).then([client, misses] (ethernet_address) {
+        return for_a_while(std::chrono::milliseconds(600), [client, misses] {
+            *misses += !resolved(client);
+        });
+    }).then([peer, misses] {
+        BOOST_REQUIRE_EQUAL(*misses, 0u);
+        BOOST_REQUIRE_EQUAL(peer->broadcasts, 1u);
+        BOOST_REQUIRE_GE(peer->probes, 2u);
+    });
+}
+
+// A neighbor in use that stops answering goes stale, is still used while
+// being probed, and is dropped stale_time after its last confirmation
+SEASTAR_TEST_CASE(test_arp_stale_neighbor_is_probed_then_evicted) {
+    auto hosts = make_arp_hosts();
+    auto client = hosts.first;
+    auto peer = hosts.second;
+    auto misses = make_lw_shared<unsigned>(0);
+    return client->inet.get_l2_dst_address(arp_peer::ip()).then([client, peer, misses] (ethernet_address) {
+        peer->answering = false;
+        return for_a_while(std::chrono::milliseconds(350), [client, misses] {
+            *misses += !resolved(client);
+        });
+    }).then([client, peer, misses] {
+        BOOST_REQUIRE_EQUAL(*misses, 0u);
+        BOOST_REQUIRE_GE(peer->probes, 2u);
+        auto tries = make_lw_shared<unsigned>(0);
+        return do_until([client, tries] { return !resolved(client) || ++*tries > 200; }, [] {
+            return sleep(std::chrono::milliseconds(5));
+        }).then([client, tries] {
+            BOOST_REQUIRE_LE(*tries, 200u);
+        });
+    });
+}
+
+// A neighbor nobody uses is not probed, and is dropped once it goes stale
+SEASTAR_TEST_CASE(test_arp_unused_neighbor_is_evicted) {
+    auto hosts = make_arp_hosts();
+    auto client = hosts.first;
+    auto peer = hosts.second;
+    return client->inet.get_l2_dst_address(arp_peer::ip()).then([] (ethernet_address) {
+        return sleep(std::chrono::milliseconds(350));
+    }).then([client, peer] {
+        BOOST_REQUIRE_EQUAL(peer->probes, 0u);
+        BOOST_REQUIRE(!resolved(client));
+    });
+}
+
+SEASTAR_TEST_CASE(test_ndp_resolution) {
+    auto devs = create_loopback_net_device_pair(loopback_link_config(), 1);
+    auto client = make_host(devs.first, ipv4_address("10.0.0.1"));
+    auto server = make_host(devs.second, ipv4_address("10.0.0.2"));
+    auto target = server->inet6.link_local_address();
+    return client->inet6.get_l2_dst_address(target).then([client, server, target] (ethernet_address l2) {
+        BOOST_REQUIRE(l2.mac == server->netif.hw_address().mac);
+        // Resolved now, so answered without waiting
+        auto f = client->inet6.get_l2_dst_address(target);
+        BOOST_REQUIRE(f.available());
+        BOOST_REQUIRE(f.get0().mac == server->netif.hw_address().mac);
+    });
+}
+
+SEASTAR_TEST_CASE(test_ipv6_transfer) {
+    loopback_link_config config;
+    config.latency = std::chrono::microseconds(200);
+    config.loss = 0.01;
+    config.seed = 2;
+    auto devs = create_loopback_net_device_pair(config, 1);
+    auto client = make_host(devs.first, ipv4_address("10.0.0.1"));
+    auto server = make_host(devs.second, ipv4_address("10.0.0.2"));
+    client->inet6.set_host_address(ipv6_address("fd00::1"), 64);
+    server->inet6.set_host_address(ipv6_address("fd00::2"), 64);
+    return transfer(client->inet6.get_tcp(), server->inet6.get_tcp(),
+            make_ipv6_address(ipv6_address("fd00::2"), 10000), 256);
+}
+
+static sstring datagram_text(udp_datagram& dgram) {
+    auto& p = dgram.get_data();
+    p.linearize();
+    return sstring(p.frag(0).base, p.len());
+}
+
+// A datagram each way, the reply addressed to the request's source, then
+// one the client sends behind a hop-by-hop options header
+SEASTAR_TEST_CASE(test_ipv6_udp) {
+    auto devs = create_loopback_net_device_pair(loopback_link_config(), 1);
+    auto client = make_host(devs.first, ipv4_address("10.0.0.1"));
+    auto server = make_host(devs.second, ipv4_address("10.0.0.2"));
+    client->inet6.set_host_address(ipv6_address("fd00::1"), 64);
+    server->inet6.set_host_address(ipv6_address("fd00::2"), 64);
+    auto server_chan = make_lw_shared(server->inet6.get_udp().make_channel(5000));
+    auto client_chan = make_lw_shared(client->inet6.get_udp().make_channel(0));
+    return client_chan->send(make_ipv6_address(ipv6_address("fd00::2"), 5000), packet::from_static_data("ping", 4)).then([server_chan] {
+        return server_chan->receive();
+    }).then([server_chan] (udp_datagram dgram) {
+        BOOST_REQUIRE_EQUAL(datagram_text(dgram), "ping");
+        auto src = dgram.get_src_address();
+        BOOST_REQUIRE_EQUAL(src.as_posix_sockaddr().sa_family, AF_INET6);
+        BOOST_REQUIRE(ipv6_address(src.as_posix_sockaddr_in6().sin6_addr) == ipv6_address("fd00::1"));
+        return server_chan->send(src, packet::from_static_data("pong", 4));
+    }).then([client_chan] {
+        return client_chan->receive();
+    }).then([client, server, server_chan, client_chan] (udp_datagram dgram) {
+        BOOST_REQUIRE_EQUAL(datagram_text(dgram), "pong");
+        BOOST_REQUIRE_EQUAL(ntohs(dgram.get_src_address().as_posix_sockaddr_in6().sin6_port), 5000);
+
+        auto src = ipv6_address("fd00::1");
+        auto dst = ipv6_address("fd00::2");
+        packet p = packet::from_static_data("ext", 3);
+        auto uh = p.prepend_header<udp_hdr>();
+        uh->src_port = 4000;
+        uh->dst_port = 5000;
+        uh->len = p.len();
+        uh->cksum = 0;
+        *uh = hton(*uh);
+        checksummer csum;
+        ipv6_traits::udp_pseudo_header_checksum(csum, src, dst, p.len());
+        csum.sum(p);
+        uh->cksum = csum.get();
+        // Next header UDP, no extra length, and a 4-byte PadN option
+        static const char hop_by_hop[] = { 17, 0, 1, 4, 0, 0, 0, 0 };
+        std::copy(std::begin(hop_by_hop), std::end(hop_by_hop), p.prepend_uninitialized_header(sizeof(hop_by_hop)));
+        client->inet6.send(dst, ip_protocol_num(uint8_t(ipv6_ext_header::hop_by_hop)), std::move(p), server->netif.hw_address());
+        return server_chan->receive();
+    }).then([server_chan] (udp_datagram dgram) {
+        BOOST_REQUIRE_EQUAL(datagram_text(dgram), "ext");
+        BOOST_REQUIRE_EQUAL(dgram.get_dst_port(), 5000);
+    });
+}
+
+SEASTAR_TEST_CASE(test_receive_buffer_grows_under_fast_reader) {
+    loopback_link_config config;
+    config.latency = std::chrono::milliseconds(1);
+    auto devs = create_loopback_net_device_pair(config, 1);
+    auto client = make_host(devs.first, ipv4_address("10.0.0.1"));
+    auto server = make_host(devs.second, ipv4_address("10.0.0.2"));
+    auto max_window = make_lw_shared<uint32_t>(0);
+    return transfer(client->inet.get_tcp(), server->inet.get_tcp(), make_ipv4_address({"10.0.0.2", 10000}), 4096,
+            [max_window] (tcp4::connection& conn) {
+        *max_window = std::max(*max_window, conn.get_tcp_info().rcv_wnd);
+        return make_ready_future<>();
+    }).then([max_window] {
+        // The buffer, which bounds the window, starts at 128KB
+        BOOST_REQUIRE_GT(*max_window, 128u << 10);
+    });
+}
+
+// With the shard's receive memory limited to less than a window, a
+// receiver that stops reading closes its window once the limit is
+// reached, and reopens it as it reads
+SEASTAR_TEST_CASE(test_window_follows_receive_memory_limit) {
+    auto devs = create_loopback_net_device_pair(loopback_link_config(), 1);
+    auto client = make_host(devs.first, ipv4_address("10.0.0.1"));
+    auto server = make_host(devs.second, ipv4_address("10.0.0.2"));
+    auto& mem = tcp_receive_memory::local();
+    auto old_limit = mem.limit();
+    mem.set_limit(64 << 10);
+    auto stalled = make_lw_shared<bool>(false);
+    return transfer(client->inet.get_tcp(), server->inet.get_tcp(), make_ipv4_address({"10.0.0.2", 10000}), 256,
+            [stalled] (tcp4::connection& conn) {
+        if (*stalled) {
+            return make_ready_future<>();
+        }
+        *stalled = true;
+        return sleep(std::chrono::milliseconds(100)).then([&conn] {
+            BOOST_REQUIRE(tcp_receive_memory::local().exhausted());
+            BOOST_REQUIRE_EQUAL(conn.get_tcp_info().rcv_wnd, 0u);
+        });
+    }).finally([&mem, old_limit] {
+        mem.set_limit(old_limit);
+    });
+}
+
+// Server and client of each shard in the multi-shard tests
+static thread_local lw_shared_ptr<tcp4::listener> shard_listener;
+static thread_local loopback_host* shard_client;
+static thread_local size_t shard_received;
+
+static void accept_all(lw_shared_ptr<tcp4::listener> listener) {
+    listener->accept().then_wrapped([listener] (future<tcp4::connection> f) {
+        if (f.failed()) {
+            // Aborted at the end of the test
+            f.ignore_ready_future();
+            return;
+        }
+        auto conn = make_lw_shared<tcp4::connection>(f.get0());
+        receive_all(conn).then([conn] (size_t len) {
+            conn->close_write();
+            shard_received += len;
+        });
+        accept_all(listener);
+    });
+}
+
+// Connects from every shard to servers on every shard, over devices with
+// queues on the first queues_count shards and proxies on the others.  The
+// connections land on the server shards their RSS hashes name, so packets
+// cross shards both in the loopback link and in the stacks' forwarding.
+static future<> check_multi_shard(unsigned queues_count) {
+    static constexpr size_t chunks = 64;
+    auto devs = create_loopback_net_device_pair(loopback_link_config(), queues_count);
+    auto shards = boost::irange(0u, smp::count);
+    auto on_all_shards = [shards] (std::function<future<> ()> func) {
+        return parallel_for_each(shards, [func] (unsigned cpu) {
+            return smp::submit_to(cpu, [func] { return func(); });
+        });
+    };
+    auto expected = smp::count * chunks * chunk_size;
+    return on_all_shards([devs] {
+        shard_client = make_host(devs.first, ipv4_address("10.0.0.1"), smp::count);
+        auto server = make_host(devs.second, ipv4_address("10.0.0.2"), smp::count);
+        shard_received = 0;
+        shard_listener = make_lw_shared<tcp4::listener>(server->inet.get_tcp().listen(10000));
+        accept_all(shard_listener);
+        return make_ready_future<>();
+    }).then([on_all_shards] {
+        return on_all_shards([] {
+            return shard_client->inet.get_tcp().connect(make_ipv4_address({"10.0.0.2", 10000})).then(
+                    [] (tcp4::connection c) {
+                return send_all(make_lw_shared<tcp4::connection>(std::move(c)), chunks);
+            });
+        });
+    }).then([shards, expected] {
+        // The senders are done once their data is queued; wait for the
+        // receivers, for ten seconds at most
+        auto total = make_lw_shared<size_t>(0);
+        auto tries = make_lw_shared<unsigned>(0);
+        return do_until([total, tries, expected] { return *total == expected || ++*tries > 10000; },
+                [shards, total] {
+            return map_reduce(shards.begin(), shards.end(), [] (unsigned cpu) {
+                return smp::submit_to(cpu, [] { return shard_received; });
+            }, size_t(0), std::plus<size_t>()).then([total] (size_t received) {
+                *total = received;
+                return sleep(std::chrono::milliseconds(1));
+            });
+        }).then([total, expected] {
+            BOOST_REQUIRE_EQUAL(*total, expected);
+        });
+    }).finally([on_all_shards] {
+        return on_all_shards([] {
+            shard_listener->abort_accept();
+            shard_listener = {};
+            return make_ready_future<>();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_multi_shard_queues) {
+    return check_multi_shard(smp::count);
+}
+
+SEASTAR_TEST_CASE(test_multi_shard_proxies) {
+    return check_multi_shard(1);
+}
+
+// An interface with one protocol that takes bursts and one that doesn't,
+// recording the tags of the packets they get
+struct order_recorder {
+    interface netif;
+    l3_protocol with_bursts;
+    l3_protocol without_bursts;
+    subscription<packet, ethernet_address> with_bursts_rx;
+    subscription<packet, ethernet_address> without_bursts_rx;
+    std::vector<uint8_t> tags;
+    static std::experimental::optional<l3_protocol::l3packet> nothing() { return {}; }
+    static bool no_hash(forward_hash&, packet&, size_t) { return false; }
+    explicit order_recorder(std::shared_ptr<device> dev)
+        : netif(std::move(dev))
+        , with_bursts(&netif, eth_protocol_num::ipv4, nothing)
+        , without_bursts(&netif, eth_protocol_num::arp, nothing)
+        , with_bursts_rx(with_bursts.receive([] (packet, ethernet_address) { return make_ready_future<>(); }, no_hash))
+        , without_bursts_rx(without_bursts.receive([this] (packet p, ethernet_address) {
+            tags.push_back(p.frag(0).base[0]);
+            return make_ready_future<>();
+        }, no_hash)) {
+        with_bursts.receive_burst([this] (l3_protocol::rx_burst& burst) {
+            for (auto&& rp : burst) {
+                tags.push_back(rp.p.frag(0).base[0]);
+            }
+        });
+    }
+};
+
+// Packets of protocols with and without burst handlers, interleaved in
+// one burst, go up in the order they arrived
+SEASTAR_TEST_CASE(test_burst_keeps_arrival_order) {
+    auto devs = create_loopback_net_device_pair(loopback_link_config(), 1);
+    auto recorder = make_lw_shared<std::unique_ptr<order_recorder>>();
+    engine().at_destroy([recorder] { recorder->reset(); });
+    set_up_local_queue(*devs.second, 1);
+    *recorder = std::make_unique<order_recorder>(devs.second);
+    set_up_local_queue(*devs.first, 1);
+    static const eth_protocol_num protos[] = {
+        eth_protocol_num::ipv4, eth_protocol_num::arp, eth_protocol_num::ipv4, eth_protocol_num::ipv4,
+        eth_protocol_num::arp, eth_protocol_num::arp, eth_protocol_num::ipv4,
+    };
+    circular_buffer<packet> q;
+    for (uint8_t tag = 0; tag < sizeof(protos) / sizeof(protos[0]); ++tag) {
+        std::vector<char> payload(46, tag);
+        packet p(payload.data(), payload.size());
+        auto eh = p.prepend_header<eth_hdr>();
+        eh->dst_mac = devs.second->hw_address();
+        eh->src_mac = devs.first->hw_address();
+        eh->eth_proto = uint16_t(protos[tag]);
+        *eh = hton(*eh);
+        q.push_back(std::move(p));
+    }
+    devs.first->local_queue().send(q);
+    auto rec = recorder->get();
+    return do_until([rec] { return rec->tags.size() == 7; }, [] {
+        return later();
+    }).then([rec] {
+        for (uint8_t tag = 0; tag < 7; ++tag) {
+            BOOST_REQUIRE_EQUAL(rec->tags[tag], tag);
+        }
+    });
+}
@@ -65,3 +65,58 @@ BOOST_AUTO_TEST_CASE(test_headers_are_contiguous_even_with_many_fragments) {
     BOOST_REQUIRE_EQUAL(p.nr_frags(), 9);
 }
 
+
+BOOST_AUTO_TEST_CASE(test_headers_with_all_options_fit_in_one_fragment) {
+    using tcp_header = std::array<char, 60>;
+    using ip_header = std::array<char, 60>;
+    using eth_header = std::array<char, 14>;
+    packet p;
+    p.prepend_header<tcp_header>();
+    p.prepend_header<ip_header>();
+    p.prepend_header<eth_header>();
+    BOOST_REQUIRE_EQUAL(p.nr_frags(), 1);
+    BOOST_REQUIRE_EQUAL(p.len(), 134);
+}
+
+BOOST_AUTO_TEST_CASE(test_pooled_blocks_are_reused) {
+    // Exercise the pool across sizes, and frees out of allocation order
+    std::vector<packet> packets;
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 100; ++i) {
+            packets.push_back(packet(i % 10 == 0 ? 16 : 1));
+            packets.back().prepend_header<std::array<char, 20>>();
+        }
+        for (size_t i = 0; i < packets.size(); i += 2) {
+            packets[i] = packet();
+        }
+        packets.erase(packets.begin(), packets.begin() + packets.size() / 2);
+    }
+    for (auto&& p : packets) {
+        BOOST_REQUIRE(p.len() == 20 || p.len() == 0);
+    }
+    packets.clear();
+    // A free block serves the next allocation, and returns when freed
+    auto pooled = packet::pooled_blocks();
+    BOOST_REQUIRE_GT(pooled, 0u);
+    {
+        packet p(1);
+        BOOST_REQUIRE_EQUAL(packet::pooled_blocks(), pooled - 1);
+    }
+    BOOST_REQUIRE_EQUAL(packet::pooled_blocks(), pooled);
+    // Blocks for more fragments come from the heap
+    {
+        packet p(16);
+        BOOST_REQUIRE_EQUAL(packet::pooled_blocks(), pooled);
+    }
+    BOOST_REQUIRE_EQUAL(packet::pooled_blocks(), pooled);
+}
+
+BOOST_AUTO_TEST_CASE(test_pool_is_bounded) {
+    std::vector<packet> packets;
+    for (size_t i = 0; i < packet::max_pooled_blocks + 100; ++i) {
+        packets.push_back(packet(1));
+    }
+    BOOST_REQUIRE_EQUAL(packet::pooled_blocks(), 0u);
+    packets.clear();
+    BOOST_REQUIRE_EQUAL(packet::pooled_blocks(), packet::max_pooled_blocks);
+}
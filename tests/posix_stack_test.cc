@@ -0,0 +1,210 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "core/reactor.hh"
+#include "core/future-util.hh"
+#include "core/print.hh"
+#include "net/posix-stack.hh"
+#include "test-utils.hh"
+#include <boost/range/irange.hpp>
+
+using namespace net;
+
+static uint8_t pattern(unsigned datagram, size_t pos) {
+    return (datagram + pos) % 251;
+}
+
+static packet make_datagram(unsigned datagram, size_t size) {
+    std::vector<char> data(size);
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = pattern(datagram, i);
+    }
+    return packet(data.data(), data.size());
+}
+
+static void check_datagram(udp_datagram& dgram, unsigned datagram, size_t size, ipv4_addr src) {
+    auto& p = dgram.get_data();
+    BOOST_REQUIRE_EQUAL(p.len(), size);
+    BOOST_REQUIRE_EQUAL(dgram.get_src().ip, src.ip);
+    BOOST_REQUIRE_EQUAL(dgram.get_src().port, src.port);
+    size_t pos = 0;
+    for (auto&& f : p.fragments()) {
+        for (size_t i = 0; i < f.size; ++i, ++pos) {
+            BOOST_REQUIRE_EQUAL(uint8_t(f.base[i]), pattern(datagram, pos));
+        }
+    }
+}
+
+// A pair of channels on localhost, a fixed port each
+struct udp_pair {
+    posix_network_stack stack{boost::program_options::variables_map()};
+    ipv4_addr sender_addr{"127.0.0.1", 10001};
+    ipv4_addr receiver_addr{"127.0.0.1", 10002};
+    udp_channel sender = stack.make_udp_channel(sender_addr);
+    udp_channel receiver = stack.make_udp_channel(receiver_addr);
+};
+
+// Sends datagrams of the given sizes all at once, so that they leave in
+// batches, and receives them intact and in order.  Rounds are small
+// enough for the receive buffer to hold a whole one.
+static future<> check_round(lw_shared_ptr<udp_pair> pair, std::vector<size_t> sizes) {
+    auto indexes = boost::irange<unsigned>(0, sizes.size());
+    auto sent = parallel_for_each(indexes.begin(), indexes.end(), [pair, sizes] (unsigned i) {
+        return pair->sender.send(pair->receiver_addr, make_datagram(i, sizes[i]));
+    });
+    auto received = do_for_each(indexes.begin(), indexes.end(), [pair, sizes] (unsigned i) {
+        return pair->receiver.receive().then([pair, sizes, i] (udp_datagram dgram) {
+            check_datagram(dgram, i, sizes[i], pair->sender_addr);
+        });
+    });
+    return when_all(std::move(sent), std::move(received)).then([] (std::tuple<future<>, future<>> r) {
+        // Every send resolved, without an error
+        std::get<0>(r).get();
+        std::get<1>(r).get();
+    });
+}
+
+// Runs of one size, as sent in UDP_SEGMENT messages and received
+// coalesced by UDP_GRO, the last of each run shorter
+SEASTAR_TEST_CASE(test_udp_same_size_runs) {
+    auto pair = make_lw_shared<udp_pair>();
+    auto rounds = boost::irange(0, 4);
+    return do_for_each(rounds.begin(), rounds.end(), [pair] (int round) {
+        std::vector<size_t> sizes;
+        for (unsigned run = 0; run < 4; ++run) {
+            size_t size = 100 + 300 * run + round;
+            sizes.insert(sizes.end(), 7, size);
+            sizes.push_back(size / 2);
+        }
+        return check_round(pair, std::move(sizes));
+    }).finally([pair] {});
+}
+
+// Sizes that vary from one datagram to the next, including empty ones
+// and ones larger than a segment may be
+SEASTAR_TEST_CASE(test_udp_mixed_sizes) {
+    auto pair = make_lw_shared<udp_pair>();
+    auto rounds = boost::irange(0, 4);
+    return do_for_each(rounds.begin(), rounds.end(), [pair] (int round) {
+        std::vector<size_t> sizes;
+        for (unsigned i = 0; i < 32; ++i) {
+            sizes.push_back((i * 487 + round * 131) % 1600);
+        }
+        sizes[5] = 0;
+        sizes[17] = 9000;
+        return check_round(pair, std::move(sizes));
+    }).finally([pair] {});
+}
+
+// Receive buffers freed on another shard go back to their own shard's pool
+SEASTAR_TEST_CASE(test_udp_datagram_freed_on_other_shard) {
+    if (smp::count < 2) {
+        print("skipped: needs two shards\n");
+        return make_ready_future<>();
+    }
+    auto pair = make_lw_shared<udp_pair>();
+    return check_round(pair, std::vector<size_t>(8, 1000)).then([pair] {
+        return pair->sender.send(pair->receiver_addr, make_datagram(0, 1000));
+    }).then([pair] {
+        return pair->receiver.receive();
+    }).then([] (udp_datagram dgram) {
+        return smp::submit_to(1, [p = std::move(dgram.get_data())] () mutable {
+            packet local(std::move(p));
+        });
+    }).then([pair] {
+        return check_round(pair, std::vector<size_t>(8, 1000));
+    }).finally([pair] {});
+}
+
+// Sends still queued when the channel closes fail instead of hanging
+SEASTAR_TEST_CASE(test_udp_close_fails_queued_sends) {
+    auto pair = make_lw_shared<udp_pair>();
+    auto f = pair->sender.send(pair->receiver_addr, make_datagram(0, 100));
+    pair->sender.close();
+    return f.then_wrapped([pair] (future<> f) {
+        BOOST_REQUIRE(f.failed());
+        f.ignore_ready_future();
+    });
+}
+
+static future<> check_zerocopy_transfer(size_t write_size, unsigned nr_writes) {
+    boost::program_options::variables_map opts;
+    opts.insert({"posix-zerocopy-threshold", boost::program_options::variable_value(size_t(16384), false)});
+    auto stack = make_lw_shared<posix_network_stack>(opts);
+    listen_options lo;
+    lo.reuse_address = true;
+    auto addr = make_ipv4_address({"127.0.0.1", 10003});
+    auto listener = make_lw_shared(stack->listen(addr, lo));
+    auto accepted = listener->accept();
+    return stack->connect(addr, socket_address(::sockaddr_in{AF_INET, INADDR_ANY, {0}})).then(
+            [stack, listener, accepted = std::move(accepted), write_size, nr_writes] (connected_socket client) mutable {
+        return accepted.then([client = std::move(client), write_size, nr_writes] (connected_socket server, socket_address) mutable {
+            auto out = make_lw_shared(client.output());
+            auto in = make_lw_shared(server.input());
+            auto freed = make_lw_shared<unsigned>(0);
+            auto received = make_lw_shared<size_t>(0);
+            // The reader checks that no buffer was reused while the kernel
+            // was still sending from it
+            auto reader = repeat([in, received] {
+                return in->read().then([received] (temporary_buffer<char> buf) {
+                    if (buf.empty()) {
+                        return stop_iteration::yes;
+                    }
+                    for (size_t i = 0; i < buf.size(); ++i, ++*received) {
+                        BOOST_REQUIRE_EQUAL(uint8_t(buf[i]), pattern(0, *received));
+                    }
+                    return stop_iteration::no;
+                });
+            });
+            auto writes = boost::irange<unsigned>(0, nr_writes);
+            auto writer = do_for_each(writes.begin(), writes.end(), [out, freed, write_size] (unsigned i) {
+                // Carries the bytes at offset i * write_size of pattern(0, ...)
+                auto p = make_datagram(i * write_size % 251, write_size);
+                p = packet(std::move(p), make_deleter([freed] { ++*freed; }));
+                return out->write(std::move(p));
+            }).then([out] {
+                return out->close();
+            }).then([freed, nr_writes] {
+                // close() waited for the kernel to release every buffer
+                BOOST_REQUIRE_EQUAL(*freed, nr_writes);
+            });
+            return when_all(std::move(reader), std::move(writer)).then(
+                    [in, out, received, write_size, nr_writes, client = std::move(client), server = std::move(server)]
+                    (std::tuple<future<>, future<>> r) {
+                std::get<0>(r).get();
+                std::get<1>(r).get();
+                BOOST_REQUIRE_EQUAL(*received, write_size * nr_writes);
+            });
+        });
+    }).finally([stack, listener] {});
+}
+
+// Zero-copy writes of a connection over localhost, then close(), which
+// returns once the kernel no longer uses the written buffers
+SEASTAR_TEST_CASE(test_zerocopy_writes_then_close) {
+    return check_zerocopy_transfer(65536, 64);
+}
+
+// close() right after a single write, while the data is likely still
+// in flight
+SEASTAR_TEST_CASE(test_zerocopy_close_after_one_write) {
+    return check_zerocopy_transfer(1 << 20, 1);
+}
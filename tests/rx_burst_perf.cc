@@ -0,0 +1,149 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+
+// Packets per second the native stack receives, from the device up to a
+// UDP channel, with the packets of a poll delivered one by one and as a
+// burst.  Minimum sized IPv4/UDP frames go into one end of a loopback
+// pair, on one shard; the other end has the receiving stack.
+
+#include "core/app-template.hh"
+#include "core/future-util.hh"
+#include "core/reactor.hh"
+#include "core/print.hh"
+#include "net/loopback.hh"
+#include "net/ip.hh"
+#include "net/udp.hh"
+#include <chrono>
+
+using namespace net;
+
+static constexpr unsigned frames_per_send = 32;
+static constexpr uint16_t port = 5000;
+
+struct receiver {
+    interface netif;
+    ipv4 inet;
+    udp_channel chan;
+    explicit receiver(std::shared_ptr<device> dev)
+            : netif(std::move(dev)), inet(&netif) {
+        inet.set_host_address(ipv4_address("10.0.0.2"));
+        inet.set_netmask_address(ipv4_address("255.255.255.0"));
+        inet.get_udp().set_queue_size(4096);
+        chan = inet.get_udp().make_channel(ipv4_addr(port));
+    }
+};
+
+static std::vector<char> udp_frame(ethernet_address src, ethernet_address dst) {
+    std::vector<char> payload(18);
+    packet p(payload.data(), payload.size());
+    auto uh = p.prepend_header<udp_hdr>();
+    uh->src_port = port;
+    uh->dst_port = port;
+    uh->len = p.len();
+    uh->cksum = 0;
+    *uh = hton(*uh);
+    auto iph = p.prepend_header<ip_hdr>();
+    iph->ihl = sizeof(*iph) / 4;
+    iph->ver = 4;
+    iph->dscp = 0;
+    iph->ecn = 0;
+    iph->len = p.len();
+    iph->id = 0;
+    iph->frag = 0;
+    iph->ttl = 64;
+    iph->ip_proto = uint8_t(ip_protocol_num::udp);
+    iph->csum = 0;
+    iph->src_ip = ipv4_address("10.0.0.1");
+    iph->dst_ip = ipv4_address("10.0.0.2");
+    *iph = hton(*iph);
+    checksummer csum;
+    csum.sum(reinterpret_cast<char*>(iph), sizeof(*iph));
+    iph->csum = csum.get();
+    auto eh = p.prepend_header<eth_hdr>();
+    eh->dst_mac = dst;
+    eh->src_mac = src;
+    eh->eth_proto = uint16_t(eth_protocol_num::ipv4);
+    *eh = hton(*eh);
+    p.linearize();
+    auto& f = p.frag(0);
+    return std::vector<char>(f.base, f.base + f.size);
+}
+
+// Feeds frames for duration and resolves to the packets per second
+// that reached the channel
+static future<double> measure(bool bursts, std::chrono::seconds duration) {
+    loopback_link_config config;
+    config.bursts = bursts;
+    auto devs = create_loopback_net_device_pair(config, 1);
+    for (auto&& dev : { devs.first, devs.second }) {
+        dev->set_local_queue(dev->init_local_queue(boost::program_options::variables_map(), 0));
+    }
+    // The queue calls into the receiver until the reactor stops
+    auto rx = make_lw_shared<std::unique_ptr<receiver>>(std::make_unique<receiver>(devs.second));
+    engine().at_destroy([rx, devs] { rx->reset(); });
+    auto frame = udp_frame(devs.first->hw_address(), devs.second->hw_address());
+    auto received = make_lw_shared<uint64_t>(0);
+    auto stop = make_lw_shared<bool>(false);
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + duration;
+    auto reader = repeat([rx, received, stop] {
+        return (*rx)->chan.receive().then([received, stop] (udp_datagram) {
+            if (*stop) {
+                return stop_iteration::yes;
+            }
+            ++*received;
+            return stop_iteration::no;
+        });
+    });
+    auto send = [devs, frame] {
+        circular_buffer<packet> q;
+        for (unsigned i = 0; i < frames_per_send; ++i) {
+            q.push_back(packet(frame.data(), frame.size()));
+        }
+        devs.first->local_queue().send(q);
+    };
+    return do_until([end] { return std::chrono::steady_clock::now() >= end; }, [send] {
+        send();
+        return later();
+    }).then([stop, send, reader = std::move(reader)] () mutable {
+        // Wakes the reader up to see the stop flag
+        *stop = true;
+        send();
+        return std::move(reader);
+    }).then([received, start] {
+        std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+        return make_ready_future<double>(*received / t.count());
+    });
+}
+
+int main(int ac, char** av) {
+    app_template app;
+    return app.run(ac, av, [] {
+        auto duration = std::chrono::seconds(5);
+        return measure(false, duration).then([duration] (double one_by_one) {
+            return measure(true, duration).then([one_by_one] (double bursts) {
+                print("one by one: %.0f pps\n", one_by_one);
+                print("bursts:     %.0f pps (%+.1f%%)\n", bursts, (bursts / one_by_one - 1) * 100);
+            });
+        });
+    });
+}
@@ -22,6 +22,7 @@
 #include "core/app-template.hh"
 #include "core/future-util.hh"
 #include "core/distributed.hh"
+#include "core/io_stats.hh"
 
 using namespace net;
 using namespace std::chrono_literals;
@@ -31,6 +32,7 @@ static int tx_msg_total_size = 100 * 1024 * 1024;
 static int tx_msg_size = 4 * 1024;
 static int tx_msg_nr = tx_msg_total_size / tx_msg_size;
 static std::string str_txbuf(tx_msg_size, 'X');
+static tcp_congestion_control congestion_control = tcp_congestion_control::stack_default;
 
 class client;
 distributed<client> clients;
@@ -46,6 +48,7 @@ class client {
     lowres_clock::time_point _latest_finished;
     size_t _processed_bytes;
     unsigned _num_reported;
+    latency_histogram _ping_latency;
 public:
     class connection {
         connected_socket _fd;
@@ -53,6 +56,7 @@ class client {
         output_stream<char> _write_buf;
         size_t _bytes_read = 0;
         size_t _bytes_write = 0;
+        latency_histogram _ping_latency;
     public:
         connection(connected_socket&& fd)
             : _fd(std::move(fd))
@@ -83,10 +87,12 @@ class client {
         }
 
         future<> ping(int times) {
+            auto sent = std::chrono::steady_clock::now();
             return _write_buf.write("ping").then([this] {
                 return _write_buf.flush();
-            }).then([this, times] {
-                return _read_buf.read_exactly(4).then([this, times] (temporary_buffer<char> buf) {
+            }).then([this, times, sent] {
+                return _read_buf.read_exactly(4).then([this, times, sent] (temporary_buffer<char> buf) {
+                    _ping_latency.add(std::chrono::steady_clock::now() - sent);
                     if (buf.size() != 4) {
                         fprint(std::cerr, "illegal packet received: %d\n", buf.size());
                         return make_ready_future();
@@ -105,6 +111,10 @@ class client {
             });
         }
 
+        const latency_histogram& ping_latency() const {
+            return _ping_latency;
+        }
+
         future<size_t> rxrx() {
             return _write_buf.write("rxrx").then([this] {
                 return _write_buf.flush();
@@ -130,9 +140,9 @@ class client {
 
     future<> ping_test(connection *conn) {
         auto started = lowres_clock::now();
-        return conn->ping(_pings_per_connection).then([started] {
+        return conn->ping(_pings_per_connection).then([started, conn] {
             auto finished = lowres_clock::now();
-            clients.invoke_on(0, &client::ping_report, started, finished);
+            clients.invoke_on(0, &client::ping_report, started, finished, conn->ping_latency());
         });
     }
 
@@ -152,11 +162,12 @@ class client {
         });
     }
 
-    void ping_report(lowres_clock::time_point started, lowres_clock::time_point finished) {
+    void ping_report(lowres_clock::time_point started, lowres_clock::time_point finished, latency_histogram latency) {
         if (_earliest_started > started)
             _earliest_started = started;
         if (_latest_finished < finished)
             _latest_finished = finished;
+        _ping_latency.merge(latency);
         if (++_num_reported == _concurrent_connections) {
             auto elapsed = _latest_finished - _earliest_started;
             auto usecs = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
@@ -168,6 +179,8 @@ class client {
             fprint(std::cout, "Total Time(Secs): %f\n", secs);
             fprint(std::cout, "Requests/Sec: %f\n",
                 static_cast<double>(_total_pings) / secs);
+            fprint(std::cout, "Latency(us): p50<%u p99<%u p999<%u\n", _ping_latency.quantile_us(0.5),
+                _ping_latency.quantile_us(0.99), _ping_latency.quantile_us(0.999));
             clients.stop().then([] {
                 engine().exit(0);
             });
@@ -205,6 +218,7 @@ class client {
 
         for (unsigned i = 0; i < ncon; i++) {
             engine().net().connect(make_ipv4_address(server_addr)).then([this, server_addr, test] (connected_socket fd) {
+                fd.set_congestion_control(congestion_control);
                 auto conn = new connection(std::move(fd));
                 (this->*tests.at(test))(conn).then_wrapped([this, conn] (auto&& f) {
                     delete conn;
@@ -234,6 +248,7 @@ int main(int ac, char ** av) {
         ("server", bpo::value<std::string>(), "Server address")
         ("test", bpo::value<std::string>()->default_value("ping"), "test type(ping | rxrx | txtx)")
         ("conn", bpo::value<unsigned>()->default_value(16), "nr connections per cpu")
+        ("congestion-control", bpo::value<std::string>()->default_value("default"), "congestion control (default | reno | cubic | bbr)")
         ;
 
     return app.run_deprecated(ac, av, [&app] {
@@ -241,6 +256,18 @@ int main(int ac, char ** av) {
         auto server = config["server"].as<std::string>();
         auto test = config["test"].as<std::string>();
         auto ncon = config["conn"].as<unsigned>();
+        auto cc = config["congestion-control"].as<std::string>();
+        bool known = cc == "default";
+        for (auto c : { tcp_congestion_control::reno, tcp_congestion_control::cubic, tcp_congestion_control::bbr }) {
+            if (cc == tcp_congestion_control_name(c)) {
+                congestion_control = c;
+                known = true;
+            }
+        }
+        if (!known) {
+            fprint(std::cerr, "Error: --congestion-control=default | reno | cubic | bbr\n");
+            return engine().exit(1);
+        }
 
         if (!client::tests.count(test)) {
             fprint(std::cerr, "Error: -test=ping | rxrx | txtx\n");
@@ -0,0 +1,68 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include <sys/types.h>
+#include "net/toeplitz.hh"
+#include <random>
+
+// The verification suite's key and first IPv4 tuple from Microsoft's RSS
+// documentation
+static const rss_key_type microsoft_key = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+BOOST_AUTO_TEST_CASE(test_known_vector) {
+    // 66.9.149.187:2794 -> 161.142.100.80:1766
+    std::vector<uint8_t> tuple = {
+        66, 9, 149, 187, 161, 142, 100, 80, 0x0a, 0xea, 0x06, 0xe6,
+    };
+    BOOST_REQUIRE_EQUAL(toeplitz_hash(microsoft_key, tuple), 0x51ccc178);
+    BOOST_REQUIRE_EQUAL(toeplitz_table(microsoft_key).hash(tuple), 0x51ccc178);
+    tuple.resize(8);
+    BOOST_REQUIRE_EQUAL(toeplitz_table(microsoft_key).hash(tuple), 0x323e8fc2);
+}
+
+BOOST_AUTO_TEST_CASE(test_table_matches_bitwise) {
+    std::default_random_engine e;
+    std::uniform_int_distribution<int> byte(0, 255);
+    for (auto& key : {default_rsskey_40bytes, default_rsskey_52bytes, microsoft_key}) {
+        toeplitz_table table(key);
+        // Past key.size() - 4 the table defers to the bitwise hash
+        for (size_t len = 0; len <= 64; ++len) {
+            for (int i = 0; i < 100; ++i) {
+                std::vector<uint8_t> data(len);
+                for (auto& b : data) {
+                    b = byte(e);
+                }
+                BOOST_REQUIRE_EQUAL(table.hash(data), toeplitz_hash(key, data));
+            }
+        }
+    }
+}
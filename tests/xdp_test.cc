@@ -0,0 +1,186 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2015 Cloudius Systems, Ltd.
+ */
+
+#include "core/reactor.hh"
+#include "core/future-util.hh"
+#include "core/sleep.hh"
+#include "core/print.hh"
+#include "test-utils.hh"
+
+#ifdef HAVE_XDP
+
+#include "core/posix.hh"
+#include "net/xdp.hh"
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <unistd.h>
+#include <cstdlib>
+
+using namespace net;
+namespace bpo = boost::program_options;
+
+// IEEE local experimental ethertype, which nothing else on the link uses
+static constexpr uint16_t test_ethertype = 0x88b5;
+
+static bpo::variables_map xdp_options(std::string ifname, std::string mode) {
+    bpo::variables_map opts;
+    opts.insert({"xdp-device", bpo::variable_value(ifname, false)});
+    opts.insert({"xdp-mode", bpo::variable_value(mode, false)});
+    opts.insert({"xdp-frames", bpo::variable_value(4096u, false)});
+    return opts;
+}
+
+static bool run(sstring cmd) {
+    return std::system((cmd + " >/dev/null 2>&1").c_str()) == 0;
+}
+
+// A veth pair, xdpt0 for the device and xdpt1 for a packet socket;
+// creating it takes root
+struct veth_pair {
+    bool created = false;
+    veth_pair() {
+        created = ::geteuid() == 0 && run("ip link add xdpt0 type veth peer name xdpt1");
+        if (created && !(run("ip link set xdpt0 up") && run("ip link set xdpt1 up"))) {
+            run("ip link del xdpt0");
+            created = false;
+        }
+    }
+    ~veth_pair() {
+        if (created) {
+            run("ip link del xdpt0");
+        }
+    }
+};
+
+static file_desc packet_socket(const char* ifname) {
+    auto fd = file_desc::socket(AF_PACKET, SOCK_RAW, htons(test_ethertype));
+    sockaddr_ll sll = {};
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(test_ethertype);
+    sll.sll_ifindex = ::if_nametoindex(ifname);
+    fd.bind(reinterpret_cast<sockaddr&>(sll), sizeof(sll));
+    return fd;
+}
+
+static std::vector<char> test_frame(ethernet_address dst, uint8_t tag, size_t len) {
+    std::vector<char> frame(len);
+    std::copy(dst.mac.begin(), dst.mac.end(), frame.begin());
+    const uint8_t src[] = { 0x02, 0, 0, 0, 0, 0x01 };
+    std::copy(std::begin(src), std::end(src), frame.begin() + 6);
+    frame[12] = test_ethertype >> 8;
+    frame[13] = test_ethertype & 0xff;
+    for (size_t i = 14; i < len; ++i) {
+        frame[i] = tag + i;
+    }
+    return frame;
+}
+
+static bool is_test_frame(const char* data, size_t len) {
+    return len >= 14 && uint8_t(data[12]) == (test_ethertype >> 8) && uint8_t(data[13]) == (test_ethertype & 0xff);
+}
+
+// Checks cond every millisecond, for at most a second
+static future<> wait_for(std::function<bool ()> cond) {
+    auto tries = make_lw_shared<unsigned>(0);
+    return do_until([cond, tries] { return cond() || ++*tries > 1000; }, [] {
+        return sleep(std::chrono::milliseconds(1));
+    });
+}
+
+SEASTAR_TEST_CASE(test_unknown_mode_is_rejected) {
+    BOOST_REQUIRE_THROW(create_xdp_net_device(xdp_options("lo", "zerocopy"), 1), std::runtime_error);
+    return make_ready_future<>();
+}
+
+SEASTAR_TEST_CASE(test_mtu_beyond_umem_frame_is_rejected) {
+    // The loopback interface has a 64K MTU
+    BOOST_REQUIRE_THROW(create_xdp_net_device(xdp_options("lo", "copy"), 1), std::runtime_error);
+    return make_ready_future<>();
+}
+
+SEASTAR_TEST_CASE(test_veth_copy_mode) {
+    auto veth = std::make_shared<veth_pair>();
+    if (!veth->created) {
+        print("skipped: creating a veth pair takes root\n");
+        return make_ready_future<>();
+    }
+    auto opts = xdp_options("xdpt0", "copy");
+    std::shared_ptr<device> dev = create_xdp_net_device(opts, 1);
+    dev->set_local_queue(dev->init_local_queue(opts, 0));
+    auto peer = make_lw_shared<file_desc>(packet_socket("xdpt1"));
+    auto received = make_lw_shared<std::vector<packet>>();
+    auto sub = make_lw_shared(dev->receive([received] (packet p) {
+        auto& f = p.frag(0);
+        if (is_test_frame(f.base, f.size)) {
+            received->push_back(std::move(p));
+        }
+        return make_ready_future<>();
+    }));
+    static constexpr size_t sizes[] = { 60, 1000, 1514 };
+
+    // Peer to device
+    for (unsigned i = 0; i < 3; ++i) {
+        auto frame = test_frame(dev->hw_address(), i, sizes[i]);
+        peer->send(frame.data(), frame.size(), 0);
+    }
+    return wait_for([received] { return received->size() == 3; }).then([dev, peer, received] {
+        BOOST_REQUIRE_EQUAL(received->size(), 3u);
+        for (unsigned i = 0; i < 3; ++i) {
+            auto& p = (*received)[i];
+            p.linearize();
+            auto expected = test_frame(dev->hw_address(), i, sizes[i]);
+            BOOST_REQUIRE_EQUAL(p.len(), expected.size());
+            BOOST_REQUIRE(std::equal(expected.begin(), expected.end(), p.frag(0).base));
+        }
+        received->clear();
+
+        // Device to peer
+        circular_buffer<packet> q;
+        for (unsigned i = 0; i < 3; ++i) {
+            auto frame = test_frame(ethernet_address{0x02, 0, 0, 0, 0, 0x02}, 10 + i, sizes[i]);
+            q.push_back(packet(frame.data(), frame.size()));
+        }
+        BOOST_REQUIRE_EQUAL(dev->local_queue().send(q), 3u);
+        auto frames = make_lw_shared<std::vector<std::vector<char>>>();
+        return wait_for([peer, frames] {
+            std::vector<char> buf(2048);
+            while (auto r = peer->recv(buf.data(), buf.size(), MSG_DONTWAIT)) {
+                frames->emplace_back(buf.begin(), buf.begin() + *r);
+            }
+            return frames->size() == 3;
+        }).then([frames] {
+            BOOST_REQUIRE_EQUAL(frames->size(), 3u);
+            for (unsigned i = 0; i < 3; ++i) {
+                auto expected = test_frame(ethernet_address{0x02, 0, 0, 0, 0, 0x02}, 10 + i, sizes[i]);
+                BOOST_REQUIRE((*frames)[i] == expected);
+            }
+        });
+    }).finally([veth, dev, peer, sub] {});
+}
+
+#else
+
+SEASTAR_TEST_CASE(test_xdp_unsupported) {
+    print("skipped: built without AF_XDP support\n");
+    return make_ready_future<>();
+}
+
+#endif